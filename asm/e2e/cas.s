@@ -0,0 +1,15 @@
+mov x1, #5
+str x1, [#3]
+mov x4, #3
+
+mov x2, #5
+mov x3, #9
+cas x2, x3, [x4]
+
+mov x5, #1
+cas x5, x3, [x4]
+
+ldr x0, [#3]
+add x0, x0, x5
+add x0, x0, x2
+ret
@@ -0,0 +1,21 @@
+fill [#0], #5, #10
+mov x1, #9
+str x1, [#0]
+cpy [#1], [#0], #5
+
+mov x1, #20
+mov x2, #-1
+mov x3, #3
+fill [x1], x2, x3
+
+ldr x0, [#1]
+ldr x4, [#9]
+add x0, x0, x4
+ldr x4, [#22]
+add x0, x0, x4
+ldr x4, [#23]
+add x0, x0, x4
+
+fill [#250], #1, #10
+mov x0, #0
+ret
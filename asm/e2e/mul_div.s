@@ -0,0 +1,15 @@
+mov x1, #7
+mul x2, x1, #6
+sdiv x3, x2, #-5
+udiv x4, x2, #4
+mod x5, x2, #5
+madd x6, x1, x1, x5
+msub x7, x3, #2, x6
+sdiv x8, x1, #0
+
+add x0, x3, x4
+add x0, x0, x5
+add x0, x0, x6
+add x0, x0, x7
+add x0, x0, x8
+ret
@@ -0,0 +1,25 @@
+.reg one, x1
+.reg addr, x2
+.reg old, x3
+.reg n, x4
+
+mov one, #1
+mov addr, #0
+spawn worker
+spawn worker
+spawn worker
+b main
+
+worker:
+mov n, #0
+loop:
+ldadd one, old, [addr]
+add n, n, #1
+cmp n, #100
+blt loop
+ret
+
+main:
+join
+ldr x0, [#0]
+ret
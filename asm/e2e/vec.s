@@ -0,0 +1,27 @@
+mov x1, #0
+vfill:
+str x1, [x1]
+add x1, x1, #1
+cmp x1, #16
+blt vfill
+
+vld v0, [#0]
+vld v1, [#8]
+vadd v2, v0, v1
+vst v2, [#16]
+vsub v3, v1, v0
+mov x2, #32
+vst v3, [x2]
+vmin v4, v0, v1
+vmax v5, v0, v1
+vcmp v6, v4, v5
+vst v6, [#24]
+
+ldr x0, [#16]
+ldr x3, [#23]
+add x0, x0, x3
+ldr x3, [#24]
+add x0, x0, x3
+ldr x3, [#39]
+add x0, x0, x3
+ret
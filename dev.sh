@@ -15,19 +15,49 @@ CFLAGS=(
     -g
     -std=c89
     -O2
+    -pthread
+    -D_DEFAULT_SOURCE
+)
+BENCH_CFLAGS=(
+    -std=c89
+    -O2
+    -pthread
+    -D_DEFAULT_SOURCE
+)
+LIB_CFLAGS=(
+    -std=c89
+    -O2
+    -pthread
+    -D_DEFAULT_SOURCE
+    -fPIC
 )
 APP=oarm
+LIB=liboarm
 TEST=test
+BENCH=bench
 BUILD_DIR=build
 SRC_DIR=src
 
 build(){
     rm -rf $BUILD_DIR/
     mkdir -p $BUILD_DIR
-    $CC $CFLAGS -c $SRC_DIR/oarm.c -o $BUILD_DIR/oarm.o
-    $CC $CFLAGS -c $SRC_DIR/ostd.c -o $BUILD_DIR/ostd.o
-    $CC $CFLAGS $SRC_DIR/main.c $BUILD_DIR/oarm.o $BUILD_DIR/ostd.o -o $BUILD_DIR/$APP
-    $CC $CFLAGS $SRC_DIR/test.c $BUILD_DIR/oarm.o $BUILD_DIR/ostd.o -o $BUILD_DIR/$TEST
+    $CC "${CFLAGS[@]}" -c $SRC_DIR/oarm.c -o $BUILD_DIR/oarm.o
+    $CC "${CFLAGS[@]}" -c $SRC_DIR/ostd.c -o $BUILD_DIR/ostd.o
+    $CC "${CFLAGS[@]}" -c $SRC_DIR/liboarm.c -o $BUILD_DIR/liboarm.o
+    $CC "${CFLAGS[@]}" -c $SRC_DIR/serve.c -o $BUILD_DIR/serve.o
+    $CC "${CFLAGS[@]}" $SRC_DIR/main.c $BUILD_DIR/oarm.o $BUILD_DIR/ostd.o $BUILD_DIR/liboarm.o $BUILD_DIR/serve.o -o $BUILD_DIR/$APP
+    $CC "${CFLAGS[@]}" $SRC_DIR/test.c $BUILD_DIR/oarm.o $BUILD_DIR/ostd.o $BUILD_DIR/liboarm.o $BUILD_DIR/serve.o -o $BUILD_DIR/$TEST
+}
+
+lib(){
+    build || return
+    mkdir -p $BUILD_DIR/lib
+    $CC "${LIB_CFLAGS[@]}" -c $SRC_DIR/oarm.c -o $BUILD_DIR/lib/oarm.o
+    $CC "${LIB_CFLAGS[@]}" -c $SRC_DIR/ostd.c -o $BUILD_DIR/lib/ostd.o
+    $CC "${LIB_CFLAGS[@]}" -c $SRC_DIR/liboarm.c -o $BUILD_DIR/lib/liboarm.o
+    $CC "${LIB_CFLAGS[@]}" -c $SRC_DIR/serve.c -o $BUILD_DIR/lib/serve.o
+    ar rcs $BUILD_DIR/$LIB.a $BUILD_DIR/lib/oarm.o $BUILD_DIR/lib/ostd.o $BUILD_DIR/lib/liboarm.o $BUILD_DIR/lib/serve.o
+    $CC "${LIB_CFLAGS[@]}" -shared $BUILD_DIR/lib/oarm.o $BUILD_DIR/lib/ostd.o $BUILD_DIR/lib/liboarm.o $BUILD_DIR/lib/serve.o -o $BUILD_DIR/$LIB.so
 }
 
 run(){
@@ -40,6 +70,17 @@ test(){
     $BUILD_DIR/$TEST
 }
 
+bench(){
+    build || return
+    mkdir -p $BUILD_DIR/bench-obj
+    $CC "${BENCH_CFLAGS[@]}" -c $SRC_DIR/oarm.c -o $BUILD_DIR/bench-obj/oarm.o
+    $CC "${BENCH_CFLAGS[@]}" -c $SRC_DIR/ostd.c -o $BUILD_DIR/bench-obj/ostd.o
+    $CC "${BENCH_CFLAGS[@]}" -c $SRC_DIR/liboarm.c -o $BUILD_DIR/bench-obj/liboarm.o
+    $CC "${BENCH_CFLAGS[@]}" -c $SRC_DIR/serve.c -o $BUILD_DIR/bench-obj/serve.o
+    $CC "${BENCH_CFLAGS[@]}" $SRC_DIR/bench.c $BUILD_DIR/bench-obj/oarm.o $BUILD_DIR/bench-obj/ostd.o $BUILD_DIR/bench-obj/liboarm.o $BUILD_DIR/bench-obj/serve.o -o $BUILD_DIR/$BENCH
+    $BUILD_DIR/$BENCH
+}
+
 fmt() {
     clang-format --style Chromium -i $SRC_DIR/*.c $SRC_DIR/*.h 2>/dev/null || true
 }
\ No newline at end of file
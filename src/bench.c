@@ -0,0 +1,519 @@
+#include <time.h>
+#include "liboarm.h"
+#include "oarm.h"
+#include "ostd.h"
+#include "serve.h"
+
+double now_seconds(void);
+s8 generate_program(int num_lines);
+bool same_program(TokenizedProgram a, TokenizedProgram b);
+void bench_parallel_assemble(void);
+void bench_s8_kernels(void);
+void bench_vm_reuse(void);
+void bench_serve(void);
+void* serve_client(void* arg);
+int compare_double(const void* a, const void* b);
+void report(const char* kernel, const char* impl, double secs, double base);
+double time_eq(bool (*eq)(s8, s8), s8* a, s8* b, int n, int reps);
+double time_hash(u64 (*hash)(s8), s8* a, int n, int reps);
+double time_index_of(int (*index_of)(s8, char, int), s8 text, int reps);
+double time_index_of_any(int (*index_of_any)(s8, s8, int),
+                         s8 text,
+                         s8 set,
+                         int reps);
+double time_find(int (*find)(s8, s8, int), s8 text, s8 target, int reps);
+double time_parse_int(ResultInt (*parse)(s8), s8* nums, int n, int reps);
+bool should_run(int argc, char** argv, const char* name);
+
+/*keeps the compiler from throwing away benchmark results*/
+volatile u64 sink;
+
+int main(int argc, char** argv) {
+  /*Runs every benchmark, or just the ones named on the command line.*/
+  printf("oarm benchmarks\n");
+  if (should_run(argc, argv, "parallel_assemble")) {
+    bench_parallel_assemble();
+  }
+  if (should_run(argc, argv, "s8_kernels")) {
+    bench_s8_kernels();
+  }
+  if (should_run(argc, argv, "vm_reuse")) {
+    bench_vm_reuse();
+  }
+  if (should_run(argc, argv, "serve")) {
+    bench_serve();
+  }
+  return 0;
+}
+
+bool should_run(int argc, char** argv, const char* name) {
+  if (argc <= 1) {
+    return true;
+  }
+  int i = 1;
+  for (; i < argc; i++) {
+    if (strcmp(argv[i], name) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+s8 generate_program(int num_lines) {
+  /*A long, boring but valid program with labels and register labels sprinkled
+   * through it, similar to our generated sources.*/
+  s8 p;
+  p.str = malloc((u64)num_lines * 32 + 1);
+  p.len = 0;
+  int i = 0;
+  for (; i < num_lines; i++) {
+    char* out = p.str + p.len;
+    if (i % 1000 == 0) {
+      p.len += sprintf(out, ".reg r%i, x%i\n", i / 1000, i % 10);
+    } else if (i % 50 == 0) {
+      p.len += sprintf(out, "block%i:\n", i / 50);
+    } else if (i % 50 == 49) {
+      p.len += sprintf(out, "  blt block%i\n", i / 50);
+    } else if (i % 3 == 0) {
+      p.len += sprintf(out, "  add x1, x1, #%i\n", i % 100);
+    } else if (i % 3 == 1) {
+      p.len += sprintf(out, "  ldr r%i, [x3]\n", i / 1000);
+    } else {
+      p.len += sprintf(out, "  cmp x1, x2\n");
+    }
+  }
+  p.str[p.len] = EOF;
+  p.len++;
+  return p;
+}
+
+bool same_program(TokenizedProgram a, TokenizedProgram b) {
+  if (a.len != b.len) {
+    return false;
+  }
+  int ln = 0;
+  for (; ln < a.len; ln++) {
+    if (a.lines[ln].len != b.lines[ln].len) {
+      return false;
+    }
+    int j = 0;
+    for (; j < a.lines[ln].len; j++) {
+      if (!s8_eq(a.lines[ln].tokens[j], b.lines[ln].tokens[j])) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+void bench_parallel_assemble(void) {
+  printf("\nbench_parallel_assemble\n");
+  s8 source = generate_program(400000);
+  printf("source: %i bytes, %li cores online\n", source.len,
+         sysconf(_SC_NPROCESSORS_ONLN));
+
+  int thread_counts[3];
+  thread_counts[0] = 1;
+  thread_counts[1] = 4;
+  thread_counts[2] = 16;
+
+  TokenizedProgram serial;
+  double serial_time = 0;
+  int i = 0;
+  for (; i < 3; i++) {
+    int threads = thread_counts[i];
+    double start = now_seconds();
+    TokenizedProgram p = tokenize_parallel(source, threads);
+    LabelTable labels = resolve_labels_parallel(p, threads);
+    p = resolve_register_labels_parallel(p, threads);
+    double elapsed = now_seconds() - start;
+
+    int label_count = 0;
+    int id = 0;
+    for (; id < labels.len; id++) {
+      label_count += labels.lines[id] >= 0;
+    }
+
+    if (i == 0) {
+      serial = p;
+      serial_time = elapsed;
+    }
+    printf("%2i threads: %8.2f ms  speedup %5.2fx  lines %i  labels %i  %s\n",
+           threads, elapsed * 1000, serial_time / elapsed, p.len, label_count,
+           same_program(serial, p) ? "same as serial" : "DIFFERS FROM SERIAL");
+  }
+}
+
+void report(const char* kernel, const char* impl, double secs, double base) {
+  printf("%-14s %-7s %9.3f ms  %5.2fx\n", kernel, impl, secs * 1000,
+         base / secs);
+}
+
+double time_eq(bool (*eq)(s8, s8), s8* a, s8* b, int n, int reps) {
+  double start = now_seconds();
+  u64 hits = 0;
+  int r = 0;
+  for (; r < reps; r++) {
+    int i = 0;
+    for (; i < n; i++) {
+      hits += (u64)eq(a[i], b[i]);
+    }
+  }
+  sink = hits;
+  return now_seconds() - start;
+}
+
+double time_hash(u64 (*hash)(s8), s8* a, int n, int reps) {
+  double start = now_seconds();
+  u64 h = 0;
+  int r = 0;
+  for (; r < reps; r++) {
+    int i = 0;
+    for (; i < n; i++) {
+      h ^= hash(a[i]);
+    }
+  }
+  sink = h;
+  return now_seconds() - start;
+}
+
+double time_index_of(int (*index_of)(s8, char, int), s8 text, int reps) {
+  /*walk every line of text, like split_source does*/
+  double start = now_seconds();
+  u64 lines = 0;
+  int r = 0;
+  for (; r < reps; r++) {
+    int i = index_of(text, '\n', 0);
+    while (i < text.len) {
+      lines++;
+      i = index_of(text, '\n', i + 1);
+    }
+  }
+  sink = lines;
+  return now_seconds() - start;
+}
+
+double time_index_of_any(int (*index_of_any)(s8, s8, int),
+                         s8 text,
+                         s8 set,
+                         int reps) {
+  double start = now_seconds();
+  u64 tokens = 0;
+  int r = 0;
+  for (; r < reps; r++) {
+    int i = index_of_any(text, set, 0);
+    while (i < text.len) {
+      tokens++;
+      i = index_of_any(text, set, i + 1);
+    }
+  }
+  sink = tokens;
+  return now_seconds() - start;
+}
+
+double time_find(int (*find)(s8, s8, int), s8 text, s8 target, int reps) {
+  double start = now_seconds();
+  u64 found = 0;
+  int r = 0;
+  for (; r < reps; r++) {
+    int i = find(text, target, 0);
+    while (i >= 0) {
+      found++;
+      i = find(text, target, i + target.len);
+    }
+  }
+  sink = found;
+  return now_seconds() - start;
+}
+
+double time_parse_int(ResultInt (*parse)(s8), s8* nums, int n, int reps) {
+  double start = now_seconds();
+  u64 total = 0;
+  int r = 0;
+  for (; r < reps; r++) {
+    int i = 0;
+    for (; i < n; i++) {
+      total += (u64)parse(nums[i]).val;
+    }
+  }
+  sink = total;
+  return now_seconds() - start;
+}
+
+void bench_s8_kernels(void) {
+  printf("\nbench_s8_kernels (in use: %s)\n",
+         (s8_hash(s8_from(malloc, "")), s8_kernels.name));
+  bool sse2 = false;
+  bool avx2 = false;
+#if OSTD_X86_SIMD
+  sse2 = cpu_has_sse2();
+  avx2 = cpu_has_avx2();
+#endif
+
+  /*identifier sized strings, like labels and register names*/
+  int n = 4096;
+  s8* idents = malloc((u64)n * sizeof(s8));
+  s8* copies = malloc((u64)n * sizeof(s8));
+  int i = 0;
+  for (; i < n; i++) {
+    char buf[64];
+    sprintf(buf, "%.*s_%i", 4 + i % 20, "some_long_identifier_name", i);
+    idents[i] = s8_from(malloc, buf);
+    copies[i] = s8_from(malloc, buf);
+  }
+  /*long strings*/
+  int m = 64;
+  s8* longs = malloc((u64)m * sizeof(s8));
+  s8* long_copies = malloc((u64)m * sizeof(s8));
+  for (i = 0; i < m; i++) {
+    longs[i].len = 4096;
+    longs[i].str = malloc(4096);
+    memset(longs[i].str, 'a' + i % 26, 4096);
+    long_copies[i].len = 4096;
+    long_copies[i].str = malloc(4096);
+    memcpy(long_copies[i].str, longs[i].str, 4096);
+  }
+  s8 text = generate_program(100000);
+  s8 delims = s8_from(malloc, " ,:\n");
+  s8 target = s8_from(malloc, "blt block1999");
+  s8* nums = malloc((u64)n * sizeof(s8));
+  for (i = 0; i < n; i++) {
+    char buf[16];
+    sprintf(buf, "%i", (i % 2 ? -1 : 1) * (int)(((u64)i * 2654435761u) >>
+                                                  (i % 31 + 1)));
+    nums[i] = s8_from(malloc, buf);
+  }
+
+  double base = time_eq(s8_eq_scalar, idents, copies, n, 200);
+  report("eq ident", "scalar", base, base);
+#if OSTD_X86_SIMD
+  if (sse2) {
+    report("eq ident", "sse2", time_eq(s8_eq_sse2, idents, copies, n, 200),
+           base);
+  }
+  if (avx2) {
+    report("eq ident", "avx2", time_eq(s8_eq_avx2, idents, copies, n, 200),
+           base);
+  }
+#endif
+
+  base = time_eq(s8_eq_scalar, longs, long_copies, m, 200);
+  report("eq 4k", "scalar", base, base);
+#if OSTD_X86_SIMD
+  if (sse2) {
+    report("eq 4k", "sse2", time_eq(s8_eq_sse2, longs, long_copies, m, 200),
+           base);
+  }
+  if (avx2) {
+    report("eq 4k", "avx2", time_eq(s8_eq_avx2, longs, long_copies, m, 200),
+           base);
+  }
+#endif
+
+  base = time_hash(s8_hash_scalar, idents, n, 200);
+  report("hash ident", "scalar", base, base);
+#if OSTD_X86_SIMD
+  if (avx2) {
+    report("hash ident", "crc32", time_hash(s8_hash_crc32, idents, n, 200),
+           base);
+  }
+#endif
+
+  base = time_index_of(s8_index_of_scalar, text, 5);
+  report("index_of \\n", "scalar", base, base);
+#if OSTD_X86_SIMD
+  if (sse2) {
+    report("index_of \\n", "sse2", time_index_of(s8_index_of_sse2, text, 5),
+           base);
+  }
+  if (avx2) {
+    report("index_of \\n", "avx2", time_index_of(s8_index_of_avx2, text, 5),
+           base);
+  }
+#endif
+
+  base = time_index_of_any(s8_index_of_any_scalar, text, delims, 5);
+  report("index_of_any", "scalar", base, base);
+#if OSTD_X86_SIMD
+  if (sse2) {
+    report("index_of_any", "sse2",
+           time_index_of_any(s8_index_of_any_sse2, text, delims, 5), base);
+  }
+  if (avx2) {
+    report("index_of_any", "avx2",
+           time_index_of_any(s8_index_of_any_avx2, text, delims, 5), base);
+  }
+#endif
+
+  base = time_find(s8_find_scalar, text, target, 5);
+  report("find", "scalar", base, base);
+#if OSTD_X86_SIMD
+  if (sse2) {
+    report("find", "sse2", time_find(s8_find_sse2, text, target, 5), base);
+  }
+  if (avx2) {
+    report("find", "avx2", time_find(s8_find_avx2, text, target, 5), base);
+  }
+#endif
+
+  base = time_parse_int(parse_int_scalar, nums, n, 200);
+  report("parse_int", "scalar", base, base);
+  report("parse_int", "swar", time_parse_int(parse_int, nums, n, 200), base);
+}
+
+void bench_vm_reuse(void) {
+  /*Many short runs of one program in a single reused vm, the way a host
+   * service would embed it.*/
+  printf("\nbench_vm_reuse\n");
+  const char* src =
+      "mov x0, #0\n"
+      "mov x2, #0\n"
+      "loop:\n"
+      "ldr x3, [x2]\n"
+      "add x0, x0, x3\n"
+      "add x2, x2, #1\n"
+      "cmp x2, x1\n"
+      "blt loop\n"
+      "ret\n";
+  Program p = assemble_buffer(src, (int)strlen(src), 1);
+  int data[16];
+  int i = 0;
+  for (; i < 16; i++) {
+    data[i] = i;
+  }
+
+  /*the loop is a sum idiom, the last run is decoded without running it as
+   * one*/
+  Engine engines[3] = {ENGINE_TICK, ENGINE_DECODED, ENGINE_DECODED};
+  int e = 0;
+  for (; e < 3; e++) {
+    Vm* vm = vm_create(p, false);
+    vm_set_engine(vm, engines[e]);
+    vm_set_idioms(vm, e < 2);
+    int runs = 1000000;
+    double start = now_seconds();
+    for (i = 0; i < runs; i++) {
+      vm_reset(vm);
+      vm_write_memory(vm, 0, data, 16);
+      vm_set_register(vm, 1, 1 + i % 16);
+      vm_run(vm);
+      sink += (u64)vm_get_register(vm, 0);
+    }
+    double secs = now_seconds() - start;
+    printf("%-8s %-10s %i runs of a %i line program in %.3fs, %.0f runs/s\n",
+           engine_name(engines[e]), e < 2 ? "" : "no idioms", runs,
+           p.tokens.len, secs, (double)runs / secs);
+    vm_destroy(vm);
+  }
+}
+
+#define SERVE_BENCH_CLIENTS 8
+#define SERVE_BENCH_JOBS 2000
+
+typedef struct ServeClient {
+  const char* path;
+  const char* source;
+  int seed;
+  double* latencies;
+} ServeClient;
+
+void* serve_client(void* arg) {
+  /*One connection, the source on the first job and the hash after that.*/
+  ServeClient* c = arg;
+  int fd = client_connect(c->path);
+  if (fd < 0) {
+    return NULL;
+  }
+  int data[16];
+  int i = 0;
+  for (; i < 16; i++) {
+    data[i] = i;
+  }
+  int* mem = malloc(MEM_BYTES * sizeof(int));
+  JobRequest req;
+  JobReply reply;
+  memset(&req, 0, sizeof(req));
+  req.magic = JOB_MAGIC;
+  req.source_len = (int)strlen(c->source);
+  req.mem_len = 16;
+  for (i = 0; i < SERVE_BENCH_JOBS; i++) {
+    req.registers[1] = 1 + (c->seed + i) % 16;
+    double start = now_seconds();
+    if (!client_job(fd, &req, req.source_len > 0 ? c->source : NULL, data,
+                    &reply, mem)) {
+      break;
+    }
+    c->latencies[i] = now_seconds() - start;
+    sink += (u64)reply.registers[0];
+    req.source_len = 0;
+    req.hash = reply.hash;
+  }
+  free(mem);
+  close(fd);
+  return NULL;
+}
+
+int compare_double(const void* a, const void* b) {
+  double x = *(const double*)a;
+  double y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+void bench_serve(void) {
+  /*Jobs per second and latency through the job server, from several clients
+   * at once, including the socket round trip and copying memory back.*/
+  printf("\nbench_serve\n");
+  const char* src =
+      "mov x0, #0\n"
+      "mov x2, #0\n"
+      "loop:\n"
+      "ldr x3, [x2]\n"
+      "add x0, x0, x3\n"
+      "add x2, x2, #1\n"
+      "cmp x2, x1\n"
+      "blt loop\n"
+      "ret\n";
+  char path[64];
+  sprintf(path, "/tmp/oarm_bench_%i.sock", (int)getpid());
+  int workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (workers > SERVE_BENCH_CLIENTS) {
+    workers = SERVE_BENCH_CLIENTS;
+  }
+  Server* srv = server_start(path, workers);
+  if (srv == NULL) {
+    printf("couldn't start the server on %s\n", path);
+    return;
+  }
+  int jobs = SERVE_BENCH_CLIENTS * SERVE_BENCH_JOBS;
+  double* latencies = calloc((size_t)jobs, sizeof(double));
+  ServeClient clients[SERVE_BENCH_CLIENTS];
+  pthread_t threads[SERVE_BENCH_CLIENTS];
+  double start = now_seconds();
+  int i = 0;
+  for (; i < SERVE_BENCH_CLIENTS; i++) {
+    clients[i].path = path;
+    clients[i].source = src;
+    clients[i].seed = i;
+    clients[i].latencies = latencies + i * SERVE_BENCH_JOBS;
+    pthread_create(&threads[i], NULL, serve_client, &clients[i]);
+  }
+  for (i = 0; i < SERVE_BENCH_CLIENTS; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  double secs = now_seconds() - start;
+  server_stop(srv);
+
+  qsort(latencies, (size_t)jobs, sizeof(double), compare_double);
+  printf("%i clients, %i workers: %i jobs in %.3fs, %.0f jobs/s\n",
+         SERVE_BENCH_CLIENTS, workers, jobs, secs, (double)jobs / secs);
+  printf("latency p50 %.1fus p90 %.1fus p99 %.1fus\n",
+         latencies[jobs / 2] * 1e6, latencies[jobs * 9 / 10] * 1e6,
+         latencies[jobs * 99 / 100] * 1e6);
+  free(latencies);
+}
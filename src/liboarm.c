@@ -0,0 +1,237 @@
+#include "liboarm.h"
+#include "ostd.h"
+
+Program assemble_buffer(const char* source, int len, int jobs) {
+  /*The tokenizer expects the source to end in EOF, like a file read by
+   * entry, so copy it with one on the end.*/
+  s8 program;
+  program.str = malloc((u64)len + 1);
+  memcpy(program.str, source, (size_t)len);
+  program.str[len] = EOF;
+  program.len = len + 1;
+  Program p = assemble(program, jobs);
+  free(program.str);
+  return p;
+}
+
+Vm* vm_create(Program p, bool deterministic) {
+  Vm* vm = malloc(sizeof(Vm));
+  vm->program = p;
+  vm->memory = mem_create(MEM_BYTES);
+  vm->machine = machine_init(p.tokens, deterministic);
+  vm->machine->trace = false;
+  vm->history = NULL;
+  vm_reset(vm);
+  return vm;
+}
+
+Vm* vm_fork(Vm* vm) {
+  /*A new vm paused where vm is, sharing its memory copy on write. Only the
+   * main thread carries over, so fork between runs or while stepping a program
+   * that hasn't spawned.*/
+  Machine* m = vm->machine;
+  join_all(m);
+  Vm* f = malloc(sizeof(Vm));
+  f->program = vm->program;
+  f->memory = mem_fork(vm->memory);
+  f->machine = machine_init(vm->program.tokens, m->deterministic);
+  f->machine->trace = m->trace;
+  f->machine->idioms = m->idioms;
+  /*lines vm decoded itself go with it, so the child decodes its own*/
+  if (!m->owns_decoded) {
+    f->machine->decoded = m->decoded;
+  }
+  machine_set_engine(f->machine, m->engine);
+  f->history = NULL;
+
+  GuestThread* from = &m->threads[0];
+  GuestThread* to = &f->machine->threads[0];
+  to->state = from->state;
+  to->done = from->done;
+  to->parent = -1;
+  memcpy(to->vregisters, from->vregisters, sizeof(to->vregisters));
+  to->state.vregisters = to->vregisters;
+  to->state.memory = f->memory;
+  to->state.machine = f->machine;
+  return f;
+}
+
+void vm_destroy(Vm* vm) {
+  /*The program, and decoded lines handed to vm_set_program, belong to the
+   * caller and can outlive the vm. Everything else goes with it.*/
+  machine_destroy(vm->machine);
+  mem_destroy(vm->memory);
+  if (vm->history != NULL) {
+    history_destroy(vm->history);
+  }
+  free(vm);
+}
+
+void vm_reset(Vm* vm) {
+  /*Back to the state entry starts a program in: zeroed registers and memory,
+   * only the main thread, pc at the first line.*/
+  Machine* m = vm->machine;
+  join_all(m);
+  mem_clear(vm->memory);
+  memset(m->threads, 0, (size_t)m->thread_count * sizeof(GuestThread));
+  m->thread_count = 1;
+
+  State* s = &m->threads[0].state;
+  s->memory = vm->memory;
+  s->vregisters = m->threads[0].vregisters;
+  s->labels = vm->program.labels;
+  s->machine = m;
+  s->tid = 0;
+  s->cont = true;
+  m->threads[0].parent = -1;
+  if (vm->history != NULL) {
+    history_clear(vm->history);
+  }
+}
+
+void vm_set_program(Vm* vm, Program p, Decoded* decoded) {
+  /*Run p from now on, reset and keeping the vm's memory and threads. decoded
+   * is p run through decode_program already, for hosts switching between
+   * programs often, or NULL to decode here if the engine needs it.*/
+  Machine* m = vm->machine;
+  join_all(m);
+  if (m->owns_decoded) {
+    decoded_destroy(m->decoded, m->program);
+  }
+  vm->program = p;
+  m->program = p.tokens;
+  m->decoded = decoded;
+  m->owns_decoded = false;
+  machine_set_engine(m, m->engine);
+  vm_reset(vm);
+}
+
+void vm_set_engine(Vm* vm, Engine engine) {
+  machine_set_engine(vm->machine, engine);
+}
+
+void vm_set_idioms(Vm* vm, bool idioms) {
+  vm->machine->idioms = idioms;
+}
+
+void vm_set_trace(Vm* vm, bool trace) {
+  vm->machine->trace = trace;
+}
+
+void vm_set_compact_mem(Vm* vm, bool compact) {
+  vm->machine->compact_mem = compact;
+}
+
+void vm_set_io(Vm* vm, FILE* in, FILE* out) {
+  /*NULL out sends guest output to the emulator's own output.*/
+  vm->machine->guest_in = in;
+  vm->machine->guest_out = out;
+}
+
+bool vm_map_file(Vm* vm, const char* path, long offset, bool shared) {
+  /*Note vm_reset zeroes a mapped memory like any other, file included when
+   * the mapping is shared.*/
+  return mem_map_file(vm->memory, path, offset, shared);
+}
+
+void vm_set_register(Vm* vm, int reg, int val) {
+  if (reg < 0 || reg >= NUM_REGISTERS) {
+    return;
+  }
+  vm->machine->threads[0].state.registers[reg] = val;
+}
+
+int vm_get_register(Vm* vm, int reg) {
+  if (reg < 0 || reg >= NUM_REGISTERS) {
+    return 0;
+  }
+  return vm->machine->threads[0].state.registers[reg];
+}
+
+bool vm_write_memory(Vm* vm, int addr, const int* vals, int len) {
+  if (len < 0 || addr < 0 || addr > MEM_BYTES - len) {
+    return false;
+  }
+  mem_write(vm->memory, addr, vals, len);
+  return true;
+}
+
+bool vm_read_memory(Vm* vm, int addr, int* dest, int len) {
+  if (len < 0 || addr < 0 || addr > MEM_BYTES - len) {
+    return false;
+  }
+  mem_read(vm->memory, addr, dest, len);
+  return true;
+}
+
+State* vm_state(Vm* vm) {
+  /*The main thread, for anything the getters don't cover.*/
+  return &vm->machine->threads[0].state;
+}
+
+void vm_run(Vm* vm) {
+  /*Run until the main thread stops, then wait for any guest threads.*/
+  Machine* m = vm->machine;
+  if (m->deterministic) {
+    run_deterministic(m);
+  } else {
+    m->threads[0].state = run_thread(m->threads[0].state);
+    join_all(m);
+  }
+  m->threads[0].done = true;
+}
+
+bool vm_step(Vm* vm) {
+  /*One instruction on the main thread, or one turn of every thread when
+   * deterministic. Returns whether there is more to run.*/
+  Machine* m = vm->machine;
+  if (m->deterministic) {
+    return machine_turn(m);
+  }
+  GuestThread* t = &m->threads[0];
+  if (t->done) {
+    return false;
+  }
+  State s = step(t->state);
+  if (s.pc > m->program.len || s.pc < 0) {
+    s.cont = false;
+  }
+  t->state = s;
+  t->done = !s.cont;
+  if (t->done) {
+    join_all(m);
+  }
+  return !t->done;
+}
+
+bool vm_running(Vm* vm) {
+  return !vm->machine->threads[0].done;
+}
+
+void vm_record(Vm* vm, int entries) {
+  /*Record from here on, keeping about entries register and memory changes
+   * before relying on snapshots. A fork doesn't inherit the recording.*/
+  if (vm->history == NULL) {
+    vm->history = history_create(entries, HISTORY_SNAPSHOTS);
+  }
+  machine_record(vm->machine, vm->history);
+}
+
+bool vm_reverse_step(Vm* vm) {
+  /*Undo the last vm_step. Returns false at the start of the recording.*/
+  History* h = vm->history;
+  return h != NULL && h->turn > 0 && history_seek(vm->machine, h->turn - 1);
+}
+
+bool vm_reverse_continue(Vm* vm, int line) {
+  /*Back until a thread is about to run line, returns false if none was as far
+   * back as the logs reach.*/
+  return vm->history != NULL && history_reverse_continue(vm->machine, line);
+}
+
+bool vm_rewind_to_write(Vm* vm, int addr) {
+  /*Back to just before the last recorded write of addr.*/
+  StepRecord r;
+  return vm->history != NULL && history_find_write(vm->history, addr, &r) &&
+         history_seek(vm->machine, r.turn);
+}
@@ -0,0 +1,68 @@
+#ifndef LIBOARM_H
+#define LIBOARM_H
+
+#include "oarm.h"
+
+/*Embedding oarm in another program.
+ *
+ * Assemble once, then create a Vm and run it as many times as needed. Resets
+ * reuse the Vm's memory, so nothing is allocated between runs and tracing is
+ * off unless asked for.
+ *
+ *   Program p = assemble_buffer(src, len, 1);
+ *   Vm* vm = vm_create(p, false);
+ *   vm_set_register(vm, 1, 42);
+ *   vm_run(vm);
+ *   x0 = vm_get_register(vm, 0);
+ *   vm_reset(vm);
+ *
+ * vm_fork makes a child vm that shares memory pages with its parent until one
+ * of them writes to a page, for trying many variants from one point.
+ *
+ * vm_record keeps a bounded history of the run so it can be stepped back:
+ * vm_reverse_step undoes the last vm_step, vm_reverse_continue goes back until
+ * a line is about to run and vm_rewind_to_write to just before the last write
+ * of an address. Recording runs the vm deterministically.
+ *
+ * Assembling interns labels into a global table behind a lock, so host
+ * threads can assemble at the same time. Separate Vms can run on separate
+ * host threads.*/
+
+typedef struct Vm {
+  Program program;
+  Machine* machine;
+  Memory* memory;
+  /*NULL unless recording*/
+  History* history;
+} Vm;
+
+Program assemble_buffer(const char* source, int len, int jobs);
+
+Vm* vm_create(Program p, bool deterministic);
+Vm* vm_fork(Vm* vm);
+void vm_destroy(Vm* vm);
+void vm_reset(Vm* vm);
+void vm_set_program(Vm* vm, Program p, Decoded* decoded);
+void vm_set_engine(Vm* vm, Engine engine);
+void vm_set_idioms(Vm* vm, bool idioms);
+void vm_set_trace(Vm* vm, bool trace);
+void vm_set_compact_mem(Vm* vm, bool compact);
+void vm_set_io(Vm* vm, FILE* in, FILE* out);
+bool vm_map_file(Vm* vm, const char* path, long offset, bool shared);
+
+void vm_set_register(Vm* vm, int reg, int val);
+int vm_get_register(Vm* vm, int reg);
+bool vm_write_memory(Vm* vm, int addr, const int* vals, int len);
+bool vm_read_memory(Vm* vm, int addr, int* dest, int len);
+State* vm_state(Vm* vm);
+
+void vm_run(Vm* vm);
+bool vm_step(Vm* vm);
+bool vm_running(Vm* vm);
+
+void vm_record(Vm* vm, int entries);
+bool vm_reverse_step(Vm* vm);
+bool vm_reverse_continue(Vm* vm, int line);
+bool vm_rewind_to_write(Vm* vm, int addr);
+
+#endif
@@ -1,39 +1,350 @@
 #include "oarm.h"
 #include "ostd.h"
+#include "serve.h"
 
 #define LOG_VERBOSE
 /*#define LOG_NONE*/
 
+void result_destroy(ResultState r) {
+  /*Free the run entry left behind: its machine, the program it ran, the
+   * history and the --in and --out files. Nothing if it never got to run.*/
+  Machine* m = r.state.machine;
+  if (m == NULL) {
+    return;
+  }
+  if (m->history != NULL) {
+    history_destroy(m->history);
+  }
+  if (m->guest_in != stdin) {
+    fclose(m->guest_in);
+  }
+  if (m->guest_out != NULL) {
+    fclose(m->guest_out);
+  }
+  machine_destroy(m);
+  program_destroy(r.program);
+}
+
 ResultState entry(int argc, char** argv) {
+  ResultState r = run_args(argc, argv);
+  /*nothing is left sitting in the output buffer once we return*/
+  out_flush();
+  return r;
+}
+
+ResultState run_args(int argc, char** argv) {
+  /*--quiet is looked for first, it takes the banner with it*/
+  bool quiet = false;
+  int i = 1;
+  for (; i < argc; i++) {
+    quiet = quiet || strcmp(argv[i], "--quiet") == 0;
+  }
 #ifndef LOG_NONE
-  printf("oarm v0.1\n____\n\n");
+  if (!quiet) {
+    out_printf("oarm v" OARM_VERSION "\n____\n\n");
+  }
 #endif
 
   ResultState r;
+  memset(&r, 0, sizeof(r));
 
   FILE* input_stream = NULL;
-  if (argc <= 1) {
-    print_help();
-    r.return_val = 0;
-    return r;
-  } else {
-    s8 arg1 = s8_from(malloc, argv[1]);
-    if (s8_eq(s8_from(malloc, "--help"), arg1)) {
+  const char* file_name = NULL;
+  /*0 picks a thread count from the size of the source*/
+  int jobs = 0;
+  bool deterministic = false;
+  bool compact_mem = false;
+  const char* mem_file = NULL;
+  long mem_file_offset = 0;
+  bool mem_file_shared = true;
+  bool mem_guard = false;
+  bool explain_idioms_flag = false;
+  bool idioms = true;
+  const char* profile_path = NULL;
+  int profile_hz = PROFILE_HZ;
+  FILE* guest_in = stdin;
+  FILE* guest_out = NULL;
+  Engine engine = ENGINE_TICK;
+  bool diff = false;
+  Engine diff_with = ENGINE_TICK;
+  /*compare the engines after this many turns*/
+  int diff_every = 1;
+  /*0 records no history unless a rewind asks for it*/
+  int history_entries = 0;
+  Rewind rewind = REWIND_NONE;
+  int rewind_value = 0;
+  const char* serve_path = NULL;
+  const char* client_path = NULL;
+  /*0 picks one worker per core*/
+  int workers = 0;
+  int budget = 0;
+  bool timed = false;
+  bool timings_json = false;
+  bool alloc_report = false;
+  /*what --cost-model prices the run with, NULL for no estimate*/
+  CostModel* costs = NULL;
+  /*the levels of the data cache --cache-sim runs, none for no simulation*/
+  CacheLevel cache_levels[CACHE_MAX_LEVELS];
+  int cache_level_count = 0;
+  parse_cache_level(s8_view(CACHE_SIM_DEFAULT), &cache_levels[0]);
+  bool bpred_sim = false;
+  Predictor predictor = PREDICT_GSHARE;
+  int bpred_bits = BPRED_BITS;
+  /*where --cache keeps assembled programs, NULL to always assemble*/
+  const char* cache_dir = NULL;
+  Timings timings;
+  memset(&timings, 0, sizeof(timings));
+  for (i = 1; i < argc; i++) {
+    s8 arg = s8_view(argv[i]);
+    s8 value;
+    if (s8_eq(s8_view("--help"), arg)) {
       print_help();
       r.return_val = 0;
       return r;
-    } else if (s8_eq(s8_from(malloc, "--docs"), arg1)) {
+    } else if (s8_eq(s8_view("--docs"), arg)) {
       print_docs();
       r.return_val = 0;
       return r;
-    } else {
-      input_stream = fopen(argv[1], "r");
-      if (input_stream == NULL) {
-        perror("Error opening file");
+    } else if (s8_eq(s8_view("--deterministic"), arg)) {
+      deterministic = true;
+    } else if (s8_eq(s8_view("--quiet"), arg)) {
+      quiet = true;
+    } else if (s8_eq(s8_view("--timings"), arg)) {
+      timed = true;
+    } else if (flag_value(arg, "--timings=", &value)) {
+      if (s8_eq(s8_view("text"), value)) {
+        timings_json = false;
+      } else if (s8_eq(s8_view("json"), value)) {
+        timings_json = true;
+      } else {
+        out_printf("--timings expects text or json\n");
+        r.return_val = 1;
+        return r;
+      }
+      timed = true;
+    } else if (s8_eq(s8_view("--cache"), arg)) {
+      cache_dir = cache_default_dir();
+      if (cache_dir == NULL) {
+        out_printf("--cache needs XDG_CACHE_HOME or HOME set, or a DIR\n");
+        r.return_val = 1;
+        return r;
+      }
+    } else if (flag_value(arg, "--cache=", &value)) {
+      cache_dir = s8_to_c(malloc, value);
+    } else if (s8_eq(s8_view("--cost-model"), arg)) {
+      costs = malloc(sizeof(CostModel));
+      *costs = cost_model_default();
+    } else if (flag_value(arg, "--cost-model=", &value)) {
+      costs = malloc(sizeof(CostModel));
+      if (!cost_model_load(value.str, costs)) {
+        r.return_val = 1;
+        return r;
+      }
+    } else if (s8_eq(s8_view("--cache-sim"), arg)) {
+      cache_level_count = cache_level_count > 1 ? cache_level_count : 1;
+    } else if (flag_value(arg, "--cache-sim=", &value)) {
+      if (!parse_cache_level(value, &cache_levels[0])) {
+        out_printf("--cache-sim expects SIZE,LINE,WAYS[,POLICY] ex: "
+                   "32768,64,4,lru, with lru, fifo or random\n");
+        r.return_val = 1;
+        return r;
+      }
+      cache_level_count = cache_level_count > 1 ? cache_level_count : 1;
+    } else if (flag_value(arg, "--cache-sim-l2=", &value)) {
+      if (!parse_cache_level(value, &cache_levels[1])) {
+        out_printf("--cache-sim-l2 expects SIZE,LINE,WAYS[,POLICY] ex: "
+                   "262144,64,8,lru, with lru, fifo or random\n");
+        r.return_val = 1;
+        return r;
+      }
+      cache_level_count = 2;
+    } else if (s8_eq(s8_view("--bpred-sim"), arg)) {
+      bpred_sim = true;
+    } else if (flag_value(arg, "--bpred-sim=", &value)) {
+      if (!parse_predictor(value, &predictor)) {
+        out_printf("--bpred-sim expects static, bimodal or gshare\n");
+        r.return_val = 1;
+        return r;
+      }
+      bpred_sim = true;
+    } else if (flag_value(arg, "--bpred-bits=", &value)) {
+      ResultInt n = parse_int(value);
+      if (!n.ok || n.val < 1 || n.val > BPRED_MAX_BITS) {
+        out_printf("--bpred-bits expects 1 to %i bits of counters\n",
+                   BPRED_MAX_BITS);
+        r.return_val = 1;
+        return r;
+      }
+      bpred_bits = n.val;
+    } else if (s8_eq(s8_view("--alloc-report"), arg)) {
+      alloc_report = true;
+    } else if (flag_value(arg, "--mem=", &value)) {
+      if (s8_eq(s8_view("full"), value)) {
+        compact_mem = false;
+      } else if (s8_eq(s8_view("changes"), value)) {
+        compact_mem = true;
+      } else {
+        out_printf("--mem expects full or changes\n");
+        r.return_val = 1;
+        return r;
+      }
+    } else if (flag_value(arg, "--mem-file=", &value)) {
+      if (!parse_mem_file(value, &mem_file, &mem_file_offset)) {
+        out_printf("--mem-file expects a file ex: data.bin or data.bin:64\n");
+        r.return_val = 1;
+        return r;
+      }
+    } else if (s8_eq(s8_view("--mem-file-private"), arg)) {
+      mem_file_shared = false;
+    } else if (s8_eq(s8_view("--mem-guard"), arg)) {
+      mem_guard = true;
+    } else if (s8_eq(s8_view("--explain-idioms"), arg)) {
+      explain_idioms_flag = true;
+    } else if (s8_eq(s8_view("--no-idioms"), arg)) {
+      idioms = false;
+    } else if (flag_value(arg, "--in=", &value)) {
+      guest_in = fopen(value.str, "rb");
+      if (guest_in == NULL) {
+        out_flush();
+        perror("Error opening --in file");
+        r.return_val = 1;
+        return r;
+      }
+    } else if (flag_value(arg, "--out=", &value)) {
+      guest_out = fopen(value.str, "wb");
+      if (guest_out == NULL) {
+        out_flush();
+        perror("Error opening --out file");
+        r.return_val = 1;
+        return r;
+      }
+      setvbuf(guest_out, NULL, _IOFBF, GUEST_IO_BYTES);
+    } else if (flag_value(arg, "--jobs=", &value)) {
+      ResultInt n = parse_int(value);
+      if (!n.ok || n.val < 1) {
+        out_printf("--jobs expects a positive number of threads\n");
+        r.return_val = 1;
+        return r;
+      }
+      jobs = n.val;
+    } else if (flag_value(arg, "--engine=", &value)) {
+      if (!parse_engine(value, &engine)) {
+        r.return_val = 1;
+        return r;
+      }
+    } else if (flag_value(arg, "--diff-engines=", &value)) {
+      int comma = s8_index_of(value, ',', 0);
+      s8 second = value;
+      second.str += comma + 1;
+      second.len -= comma + 1;
+      value.len = comma;
+      if (second.len < 0 || !parse_engine(value, &engine) ||
+          !parse_engine(second, &diff_with)) {
+        out_printf("--diff-engines expects two engines ex: tick,decoded\n");
+        r.return_val = 1;
+        return r;
+      }
+      diff = true;
+    } else if (flag_value(arg, "--diff-every=", &value)) {
+      ResultInt n = parse_int(value);
+      if (!n.ok || n.val < 1) {
+        out_printf("--diff-every expects a positive number of steps\n");
+        r.return_val = 1;
+        return r;
+      }
+      diff_every = n.val;
+    } else if (flag_value(arg, "--serve=", &value)) {
+      serve_path = value.str;
+    } else if (flag_value(arg, "--client=", &value)) {
+      client_path = value.str;
+    } else if (flag_value(arg, "--workers=", &value)) {
+      ResultInt n = parse_int(value);
+      if (!n.ok || n.val < 1 || n.val > SERVE_MAX_WORKERS) {
+        out_printf("--workers expects 1 to %i worker threads\n",
+                   SERVE_MAX_WORKERS);
         r.return_val = 1;
         return r;
       }
+      workers = n.val;
+    } else if (flag_value(arg, "--budget=", &value)) {
+      ResultInt n = parse_int(value);
+      if (!n.ok || n.val < 0) {
+        out_printf("--budget expects a number of turns, 0 for no limit\n");
+        r.return_val = 1;
+        return r;
+      }
+      budget = n.val;
+    } else if (flag_value(arg, "--profile=", &value)) {
+      profile_path = value.str;
+    } else if (flag_value(arg, "--profile-hz=", &value)) {
+      ResultInt n = parse_int(value);
+      if (!n.ok || n.val < 1 || n.val > 1000000) {
+        out_printf("--profile-hz expects samples per second, 1 to 1000000\n");
+        r.return_val = 1;
+        return r;
+      }
+      profile_hz = n.val;
+    } else if (flag_value(arg, "--history=", &value)) {
+      ResultInt n = parse_int(value);
+      if (!n.ok || n.val < 1) {
+        out_printf("--history expects a positive number of undo entries\n");
+        r.return_val = 1;
+        return r;
+      }
+      history_entries = n.val;
+    } else if (flag_value(arg, "--rewind=", &value)) {
+      ResultInt n = parse_int(value);
+      if (!n.ok || n.val < 0) {
+        out_printf("--rewind expects a number of turns\n");
+        r.return_val = 1;
+        return r;
+      }
+      rewind = REWIND_TURNS;
+      rewind_value = n.val;
+    } else if (flag_value(arg, "--rewind-to-line=", &value)) {
+      ResultInt n = parse_int(value);
+      if (!n.ok || n.val < 0) {
+        out_printf("--rewind-to-line expects a line number\n");
+        r.return_val = 1;
+        return r;
+      }
+      rewind = REWIND_LINE;
+      rewind_value = n.val;
+    } else if (flag_value(arg, "--rewind-to-write=", &value)) {
+      ResultInt n = parse_int(value);
+      if (!n.ok || n.val < 0 || n.val >= MEM_BYTES) {
+        out_printf("--rewind-to-write expects a memory address\n");
+        r.return_val = 1;
+        return r;
+      }
+      rewind = REWIND_WRITE;
+      rewind_value = n.val;
+    } else {
+      file_name = argv[i];
+    }
+  }
+
+  if (serve_path != NULL) {
+    if (workers == 0) {
+      workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
     }
+    r.return_val = serve_main(serve_path, workers);
+    return r;
+  }
+  if (file_name == NULL) {
+    print_help();
+    r.return_val = 0;
+    return r;
+  }
+  Timings* t = timed || alloc_report ? &timings : NULL;
+  alloc_stats.enabled = alloc_report;
+  timings_begin(t);
+  input_stream = fopen(file_name, "r");
+  if (input_stream == NULL) {
+    out_flush();
+    perror("Error opening file");
+    r.return_val = 1;
+    return r;
   }
 
   /*Copy the file into memory*/
@@ -44,38 +355,165 @@ ResultState entry(int argc, char** argv) {
   fseek(input_stream, 0, SEEK_END);
   i64 fsize = ftell(input_stream);
   fseek(input_stream, 0, SEEK_SET);
-  program.str = malloc((u64)(fsize + 1));
+  program.str = alloc_source((u64)(fsize + 1));
   fread(program.str, (u64)fsize, 1, input_stream);
   fclose(input_stream);
   program.str[fsize] = EOF;
   program.len = (int)fsize + 1;
+  timings_end(t, PHASE_LOAD);
 
-  TokenizedProgram program_tokens = tokenize(program);
+  if (client_path != NULL) {
+    /*the server adds its own EOF*/
+    program.len--;
+    r.return_val = client_main(client_path, program, budget);
+    counted_free(program.str);
+    return r;
+  }
 
-#ifdef LOG_VERBOSE
-  log_tokenized_program(program_tokens);
-#endif
+  if (mem_guard && mem_file != NULL) {
+    out_printf("--mem-guard can't be used with --mem-file\n");
+    r.return_val = 1;
+    return r;
+  }
 
-  State s;
-  memset(s.memory, 0, sizeof(int) * MEM_BYTES);
-  memset(s.registers, 0, sizeof(int) * NUM_REGISTERS);
-  s.pc = 0;
-  s.cont = true;
-  s.cmp = 0;
-  s.labels = resolve_labels(program_tokens);
-  program_tokens = resolve_register_labels(program_tokens);
+  if (jobs == 0) {
+    jobs = default_assemble_threads(program);
+  }
+  Decoded* decoded = NULL;
+  Program assembled = cache_dir != NULL
+                          ? assemble_cached(cache_dir, program, jobs, t,
+                                            &decoded)
+                          : assemble_timed(program, jobs, t);
+  /*the tokens have their own copy*/
+  counted_free(program.str);
+  free((char*)cache_dir);
+  r.program = assembled;
 
-  log_tokenized_program(program_tokens);
+  if (!quiet) {
+    log_tokenized_program(assembled.tokens);
+  }
 
-  while (s.cont) {
-    s = tick(s, program_tokens.lines[s.pc]);
-    if (s.pc > program_tokens.len || s.pc < 0) {
-      s.cont = false;
+  /*guest programs read and write in big blocks, not a syscall per word*/
+  setvbuf(guest_in, NULL, _IOFBF, GUEST_IO_BYTES);
+  timings_begin(t);
+  Machine* m = machine_start(assembled, deterministic, ENGINE_TICK);
+  /*a program from the cache comes decoded already*/
+  m->decoded = decoded;
+  m->owns_decoded = decoded != NULL;
+  machine_set_engine(m, engine);
+  timings_end(t, PHASE_SETUP);
+  m->compact_mem = compact_mem;
+  m->guest_in = guest_in;
+  m->guest_out = guest_out;
+  m->idioms = idioms;
+  m->trace = !quiet;
+  r.state = m->threads[0].state;
+  if (explain_idioms_flag) {
+    Decoded* lines = m->decoded != NULL ? m->decoded
+                                        : decode_program(assembled.tokens);
+    explain_idioms(assembled.tokens, lines);
+    if (lines != m->decoded) {
+      decoded_destroy(lines, assembled.tokens);
+    }
+    if (engine != ENGINE_DECODED || !idioms) {
+      out_printf("idiom: none run, that takes --engine=decoded\n");
+    }
+  }
+  if (mem_guard && !machine_guard_memory(m)) {
+    r.return_val = 1;
+    return r;
+  }
+  if (mem_file != NULL && !mem_map_file(m->threads[0].state.memory, mem_file,
+                                         mem_file_offset, mem_file_shared)) {
+    r.return_val = 1;
+    return r;
+  }
+  State s;
+  if (diff) {
+    /*the second engine runs quietly beside the first*/
+    Machine* other = machine_start(assembled, deterministic, diff_with);
+    other->trace = false;
+    other->compact_mem = compact_mem;
+    /*privately, so only the first engine's writes reach the file*/
+    if (mem_file != NULL &&
+        !mem_map_file(other->threads[0].state.memory, mem_file,
+                      mem_file_offset, false)) {
+      r.return_val = 1;
+      return r;
+    }
+    free((char*)mem_file);
+    diff_guest_io(m, other);
+    DiffResult d = diff_machines(m, other, diff_every, 0);
+    r.return_val = d.diverged;
+    r.state = m->threads[0].state;
+    machine_destroy(other);
+    if (!d.diverged) {
+      out_printf("%s and %s engines agreed for %i steps\n", engine_name(engine),
+                 engine_name(diff_with), d.steps);
     }
+    return r;
+  }
+  free((char*)mem_file);
+  if (history_entries > 0 || rewind != REWIND_NONE) {
+    History* h = history_create(
+        history_entries > 0 ? history_entries : HISTORY_ENTRIES,
+        HISTORY_SNAPSHOTS);
+    machine_record(m, h);
+    deterministic = true;
+  }
+  if (profile_path != NULL &&
+      !profile_start(assembled.tokens.len, profile_hz)) {
+    r.return_val = 1;
+    return r;
+  }
+  if (costs != NULL) {
+    machine_count_costs(m, costs);
+  }
+  if (cache_level_count > 0) {
+    m->cache_sim = cache_sim_create(cache_levels, cache_level_count,
+                                    assembled.tokens.len);
+  }
+  if (bpred_sim) {
+    m->bpred = bpred_create(predictor, bpred_bits, assembled.tokens.len);
+  }
+  u64 instructions_before = guest_instructions;
+  timings_begin(t);
+  if (deterministic) {
+    s = run_deterministic(m);
+  } else {
+    s = run_thread(m->threads[0].state);
+    /*don't leave guest threads running on our memory after returning*/
+    join_all(m);
+  }
+  timings_end(t, PHASE_RUN);
+  timings.instructions =
+      guest_instructions - instructions_before + m->instructions;
+  if (profile_path != NULL) {
+    profile_stop();
+    profile_write(assembled.tokens, profile_path);
+  }
+  if (costs != NULL) {
+    cost_report(m);
+    m->costs = NULL;
+    free(costs);
+  }
+  if (m->cache_sim != NULL) {
+    cache_sim_report(m->cache_sim, assembled.tokens);
+  }
+  if (m->bpred != NULL) {
+    bpred_report(m->bpred, assembled.tokens);
+  }
+  if (rewind != REWIND_NONE) {
+    s = machine_rewind(m, rewind, rewind_value);
+  }
+  if (timed) {
+    timings_print(&timings, timings_json);
+  }
+  if (alloc_report) {
+    alloc_report_print(&timings);
   }
 
-  /*This is a short lived program, so I purposefully am not freeing anything.
-   * The OS can do that for me.*/
+  /*the run is left for the caller to look at, then result_destroy*/
   r.return_val = 0;
   r.state = s;
   return r;
@@ -83,19 +521,77 @@ ResultState entry(int argc, char** argv) {
 
 void print_help(void) {
   /*Write a little tutorial of the commands available*/
-  printf(
-      "Usage: oarm [FILE]\n"
+  out_printf(
+      "Usage: oarm [OPTIONS] [FILE]\n"
       "\n"
       "Examples:\n"
       "  oarm program.s      Assemble and run program.s\n"
       "\n"
       "Options:\n"
       "  --help              Show this help message and exit\n"
-      "  --docs              Show documentation\n");
+      "  --docs              Show documentation\n"
+      "  --jobs=N            Assemble on N threads (default: one per core for "
+      "sources over 1MB)\n"
+      "  --deterministic     Run guest threads one instruction at a time in "
+      "turn on one host thread\n"
+      "  --quiet             Don't print the banner, the tokenized program or "
+      "each line as it runs\n"
+      "  --timings[=F]       After the run, print the time and memory each "
+      "phase took as text (default) or json\n"
+      "  --cache[=DIR]       Keep assembled programs in DIR (default: "
+      "$XDG_CACHE_HOME/oarm) and reuse them for the same source\n"
+      "  --alloc-report      After the run, print the allocations each "
+      "phase and each part of the assembler made\n"
+      "  --cost-model[=F]    After the run, estimate the cycles it would take "
+      "on an in-order ARM core, or with the latencies in file F\n"
+      "  --cache-sim[=C]     Run each ldr and str through a data cache of C, "
+      "SIZE,LINE,WAYS[,POLICY] (default: 32768,64,4,lru), and print its "
+      "misses\n"
+      "  --cache-sim-l2=C    Add a second level of C behind it\n"
+      "  --bpred-sim[=P]     Run each conditional branch through predictor "
+      "P, static, bimodal or gshare (default), and print its mispredicts\n"
+      "  --bpred-bits=N      Give the predictor 2^N counters (default: 12)\n"
+      "  --engine=E          Run with engine E, tick (default) or decoded\n"
+      "  --diff-engines=A,B  Run engines A and B side by side and stop at the "
+      "first difference between them\n"
+      "  --diff-every=N      Compare the engines every N steps instead of "
+      "every step\n"
+      "  --mem=M             What mem prints, full (default) or changes, the "
+      "ranges written since the last mem\n"
+      "  --mem-file=F[:O]    Use file F, from byte O on, as guest memory, so "
+      "writes land in the file\n"
+      "  --mem-file-private  Keep writes to the --mem-file in memory instead "
+      "of the file\n"
+      "  --mem-guard         Put guard pages after memory so ldr and str "
+      "skip their bounds checks\n"
+      "  --explain-idioms    List the loops the decoded engine runs as one "
+      "native operation\n"
+      "  --no-idioms         Run those loops line by line like any other\n"
+      "  --in=F              Read the words for in and read from file F "
+      "instead of stdin\n"
+      "  --out=F             Send the words from out and write to file F "
+      "instead of stdout\n"
+      "  --serve=S           Run jobs sent to Unix socket S on a pool of "
+      "workers until killed, see src/serve.h\n"
+      "  --workers=N         Serve with N workers (default: one per core)\n"
+      "  --client=S          Run FILE on the server at socket S and print how "
+      "it ended\n"
+      "  --budget=N          With --client, stop the job after N turns\n"
+      "  --profile=F         Sample the line being run 997 times a second of "
+      "CPU and write folded stacks to file F\n"
+      "  --profile-hz=N      Sample N times a second instead\n"
+      "  --history=N         Record the run for rewinding, keeping the last N "
+      "register and memory changes (default: 1048576)\n"
+      "  --rewind=N          After the run, step it back N turns and show "
+      "where it is\n"
+      "  --rewind-to-line=L  After the run, go back to the last time a thread "
+      "was about to run line L\n"
+      "  --rewind-to-write=A After the run, go back to just before the last "
+      "write of memory address A\n");
 }
 
 void print_docs(void) {
-  printf(
+  out_printf(
       "oarm (Orion's subset of ARM assembly) documentation\n"
       "\n"
       "Arguments:\n"
@@ -103,60 +599,70 @@ void print_docs(void) {
       "  register: ex: \'x0\' is the first register, \'x9\' is the last "
       "register\n"
       "  memory address: ex: \'[#1]\' is memory address 1, \'[x2]\' is the "
-      "address of the value in register x2\n"
-      "\n"
-      "Debugging:\n"
-      "  reg - print all registers\n"
-      "  mem - print all memory\n"
-      "  rpc - print the program counter\n"
-      "  rcb - print the comparison byte\n"
-      "\n"
-      "Registers + Memory:\n"
-      "  mov - move a constant or register value to a register ex: \'mov x0, "
-      "x0, #1\'\n"
-      "  ldr - load value at memory address into register ex: \'ldr x0, "
-      "[#1]\'\n"
-      "  str - store the value from register into memory ex: \'str x0, [#1]\'\n"
-      "\n"
-      "Arithmetic:\n"
-      "  add - add two register or constant values and store in register ex: "
-      "\'add x0, x0, #1\' increments x0 by 1\n"
-      "  sub - subtract\n"
-      "  lsl - bitwise shift left ex: \'lsl x0, x0, #1\' shifts the value in "
-      "x0 left 1\n"
-      "  lsr - bitwise shift right\n"
-      "\n"
-      "Branches:\n"
-      "  cmp - compare two register or constant values, sets the sign byte to "
-      "-1, 0, or 1 ex: \'cmp x0, #1\'\n"
-      "  <label name>: - labels are arbitrary strings with a colon ex: "
-      "\'exit:\' declares the exit label\n"
-      "  b - branch (jump) to the label specified ex: \'b exit\' jumps the "
-      "exit label\n"
-      "  beq - branch if equal, jumps if the cmp byte is 0 ex: \'beq exit\'\n"
-      "  bne - branch if not equal\n"
-      "  blt - branch if less than\n"
-      "  ble - branch if less than or equal\n"
-      "  bgt - branch if greater than\n"
-      "  bge - branch if greater than or equal\n"
-      "\n"
-      "Register Labels:\n"
-      "  .reg <label_name> <register> - give pretty name to register ex: "
-      "\'.reg counter x0\' lets you use the word \'counter\' in place of \'x0\'"
-      "\n\n"
-      "");
+      "address of the value in register x2\n");
+#define PRINT_DOC_SECTION(section, title, intro) \
+  print_doc_section(section, title, intro);
+  OARM_DOC_SECTIONS(PRINT_DOC_SECTION)
+#undef PRINT_DOC_SECTION
+  out_printf("\n");
+}
+
+void print_doc_section(DocSection section,
+                       const char* title,
+                       const char* intro) {
+  if (section == DOC_NONE) {
+    return;
+  }
+  out_printf("\n%s:\n%s", title, intro);
+#define PRINT_DOC(cmd, name, mnemonic, kind, semantics, count, t1, t2, t3, \
+                  t4, doc_section, docs)                                   \
+  if (doc_section == section) {                                            \
+    out_printf("  %s%s\n", mnemonic, docs);                                \
+  }
+  OARM_INSTRUCTIONS(PRINT_DOC)
+#undef PRINT_DOC
 }
 
 TokenizedProgram tokenize(s8 s) {
+  return tokenize_parallel(s, 1);
+}
+
+s8 symbol_key(s8 token) {
+  /*The identifier part of a token: 'loop:' and '[i]' are interned as 'loop'
+   * and 'i'.*/
+  if (token.len > 0 && token.str[token.len - 1] == ':') {
+    token.len--;
+  } else if (token.len > 2 && token.str[0] == '[') {
+    token.str++;
+    token.len -= 2;
+  }
+  return token;
+}
+
+TokenizedProgram tokenize_chunk(s8 s, Interner* local) {
+  /*Split s into lines of tokens, giving each identifier an id in local. The
+   * tokens point into s, which has to outlive them.*/
   int program_size = 2;
   TokenizedProgram program;
-  program.len = 0;
-  program.lines = (Line*)malloc((size_t)program_size * sizeof(Line));
+  memset(&program, 0, sizeof(program));
+  program.ok = true;
+  program.lines = (Line*)alloc_lines((size_t)program_size * sizeof(Line));
   memset(program.lines, 0, (size_t)program_size * sizeof(Line));
   s8 t;
   t.len = 0;
-  t.str = malloc(sizeof(u8) * MAX_IDENT_LEN);
-  memset(t.str, 0, sizeof(char) * MAX_IDENT_LEN);
+  t.str = s.str;
+
+  /*every char the switch below ends a token on*/
+  char delimiter_chars[6];
+  delimiter_chars[0] = '\0';
+  delimiter_chars[1] = (char)EOF;
+  delimiter_chars[2] = '\n';
+  delimiter_chars[3] = ' ';
+  delimiter_chars[4] = ',';
+  delimiter_chars[5] = ':';
+  s8 delimiters;
+  delimiters.str = delimiter_chars;
+  delimiters.len = 6;
 
   int i = 0;
   for (; i < s.len; i++) {
@@ -165,10 +671,11 @@ TokenizedProgram tokenize(s8 s) {
     int num_tokens = program.lines[li].len;
     bool is_token_empty = t.len == 0;
     if (num_tokens >= MAX_TOKENS_PER_LINE) {
-      printf(
+      out_printf(
           "parsing failed, max tokens exceeded on line %i more than %i tokens "
           "detected\n",
           i, MAX_TOKENS_PER_LINE);
+      program.ok = false;
       break;
     }
 
@@ -183,11 +690,12 @@ TokenizedProgram tokenize(s8 s) {
         if (program.len == program_size) {
           int old_program_size = program_size;
           program_size = program_size * 2;
-          program.lines =
-              realloc(program.lines, (size_t)program_size * sizeof(Line));
+          program.lines = counted_realloc(ALLOC_LINES, program.lines,
+                                          (size_t)program_size * sizeof(Line));
           memset(program.lines + old_program_size, 0,
                  (size_t)(program_size - old_program_size) * sizeof(Line));
         }
+        /*fall through*/
       case ' ':
       case ',':
       case ':':
@@ -196,700 +704,4785 @@ TokenizedProgram tokenize(s8 s) {
         }
         if (c == ':') {
           if (t.len >= MAX_IDENT_LEN) {
-            printf("Warning: max identifier length of %i exceeded",
-                   MAX_IDENT_LEN);
+            out_printf("Warning: max identifier length of %i exceeded",
+                       MAX_IDENT_LEN);
             break;
           }
-          t.str[t.len] = c;
+          /*the ':' is the char right after the token*/
           t.len++;
         }
         /*Push token onto program struct.*/
         program.lines[li].tokens[num_tokens] = t;
+        s8 key = symbol_key(t);
+        program.lines[li].ids[num_tokens] =
+            key.len > 0 && key.str[0] != '#'
+                ? intern(alloc_symbols, counted_free, local, key)
+                : NO_SYMBOL;
         program.lines[li].len = num_tokens + 1;
 
         /* reset token*/
         t.len = 0;
-        t.str = malloc(sizeof(u8) * MAX_IDENT_LEN);
-        memset(t.str, 0, sizeof(char) * MAX_IDENT_LEN);
         break;
-      default:
-        if (t.len >= MAX_IDENT_LEN) {
+      default: {
+        /*Take the whole run of identifier chars up to the next delimiter.*/
+        int end = s8_index_of_any(s, delimiters, i);
+        int run = end - i;
+        int copy = MAX_IDENT_LEN - t.len;
+        if (copy > run) {
+          copy = run;
+        }
+        if (t.len == 0) {
+          t.str = s.str + i;
+        }
+        t.len += copy;
+        for (; copy < run; copy++) {
           /*just grow the token and get rid of max identifier*/
-          printf("Warning: max identifier length of %i exceeded",
-                 MAX_IDENT_LEN);
-          break;
+          out_printf("Warning: max identifier length of %i exceeded",
+                     MAX_IDENT_LEN);
         }
-        t.str[t.len] = c;
-        t.len++;
+        i = end - 1;
+      }
     }
   }
   return program;
 }
 
-Map resolve_labels(TokenizedProgram p) {
-  /*Find all label declarations and store line number.*/
-  Map labels = map_init(malloc, 10);
-  int ln = 0;
-  for (; ln < p.len; ln++) {
-    Line line = p.lines[ln];
-    if (line.len == 1) {
+LabelTable resolve_labels(TokenizedProgram p) {
+  /*Find all label declarations and store line number. A label declared twice
+   * goes to the later line.*/
+  int count = 0;
+  int pass = 0;
+  LabelTable labels;
+  for (; pass < 2; pass++) {
+    int ln = 0;
+    if (pass == 1) {
+      labels = label_table_create(alloc_labels, count);
+    }
+    for (; ln < p.len; ln++) {
+      Line line = p.lines[ln];
       s8 t = line.tokens[0];
-      if (t.len > 0 && ':' == t.str[t.len - 1]) {
-        t.len--;
-        labels = map_set(malloc, labels, t, ln);
+      if (line.len != 1 || t.len < 1 || ':' != t.str[t.len - 1] ||
+          line.ids[0] == NO_SYMBOL) {
+        continue;
+      }
+      if (pass == 0) {
+        count++;
+      } else {
+        label_table_set(&labels, line.ids[0], ln);
       }
     }
   }
-
   return labels;
 }
 
-TokenizedProgram resolve_register_labels(TokenizedProgram p) {
-  /*Find all register label declarations and replace references to them with the
-   * register they point too.*/
-  Map register_labels = map_init(malloc, 10);
-  s8 reg_keyword = s8_from(malloc, ".reg");
-  int ln = 0;
-  for (; ln < p.len; ln++) {
-    Line line = p.lines[ln];
-    bool is_register_label_decl =
-        line.len == 3 && s8_eq(line.tokens[0], reg_keyword);
-    if (is_register_label_decl) {
-      s8 reg_str;
-      reg_str.str = line.tokens[2].str + 1;
-      reg_str.len = line.tokens[2].len - 1;
-      ResultInt r = parse_int(reg_str);
-      if (!r.ok) {
-        printf("warning register label failed to parse\n");
-      }
-      register_labels = map_set(malloc, register_labels, line.tokens[1], r.val);
-      continue;
-    }
-    int j = 0;
-    for (; j < line.len; j++) {
-      /*register label tokens could only be bare, or wrapped in []
+LabelTable label_table_create(AllocFn alloc, int count) {
+  /*An empty table with room for count labels.*/
+  LabelTable labels;
+  labels.len = 1;
+  while (labels.len < 2 * count) {
+    labels.len *= 2;
+  }
+  labels.lines = alloc((u64)(2 * labels.len) * sizeof(int));
+  labels.ids = labels.lines + labels.len;
+  memset(labels.lines, -1, (u64)(2 * labels.len) * sizeof(int));
+  return labels;
+}
 
-      if it starts with square [], strip those before checking map
-      */
-      s8 t = line.tokens[j];
-      bool is_addr = t.len > 2 && t.str[0] == '[';
-      if (is_addr) {
-        t.len -= 2;
-        t.str++;
-      }
-      ResultInt r = map_get(register_labels, t);
-      if (r.ok) {
-        char ascii_num = (char)(r.val + '0');
-
-        char buf[2];
-        buf[0] = ascii_num;
-        buf[1] = '\0';
-        if (is_addr) {
-          line.tokens[j] = s8_concat(
-              malloc,
-              s8_concat(malloc, s8_from(malloc, "[x"), s8_from(malloc, buf)),
-              s8_from(malloc, "]"));
-        } else {
-          line.tokens[j] =
-              s8_concat(malloc, s8_from(malloc, "x"), s8_from(malloc, buf));
-        }
+LabelTable label_table_clone(AllocFn alloc, LabelTable labels) {
+  LabelTable copy = labels;
+  copy.lines = alloc((u64)(2 * labels.len) * sizeof(int));
+  copy.ids = copy.lines + copy.len;
+  memcpy(copy.lines, labels.lines, (u64)(2 * labels.len) * sizeof(int));
+  return copy;
+}
 
-        p.lines[ln] = line;
-      }
-    }
+void label_table_set(LabelTable* labels, int id, int line) {
+  /*Declare id at line, over any line it had. There has to be room left.*/
+  u32 mask = (u32)labels->len - 1;
+  u32 slot = label_slot(*labels, id);
+  while (labels->ids[slot] != NO_SYMBOL && labels->ids[slot] != id) {
+    slot = (slot + 1) & mask;
   }
+  labels->ids[slot] = id;
+  labels->lines[slot] = line;
+}
 
-  return p;
+u32 label_slot(LabelTable labels, int id) {
+  return ((u32)id * 2654435761u) & ((u32)labels.len - 1);
 }
 
-State tick(State s, Line line) {
-/*Evaluate one line of asm.*/
-#ifndef LOG_NONE
-  log_line(line);
-#endif
-  if (line.len < 1) {
-    printf("warning:tick: empty line\n");
-    s.cont = false;
-    return s;
+pthread_mutex_t symbols_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int register_label_keyword(void) {
+  /*Symbol id of '.reg', only looked up so it is safe to call from workers.*/
+  pthread_mutex_lock(&symbols_lock);
+  ResultInt r = interner_find(symbols, s8_view(".reg"));
+  pthread_mutex_unlock(&symbols_lock);
+  return r.ok ? r.val : NO_SYMBOL;
+}
+
+s8 symbol_name(int id) {
+  /*The name stays put when the table grows, so it can be read unlocked.*/
+  pthread_mutex_lock(&symbols_lock);
+  s8 name = interner_name(symbols, id);
+  pthread_mutex_unlock(&symbols_lock);
+  return name;
+}
+
+int label_line(LabelTable labels, int id) {
+  u32 mask = (u32)labels.len - 1;
+  u32 slot;
+  if (id < 0) {
+    return -1;
   }
-  s8 t = line.tokens[0];
-  CMD cmd = identify_cmd(t);
-  switch (cmd) {
-    case ADD:
-      s = add_or_sub(s, line, true);
-      break;
-    case BRANCH:
-    case BEQ:
-    case BNE:
-    case BLE:
-    case BLT:
-    case BGE:
-    case BGT:
-      s = branch(s, line, cmd);
-      break;
-    case LDR:
-      s = ldr(s, line);
-      break;
-    case LSL:
-      s = lsl_or_lsr(s, line, true);
-      break;
-    case LSR:
-      s = lsl_or_lsr(s, line, false);
-      break;
-    case MEM:
-      log_mem(s);
-      break;
-    case MOV:
-      s = mov(s, line);
-      break;
-    case REG:
-      log_registers(s);
-      break;
-    case RET:
-      s.cont = false;
-      break;
-    case NL:
-      s.cont = false;
-    case STR:
-      s = str(s, line);
-      break;
-    case SUB:
-      s = add_or_sub(s, line, false);
-      break;
-    case RPC:
-      printf("pc: %i\n", s.pc);
-      break;
-    case CMP:
-      s = cmp(s, line);
-      break;
-    case RCB:
-      printf("cmp: %i\n", s.cmp);
-      break;
-    case UNKNOWN:
-      printf("Error could not parse statement identifier: %c%c%c\n", t.str[0],
-             t.str[1], t.str[2]);
-      break;
-    case REG_LABEL:
-    case LABEL_DECL:
-      /*Label declarations dont do anything. They can be jumped too.*/
-      break;
+  slot = label_slot(labels, id);
+  while (labels.ids[slot] != NO_SYMBOL) {
+    if (labels.ids[slot] == id) {
+      return labels.lines[slot];
+    }
+    slot = (slot + 1) & mask;
   }
-  s.pc++;
-  return s;
+  return -1;
 }
 
-CMD identify_cmd(s8 t) {
-  if (t.str[t.len - 1] == ':') {
-    return LABEL_DECL;
+TokenizedProgram resolve_register_labels(TokenizedProgram p) {
+  /*Find all register label declarations and replace references to them with the
+   * register they point too.*/
+  return resolve_register_labels_parallel(p, 1);
+}
+
+int default_assemble_threads(s8 source) {
+  if (source.len < PARALLEL_ASSEMBLE_MIN_BYTES) {
+    return 1;
   }
-  int key = (t.str[0] << 16) | (t.str[1] << 8) | t.str[2];
-  switch (key) {
-    case ('m' << 16) | ('e' << 8) | 'm':
-      return MEM;
-    case ('m' << 16) | ('o' << 8) | 'v':
-      return MOV;
-    case ('a' << 16) | ('d' << 8) | 'd':
-      return ADD;
-    case ('r' << 16) | ('e' << 8) | 'g':
-      return REG;
-    case ('r' << 16) | ('e' << 8) | 't':
-      return RET;
-    case ('l' << 16) | ('s' << 8) | 'l':
-      return LSL;
-    case ('l' << 16) | ('s' << 8) | 'r':
-      return LSR;
-    case ('s' << 16) | ('u' << 8) | 'b':
-      return SUB;
-    case ('l' << 16) | ('d' << 8) | 'r':
-      return LDR;
-    case ('s' << 16) | ('t' << 8) | 'r':
-      return STR;
-    case ('b' << 16) | ('e' << 8) | 'q':
-      return BEQ;
-    case ('b' << 16) | ('n' << 8) | 'e':
-      return BNE;
-    case ('b' << 16) | ('l' << 8) | 't':
-      return BLT;
-    case ('b' << 16) | ('l' << 8) | 'e':
-      return BLE;
-    case ('b' << 16) | ('g' << 8) | 't':
-      return BGT;
-    case ('b' << 16) | ('g' << 8) | 'e':
-      return BGE;
-    case ('b' << 16) | (0 << 8) | 0:
-      return BRANCH;
-    case ('r' << 16) | ('p' << 8) | 'c':
-      return RPC;
-    case ('c' << 16) | ('m' << 8) | 'p':
-      return CMP;
-    case ('r' << 16) | ('c' << 8) | 'b':
-      return RCB;
-    case ('.' << 16) | ('r' << 8) | 'e':
-      return REG_LABEL;
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n < 1) {
+    return 1;
   }
-  return UNKNOWN;
+  if (n > 16) {
+    return 16;
+  }
+  return (int)n;
 }
 
-ResultInt parse_int(s8 s) {
-  /*Convert s8 char array to int.*/
-  ResultInt r;
-
-  if (s.len > 8) {
-    printf(
-        "Integer overflow detected in parse int. Max int is 8 digits. "
-        "Truncating digits.\n");
-    r.ok = false;
-    r.val = 0;
-    return r;
+int split_source(s8 s, int num_chunks, AssembleChunk* chunks) {
+  /*Cut the source into roughly even pieces, each ending just after a newline
+   * so no line is split between two chunks. Returns the chunk count, which can
+   * be less than num_chunks for small sources.*/
+  int count = 0;
+  int start = 0;
+  int k = 0;
+  for (; k < num_chunks && start < s.len; k++) {
+    int end = s.len;
+    if (k < num_chunks - 1) {
+      end = (int)(((i64)s.len * (k + 1)) / num_chunks);
+      if (end < start) {
+        end = start;
+      }
+      end = s8_index_of(s, '\n', end);
+      if (end < s.len) {
+        end++;
+      }
+    }
+    memset(&chunks[count], 0, sizeof(AssembleChunk));
+    chunks[count].source.str = s.str + start;
+    chunks[count].source.len = end - start;
+    count++;
+    start = end;
   }
+  return count;
+}
 
-  i32 result = 0;
-  i32 place = 1;
-  i32 i = s.len - 1;
-  i32 sign = 1;
-  i32 end = 0;
-  if (s.str[0] == '-') {
-    sign = -1;
-    end = 1;
+int split_lines(TokenizedProgram p, int num_chunks, AssembleChunk* chunks) {
+  int count = 0;
+  int start = 0;
+  int k = 0;
+  for (; k < num_chunks && (start < p.len || count == 0); k++) {
+    int end = p.len;
+    if (k < num_chunks - 1) {
+      end = (int)(((i64)p.len * (k + 1)) / num_chunks);
+    }
+    memset(&chunks[count], 0, sizeof(AssembleChunk));
+    chunks[count].program.lines = p.lines + start;
+    chunks[count].program.len = end - start;
+    chunks[count].program.ok = p.ok;
+    chunks[count].line_offset = start;
+    count++;
+    start = end;
   }
+  return count;
+}
 
-  for (; i >= end; i--) {
-    if (s.str[i] < (int)'0' || s.str[i] > (int)'9') {
-      printf("Non digit detected in parse int string: %x (%i)\n", s.str[i],
-             s.str[i]);
-      r.ok = false;
-      r.val = 0;
-      return r;
+void run_chunks(void* (*worker)(void*), AssembleChunk* chunks, int n) {
+  /*The calling thread takes the first chunk itself.*/
+  pthread_t threads[MAX_ASSEMBLE_THREADS];
+  int k = 1;
+  for (; k < n; k++) {
+    if (pthread_create(&threads[k], NULL, worker, &chunks[k]) != 0) {
+      out_flush();
+      perror("pthread_create");
+      exit(1);
     }
-    result += place * (s.str[i] - (int)'0');
-    place = place * 10;
   }
-  r.ok = true;
-  r.val = result * sign;
-  return r;
+  worker(&chunks[0]);
+  for (k = 1; k < n; k++) {
+    pthread_join(threads[k], NULL);
+  }
 }
 
-Args parse_args(Line line) {
-  Args args;
-  args.count = 0;
-  args.is_valid = true;
-  int i = 1;
-  for (; i < line.len; i++) {
-    s8 t = line.tokens[i];
-    Arg a;
+void* tokenize_chunk_worker(void* arg) {
+  AssembleChunk* c = (AssembleChunk*)arg;
+  c->symbols = interner_init(alloc_symbols, 10);
+  c->program = tokenize_chunk(c->source, &c->symbols);
+  return NULL;
+}
 
-    /*Address argument */
-    if (t.str[0] == '[') {
-      a.tag = ADDRESS;
-      if (t.str[1] == 'x') {
-        a.addr.type = A_REGISTER;
-      } else if (t.str[1] == '#') {
-        a.addr.type = A_CONSTANT;
-      } else {
-        printf(
-            "Argument %i, unsupported address type, must be register or "
-            "constant.",
-            args.count + 1);
-        args.is_valid = false;
-        return args;
+void* intern_chunk_worker(void* arg) {
+  /*Swap the chunk local token ids for global ones while copying the lines to
+   * their place in the whole program.*/
+  AssembleChunk* c = (AssembleChunk*)arg;
+  int end = c->copy_end_line ? c->program.len + 1 : c->program.len;
+  int ln = 0;
+  for (; ln < end; ln++) {
+    Line line = c->program.lines[ln];
+    int j = 0;
+    for (; j < line.len; j++) {
+      if (line.ids[j] != NO_SYMBOL) {
+        line.ids[j] = c->global_ids[line.ids[j]];
       }
+    }
+    c->dest[ln] = line;
+  }
+  return NULL;
+}
 
-      t.str = t.str + 2;
-      t.len = t.len - 3;
-      if (t.len < 1) {
-        printf(
-            "Argument %i, expected numerical value for memory "
-            "address argument, got empty string.\n",
-            args.count + 1);
-        args.is_valid = false;
-        return args;
+Program assemble(s8 source, int jobs) {
+  /*Tokenize, then resolve labels and register labels. source must end in EOF
+   * like a file read by entry.*/
+  return assemble_timed(source, jobs, NULL);
+}
+
+Program assemble_timed(s8 source, int jobs, Timings* t) {
+  /*assemble, timing each phase into t unless it is NULL.*/
+  Program p;
+  if (jobs < 1) {
+    jobs = default_assemble_threads(source);
+  }
+  timings_begin(t);
+  p.tokens = tokenize_parallel(source, jobs);
+  p.ok = p.tokens.ok;
+  timings_end(t, PHASE_TOKENIZE);
+  p.labels = resolve_labels_parallel(p.tokens, jobs);
+  timings_end(t, PHASE_RESOLVE_LABELS);
+  p.tokens = resolve_register_labels_parallel(p.tokens, jobs);
+  timings_end(t, PHASE_RESOLVE_REGISTER_LABELS);
+  return p;
+}
+
+void program_destroy(Program p) {
+  /*Free what assemble made. Symbol ids stay interned, they are shared by every
+   * program.*/
+  tokenized_program_destroy(p.tokens);
+  counted_free(p.labels.lines);
+}
+
+void tokenized_program_destroy(TokenizedProgram p) {
+  if (p.mapping != NULL) {
+    munmap(p.mapping, (size_t)p.mapping_len);
+    return;
+  }
+  counted_free(p.lines);
+  counted_free(p.text);
+  counted_free(p.register_text);
+}
+
+Program assemble_cached(const char* dir,
+                        s8 source,
+                        int jobs,
+                        Timings* t,
+                        Decoded** decoded) {
+  /*assemble_timed through the cache in dir, and decode_program too. A hit
+   * skips the assembler, a miss assembles and writes the result for next
+   * time. Programs that didn't assemble cleanly are never cached, so their
+   * errors are printed every run.*/
+  Program p;
+  timings_begin(t);
+  if (cache_load(dir, source, &p, decoded)) {
+    timings_end(t, PHASE_CACHE);
+    return p;
+  }
+  timings_end(t, PHASE_CACHE);
+  p = assemble_timed(source, jobs, t);
+  timings_begin(t);
+  *decoded = decode_program(p.tokens);
+  if (p.ok && !cache_store(dir, source, p, *decoded)) {
+    out_printf("cache: can't write to %s\n", dir);
+  }
+  timings_end(t, PHASE_CACHE);
+  return p;
+}
+
+const char* cache_default_dir(void) {
+  /*$XDG_CACHE_HOME/oarm, or ~/.cache/oarm without it. NULL if there is no
+   * HOME either.*/
+  const char* xdg = getenv("XDG_CACHE_HOME");
+  const char* home = getenv("HOME");
+  char* dir;
+  if (xdg != NULL && xdg[0] == '/') {
+    dir = malloc(strlen(xdg) + sizeof("/oarm"));
+    sprintf(dir, "%s/oarm", xdg);
+  } else if (home != NULL && home[0] != '\0') {
+    dir = malloc(strlen(home) + sizeof("/.cache/oarm"));
+    sprintf(dir, "%s/.cache/oarm", home);
+  } else {
+    return NULL;
+  }
+  return dir;
+}
+
+u64 cache_version_key(void) {
+  /*Changes with anything that changes what a cache file means: the release,
+   * the build, which can renumber instructions, and the layout of the structs
+   * stored as they are.*/
+  char stamp[256];
+  sprintf(stamp, "oarm %s %s %s %i %i %i %i %i", OARM_VERSION, __DATE__,
+          __TIME__, (int)sizeof(Line), (int)sizeof(Decoded),
+          (int)sizeof(Idiom), (int)sizeof(CacheHeader), (int)UNKNOWN);
+  s8 s;
+  s.str = stamp;
+  s.len = (int)strlen(stamp);
+  return s8_hash_scalar(s);
+}
+
+u64 cache_key(s8 source) {
+  /*Always the FNV hash, s8_hash can differ between CPUs.*/
+  return (s8_hash_scalar(source) ^ cache_version_key()) * 1099511628211ull;
+}
+
+char* cache_path(const char* dir, u64 key, const char* suffix) {
+  char* path = malloc(strlen(dir) + strlen(suffix) + 18);
+  sprintf(path, "%s/%016lx%s", dir, key, suffix);
+  return path;
+}
+
+#define CACHE_ALIGN(n) (((n) + 7) & ~(u64)7)
+
+void cache_layout(CacheHeader* h) {
+  /*Where each section goes for h's counts, and the length of the file.*/
+  u64 at = CACHE_ALIGN(sizeof(CacheHeader));
+  h->lines_at = at;
+  at = CACHE_ALIGN(at + (u64)(h->line_count + 1) * sizeof(Line));
+  h->decoded_at = at;
+  at = CACHE_ALIGN(at + (u64)(h->line_count + 1) * sizeof(Decoded));
+  h->idioms_at = at;
+  at = CACHE_ALIGN(at + (u64)h->idiom_count * sizeof(Idiom));
+  h->symbols_at = at;
+  at = CACHE_ALIGN(at + (u64)h->symbol_count * sizeof(s8));
+  h->labels_at = at;
+  at = CACHE_ALIGN(at + (u64)h->symbol_count * sizeof(int));
+  h->text_at = at;
+  h->file_len = at + h->text_len;
+}
+
+bool cache_load(const char* dir, s8 source, Program* p, Decoded** decoded) {
+  /*p and decoded from the cache file for source, if there is one written by
+   * this build for exactly this source. Anything else is a miss.*/
+  u64 key = cache_key(source);
+  char* path = cache_path(dir, key, ".oac");
+  int fd = open(path, O_RDONLY);
+  free(path);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (u64)st.st_size < sizeof(CacheHeader)) {
+    close(fd);
+    return false;
+  }
+  u64 len = (u64)st.st_size;
+  char* base = mmap(NULL, (size_t)len, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_POPULATE,
+                    fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    return false;
+  }
+  CacheHeader h;
+  memcpy(&h, base, sizeof(h));
+  bool ok = h.magic == PROGRAM_CACHE_MAGIC &&
+            h.version == cache_version_key() && h.key == key &&
+            h.source_len == source.len && h.line_count >= 0 &&
+            h.idiom_count >= 0 && h.symbol_count >= 0 &&
+            (u64)h.line_count < len && (u64)h.idiom_count < len &&
+            (u64)h.symbol_count < len && h.text_len >= (u64)source.len &&
+            h.text_len < len;
+  if (ok) {
+    CacheHeader expect = h;
+    cache_layout(&expect);
+    ok = memcmp(&h, &expect, sizeof(h)) == 0 && h.file_len == len &&
+         memcmp(base + h.text_at, source.str, (size_t)source.len) == 0;
+  }
+  if (!ok) {
+    munmap(base, (size_t)len);
+    return false;
+  }
+
+  /*names to global symbol ids*/
+  char* text = base + h.text_at;
+  s8* names = (s8*)(base + h.symbols_at);
+  int* global = alloc_scratch((u64)(h.symbol_count + 1) * sizeof(int));
+  int k = 0;
+  pthread_mutex_lock(&symbols_lock);
+  for (; ok && k < h.symbol_count; k++) {
+    u64 at = (u64)(size_t)names[k].str;
+    ok = names[k].len >= 0 && at + (u64)names[k].len <= h.text_len;
+    if (ok) {
+      names[k].str = text + at;
+      global[k] = intern(alloc_symbols, counted_free, &symbols, names[k]);
+    }
+  }
+  pthread_mutex_unlock(&symbols_lock);
+
+  Line* lines = (Line*)(base + h.lines_at);
+  int ln = 0;
+  for (; ok && ln <= h.line_count; ln++) {
+    Line* line = &lines[ln];
+    ok = line->len >= 0 && line->len <= MAX_TOKENS_PER_LINE;
+    int j = 0;
+    for (; ok && j < line->len; j++) {
+      u64 at = (u64)(size_t)line->tokens[j].str;
+      int id = line->ids[j];
+      ok = line->tokens[j].len >= 0 &&
+           at + (u64)line->tokens[j].len <= h.text_len &&
+           id >= NO_SYMBOL && id < h.symbol_count;
+      line->tokens[j].str = text + at;
+      if (ok && id != NO_SYMBOL) {
+        line->ids[j] = global[id];
       }
-      ResultInt r = parse_int(t);
-      if (!r.ok) {
-        args.is_valid = false;
-        return args;
+    }
+  }
+
+  Decoded* d = (Decoded*)(base + h.decoded_at);
+  Idiom* idioms = (Idiom*)(base + h.idioms_at);
+  for (ln = 0; ok && ln < h.line_count; ln++) {
+    Decoded* e = &d[ln];
+    u64 idiom = (u64)(size_t)e->idiom;
+    ok = idiom <= (u64)h.idiom_count && e->args.count >= 0 &&
+         e->args.count < MAX_TOKENS_PER_LINE;
+    int i = 0;
+    for (; ok && i < e->args.count; i++) {
+      Arg* a = &e->args.args[i];
+      if (a->tag == LABEL_ARG) {
+        ok = a->label >= NO_SYMBOL && a->label < h.symbol_count;
+        a->label = ok && a->label >= 0 ? global[a->label] : NO_SYMBOL;
       }
-      a.addr.val = r.val;
+    }
+    e->idiom = idiom > 0 ? &idioms[idiom - 1] : NULL;
+    e->run = NULL;
+    if (e->idiom != NULL) {
+      e->run = exec_idiom;
+    } else if (e->ok) {
+      e->run = select_handler(e->cmd, &e->args);
+    }
+  }
 
-      if (a.addr.type == A_CONSTANT) {
-        if (a.addr.val > MEM_BYTES || a.addr.val < 0) {
-          printf(
-              "Argument %i memory address is out of range, must be between 0 "
-              "and %i\n",
-              args.count + 1, MEM_BYTES);
-          args.is_valid = false;
-          return args;
-        }
+  int* label_lines = (int*)(base + h.labels_at);
+  int label_count = 0;
+  for (k = 0; k < h.symbol_count; k++) {
+    label_count += label_lines[k] >= 0;
+  }
+  LabelTable labels = label_table_create(alloc_labels, label_count);
+  for (k = 0; ok && k < h.symbol_count; k++) {
+    if (label_lines[k] >= 0) {
+      label_table_set(&labels, global[k], label_lines[k]);
+    }
+  }
+  counted_free(global);
+  if (!ok) {
+    counted_free(labels.lines);
+    munmap(base, (size_t)len);
+    return false;
+  }
+
+  memset(p, 0, sizeof(Program));
+  p->tokens.lines = lines;
+  p->tokens.len = h.line_count;
+  p->tokens.ok = true;
+  p->tokens.mapping = base;
+  p->tokens.mapping_len = len;
+  p->labels = labels;
+  p->ok = true;
+  *decoded = d;
+  return true;
+}
+
+bool cache_store(const char* dir, s8 source, Program p, const Decoded* d) {
+  /*Write p and d, assembled and decoded from source, to a temporary file and
+   * rename it into place, so a reader finds the whole file or none of it.*/
+  TokenizedProgram tp = p.tokens;
+  CacheHeader h;
+  memset(&h, 0, sizeof(h));
+  h.magic = PROGRAM_CACHE_MAGIC;
+  h.version = cache_version_key();
+  h.key = cache_key(source);
+  h.source_len = source.len;
+  h.line_count = tp.len;
+
+  /*Number the symbols the program uses from 0, and find how much text there
+   * is besides the source: names, and tokens made for register labels.*/
+  pthread_mutex_lock(&symbols_lock);
+  u64 ids_size = (u64)(symbols.count + 1) * sizeof(int);
+  pthread_mutex_unlock(&symbols_lock);
+  int* local = alloc_scratch(ids_size);
+  int* names = alloc_scratch(ids_size);
+  memset(local, -1, ids_size);
+  u64 extra = 0;
+  int ln = 0;
+  for (; ln <= tp.len; ln++) {
+    Line line = tp.lines[ln];
+    int j = 0;
+    for (; j < line.len; j++) {
+      s8 t = line.tokens[j];
+      int id = line.ids[j];
+      if (t.str < tp.text || t.str + t.len > tp.text + source.len) {
+        extra += (u64)t.len;
+      }
+      if (id != NO_SYMBOL && local[id] < 0) {
+        local[id] = h.symbol_count;
+        names[h.symbol_count] = id;
+        h.symbol_count++;
+        extra += (u64)symbol_name(id).len;
       }
     }
-    /*Register argument*/
-    else if (t.str[0] == 'x') {
-      a.tag = REGISTER;
-      t.str += 1;
-      t.len -= 1;
-      ResultInt r = parse_int(t);
-      if (!r.ok) {
-        args.is_valid = false;
-        return args;
+    if (ln < tp.len && d[ln].idiom != NULL) {
+      h.idiom_count++;
+    }
+  }
+  h.text_len = (u64)source.len + extra;
+  cache_layout(&h);
+
+  char* buf = alloc_scratch(h.file_len);
+  memset(buf, 0, (size_t)h.file_len);
+  memcpy(buf, &h, sizeof(h));
+  char* text = buf + h.text_at;
+  memcpy(text, source.str, (size_t)source.len);
+  u64 text_end = (u64)source.len;
+
+  Line* lines = (Line*)(buf + h.lines_at);
+  for (ln = 0; ln <= tp.len; ln++) {
+    Line line = tp.lines[ln];
+    int j = 0;
+    for (; j < line.len; j++) {
+      s8 t = line.tokens[j];
+      u64 at = (u64)(t.str - tp.text);
+      if (t.str < tp.text || t.str + t.len > tp.text + source.len) {
+        memcpy(text + text_end, t.str, (size_t)t.len);
+        at = text_end;
+        text_end += (u64)t.len;
       }
-      a.reg = r.val;
-      if (a.reg > NUM_REGISTERS || a.reg < 0) {
-        printf(
-            "Argument %i register is out of range, must be between 0 and "
-            "%i\n",
-            args.count + 1, NUM_REGISTERS);
-        args.is_valid = false;
-        return args;
+      lines[ln].tokens[j].str = (char*)(size_t)at;
+      lines[ln].tokens[j].len = t.len;
+      lines[ln].ids[j] = line.ids[j] == NO_SYMBOL ? NO_SYMBOL
+                                                  : local[line.ids[j]];
+    }
+    lines[ln].len = line.len;
+  }
+
+  Decoded* dec = (Decoded*)(buf + h.decoded_at);
+  Idiom* idioms = (Idiom*)(buf + h.idioms_at);
+  int idiom = 0;
+  for (ln = 0; ln < tp.len; ln++) {
+    Decoded e = d[ln];
+    e.run = NULL;
+    if (e.idiom != NULL) {
+      idioms[idiom] = *e.idiom;
+      idiom++;
+      e.idiom = (Idiom*)(size_t)idiom;
+    }
+    int i = 0;
+    for (; i < e.args.count; i++) {
+      if (e.args.args[i].tag == LABEL_ARG) {
+        int id = e.args.args[i].label;
+        e.args.args[i].label = id == NO_SYMBOL ? NO_SYMBOL : local[id];
       }
+    }
+    dec[ln] = e;
+  }
+  dec[tp.len].cmd = UNKNOWN;
 
-      /*constant argument*/
-    } else if (t.str[0] == '#') {
-      a.tag = CONSTANT;
-      t.str++;
-      t.len--;
-      ResultInt r = parse_int(t);
+  s8* syms = (s8*)(buf + h.symbols_at);
+  int* label_lines = (int*)(buf + h.labels_at);
+  int k = 0;
+  for (; k < h.symbol_count; k++) {
+    s8 name = symbol_name(names[k]);
+    memcpy(text + text_end, name.str, (size_t)name.len);
+    syms[k].str = (char*)(size_t)text_end;
+    syms[k].len = name.len;
+    text_end += (u64)name.len;
+    label_lines[k] = label_line(p.labels, names[k]);
+  }
+  counted_free(local);
+  counted_free(names);
+
+  bool ok = make_dirs(dir);
+  char* path = cache_path(dir, h.key, ".oac");
+  char suffix[32];
+  sprintf(suffix, ".oac.%i.tmp", (int)getpid());
+  char* tmp = cache_path(dir, h.key, suffix);
+  int fd = ok ? open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600) : -1;
+  ok = fd >= 0 && write_full(fd, buf, (size_t)h.file_len);
+  if (fd >= 0) {
+    ok = close(fd) == 0 && ok;
+  }
+  ok = ok && rename(tmp, path) == 0;
+  if (!ok && fd >= 0) {
+    unlink(tmp);
+  }
+  free(tmp);
+  free(path);
+  counted_free(buf);
+  return ok;
+}
+
+bool make_dirs(const char* dir) {
+  /*mkdir -p, true if dir is a directory at the end.*/
+  char* path = malloc(strlen(dir) + 1);
+  strcpy(path, dir);
+  char* c = path + 1;
+  for (; *c != '\0'; c++) {
+    if (*c == '/') {
+      *c = '\0';
+      mkdir(path, 0700);
+      *c = '/';
+    }
+  }
+  mkdir(path, 0700);
+  struct stat st;
+  bool ok = stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+  free(path);
+  return ok;
+}
+
+TokenizedProgram tokenize_parallel(s8 s, int num_threads) {
+  /*Tokenize newline aligned chunks of the source on separate threads and stitch
+   * the per chunk line arrays back together. The result is the same as
+   * tokenizing on one thread. The tokens point into a copy of s the program
+   * owns, so s can go once this returns.*/
+  char* text = alloc_text((u64)s.len);
+  memcpy(text, s.str, (u64)s.len);
+  s.str = text;
+  if (num_threads < 1) {
+    num_threads = 1;
+  }
+  if (num_threads > MAX_ASSEMBLE_THREADS) {
+    num_threads = MAX_ASSEMBLE_THREADS;
+  }
+  AssembleChunk chunks[MAX_ASSEMBLE_THREADS];
+  int n = split_source(s, num_threads, chunks);
+  if (n == 0) {
+    n = 1;
+    memset(&chunks[0], 0, sizeof(AssembleChunk));
+    chunks[0].source = s;
+  }
+  run_chunks(tokenize_chunk_worker, chunks, n);
+
+  /*The serial tokenizer gives up at the first malformed line, so drop every
+   * chunk after the first one that failed.*/
+  int last = 0;
+  int total = 0;
+  for (; last < n; last++) {
+    total += chunks[last].program.len;
+    if (!chunks[last].program.ok || last == n - 1) {
+      break;
+    }
+  }
+
+  /*Give the identifiers of each chunk global ids in program order, so the ids
+   * do not depend on the thread count. One lock for the whole program, so its
+   * ids come from one table even if the server starts the table over.*/
+  int k = 0;
+  pthread_mutex_lock(&symbols_lock);
+  for (; k <= last; k++) {
+    AssembleChunk* c = &chunks[k];
+    c->global_ids =
+        alloc_scratch((size_t)(c->symbols.count + 1) * sizeof(int));
+    int id = 0;
+    for (; id < c->symbols.count; id++) {
+      c->global_ids[id] = intern(alloc_symbols, counted_free, &symbols,
+                                 interner_name(c->symbols, id));
+    }
+  }
+  pthread_mutex_unlock(&symbols_lock);
+
+  /*Keep the line one past the end too, it is a zeroed line unless the last
+   * chunk stopped on a malformed line.*/
+  TokenizedProgram program;
+  memset(&program, 0, sizeof(program));
+  program.len = total;
+  program.ok = chunks[last].program.ok;
+  program.text = text;
+  if (last == 0) {
+    program.lines = chunks[0].program.lines;
+  } else {
+    program.lines = (Line*)alloc_lines((size_t)(total + 1) * sizeof(Line));
+  }
+  int offset = 0;
+  for (k = 0; k <= last; k++) {
+    chunks[k].dest = program.lines + offset;
+    chunks[k].copy_end_line = k == last;
+    offset += chunks[k].program.len;
+  }
+  run_chunks(intern_chunk_worker, chunks, last + 1);
+
+  for (k = 0; k < n; k++) {
+    if (last != 0 || k > last) {
+      counted_free(chunks[k].program.lines);
+    }
+    if (k <= last) {
+      counted_free(chunks[k].global_ids);
+    }
+    interner_destroy(counted_free, chunks[k].symbols);
+  }
+  return program;
+}
+
+void* resolve_labels_chunk_worker(void* arg) {
+  AssembleChunk* c = (AssembleChunk*)arg;
+  c->labels = resolve_labels(c->program);
+  return NULL;
+}
+
+LabelTable resolve_labels_parallel(TokenizedProgram p, int num_threads) {
+  /*Collect labels per chunk of lines, then merge them in program order so a
+   * later declaration of the same label still wins.*/
+  if (num_threads <= 1) {
+    return resolve_labels(p);
+  }
+  if (num_threads > MAX_ASSEMBLE_THREADS) {
+    num_threads = MAX_ASSEMBLE_THREADS;
+  }
+  AssembleChunk chunks[MAX_ASSEMBLE_THREADS];
+  int n = split_lines(p, num_threads, chunks);
+  run_chunks(resolve_labels_chunk_worker, chunks, n);
+
+  int count = 0;
+  int k = 0;
+  for (; k < n; k++) {
+    count += chunks[k].labels.len / 2;
+  }
+  LabelTable labels = label_table_create(alloc_labels, count);
+  for (k = 0; k < n; k++) {
+    LabelTable chunk_labels = chunks[k].labels;
+    int slot = 0;
+    for (; slot < chunk_labels.len; slot++) {
+      if (chunk_labels.ids[slot] != NO_SYMBOL) {
+        label_table_set(&labels, chunk_labels.ids[slot],
+                        chunk_labels.lines[slot] + chunks[k].line_offset);
+      }
+    }
+    counted_free(chunk_labels.lines);
+  }
+  return labels;
+}
+
+void* find_register_label_decls_worker(void* arg) {
+  AssembleChunk* c = (AssembleChunk*)arg;
+  int reg_keyword = register_label_keyword();
+  int cap = 0;
+  int ln = 0;
+  for (; ln < c->program.len; ln++) {
+    Line line = c->program.lines[ln];
+    if (line.len == 3 && line.ids[0] == reg_keyword) {
+      if (c->reg_decl_count == cap) {
+        cap = cap == 0 ? 8 : cap * 2;
+        c->reg_decl_lines = counted_realloc(ALLOC_SCRATCH, c->reg_decl_lines,
+                                            (size_t)cap * sizeof(int));
+      }
+      c->reg_decl_lines[c->reg_decl_count] = ln;
+      c->reg_decl_count++;
+    }
+  }
+  return NULL;
+}
+
+void* resolve_register_labels_chunk_worker(void* arg) {
+  AssembleChunk* c = (AssembleChunk*)arg;
+  TokenizedProgram p = c->program;
+  RegisterLabels* decls = c->decls;
+  LabelTable* register_labels = &c->register_labels;
+  int decl = 0;
+  int ln = 0;
+  for (; ln < p.len; ln++) {
+    Line line = p.lines[ln];
+    bool is_register_label_decl =
+        decl < c->reg_decl_count && c->reg_decl_lines[decl] == ln;
+    if (is_register_label_decl) {
+      if (line.ids[1] != NO_SYMBOL) {
+        label_table_set(register_labels, line.ids[1],
+                        c->first_reg_decl + decl);
+      }
+      decl++;
+      continue;
+    }
+    int j = 0;
+    for (; j < line.len; j++) {
+      /*register label tokens could only be bare, or wrapped in []. Label
+       * declarations share the symbol id of the bare name, skip those.*/
+      s8 t = line.tokens[j];
+      int id = line.ids[j];
+      if (id == NO_SYMBOL || t.str[t.len - 1] == ':') {
+        continue;
+      }
+      int d = label_line(*register_labels, id);
+      if (d < 0) {
+        continue;
+      }
+      if (t.len > 2 && t.str[0] == '[') {
+        line.tokens[j] = decls->reg_addr[d];
+      } else {
+        line.tokens[j] = decls->reg[d];
+      }
+      line.ids[j] = decls->reg_id[d];
+      p.lines[ln] = line;
+    }
+  }
+  return NULL;
+}
+
+TokenizedProgram resolve_register_labels_parallel(TokenizedProgram p,
+                                                  int num_threads) {
+  /*A register label applies to every line after its declaration, so this runs
+   * in three steps: find the declarations in each chunk, parse them in program
+   * order to get the labels live at the start of each chunk, then rewrite the
+   * chunks.*/
+  if (num_threads < 1) {
+    num_threads = 1;
+  }
+  if (num_threads > MAX_ASSEMBLE_THREADS) {
+    num_threads = MAX_ASSEMBLE_THREADS;
+  }
+  AssembleChunk chunks[MAX_ASSEMBLE_THREADS];
+  int n = split_lines(p, num_threads, chunks);
+  run_chunks(find_register_label_decls_worker, chunks, n);
+
+  RegisterLabels decls;
+  decls.count = 0;
+  int k = 0;
+  for (; k < n; k++) {
+    decls.count += chunks[k].reg_decl_count;
+  }
+  decls.reg = alloc_scratch((size_t)(decls.count + 1) * sizeof(s8));
+  decls.reg_addr = alloc_scratch((size_t)(decls.count + 1) * sizeof(s8));
+  decls.reg_id = alloc_scratch((size_t)(decls.count + 1) * sizeof(int));
+  /*room for every [xN] token the rewrite can use*/
+  u64 text_size = 0;
+  for (k = 0; k < n; k++) {
+    int i = 0;
+    for (; i < chunks[k].reg_decl_count; i++) {
+      Line line = chunks[k].program.lines[chunks[k].reg_decl_lines[i]];
+      text_size += (u64)line.tokens[2].len + 2;
+    }
+  }
+  char* text = text_size > 0 ? alloc_register_labels(text_size) : NULL;
+  char* text_end = text;
+
+  /*each chunk starts from the aliases live before it, with room for all of
+   * them*/
+  LabelTable live = label_table_create(alloc_scratch, decls.count);
+  int d = 0;
+  for (k = 0; k < n; k++) {
+    AssembleChunk* c = &chunks[k];
+    c->decls = &decls;
+    c->first_reg_decl = d;
+    c->register_labels = label_table_clone(alloc_scratch, live);
+    int i = 0;
+    for (; i < c->reg_decl_count; i++, d++) {
+      Line line = c->program.lines[c->reg_decl_lines[i]];
+      s8 reg_str;
+      reg_str.str = line.tokens[2].str + 1;
+      reg_str.len = line.tokens[2].len - 1;
+      ResultInt r = parse_int(reg_str);
       if (!r.ok) {
-        args.is_valid = false;
-        return args;
+        out_printf("warning register label failed to parse\n");
       }
-      a.constant = r.val;
-      /*label argument*/
-    } else {
-      a.tag = LABEL_ARG;
-      a.label = t;
+      /*Substitute the register token itself, so any register number works.*/
+      decls.reg[d] = line.tokens[2];
+      decls.reg_addr[d].str = text_end;
+      decls.reg_addr[d].len = line.tokens[2].len + 2;
+      text_end[0] = '[';
+      memcpy(text_end + 1, line.tokens[2].str, (u64)line.tokens[2].len);
+      text_end[line.tokens[2].len + 1] = ']';
+      text_end += decls.reg_addr[d].len;
+      decls.reg_id[d] = line.ids[2];
+      if (line.ids[1] != NO_SYMBOL) {
+        label_table_set(&live, line.ids[1], d);
+      }
+    }
+  }
+  counted_free(live.lines);
+
+  run_chunks(resolve_register_labels_chunk_worker, chunks, n);
+  for (k = 0; k < n; k++) {
+    counted_free(chunks[k].register_labels.lines);
+    counted_free(chunks[k].reg_decl_lines);
+  }
+  counted_free(decls.reg);
+  counted_free(decls.reg_addr);
+  counted_free(decls.reg_id);
+  /*Resolving a program again finds nothing left to rewrite, the tokens from the
+   * first pass are the ones in use.*/
+  if (p.register_text == NULL) {
+    p.register_text = text;
+  } else {
+    counted_free(text);
+  }
+  return p;
+}
+
+State tick(State s, Line line) {
+/*Evaluate one line of asm.*/
+#ifndef LOG_NONE
+  if (s.machine->trace) {
+    log_line(line);
+  }
+#endif
+  if (line.len < 1) {
+    out_printf("warning:tick: empty line\n");
+    s.cont = false;
+    return s;
+  }
+  CMD cmd = identify_cmd(line.tokens[0]);
+  Args args;
+  args.count = 0;
+  ArgValidations v = cmd_validations(cmd);
+  if (v.expected_arg_count >= 0) {
+    args = parse_args(line);
+    if (!args.is_valid || !validate_args(args, v)) {
+      s.cont = false;
+      s.pc++;
+      return s;
+    }
+  }
+  s = execute(s, &line, cmd, &args);
+  s.pc++;
+  return s;
+}
+
+State execute(State s, const Line* line, CMD cmd, const Args* args) {
+  /*Run one instruction whose arguments have already been checked against
+   * cmd_validations. Leaves moving to the next line to the caller.*/
+  Handler run = select_handler(cmd, args);
+  if (s.machine != NULL && s.machine->guard_mem) {
+    run = guarded_handler(cmd, run);
+  }
+  return run(s, args, line);
+}
+
+/*Where the operands of each kind of instruction are, see OARM_INSTRUCTIONS.*/
+#define SHAPE_ALU(args) operand_shape(args, 1, 2)
+#define SHAPE_MAC(args) operand_shape(args, 1, 3)
+#define SHAPE_MOVE(args) operand_shape(args, 1, 1)
+#define SHAPE_COMPARE(args) operand_shape(args, 0, 2)
+#define SHAPE_OTHER(args) 0
+
+Handler select_handler(CMD cmd, const Args* args) {
+  /*The version of cmd's handler made for the registers and constants in
+   * args. The decoded engine does this once per line.*/
+  switch (cmd) {
+#define SELECT_HANDLER(cmd, name, mnemonic, kind, semantics, count, t1, t2, \
+                       t3, t4, section, docs)                               \
+  case cmd:                                                                 \
+    return name##_shapes[SHAPE_##kind(args)];
+    OARM_INSTRUCTIONS(SELECT_HANDLER)
+#undef SELECT_HANDLER
+  }
+  return exec_unknown;
+}
+
+int operand_shape(const Args* args, int first, int count) {
+  /*Bit i is set when operand first + i is a constant.*/
+  int shape = 0;
+  int i = 0;
+  for (; i < count; i++) {
+    if (args->args[first + i].tag == CONSTANT) {
+      shape |= 1 << i;
+    }
+  }
+  return shape;
+}
+
+/*Every handler, generated from OARM_INSTRUCTIONS. The specialised ones read
+ * each operand from where their shape says it is, so nothing on the way to
+ * the semantics looks at an operand's tag.*/
+#define OPERAND_r(i) s.registers[args->args[i].reg]
+#define OPERAND_i(i) args->args[i].constant
+#define DEFINE_ALU_SHAPE(name, semantics, a, b)    \
+  HANDLER(name##_##a##b) {                         \
+    (void)line;                                    \
+    s.registers[args->args[0].reg] =               \
+        semantics(OPERAND_##a(1), OPERAND_##b(2)); \
+    return s;                                      \
+  }
+#define DEFINE_ALU(name, semantics)                                 \
+  DEFINE_ALU_SHAPE(name, semantics, r, r)                           \
+  DEFINE_ALU_SHAPE(name, semantics, i, r)                           \
+  DEFINE_ALU_SHAPE(name, semantics, r, i)                           \
+  DEFINE_ALU_SHAPE(name, semantics, i, i)                           \
+  const Handler name##_shapes[] = {name##_rr, name##_ir, name##_ri, \
+                                   name##_ii};
+#define DEFINE_MAC_SHAPE(name, semantics, a, b, c)                 \
+  HANDLER(name##_##a##b##c) {                                      \
+    (void)line;                                                    \
+    s.registers[args->args[0].reg] =                               \
+        semantics(OPERAND_##a(1), OPERAND_##b(2), OPERAND_##c(3)); \
+    return s;                                                      \
+  }
+#define DEFINE_MAC(name, semantics)                    \
+  DEFINE_MAC_SHAPE(name, semantics, r, r, r)           \
+  DEFINE_MAC_SHAPE(name, semantics, i, r, r)           \
+  DEFINE_MAC_SHAPE(name, semantics, r, i, r)           \
+  DEFINE_MAC_SHAPE(name, semantics, i, i, r)           \
+  DEFINE_MAC_SHAPE(name, semantics, r, r, i)           \
+  DEFINE_MAC_SHAPE(name, semantics, i, r, i)           \
+  DEFINE_MAC_SHAPE(name, semantics, r, i, i)           \
+  DEFINE_MAC_SHAPE(name, semantics, i, i, i)           \
+  const Handler name##_shapes[] = {                    \
+      name##_rrr, name##_irr, name##_rir, name##_iir,  \
+      name##_rri, name##_iri, name##_rii, name##_iii};
+#define DEFINE_MOVE_SHAPE(name, a)                   \
+  HANDLER(name##_##a) {                              \
+    (void)line;                                      \
+    s.registers[args->args[0].reg] = OPERAND_##a(1); \
+    return s;                                        \
+  }
+#define DEFINE_MOVE(name, semantics)                    \
+  DEFINE_MOVE_SHAPE(name, r)                            \
+  DEFINE_MOVE_SHAPE(name, i)                            \
+  const Handler name##_shapes[] = {name##_r, name##_i};
+#define DEFINE_COMPARE_SHAPE(name, semantics, a, b)    \
+  HANDLER(name##_##a##b) {                             \
+    (void)line;                                        \
+    s.cmp = semantics(OPERAND_##a(0), OPERAND_##b(1)); \
+    return s;                                          \
+  }
+#define DEFINE_COMPARE(name, semantics)                             \
+  DEFINE_COMPARE_SHAPE(name, semantics, r, r)                       \
+  DEFINE_COMPARE_SHAPE(name, semantics, i, r)                       \
+  DEFINE_COMPARE_SHAPE(name, semantics, r, i)                       \
+  DEFINE_COMPARE_SHAPE(name, semantics, i, i)                       \
+  const Handler name##_shapes[] = {name##_rr, name##_ir, name##_ri, \
+                                   name##_ii};
+#define DEFINE_OTHER(name, semantics)            \
+  HANDLER(exec_##name) {                         \
+    (void)args;                                  \
+    (void)line;                                  \
+    semantics;                                   \
+    return s;                                    \
+  }                                              \
+  const Handler name##_shapes[] = {exec_##name};
+#define DEFINE_HANDLERS(cmd, name, mnemonic, kind, semantics, count, t1, \
+                        t2, t3, t4, section, docs)                       \
+  DEFINE_##kind(name, semantics)
+OARM_INSTRUCTIONS(DEFINE_HANDLERS)
+#undef DEFINE_HANDLERS
+
+State tick_decoded(State s, const Decoded* d, Line line) {
+  /*tick, with the parsing and checking already done by decode_line.*/
+  if (!d->ok) {
+    return tick(s, line);
+  }
+#ifndef LOG_NONE
+  if (s.machine->trace) {
+    log_line(line);
+  }
+#endif
+  s = d->run(s, &d->args, &line);
+  s.pc++;
+  return s;
+}
+
+State step(State s) {
+  /*Run the line at pc with the machine's engine.*/
+  Machine* m = s.machine;
+  int pc = s.pc;
+  /*a thread local store, cheaper than checking whether anyone is sampling*/
+  profile_pc = pc;
+  guest_instructions++;
+  if (m->engine == ENGINE_DECODED) {
+    s = tick_decoded(s, &m->decoded[pc], m->program.lines[pc]);
+  } else {
+    s = tick(s, m->program.lines[pc]);
+  }
+  if (m->costs != NULL) {
+    cost_count(m, pc, s.pc);
+  }
+  return s;
+}
+
+Profile profile;
+__thread int profile_pc = -1;
+__thread u64 guest_instructions;
+
+double monotonic_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+i64 heap_in_use(void) {
+  /*Bytes malloc has handed out and not had back, mapped blocks included.*/
+  struct mallinfo2 info = mallinfo2();
+  return (i64)(info.uordblks + info.hblkhd);
+}
+
+#define ALLOC_SITE_FN(site, fn, name) \
+  void* fn(u64 size) {                \
+    return counted_alloc(site, size); \
+  }
+OARM_ALLOC_SITES(ALLOC_SITE_FN)
+#undef ALLOC_SITE_FN
+
+void timings_begin(Timings* t) {
+  if (t == NULL) {
+    return;
+  }
+  t->started = monotonic_seconds();
+  t->heap_started = heap_in_use();
+  t->allocs_started = alloc_stats;
+  alloc_stats_mark();
+}
+
+void timings_end(Timings* t, Phase phase) {
+  /*Put what the time and heap did since the last begin or end down to phase,
+   * and start timing the next.*/
+  if (t == NULL) {
+    return;
+  }
+  double now = monotonic_seconds();
+  i64 heap = heap_in_use();
+  t->seconds[phase] += now - t->started;
+  t->bytes[phase] += heap - t->heap_started;
+  t->started = now;
+  t->heap_started = heap;
+
+  AllocStats a = alloc_stats;
+  t->allocs[phase] += a.count - t->allocs_started.count;
+  t->alloc_bytes[phase] += a.bytes - t->allocs_started.bytes;
+  t->frees[phase] += a.frees - t->allocs_started.frees;
+  if (a.peak > t->peak[phase]) {
+    t->peak[phase] = a.peak;
+  }
+  t->allocs_started = a;
+  alloc_stats_mark();
+}
+
+void timings_print(const Timings* t, bool json) {
+  /*As a table, or for --timings=json one JSON object on one line.*/
+  const char* names[PHASE_COUNT] = {
+#define PHASE_NAME(phase, name) name,
+      OARM_PHASES(PHASE_NAME)
+#undef PHASE_NAME
+  };
+  double run = t->seconds[PHASE_RUN];
+  double rate = run > 0 ? (double)t->instructions / run : 0;
+  int i = 0;
+  if (json) {
+    out_printf("{");
+    for (; i < PHASE_COUNT; i++) {
+      out_printf("\"%s\":{\"seconds\":%.9f,\"bytes\":%li},", names[i],
+                 t->seconds[i], t->bytes[i]);
+    }
+    out_printf("\"instructions\":%lu,\"instructions_per_second\":%.0f}\n",
+               t->instructions, rate);
+    return;
+  }
+  out_printf("timings:\n");
+  for (; i < PHASE_COUNT; i++) {
+    out_printf("  %-24s %12.6fs %14li bytes\n", names[i], t->seconds[i],
+               t->bytes[i]);
+  }
+  out_printf("  %lu instructions, %.0f instructions/s\n", t->instructions,
+             rate);
+}
+
+void alloc_report_print(const Timings* t) {
+  /*What the counted allocators did in each phase, then per site over the
+   * whole run. peak is the most live at once during the phase.*/
+  const char* phases[PHASE_COUNT] = {
+#define PHASE_NAME(phase, name) name,
+      OARM_PHASES(PHASE_NAME)
+#undef PHASE_NAME
+  };
+  const char* sites[ALLOC_SITE_COUNT] = {
+#define ALLOC_SITE_NAME(site, fn, name) name,
+      OARM_ALLOC_SITES(ALLOC_SITE_NAME)
+#undef ALLOC_SITE_NAME
+  };
+  out_printf("allocations:\n");
+  out_printf("  %-24s %10s %14s %10s %14s\n", "phase", "allocs", "bytes",
+             "frees", "peak");
+  int i = 0;
+  for (; i < PHASE_COUNT; i++) {
+    out_printf("  %-24s %10li %14li %10li %14li\n", phases[i], t->allocs[i],
+               t->alloc_bytes[i], t->frees[i], t->peak[i]);
+  }
+  out_printf("  %-24s %10s %14s\n", "site", "allocs", "bytes");
+  for (i = 0; i < ALLOC_SITE_COUNT; i++) {
+    out_printf("  %-24s %10li %14li\n", sites[i], alloc_stats.site_count[i],
+               alloc_stats.site_bytes[i]);
+  }
+  out_printf("  %li allocs, %li bytes, %li frees, %li bytes still live\n",
+             alloc_stats.count, alloc_stats.bytes, alloc_stats.frees,
+             alloc_stats.live);
+}
+
+bool profile_start(int len, int hz) {
+  /*Sample hz times a second of CPU time for a program of len lines.*/
+  profile.hits = calloc((size_t)len, sizeof(u64));
+  profile.len = len;
+  profile.missed = 0;
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = profile_sample;
+  /*guest reads shouldn't fail with EINTR because a sample was taken*/
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  struct itimerval timer;
+  timer.it_interval.tv_sec = 1000000 / hz / 1000000;
+  timer.it_interval.tv_usec = 1000000 / hz % 1000000;
+  timer.it_value = timer.it_interval;
+  if (sigaction(SIGPROF, &sa, NULL) != 0 ||
+      setitimer(ITIMER_PROF, &timer, NULL) != 0) {
+    out_printf("profile: can't start the sampling timer\n");
+    return false;
+  }
+  return true;
+}
+
+void profile_sample(int sig) {
+  int pc = profile_pc;
+  (void)sig;
+  if (pc >= 0 && pc < profile.len) {
+    __atomic_add_fetch(&profile.hits[pc], 1, __ATOMIC_RELAXED);
+  } else {
+    __atomic_add_fetch(&profile.missed, 1, __ATOMIC_RELAXED);
+  }
+}
+
+void profile_stop(void) {
+  struct itimerval timer;
+  memset(&timer, 0, sizeof(timer));
+  setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+bool profile_write(TokenizedProgram p, const char* path) {
+  /*One folded stack per line that was sampled, "label;line: text hits",
+   * the label being the last one declared above the line. flamegraph.pl and
+   * speedscope read these.*/
+  FILE* f = fopen(path, "w");
+  if (f == NULL) {
+    out_printf("profile: can't write %s\n", path);
+    return false;
+  }
+  s8 label = s8_view("(start)");
+  u64 total = 0;
+  int ln = 0;
+  for (; ln < p.len && ln < profile.len; ln++) {
+    Line line = p.lines[ln];
+    s8 t = line.tokens[0];
+    if (line.len == 1 && t.len > 1 && t.str[t.len - 1] == ':') {
+      label = t;
+      label.len--;
+    }
+    if (profile.hits[ln] == 0) {
+      continue;
+    }
+    fprintf(f, "%.*s;%i:", label.len, label.str, ln);
+    int i = 0;
+    for (; i < line.len; i++) {
+      fprintf(f, " %.*s", line.tokens[i].len, line.tokens[i].str);
+    }
+    fprintf(f, " %lu\n", profile.hits[ln]);
+    total += profile.hits[ln];
+  }
+  fclose(f);
+  out_printf("profile: %lu samples in guest code written to %s, %lu outside\n",
+             total, path, profile.missed);
+  return true;
+}
+
+CostModel cost_model_default(void) {
+  /*Roughly an in-order ARMv8 core like the Cortex-A53 running out of L1:
+   * single cycle ALU ops, a 3 cycle multiplier, a divider taking about a
+   * dozen, 3 cycle loads and a 2 cycle bubble after each taken branch. A
+   * vector op is two 128 bit halves. Debugging commands and labels cost
+   * nothing, the real core wouldn't run them, and in, out, read, write,
+   * spawn and join stand in for system calls.*/
+  CostModel c;
+  int i = 0;
+  for (; i <= UNKNOWN; i++) {
+    c.cycles[i] = 1;
+  }
+  c.cycles[REG] = 0;
+  c.cycles[MEM] = 0;
+  c.cycles[RPC] = 0;
+  c.cycles[RCB] = 0;
+  c.cycles[LABEL_DECL] = 0;
+  c.cycles[NL] = 0;
+  c.cycles[UNKNOWN] = 0;
+  c.cycles[MUL] = 3;
+  c.cycles[MADD] = 4;
+  c.cycles[MSUB] = 4;
+  c.cycles[SDIV] = 12;
+  c.cycles[UDIV] = 12;
+  /*a divide and a multiply subtract*/
+  c.cycles[MOD] = 16;
+  c.cycles[FILL] = 8;
+  c.cycles[CPY] = 8;
+  c.cycles[VLD] = 2;
+  c.cycles[VST] = 2;
+  c.cycles[VADD] = 2;
+  c.cycles[VSUB] = 2;
+  c.cycles[VMIN] = 2;
+  c.cycles[VMAX] = 2;
+  c.cycles[VCMP] = 2;
+  c.cycles[LDADD] = 6;
+  c.cycles[CAS] = 8;
+  c.cycles[IN] = 50;
+  c.cycles[OUT] = 50;
+  c.cycles[READ] = 50;
+  c.cycles[WRITE] = 50;
+  c.cycles[SPAWN] = 200;
+  c.cycles[JOIN] = 200;
+  c.branch_taken = 2;
+  c.memory = 2;
+  return c;
+}
+
+bool cost_model_load(const char* path, CostModel* model) {
+  /*The default table with what the file at path changes, one "name cycles"
+   * line each. A name is a mnemonic, label for label declarations, or
+   * branch_taken or memory for the extra costs. # starts a comment.*/
+  FILE* f = fopen(path, "r");
+  if (f == NULL) {
+    out_printf("cost model: can't read %s\n", path);
+    return false;
+  }
+  *model = cost_model_default();
+  char buf[256];
+  int ln = 0;
+  bool ok = true;
+  while (ok && fgets(buf, sizeof(buf), f) != NULL) {
+    ln++;
+    char* comment = strchr(buf, '#');
+    if (comment != NULL) {
+      *comment = '\0';
+    }
+    char name[32];
+    int cycles = 0;
+    char rest = 0;
+    int n = sscanf(buf, "%31s %i %c", name, &cycles, &rest);
+    if (n < 1) {
+      continue;
+    }
+    CMD cmd = cost_model_cmd(name);
+    if (n != 2 || cycles < 0) {
+      out_printf("cost model: %s:%i: expected a name and a number of "
+                 "cycles\n",
+                 path, ln);
+      ok = false;
+    } else if (strcmp(name, "branch_taken") == 0) {
+      model->branch_taken = cycles;
+    } else if (strcmp(name, "memory") == 0) {
+      model->memory = cycles;
+    } else if (cmd == UNKNOWN) {
+      out_printf("cost model: %s:%i: unknown instruction %s\n", path, ln,
+                 name);
+      ok = false;
+    } else {
+      model->cycles[cmd] = cycles;
+    }
+  }
+  fclose(f);
+  return ok;
+}
+
+CMD cost_model_cmd(const char* text) {
+  /*The row whose mnemonic is all of text, or UNKNOWN. Label declarations
+   * have no mnemonic, in a cost model they're label.*/
+  if (strcmp(text, "label") == 0) {
+    return LABEL_DECL;
+  }
+#define MNEMONIC_CMD(cmd, name, mnemonic, kind, semantics, count, t1, t2, t3, \
+                     t4, section, docs)                                       \
+  if (*mnemonic != '\0' && strcmp(mnemonic, text) == 0) {                     \
+    return cmd;                                                               \
+  }
+  OARM_INSTRUCTIONS(MNEMONIC_CMD)
+#undef MNEMONIC_CMD
+  return UNKNOWN;
+}
+
+bool cmd_accesses_memory(CMD cmd) {
+  switch (cmd) {
+    case LDR:
+    case STR:
+    case FILL:
+    case CPY:
+    case VLD:
+    case VST:
+    case LDADD:
+    case CAS:
+      return true;
+    default:
+      return false;
+  }
+}
+
+bool cmd_ends_block(CMD cmd) {
+  /*Whether the line after one running cmd starts a basic block.*/
+  switch (cmd) {
+    case BRANCH:
+    case BEQ:
+    case BNE:
+    case BLT:
+    case BLE:
+    case BGT:
+    case BGE:
+    case RET:
+      return true;
+    default:
+      return false;
+  }
+}
+
+CMD line_cmd(Line line) {
+  return line.len < 1 ? NL : identify_cmd(line.tokens[0]);
+}
+
+void machine_count_costs(Machine* m, const CostModel* model) {
+  /*Count the lines m runs from here on so they can be priced with model.
+   * Fused idioms are run line by line while it counts.*/
+  m->costs = model;
+  m->line_runs = calloc((size_t)m->program.len + 1, sizeof(u64));
+  m->line_taken = calloc((size_t)m->program.len + 1, sizeof(u64));
+}
+
+void cost_count(Machine* m, int pc, int next) {
+  /*One run of line pc, which left its thread at next. Anything but the line
+   * after pc is a jump. A deterministic join that is still waiting stays on
+   * its line to run again next turn, and isn't counted until it is done.
+   * Guest threads on host threads of their own count atomically. Stepping off
+   * the end of a program counts one past its last line.*/
+  if (pc < 0 || pc >= m->program.len) {
+    pc = m->program.len;
+  } else if (next == pc && line_cmd(m->program.lines[pc]) == JOIN) {
+    return;
+  }
+  if (m->thread_count == 1 || m->deterministic) {
+    m->line_runs[pc]++;
+    if (next != pc + 1) {
+      m->line_taken[pc]++;
+    }
+    return;
+  }
+  __atomic_add_fetch(&m->line_runs[pc], 1, __ATOMIC_RELAXED);
+  if (next != pc + 1) {
+    __atomic_add_fetch(&m->line_taken[pc], 1, __ATOMIC_RELAXED);
+  }
+}
+
+u64 line_cycles(const Machine* m, int ln) {
+  /*What line ln cost over the run so far.*/
+  CMD cmd = line_cmd(m->program.lines[ln]);
+  u64 each = (u64)m->costs->cycles[cmd];
+  if (cmd_accesses_memory(cmd)) {
+    each += (u64)m->costs->memory;
+  }
+  return m->line_runs[ln] * each +
+         m->line_taken[ln] * (u64)m->costs->branch_taken;
+}
+
+void top_rows(const u64* counts, int len, int* top, int rows) {
+  /*Fill top with the indexes of the rows largest nonzero counts, largest
+   * first and the earlier index first between equals, then -1s.*/
+  int i = 0;
+  int j = 0;
+  for (; j < rows; j++) {
+    top[j] = -1;
+  }
+  for (; i < len; i++) {
+    if (counts[i] == 0) {
+      continue;
+    }
+    j = rows;
+    while (j > 0 && (top[j - 1] < 0 || counts[top[j - 1]] < counts[i])) {
+      j--;
+    }
+    if (j < rows) {
+      memmove(&top[j + 1], &top[j], (size_t)(rows - j - 1) * sizeof(int));
+      top[j] = i;
+    }
+  }
+}
+
+void cost_report(const Machine* m) {
+  /*The estimated cycles of the run in total, then for the basic blocks and
+   * the lines that cost the most. A block starts at the first line, a label
+   * or the line after a branch or ret. A branch back to a label goes past it,
+   * so a block's runs are the most any of its lines ran.
+   * Cycles from every guest thread are added together.*/
+  TokenizedProgram p = m->program;
+  u64* cycles = calloc((size_t)p.len + 1, sizeof(u64));
+  u64* block_cycles = calloc((size_t)p.len + 1, sizeof(u64));
+  u64* block_runs = calloc((size_t)p.len + 1, sizeof(u64));
+  int* block_last = calloc((size_t)p.len + 1, sizeof(int));
+  u64 total = 0;
+  u64 instructions = 0;
+  int leader = 0;
+  int ln = 0;
+  for (; ln < p.len; ln++) {
+    if (ln > 0 && (line_cmd(p.lines[ln]) == LABEL_DECL ||
+                   cmd_ends_block(line_cmd(p.lines[ln - 1])))) {
+      leader = ln;
+    }
+    cycles[ln] = line_cycles(m, ln);
+    block_cycles[leader] += cycles[ln];
+    block_last[leader] = ln;
+    if (m->line_runs[ln] > block_runs[leader]) {
+      block_runs[leader] = m->line_runs[ln];
+    }
+    total += cycles[ln];
+    instructions += m->line_runs[ln];
+  }
+  out_printf("cost: %lu cycles for %lu instructions, %.2f per instruction\n",
+             total, instructions,
+             instructions > 0 ? (double)total / (double)instructions : 0.0);
+
+  int top[REPORT_ROWS];
+  int i = 0;
+  top_rows(block_cycles, p.len, top, REPORT_ROWS);
+  out_printf("cost: blocks by cycles\n");
+  for (; i < REPORT_ROWS && top[i] >= 0; i++) {
+    Line first = p.lines[top[i]];
+    out_printf("  %12lu cycles %5.1f%% %10lu runs  lines %i-%i",
+               block_cycles[top[i]],
+               100.0 * (double)block_cycles[top[i]] / (double)total,
+               block_runs[top[i]], top[i], block_last[top[i]]);
+    if (line_cmd(first) == LABEL_DECL) {
+      out_printf(" %.*s", first.tokens[0].len, first.tokens[0].str);
+    }
+    out_printf("\n");
+  }
+  top_rows(cycles, p.len, top, REPORT_ROWS);
+  out_printf("cost: lines by cycles\n");
+  for (i = 0; i < REPORT_ROWS && top[i] >= 0; i++) {
+    Line line = p.lines[top[i]];
+    out_printf("  %12lu cycles %5.1f%% %10lu runs  %i:", cycles[top[i]],
+               100.0 * (double)cycles[top[i]] / (double)total,
+               m->line_runs[top[i]], top[i]);
+    log_line_tokens(line);
+    if (m->line_taken[top[i]] > 0) {
+      out_printf(", %lu taken", m->line_taken[top[i]]);
+    }
+    out_printf("\n");
+  }
+  free(cycles);
+  free(block_cycles);
+  free(block_runs);
+  free(block_last);
+}
+
+bool parse_cache_level(s8 value, CacheLevel* c) {
+  /*SIZE,LINE,WAYS[,POLICY], the size and line in bytes, ex: 32768,64,4,lru.
+   * The line has to be a power of two of at least a word, and the size a
+   * whole number of sets. The policy is lru unless given.*/
+  int fields[3];
+  int from = 0;
+  int i = 0;
+  memset(c, 0, sizeof(CacheLevel));
+  c->policy = CACHE_LRU;
+  for (; i < 3; i++) {
+    int comma = s8_index_of(value, ',', from);
+    s8 field;
+    field.str = value.str + from;
+    field.len = comma - from;
+    ResultInt n = parse_int_report(field, false);
+    if (field.len < 1 || !n.ok || n.val < 1 || (comma == value.len && i < 2)) {
+      return false;
+    }
+    fields[i] = n.val;
+    from = comma + 1;
+  }
+  c->size = fields[0];
+  c->line = fields[1];
+  c->ways = fields[2];
+  if (from <= value.len) {
+    s8 name;
+    name.str = value.str + from;
+    name.len = value.len - from;
+    c->policy = CACHE_POLICY_COUNT;
+#define CACHE_POLICY_MATCH(id, policy_name) \
+  if (s8_eq(s8_view(policy_name), name)) {  \
+    c->policy = id;                          \
+  }
+    OARM_CACHE_POLICIES(CACHE_POLICY_MATCH)
+#undef CACHE_POLICY_MATCH
+    if (c->policy == CACHE_POLICY_COUNT) {
+      return false;
+    }
+  }
+  if (c->line < CACHE_WORD_BYTES || (c->line & (c->line - 1)) != 0 ||
+      c->size % (c->line * c->ways) != 0) {
+    return false;
+  }
+  c->sets = c->size / (c->line * c->ways);
+  return true;
+}
+
+const char* cache_policy_name(CachePolicy policy) {
+  switch (policy) {
+#define CACHE_POLICY_NAME(policy, name) \
+  case policy:                          \
+    return name;
+    OARM_CACHE_POLICIES(CACHE_POLICY_NAME)
+#undef CACHE_POLICY_NAME
+    default:
+      return "";
+  }
+}
+
+CacheSim* cache_sim_create(const CacheLevel* levels, int count, int len) {
+  /*Empty caches shaped like levels, the first count of them, for a program
+   * of len lines.*/
+  CacheSim* sim = calloc(1, sizeof(CacheSim));
+  int l = 0;
+  for (; l < count; l++) {
+    CacheLevel* c = &sim->levels[l];
+    int ways = levels[l].sets * levels[l].ways;
+    int w = 0;
+    *c = levels[l];
+    c->tags = malloc((size_t)ways * sizeof(i64));
+    c->stamps = calloc((size_t)ways, sizeof(u64));
+    for (; w < ways; w++) {
+      c->tags[w] = -1;
+    }
+    c->clock = 0;
+    c->random = 2463534242u;
+    c->hits = 0;
+    c->misses = 0;
+    sim->line_misses[l] = calloc((size_t)len + 1, sizeof(u64));
+  }
+  sim->level_count = count;
+  sim->line_accesses = calloc((size_t)len + 1, sizeof(u64));
+  sim->len = len;
+  pthread_mutex_init(&sim->lock, NULL);
+  return sim;
+}
+
+void cache_sim_destroy(CacheSim* sim) {
+  int l = 0;
+  for (; l < sim->level_count; l++) {
+    free(sim->levels[l].tags);
+    free(sim->levels[l].stamps);
+    free(sim->line_misses[l]);
+  }
+  free(sim->line_accesses);
+  pthread_mutex_destroy(&sim->lock);
+  free(sim);
+}
+
+bool cache_level_access(CacheLevel* c, int addr) {
+  /*Whether the line holding guest address addr is in c, filling it if not.
+   * An empty way is filled before anything is evicted.*/
+  i64 line = (i64)addr * CACHE_WORD_BYTES / c->line;
+  int set = (int)(line % c->sets);
+  i64* tags = &c->tags[set * c->ways];
+  u64* stamps = &c->stamps[set * c->ways];
+  int victim = 0;
+  int w = 0;
+  c->clock++;
+  for (; w < c->ways; w++) {
+    if (tags[w] == line) {
+      if (c->policy == CACHE_LRU) {
+        stamps[w] = c->clock;
+      }
+      c->hits++;
+      return true;
+    }
+    if (stamps[w] < stamps[victim]) {
+      victim = w;
+    }
+  }
+  if (c->policy == CACHE_RANDOM && tags[victim] >= 0) {
+    c->random ^= c->random << 13;
+    c->random ^= c->random >> 17;
+    c->random ^= c->random << 5;
+    victim = (int)(c->random % (u32)c->ways);
+  }
+  tags[victim] = line;
+  stamps[victim] = c->clock;
+  c->misses++;
+  return false;
+}
+
+void cache_sim_access(Machine* m, int pc, int addr, bool store) {
+  /*An ldr or str of guest address addr by line pc. Each level is only
+   * looked in when the one before it missed.*/
+  CacheSim* sim = m->cache_sim;
+  bool shared = m->thread_count > 1 && !m->deterministic;
+  int l = 0;
+  if (shared) {
+    pthread_mutex_lock(&sim->lock);
+  }
+  if (store) {
+    sim->stores++;
+  } else {
+    sim->loads++;
+  }
+  if (pc < 0 || pc >= sim->len) {
+    pc = sim->len;
+  }
+  sim->line_accesses[pc]++;
+  for (; l < sim->level_count &&
+         !cache_level_access(&sim->levels[l], addr);
+       l++) {
+    sim->line_misses[l][pc]++;
+  }
+  if (shared) {
+    pthread_mutex_unlock(&sim->lock);
+  }
+}
+
+void cache_sim_report(const CacheSim* sim, TokenizedProgram p) {
+  /*Hits and misses in each level, then the lines that missed the most in the
+   * first one. A second level only sees the first level's misses.*/
+  out_printf("cache: %lu loads, %lu stores\n", sim->loads, sim->stores);
+  int l = 0;
+  for (; l < sim->level_count; l++) {
+    const CacheLevel* c = &sim->levels[l];
+    u64 n = c->hits + c->misses;
+    out_printf("cache: L%i %i bytes, %i byte lines, %i ways, %s: %lu hits, "
+               "%lu misses, %.1f%% missed\n",
+               l + 1, c->size, c->line, c->ways, cache_policy_name(c->policy),
+               c->hits, c->misses,
+               n > 0 ? 100.0 * (double)c->misses / (double)n : 0.0);
+  }
+  int top[REPORT_ROWS];
+  int i = 0;
+  top_rows(sim->line_misses[0], p.len, top, REPORT_ROWS);
+  out_printf("cache: lines by L1 misses\n");
+  for (; i < REPORT_ROWS && top[i] >= 0; i++) {
+    int ln = top[i];
+    out_printf("  %10lu misses %10lu accesses %5.1f%%", sim->line_misses[0][ln],
+               sim->line_accesses[ln],
+               100.0 * (double)sim->line_misses[0][ln] /
+                   (double)sim->line_accesses[ln]);
+    if (sim->level_count > 1) {
+      out_printf(" %10lu L2 misses", sim->line_misses[1][ln]);
+    }
+    out_printf("  %i:", ln);
+    log_line_tokens(p.lines[ln]);
+    out_printf("\n");
+  }
+}
+
+bool parse_predictor(s8 name, Predictor* kind) {
+#define PREDICTOR_MATCH(id, predictor_name)  \
+  if (s8_eq(s8_view(predictor_name), name)) { \
+    *kind = id;                               \
+    return true;                              \
+  }
+  OARM_PREDICTORS(PREDICTOR_MATCH)
+#undef PREDICTOR_MATCH
+  return false;
+}
+
+const char* predictor_name(Predictor kind) {
+  switch (kind) {
+#define PREDICTOR_NAME(predictor, name) \
+  case predictor:                       \
+    return name;
+    OARM_PREDICTORS(PREDICTOR_NAME)
+#undef PREDICTOR_NAME
+    default:
+      return "";
+  }
+}
+
+BranchPredictor* bpred_create(Predictor kind, int bits, int len) {
+  /*A predictor with 1 << bits counters for a program of len lines.*/
+  BranchPredictor* bp = calloc(1, sizeof(BranchPredictor));
+  bp->kind = kind;
+  bp->bits = bits;
+  bp->counters = malloc((size_t)1 << bits);
+  memset(bp->counters, 2, (size_t)1 << bits);
+  bp->line_branches = calloc((size_t)len + 1, sizeof(u64));
+  bp->line_taken = calloc((size_t)len + 1, sizeof(u64));
+  bp->line_mispredicts = calloc((size_t)len + 1, sizeof(u64));
+  bp->len = len;
+  pthread_mutex_init(&bp->lock, NULL);
+  return bp;
+}
+
+void bpred_destroy(BranchPredictor* bp) {
+  free(bp->counters);
+  free(bp->line_branches);
+  free(bp->line_taken);
+  free(bp->line_mispredicts);
+  pthread_mutex_destroy(&bp->lock);
+  free(bp);
+}
+
+bool bpred_predict(BranchPredictor* bp, int pc, int target, bool taken) {
+  /*Whether bp guessed the branch at line pc to target right, then teach it
+   * that the branch was taken or not.*/
+  u32 mask = ((u32)1 << bp->bits) - 1;
+  u32 slot = (u32)pc;
+  bool guess;
+  if (bp->kind == PREDICT_STATIC) {
+    return (target < pc) == taken;
+  }
+  if (bp->kind == PREDICT_GSHARE) {
+    slot ^= bp->history;
+    bp->history = ((bp->history << 1) | (taken ? 1 : 0)) & mask;
+  }
+  slot &= mask;
+  guess = bp->counters[slot] >= 2;
+  if (taken && bp->counters[slot] < 3) {
+    bp->counters[slot]++;
+  } else if (!taken && bp->counters[slot] > 0) {
+    bp->counters[slot]--;
+  }
+  return guess == taken;
+}
+
+void bpred_branch(Machine* m, int pc, int target, bool taken) {
+  /*A conditional branch at line pc to the label at line target.*/
+  BranchPredictor* bp = m->bpred;
+  bool shared = m->thread_count > 1 && !m->deterministic;
+  if (shared) {
+    pthread_mutex_lock(&bp->lock);
+  }
+  if (pc < 0 || pc >= bp->len) {
+    pc = bp->len;
+  }
+  bp->branches++;
+  bp->line_branches[pc]++;
+  if (taken) {
+    bp->line_taken[pc]++;
+  }
+  if (!bpred_predict(bp, pc, target, taken)) {
+    bp->mispredicts++;
+    bp->line_mispredicts[pc]++;
+  }
+  if (shared) {
+    pthread_mutex_unlock(&bp->lock);
+  }
+}
+
+void bpred_report(const BranchPredictor* bp, TokenizedProgram p) {
+  /*How often bp guessed wrong, then the branches it guessed wrong the most
+   * with how often each was taken. A branch taken about half the time with
+   * no pattern to it misses whatever the predictor.*/
+  out_printf("bpred: %s", predictor_name(bp->kind));
+  if (bp->kind != PREDICT_STATIC) {
+    out_printf(" with %i counters", 1 << bp->bits);
+  }
+  out_printf(": %lu branches, %lu mispredicted, %.1f%%\n", bp->branches,
+             bp->mispredicts,
+             bp->branches > 0
+                 ? 100.0 * (double)bp->mispredicts / (double)bp->branches
+                 : 0.0);
+  int top[REPORT_ROWS];
+  int i = 0;
+  top_rows(bp->line_mispredicts, p.len, top, REPORT_ROWS);
+  out_printf("bpred: branches by mispredicts\n");
+  for (; i < REPORT_ROWS && top[i] >= 0; i++) {
+    int ln = top[i];
+    double runs = (double)bp->line_branches[ln];
+    out_printf("  %10lu mispredicts %10lu runs %5.1f%% taken %5.1f%% missed "
+               " %i:",
+               bp->line_mispredicts[ln], bp->line_branches[ln],
+               100.0 * (double)bp->line_taken[ln] / runs,
+               100.0 * (double)bp->line_mispredicts[ln] / runs, ln);
+    log_line_tokens(p.lines[ln]);
+    out_printf("\n");
+  }
+}
+
+Decoded decode_line(Line line) {
+  /*Parse and check a line without printing anything, errors are left for
+   * tick to report when the line runs.*/
+  Decoded d;
+  d.ok = false;
+  d.cmd = UNKNOWN;
+  d.args.count = 0;
+  d.idiom = NULL;
+  if (line.len < 1) {
+    return d;
+  }
+  d.cmd = identify_cmd(line.tokens[0]);
+  ArgValidations v = cmd_validations(d.cmd);
+  if (v.expected_arg_count < 0) {
+    d.ok = d.cmd != UNKNOWN;
+    d.run = select_handler(d.cmd, &d.args);
+    return d;
+  }
+  d.args = parse_args_report(line, false);
+  d.ok = d.args.is_valid && validate_args_report(d.args, v, false);
+  if (d.ok) {
+    d.run = select_handler(d.cmd, &d.args);
+  }
+  return d;
+}
+
+Decoded* decode_program(TokenizedProgram p) {
+  /*The entry past the last line is never ok, running off the end goes
+   * through tick like it always has.*/
+  Decoded* decoded = alloc_decoded((size_t)(p.len + 1) * sizeof(Decoded));
+  int i = 0;
+  for (; i < p.len; i++) {
+    decoded[i] = decode_line(p.lines[i]);
+  }
+  decoded[p.len].ok = false;
+  decoded[p.len].idiom = NULL;
+  find_idioms(p, decoded);
+  return decoded;
+}
+
+void decoded_destroy(Decoded* decoded, TokenizedProgram p) {
+  /*decoded is what decode_program or the cache gave for p.*/
+  char* at = (char*)decoded;
+  char* mapping = (char*)p.mapping;
+  if (mapping != NULL && at >= mapping && at < mapping + p.mapping_len) {
+    return;
+  }
+  int i = 0;
+  for (; i < p.len; i++) {
+    if (decoded[i].idiom != NULL) {
+      counted_free(decoded[i].idiom);
+    }
+  }
+  counted_free(decoded);
+}
+
+void find_idioms(TokenizedProgram p, Decoded* decoded) {
+  /*Point each label that starts an idiom at it, and have the label run it.*/
+  LabelTable labels = resolve_labels(p);
+  Idiom idiom;
+  int ln = 0;
+  for (; ln < p.len; ln++) {
+    if (is_line(p, decoded, ln, LABEL_DECL) &&
+        match_idiom(p, decoded, labels, ln, &idiom)) {
+      decoded[ln].idiom = alloc_decoded(sizeof(Idiom));
+      *decoded[ln].idiom = idiom;
+      decoded[ln].run = exec_idiom;
+    }
+  }
+  counted_free(labels.lines);
+}
+
+bool match_idiom(TokenizedProgram p,
+                 const Decoded* d,
+                 LabelTable labels,
+                 int first,
+                 Idiom* idiom) {
+  /*Whether the loop at label line first is one of the idioms, see Idiom.*/
+  memset(idiom, 0, sizeof(Idiom));
+  int label = p.lines[first].ids[0];
+  if (label_line(labels, label) != first) {
+    return false;
+  }
+  idiom->first = first;
+  int ln = first + 1;
+  int test = ln;
+  if (is_line(p, d, ln, CMP) && is_conditional_branch(p, d, ln + 1)) {
+    idiom->test_first = true;
+    ln += 2;
+  }
+  ln = match_idiom_body(p, d, labels, ln, idiom);
+  if (ln < 0) {
+    return false;
+  }
+
+  /*the adds and subs stepping the registers*/
+  int stepped = 0;
+  while ((is_line(p, d, ln, ADD) || is_line(p, d, ln, SUB)) &&
+         d[ln].args.args[1].tag == REGISTER &&
+         d[ln].args.args[1].reg == d[ln].args.args[0].reg &&
+         d[ln].args.args[2].tag == CONSTANT) {
+    Register r = d[ln].args.args[0].reg;
+    int k = d[ln].args.args[2].constant;
+    if (idiom->steps[r] != 0 || k == 0) {
+      return false;
+    }
+    idiom->steps[r] = d[ln].cmd == SUB ? (int)(0u - (u32)k) : k;
+    stepped++;
+    ln++;
+  }
+  if (stepped == 0) {
+    return false;
+  }
+
+  if (idiom->test_first) {
+    if (!is_line(p, d, ln, BRANCH) || d[ln].args.args[0].label != label) {
+      return false;
+    }
+    idiom->last = ln;
+    idiom->exit = label_line(labels, d[test + 1].args.args[0].label);
+    if (idiom->exit < 0 ||
+        (idiom->exit >= idiom->first && idiom->exit <= idiom->last)) {
+      return false;
+    }
+  } else {
+    test = ln;
+    if (!is_line(p, d, ln, CMP) || !is_conditional_branch(p, d, ln + 1) ||
+        d[ln + 1].args.args[0].label != label) {
+      return false;
+    }
+    idiom->last = ln + 1;
+    idiom->exit = ln + 1;
+  }
+  idiom->test = d[test + 1].cmd;
+
+  /*one side of the cmp is a stepped register, the other a bound*/
+  Arg a = d[test].args.args[0];
+  Arg b = d[test].args.args[1];
+  if (a.tag == REGISTER && idiom->steps[a.reg] != 0) {
+    idiom->index = a.reg;
+    idiom->bound = b;
+  } else if (b.tag == REGISTER && idiom->steps[b.reg] != 0) {
+    idiom->index = b.reg;
+    idiom->bound = a;
+    idiom->bound_first = true;
+  } else {
+    return false;
+  }
+  return idiom_registers_ok(idiom);
+}
+
+int match_idiom_body(TokenizedProgram p,
+                     const Decoded* d,
+                     LabelTable labels,
+                     int ln,
+                     Idiom* idiom) {
+  /*Match one of the bodies from line ln, filling in its registers. Returns
+   * the line after it, or -1.*/
+  ln = next_instruction(p, d, ln);
+  if (is_line(p, d, ln, STR)) {
+    if (d[ln].args.args[1].addr.type != A_REGISTER) {
+      return -1;
+    }
+    idiom->kind = IDIOM_FILL;
+    idiom->value = d[ln].args.args[0].reg;
+    idiom->store = d[ln].args.args[1].addr.val;
+    return next_instruction(p, d, ln + 1);
+  }
+  if (!is_line(p, d, ln, LDR) || d[ln].args.args[1].addr.type != A_REGISTER) {
+    return -1;
+  }
+  idiom->value = d[ln].args.args[0].reg;
+  idiom->load = d[ln].args.args[1].addr.val;
+
+  ln = next_instruction(p, d, ln + 1);
+  const Arg* a = d[ln].args.args;
+  if (is_line(p, d, ln, STR)) {
+    if (a[0].reg != idiom->value || a[1].addr.type != A_REGISTER) {
+      return -1;
+    }
+    idiom->kind = IDIOM_COPY;
+    idiom->store = a[1].addr.val;
+    return next_instruction(p, d, ln + 1);
+  }
+  if (is_line(p, d, ln, ADD)) {
+    if (a[1].tag != REGISTER || a[2].tag != REGISTER) {
+      return -1;
+    }
+    idiom->kind = IDIOM_SUM;
+    idiom->acc = a[0].reg;
+    if (!((a[1].reg == idiom->acc && a[2].reg == idiom->value) ||
+          (a[2].reg == idiom->acc && a[1].reg == idiom->value))) {
+      return -1;
+    }
+    return next_instruction(p, d, ln + 1);
+  }
+  if (!is_line(p, d, ln, CMP) || a[0].tag != REGISTER ||
+      a[1].tag != REGISTER || a[0].reg != idiom->value) {
+    return -1;
+  }
+  idiom->kind = IDIOM_MIN_SCAN;
+  idiom->acc = a[1].reg;
+
+  /*the branch over two movs, in either order, to the label after them*/
+  int skip = next_instruction(p, d, ln + 1);
+  int first_mov = next_instruction(p, d, skip + 1);
+  int second_mov = first_mov + 1;
+  if (!is_conditional_branch(p, d, skip) || !is_line(p, d, first_mov, MOV) ||
+      !is_line(p, d, second_mov, MOV)) {
+    return -1;
+  }
+  idiom->keep = d[skip].cmd;
+  const Arg* m = d[first_mov].args.args;
+  const Arg* n = d[second_mov].args.args;
+  if (m[0].reg != idiom->acc) {
+    m = d[second_mov].args.args;
+    n = d[first_mov].args.args;
+  }
+  if (m[0].reg != idiom->acc || m[1].tag != REGISTER ||
+      m[1].reg != idiom->value || n[1].tag != REGISTER ||
+      n[1].reg != idiom->load) {
+    return -1;
+  }
+  idiom->at = n[0].reg;
+  int after = next_instruction(p, d, second_mov + 1);
+  int target = label_line(labels, d[skip].args.args[0].label);
+  if (target <= second_mov || target >= after) {
+    return -1;
+  }
+  idiom->skipped = target - skip;
+  return after;
+}
+
+bool idiom_registers_ok(const Idiom* idiom) {
+  /*The addresses are stepped, and what the body writes is neither stepped,
+   * the bound nor written twice.*/
+  int written[3];
+  int count = 0;
+  if (idiom->kind != IDIOM_FILL) {
+    if (idiom->steps[idiom->load] == 0) {
+      return false;
+    }
+    written[count++] = idiom->value;
+  } else if (idiom->steps[idiom->value] != 0) {
+    return false;
+  }
+  if ((idiom->kind == IDIOM_FILL || idiom->kind == IDIOM_COPY) &&
+      idiom->steps[idiom->store] == 0) {
+    return false;
+  }
+  if (idiom->kind == IDIOM_SUM || idiom->kind == IDIOM_MIN_SCAN) {
+    written[count++] = idiom->acc;
+  }
+  if (idiom->kind == IDIOM_MIN_SCAN) {
+    written[count++] = idiom->at;
+  }
+  int i = 0;
+  for (; i < count; i++) {
+    if (idiom->steps[written[i]] != 0 ||
+        (idiom->bound.tag == REGISTER && idiom->bound.reg == written[i])) {
+      return false;
+    }
+    int j = 0;
+    for (; j < i; j++) {
+      if (written[j] == written[i]) {
+        return false;
+      }
+    }
+  }
+  return idiom->bound.tag == CONSTANT || idiom->steps[idiom->bound.reg] == 0;
+}
+
+bool is_line(TokenizedProgram p, const Decoded* d, int ln, CMD cmd) {
+  /*Whether line ln is in the program, has no errors and is a cmd.*/
+  return ln >= 0 && ln < p.len && d[ln].ok && d[ln].cmd == cmd;
+}
+
+bool is_conditional_branch(TokenizedProgram p, const Decoded* d, int ln) {
+  return is_line(p, d, ln, BEQ) || is_line(p, d, ln, BNE) ||
+         is_line(p, d, ln, BLT) || is_line(p, d, ln, BLE) ||
+         is_line(p, d, ln, BGT) || is_line(p, d, ln, BGE);
+}
+
+int next_instruction(TokenizedProgram p, const Decoded* d, int ln) {
+  /*The first line from ln on that isn't a label declaration.*/
+  while (is_line(p, d, ln, LABEL_DECL)) {
+    ln++;
+  }
+  return ln;
+}
+
+bool idiom_trips(const Idiom* idiom, const State* s, int* trips, int* cmp) {
+  /*How many times the body would run, stepping the index through the tests
+   * alone, and the cmp the last test leaves. False past MEM_BYTES trips, where
+   * the addresses can't all be in bounds.*/
+  int i = s->registers[idiom->index];
+  int step = idiom->steps[idiom->index];
+  int bound = get_register_or_constant(*s, idiom->bound);
+  int n = 0;
+  if (!idiom->test_first) {
+    i = add_wrap(i, step);
+    n = 1;
+  }
+  while (n <= MEM_BYTES) {
+    int c =
+        idiom->bound_first ? compare_ints(bound, i) : compare_ints(i, bound);
+    if (branch_taken(idiom->test, c) == idiom->test_first) {
+      *trips = n;
+      *cmp = c;
+      return true;
+    }
+    i = add_wrap(i, step);
+    n++;
+  }
+  return false;
+}
+
+bool idiom_in_bounds(const Idiom* idiom,
+                     const State* s,
+                     Register r,
+                     int trips) {
+  /*Whether the addresses register r steps through are all in memory.*/
+  i64 start = s->registers[r];
+  i64 end = start + (i64)(trips - 1) * idiom->steps[r];
+  return trips == 0 || (start >= 0 && start < MEM_BYTES && end >= 0 &&
+                        end < MEM_BYTES);
+}
+
+State run_idiom(State s, const Idiom* idiom, int trips) {
+  /*What trips times round the loop leaves, other than pc and cmp. The
+   * addresses have been checked.*/
+  int* r = s.registers;
+  Memory* mem = s.memory;
+  int load = r[idiom->load];
+  int load_step = idiom->steps[idiom->load];
+  int store = r[idiom->store];
+  int store_step = idiom->steps[idiom->store];
+  int last = trips - 1;
+  int t = 0;
+  if (trips > 0) {
+    switch (idiom->kind) {
+      case IDIOM_FILL:
+        if (store_step == 1 || store_step == -1) {
+          mem_fill(mem, store_step == 1 ? store : store - last,
+                   r[idiom->value], trips);
+        } else {
+          for (; t < trips; t++) {
+            mem_write(mem, store + t * store_step, &r[idiom->value], 1);
+          }
+        }
+        break;
+      case IDIOM_SUM: {
+        u32 total = (u32)r[idiom->acc];
+        for (; t < trips; t++) {
+          r[idiom->value] = mem_load(mem, load + t * load_step);
+          total += (u32)r[idiom->value];
+        }
+        r[idiom->acc] = (int)total;
+        break;
+      }
+      case IDIOM_COPY:
+        /*one int at a time front to back, which is memmove unless the store
+         * runs into ints it hasn't loaded yet*/
+        if (load_step == 1 && store_step == 1 &&
+            (store <= load || store > load + last)) {
+          mem_move(mem, store, load, trips);
+        } else if (load_step == -1 && store_step == -1 &&
+                   (store >= load || store < load - last)) {
+          mem_move(mem, store - last, load - last, trips);
+        } else {
+          for (; t < trips; t++) {
+            int v = mem_load(mem, load + t * load_step);
+            mem_write(mem, store + t * store_step, &v, 1);
+          }
+        }
+        r[idiom->value] = mem_load(mem, store + last * store_step);
+        break;
+      case IDIOM_MIN_SCAN:
+        for (; t < trips; t++) {
+          int addr = load + t * load_step;
+          int v = mem_load(mem, addr);
+          if (!branch_taken(idiom->keep, compare_ints(v, r[idiom->acc]))) {
+            r[idiom->acc] = v;
+            r[idiom->at] = addr;
+          } else {
+            guest_instructions -= (u64)idiom->skipped;
+          }
+          r[idiom->value] = v;
+        }
+        break;
+    }
+  }
+  int i = 0;
+  for (; i < NUM_REGISTERS; i++) {
+    r[i] = add_wrap(r[i], (int)((u32)trips * (u32)idiom->steps[i]));
+  }
+  return s;
+}
+
+HANDLER(exec_idiom) {
+  /*The label line of an idiom. Runs the whole loop when it safely can and
+   * otherwise, like any label, nothing.*/
+  (void)args;
+  (void)line;
+  Machine* m = s.machine;
+  const Idiom* idiom = m->decoded[s.pc].idiom;
+  int trips = 0;
+  int cmp = 0;
+  if (!m->idioms || m->history != NULL || m->costs != NULL ||
+      m->cache_sim != NULL || m->bpred != NULL || m->thread_count != 1 ||
+      !idiom_trips(idiom, &s, &trips, &cmp)) {
+    return s;
+  }
+  if ((idiom->kind != IDIOM_FILL &&
+       !idiom_in_bounds(idiom, &s, idiom->load, trips)) ||
+      ((idiom->kind == IDIOM_FILL || idiom->kind == IDIOM_COPY) &&
+       !idiom_in_bounds(idiom, &s, idiom->store, trips))) {
+    return s;
+  }
+#ifndef LOG_NONE
+  if (m->trace) {
+    out_printf("idiom: %s, lines %i to %i ran %i times\n",
+               idiom_name(idiom->kind), idiom->first, idiom->last, trips);
+  }
+#endif
+  /*every line after the label each trip, and the test that leaves*/
+  guest_instructions += (u64)trips * (u64)(idiom->last - idiom->first) +
+                        (idiom->test_first ? 2 : 0);
+  s = run_idiom(s, idiom, trips);
+  s.cmp = cmp;
+  s.pc = idiom->exit;
+  return s;
+}
+
+const char* idiom_name(IdiomKind kind) {
+  switch (kind) {
+    case IDIOM_FILL:
+      return "fill";
+    case IDIOM_SUM:
+      return "sum";
+    case IDIOM_COPY:
+      return "copy";
+    case IDIOM_MIN_SCAN:
+      return "min scan";
+  }
+  return "";
+}
+
+void explain_idioms(TokenizedProgram p, const Decoded* decoded) {
+  /*For --explain-idioms, each loop the decoded engine runs natively.*/
+  int found = 0;
+  int ln = 0;
+  for (; ln < p.len; ln++) {
+    const Idiom* d = decoded[ln].idiom;
+    if (d == NULL) {
+      continue;
+    }
+    found++;
+    out_printf("idiom: lines %i to %i, %s ", d->first, d->last,
+               idiom_name(d->kind));
+    switch (d->kind) {
+      case IDIOM_FILL:
+        out_printf("[x%i] = x%i", d->store, d->value);
+        break;
+      case IDIOM_SUM:
+        out_printf("x%i += [x%i]", d->acc, d->load);
+        break;
+      case IDIOM_COPY:
+        out_printf("[x%i] = [x%i]", d->store, d->load);
+        break;
+      case IDIOM_MIN_SCAN:
+        out_printf("of [x%i] into x%i at x%i", d->load, d->acc, d->at);
+        break;
+    }
+    out_printf(", x%i steps by %i until line %i\n", d->index,
+               d->steps[d->index], d->exit + 1);
+  }
+  out_printf("idiom: %i loops run natively by the decoded engine\n", found);
+}
+
+void machine_set_engine(Machine* m, Engine engine) {
+  if (engine == ENGINE_DECODED && m->decoded == NULL) {
+    m->decoded = decode_program(m->program);
+    m->owns_decoded = true;
+    int i = 0;
+    for (; m->guard_mem && i < m->program.len; i++) {
+      m->decoded[i].run = guarded_handler(m->decoded[i].cmd, m->decoded[i].run);
+    }
+  }
+  m->engine = engine;
+}
+
+const char* engine_name(Engine engine) {
+  if (engine == ENGINE_DECODED) {
+    return "decoded";
+  }
+  return "tick";
+}
+
+bool flag_value(s8 arg, const char* flag, s8* value) {
+  /*If arg is flag followed by a value, like --jobs=4, point value at the
+   * part after the flag.*/
+  s8 prefix = s8_view(flag);
+  if (arg.len < prefix.len) {
+    return false;
+  }
+  s8 start = arg;
+  start.len = prefix.len;
+  if (!s8_eq(start, prefix)) {
+    return false;
+  }
+  value->str = arg.str + prefix.len;
+  value->len = arg.len - prefix.len;
+  return true;
+}
+
+bool parse_engine(s8 name, Engine* engine) {
+  if (s8_eq(name, s8_view("tick"))) {
+    *engine = ENGINE_TICK;
+    return true;
+  }
+  if (s8_eq(name, s8_view("decoded"))) {
+    *engine = ENGINE_DECODED;
+    return true;
+  }
+  out_printf("unknown engine, expected tick or decoded\n");
+  return false;
+}
+
+ArgValidations cmd_validations(CMD cmd) {
+  /*What the arguments of each instruction have to look like.
+   * expected_arg_count is -1 for instructions that ignore their arguments.*/
+  switch (cmd) {
+#define CMD_VALIDATIONS(cmd, name, mnemonic, kind, semantics, count, t1, t2, \
+                        t3, t4, section, docs)                               \
+  case cmd:                                                                  \
+    return arg_validations(mnemonic, count, t1, t2, t3, t4);
+    OARM_INSTRUCTIONS(CMD_VALIDATIONS)
+#undef CMD_VALIDATIONS
+  }
+  return arg_validations("", -1, REGISTER, REGISTER, REGISTER, REGISTER);
+}
+ArgValidations arg_validations(const char* cmd_pretty_str,
+                               int expected_arg_count,
+                               ArgType a1,
+                               ArgType a2,
+                               ArgType a3,
+                               ArgType a4) {
+  /*Types past expected_arg_count are never looked at.*/
+  ArgValidations v;
+  v.cmd_pretty_str = cmd_pretty_str;
+  v.expected_arg_count = expected_arg_count;
+  v.validations[0].expected_arg_type = a1;
+  v.validations[1].expected_arg_type = a2;
+  v.validations[2].expected_arg_type = a3;
+  v.validations[3].expected_arg_type = a4;
+  return v;
+}
+
+CmdKey cmd_keys[CMD_KEY_SLOTS];
+pthread_once_t cmd_keys_once = PTHREAD_ONCE_INIT;
+
+CMD identify_cmd(s8 t) {
+  if (t.str[t.len - 1] == ':') {
+    return LABEL_DECL;
+  }
+  /*tokens point into the source, so nothing past t.len is read*/
+  int key = t.str[0] << 16;
+  if (t.len > 1) {
+    key |= t.str[1] << 8;
+  }
+  if (t.len > 2) {
+    key |= t.str[2];
+  }
+  pthread_once(&cmd_keys_once, cmd_keys_init);
+  u32 slot = cmd_key_slot(key);
+  while (cmd_keys[slot].key != 0) {
+    if (cmd_keys[slot].key == key) {
+      return cmd_keys[slot].cmd;
+    }
+    slot = (slot + 1) & (CMD_KEY_SLOTS - 1);
+  }
+  return UNKNOWN;
+}
+
+void cmd_keys_init(void) {
+  /*Rows without a mnemonic, like label declarations, are found some other
+   * way. If two mnemonics share a key the first row wins.*/
+  int key;
+  u32 slot;
+#define CMD_KEY(id, name, mnemonic, kind, semantics, count, t1, t2, t3, t4,  \
+                section, docs)                                               \
+  key = mnemonic_key(mnemonic);                                              \
+  slot = cmd_key_slot(key);                                                  \
+  while (key != 0 && cmd_keys[slot].key != 0 && cmd_keys[slot].key != key) { \
+    slot = (slot + 1) & (CMD_KEY_SLOTS - 1);                                 \
+  }                                                                          \
+  if (key != 0 && cmd_keys[slot].key == 0) {                                 \
+    cmd_keys[slot].key = key;                                                \
+    cmd_keys[slot].cmd = id;                                                 \
+  }
+  OARM_INSTRUCTIONS(CMD_KEY)
+#undef CMD_KEY
+}
+
+int mnemonic_key(const char* mnemonic) {
+  /*The key identify_cmd makes from a token, its first 3 characters with 0
+   * past the end of shorter ones.*/
+  int key = 0;
+  int i = 0;
+  for (; i < 3; i++) {
+    key <<= 8;
+    if (*mnemonic != '\0') {
+      key |= *mnemonic++;
+    }
+  }
+  return key;
+}
+
+u32 cmd_key_slot(int key) {
+  return ((u32)key * 2654435761u) >> 25;
+}
+ResultInt parse_int(s8 s) {
+  return parse_int_report(s, true);
+}
+
+ResultInt parse_int_report(s8 s, bool report) {
+  /*Convert s8 char array to int. Digits are checked and converted 8 at a time
+   * packed into a u64 (SWAR), any value that fits in 32 bits is accepted.*/
+  ResultInt r;
+  r.ok = false;
+  r.val = 0;
+
+  int start = 0;
+  if (s.len > 0 && s.str[0] == '-') {
+    start = 1;
+  }
+  /*leading zeros don't count towards the 10 digit limit*/
+  while (start < s.len - 1 && s.str[start] == '0') {
+    start++;
+  }
+  int num_digits = s.len - start;
+  if (num_digits > 10) {
+    if (report) {
+      out_printf(
+          "Integer overflow detected in parse int. Max int is 10 digits. "
+          "Truncating digits.\n");
+    }
+    return r;
+  }
+
+  /*Right align the digits in ascii zeros so they can be read as one or two
+   * blocks of 8.*/
+  char digits[16];
+  memset(digits, '0', sizeof(digits));
+  memcpy(digits + 16 - num_digits, s.str + start, (u64)num_digits);
+  bool valid = is_8_digits(digits + 8);
+  if (num_digits > 8) {
+    valid = valid && is_8_digits(digits);
+  }
+  if (!valid) {
+    int i = s.len - 1;
+    for (; i >= start; i--) {
+      if (s.str[i] < (int)'0' || s.str[i] > (int)'9') {
+        if (report) {
+          out_printf("Non digit detected in parse int string: %x (%i)\n",
+                     s.str[i], s.str[i]);
+        }
+        return r;
+      }
+    }
+  }
+  u64 val = parse_8_digits(digits + 8);
+  if (num_digits > 8) {
+    val += parse_8_digits(digits) * 100000000ull;
+  }
+
+  u64 max = 2147483647ull;
+  if (start > 0 && s.str[0] == '-') {
+    max++;
+  }
+  if (val > max) {
+    if (report) {
+      out_printf(
+          "Integer overflow detected in parse int. %.*s does not fit in 32 "
+          "bits.\n",
+          s.len, s.str);
+    }
+    return r;
+  }
+  r.ok = true;
+  if (max > 2147483647ull) {
+    r.val = (int)(-(i64)val);
+  } else {
+    r.val = (int)val;
+  }
+  return r;
+}
+
+bool is_8_digits(const char* digits) {
+  /*Every byte is 0x30-0x39 if the high nibbles are 3, and still are after
+   * adding 6.*/
+  u64 w;
+  memcpy(&w, digits, sizeof(w));
+  u64 high = 0xf0f0f0f0f0f0f0f0ull;
+  return ((w & high) | (((w + 0x0606060606060606ull) & high) >> 4)) ==
+         0x3333333333333333ull;
+}
+
+u64 parse_8_digits(const char* digits) {
+  /*Value of 8 ascii digits, most significant first. Adjacent lanes are
+   * combined in place: 8 lanes of 1 digit, 4 of 2, 2 of 4, then 1 of 8.*/
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  u64 val = 0;
+  int i = 0;
+  for (; i < 8; i++) {
+    val = val * 10 + (u64)(digits[i] - '0');
+  }
+  return val;
+#else
+  u64 w;
+  memcpy(&w, digits, sizeof(w));
+  w -= 0x3030303030303030ull;
+  w = (w * 10 + (w >> 8)) & 0x00ff00ff00ff00ffull;
+  w = (w * 100 + (w >> 16)) & 0x0000ffff0000ffffull;
+  w = (w * 10000 + (w >> 32)) & 0xffffffffull;
+  return w;
+#endif
+}
+
+ResultInt parse_int_scalar(s8 s) {
+  /*One digit at a time version of parse_int without the messages, kept to
+   * check and benchmark parse_int against.*/
+  ResultInt r;
+  r.ok = false;
+  r.val = 0;
+  int i = 0;
+  bool negative = s.len > 0 && s.str[0] == '-';
+  if (negative) {
+    i = 1;
+  }
+  i64 val = 0;
+  for (; i < s.len; i++) {
+    if (s.str[i] < '0' || s.str[i] > '9') {
+      return r;
+    }
+    val = val * 10 + (s.str[i] - '0');
+    if (val > 2147483648l) {
+      return r;
+    }
+  }
+  if (negative) {
+    val = -val;
+  }
+  if (val > 2147483647l) {
+    return r;
+  }
+  r.ok = true;
+  r.val = (int)val;
+  return r;
+}
+
+Args parse_args(Line line) {
+  return parse_args_report(line, true);
+}
+
+Args parse_args_report(Line line, bool report) {
+  Args args;
+  args.count = 0;
+  args.is_valid = true;
+  int i = 1;
+  for (; i < line.len; i++) {
+    s8 t = line.tokens[i];
+    Arg a;
+
+    /*Address argument */
+    if (t.str[0] == '[') {
+      a.tag = ADDRESS;
+      if (t.len > 1 && t.str[1] == 'x') {
+        a.addr.type = A_REGISTER;
+      } else if (t.len > 1 && t.str[1] == '#') {
+        a.addr.type = A_CONSTANT;
+      } else {
+        if (report) {
+          out_printf(
+              "Argument %i, unsupported address type, must be register or "
+              "constant.",
+              args.count + 1);
+        }
+        args.is_valid = false;
+        return args;
+      }
+
+      t.str = t.str + 2;
+      t.len = t.len - 3;
+      if (t.len < 1) {
+        if (report) {
+          out_printf(
+              "Argument %i, expected numerical value for memory "
+              "address argument, got empty string.\n",
+              args.count + 1);
+        }
+        args.is_valid = false;
+        return args;
+      }
+      ResultInt r = parse_int_report(t, report);
+      if (!r.ok) {
+        args.is_valid = false;
+        return args;
+      }
+      a.addr.val = r.val;
+
+      if (a.addr.type == A_REGISTER &&
+          (a.addr.val >= NUM_REGISTERS || a.addr.val < 0)) {
+        if (report) {
+          out_printf(
+              "Argument %i register is out of range, must be between 0 and "
+              "%i\n",
+              args.count + 1, NUM_REGISTERS);
+        }
+        args.is_valid = false;
+        return args;
+      }
+      if (a.addr.type == A_CONSTANT) {
+        if (a.addr.val >= MEM_BYTES || a.addr.val < 0) {
+          if (report) {
+            out_printf(
+                "Argument %i memory address is out of range, must be between 0 "
+                "and %i\n",
+                args.count + 1, MEM_BYTES - 1);
+          }
+          args.is_valid = false;
+          return args;
+        }
+      }
+    }
+    /*Vector register argument, anything else starting with v is a label*/
+    else if (is_vector_register(t)) {
+      a.tag = VREGISTER;
+      t.str += 1;
+      t.len -= 1;
+      ResultInt r = parse_int_report(t, report);
+      if (!r.ok) {
+        args.is_valid = false;
+        return args;
+      }
+      a.reg = r.val;
+      if (a.reg >= NUM_VREGISTERS || a.reg < 0) {
+        if (report) {
+          out_printf(
+              "Argument %i vector register is out of range, must be between 0 "
+              "and %i\n",
+              args.count + 1, NUM_VREGISTERS);
+        }
+        args.is_valid = false;
+        return args;
+      }
+    }
+    /*Register argument*/
+    else if (t.str[0] == 'x') {
+      a.tag = REGISTER;
+      t.str += 1;
+      t.len -= 1;
+      ResultInt r = parse_int_report(t, report);
+      if (!r.ok) {
+        args.is_valid = false;
+        return args;
+      }
+      a.reg = r.val;
+      if (a.reg >= NUM_REGISTERS || a.reg < 0) {
+        if (report) {
+          out_printf(
+              "Argument %i register is out of range, must be between 0 and "
+              "%i\n",
+              args.count + 1, NUM_REGISTERS);
+        }
+        args.is_valid = false;
+        return args;
+      }
+
+      /*constant argument*/
+    } else if (t.str[0] == '#') {
+      a.tag = CONSTANT;
+      t.str++;
+      t.len--;
+      ResultInt r = parse_int_report(t, report);
+      if (!r.ok) {
+        args.is_valid = false;
+        return args;
+      }
+      a.constant = r.val;
+      /*label argument*/
+    } else {
+      a.tag = LABEL_ARG;
+      a.label = line.ids[i];
+    }
+    args.args[args.count] = a;
+    args.count++;
+  }
+
+  return args;
+}
+
+State ldr(State s, Args args) {
+  Arg a1 = args.args[0];
+  Arg a2 = args.args[1];
+
+  if (a2.addr.type == A_REGISTER) {
+    int addr = s.registers[a2.addr.val];
+    if (addr < 0 || addr >= MEM_BYTES) {
+      out_printf("ldr: out of bounds memory access at address %i\n", addr);
+      s.cont = false;
+      return s;
+    }
+    s.registers[a1.reg] = mem_load(s.memory, addr);
+    if (s.machine != NULL && s.machine->cache_sim != NULL) {
+      cache_sim_access(s.machine, s.pc, addr, false);
+    }
+  } else if (a2.addr.type == A_CONSTANT) {
+    s.registers[a1.reg] = mem_load(s.memory, a2.addr.val);
+    if (s.machine != NULL && s.machine->cache_sim != NULL) {
+      cache_sim_access(s.machine, s.pc, a2.addr.val, false);
+    }
+  }
+
+  return s;
+}
+
+State str(State s, Args args) {
+  Arg a1 = args.args[0];
+  Arg a2 = args.args[1];
+
+  if (a2.addr.type == A_REGISTER) {
+    int addr = s.registers[a2.addr.val];
+    if (addr < 0 || addr >= MEM_BYTES) {
+      out_printf("str: out of bounds memory access at address %i\n", addr);
+      s.cont = false;
+      return s;
+    }
+    mem_save_undo(s.memory, addr, 1);
+    *mem_store_ptr(s.memory, addr) = s.registers[a1.reg];
+    mem_mark_dirty(s.memory, addr, 1);
+    if (s.machine != NULL && s.machine->cache_sim != NULL) {
+      cache_sim_access(s.machine, s.pc, addr, true);
+    }
+  } else if (a2.addr.type == A_CONSTANT) {
+    if (a2.addr.val < 0 || a2.addr.val >= MEM_BYTES) {
+      out_printf("str: out of bounds memory access at address %i\n",
+                 a2.addr.val);
+      s.cont = false;
+      return s;
+    }
+    mem_save_undo(s.memory, a2.addr.val, 1);
+    *mem_store_ptr(s.memory, a2.addr.val) = s.registers[a1.reg];
+    mem_mark_dirty(s.memory, a2.addr.val, 1);
+    if (s.machine != NULL && s.machine->cache_sim != NULL) {
+      cache_sim_access(s.machine, s.pc, a2.addr.val, true);
+    }
+  }
+  return s;
+}
+
+/*Guest arithmetic is defined for every input, the same as ARM: sums and
+ * products wrap, dividing by zero gives 0 and INT_MIN / -1 gives INT_MIN. mod
+ * is what msub would leave after sdiv, so a mod by zero gives back a.*/
+int add_wrap(int a, int b) {
+  return (int)((u32)a + (u32)b);
+}
+
+int sub_wrap(int a, int b) {
+  return (int)((u32)a - (u32)b);
+}
+
+/*only the low 5 bits of the shift count are used, like ARM*/
+int shift_left(int a, int b) {
+  return (int)((u32)a << (b & 31));
+}
+
+int shift_right(int a, int b) {
+  return a >> (b & 31);
+}
+
+int mul_wrap(int a, int b) {
+  return (int)((u32)a * (u32)b);
+}
+
+int madd_wrap(int a, int b, int c) {
+  return add_wrap(c, mul_wrap(a, b));
+}
+
+int msub_wrap(int a, int b, int c) {
+  return sub_wrap(c, mul_wrap(a, b));
+}
+
+int compare_ints(int a, int b) {
+  if (a < b) {
+    return -1;
+  }
+  return a > b;
+}
+
+int sdiv_defined(int a, int b) {
+  if (b == 0) {
+    return 0;
+  }
+  if (b == -1) {
+    return (int)(0u - (u32)a);
+  }
+  return a / b;
+}
+
+int udiv_defined(int a, int b) {
+  if (b == 0) {
+    return 0;
+  }
+  return (int)((u32)a / (u32)b);
+}
+
+int mod_defined(int a, int b) {
+  if (b == 0) {
+    return a;
+  }
+  if (b == -1) {
+    return 0;
+  }
+  return a % b;
+}
+
+State branch(State s, Line line, Args args, CMD command) {
+  int label = args.args[0].label;
+  ResultInt jmp;
+  jmp.val = label_line(s.labels, label);
+  jmp.ok = jmp.val >= 0;
+  if (!jmp.ok) {
+    s.cont = false;
+    out_printf("label declaration not found for label: %.*s",
+               line.tokens[1].len, line.tokens[1].str);
+    return s;
+  }
+
+  bool taken = branch_taken(command, s.cmp);
+  if (command != BRANCH && s.machine != NULL && s.machine->bpred != NULL) {
+    bpred_branch(s.machine, s.pc, jmp.val, taken);
+  }
+  if (taken) {
+    s.pc = jmp.val;
+  }
+  return s;
+}
+
+bool branch_taken(CMD command, int cmp) {
+  /*Whether a branch instruction jumps with the cmp byte at cmp.*/
+  switch (command) {
+    case BRANCH:
+      return true;
+    case BLE:
+      return cmp <= 0;
+    case BLT:
+      return cmp < 0;
+    case BGE:
+      return cmp >= 0;
+    case BGT:
+      return cmp > 0;
+    case BNE:
+      return cmp != 0;
+    case BEQ:
+      return cmp == 0;
+    default:
+      out_printf("this should never happen");
+      return false;
+  }
+}
+
+Machine* machine_init(TokenizedProgram program, bool deterministic) {
+  Machine* m = malloc(sizeof(Machine));
+  memset(m, 0, sizeof(Machine));
+  m->program = program;
+  m->thread_count = 1;
+  m->deterministic = deterministic;
+  m->engine = ENGINE_TICK;
+  m->trace = true;
+  m->idioms = true;
+  m->guest_in = stdin;
+  pthread_mutex_init(&m->lock, NULL);
+  return m;
+}
+
+void machine_destroy(Machine* m) {
+  /*Wait for m's guest threads, then free m with what it made for itself and
+   * what the flags attached: the decoded lines it decoded, the memory
+   * machine_start made, the cost counters, the cache and the predictor. The
+   * program, history and guest files are the caller's.*/
+  join_all(m);
+  if (m->owns_decoded) {
+    decoded_destroy(m->decoded, m->program);
+  }
+  if (m->owns_memory) {
+    mem_destroy(m->threads[0].state.memory);
+  }
+  free(m->line_runs);
+  free(m->line_taken);
+  if (m->cache_sim != NULL) {
+    cache_sim_destroy(m->cache_sim);
+  }
+  if (m->bpred != NULL) {
+    bpred_destroy(m->bpred);
+  }
+  pthread_mutex_destroy(&m->lock);
+  free(m);
+}
+
+State run_thread(State s) {
+  /*Run one guest thread until it stops.*/
+  if (s.machine->guard_mem) {
+    return run_thread_guarded(s);
+  }
+  TokenizedProgram p = s.machine->program;
+  while (s.cont) {
+    s = step(s);
+    if (s.pc > p.len || s.pc < 0) {
+      s.cont = false;
+    }
+  }
+  /*a stopped thread may have just reported an error, get it out now*/
+  guest_io_flush(s.machine);
+  return s;
+}
+
+__thread GuardFrame guard_frame;
+pthread_once_t guard_once = PTHREAD_ONCE_INIT;
+struct sigaction guard_previous;
+
+State run_thread_guarded(State s) {
+  /*run_thread on guarded memory. The thread lives in guard_frame, so a
+   * faulting step jumps back here with the state from before it.*/
+  GuardFrame* f = &guard_frame;
+  TokenizedProgram p = s.machine->program;
+  pthread_once(&guard_once, guard_install);
+  f->state = s;
+  f->base = s.memory->flat;
+  if (sigsetjmp(f->env, 0) != 0) {
+    f->state = guard_stop(f);
+  }
+  while (f->state.cont) {
+    f->state = step(f->state);
+    if (f->state.pc > p.len || f->state.pc < 0) {
+      f->state.cont = false;
+    }
+  }
+  f->base = NULL;
+  guest_io_flush(f->state.machine);
+  return f->state;
+}
+
+State step_guarded(State s) {
+  /*One step on guarded memory, for runs that interleave threads and can't
+   * keep one in guard_frame throughout.*/
+  GuardFrame* f = &guard_frame;
+  pthread_once(&guard_once, guard_install);
+  f->state = s;
+  f->base = s.memory->flat;
+  if (sigsetjmp(f->env, 0) != 0) {
+    f->base = NULL;
+    return guard_stop(f);
+  }
+  s = step(f->state);
+  f->base = NULL;
+  return s;
+}
+
+State guard_stop(GuardFrame* f) {
+  /*Stop the thread that faulted the way the bounds checks in ldr and str
+   * do.*/
+  State s = f->state;
+  Line line = s.machine->program.lines[s.pc];
+  out_printf("%s: out of bounds memory access at address %i\n",
+             identify_cmd(line.tokens[0]) == LDR ? "ldr" : "str", f->addr);
+  s.cont = false;
+  s.pc++;
+  return s;
+}
+
+void guard_install(void) {
+  /*SA_NODEFER since the handler leaves by siglongjmp without restoring the
+   * signal mask.*/
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_sigaction = guard_fault;
+  sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGSEGV, &sa, &guard_previous);
+}
+
+void guard_fault(int sig, siginfo_t* info, void* context) {
+  /*A guest ldr or str outside guarded memory. Anything else goes back to the
+   * previous handler, the faulting access runs again and gets it.*/
+  GuardFrame* f = &guard_frame;
+  char* at = info->si_addr;
+  char* base = (char*)f->base;
+  (void)context;
+  if (f->base != NULL && at >= base && at < base + MEM_GUARD_BYTES) {
+    f->addr = (int)(u32)((size_t)(at - base) / sizeof(int));
+    siglongjmp(f->env, 1);
+  }
+  (void)sig;
+  sigaction(SIGSEGV, &guard_previous, NULL);
+}
+
+bool machine_guard_memory(Machine* m) {
+  /*Swap the main thread's fresh memory for guarded memory, before anything
+   * else points at it.*/
+  Memory* mem = mem_create_guarded(MEM_BYTES);
+  if (mem == NULL) {
+    return false;
+  }
+  mem_destroy(m->threads[0].state.memory);
+  m->threads[0].state.memory = mem;
+  m->guard_mem = true;
+  int i = 0;
+  for (; m->decoded != NULL && i < m->program.len; i++) {
+    m->decoded[i].run = guarded_handler(m->decoded[i].cmd, m->decoded[i].run);
+  }
+  return true;
+}
+
+Handler guarded_handler(CMD cmd, Handler run) {
+  /*ldr and str leave bounds to the guard pages, everything else runs as
+   * usual. Constant addresses were checked when the line was parsed.*/
+  switch (cmd) {
+    case LDR:
+      return exec_ldr_guarded;
+    case STR:
+      return exec_str_guarded;
+    default:
+      return run;
+  }
+}
+
+HANDLER(exec_ldr_guarded) {
+  Arg a = args->args[1];
+  int addr = a.addr.type == A_REGISTER ? s.registers[a.addr.val] : a.addr.val;
+  (void)line;
+  s.registers[args->args[0].reg] = s.memory->flat[(u32)addr];
+  if (s.machine->cache_sim != NULL) {
+    cache_sim_access(s.machine, s.pc, addr, false);
+  }
+  return s;
+}
+
+HANDLER(exec_str_guarded) {
+  /*The load of the old value faults before anything is changed.*/
+  Arg a = args->args[1];
+  int addr = a.addr.type == A_REGISTER ? s.registers[a.addr.val] : a.addr.val;
+  int* to = &s.memory->flat[(u32)addr];
+  int old = *to;
+  (void)line;
+  if (s.memory->history != NULL) {
+    history_save(s.memory->history, addr, old);
+  }
+  *to = s.registers[args->args[0].reg];
+  mem_mark_dirty(s.memory, addr, 1);
+  if (s.machine->cache_sim != NULL) {
+    cache_sim_access(s.machine, s.pc, addr, true);
+  }
+  return s;
+}
+
+void* run_guest_thread(void* arg) {
+  GuestThread* t = (GuestThread*)arg;
+  Machine* m = t->state.machine;
+  u64 before = guest_instructions;
+  t->state = run_thread(t->state);
+  __atomic_fetch_add(&m->instructions, guest_instructions - before,
+                     __ATOMIC_RELAXED);
+  t->done = true;
+  return NULL;
+}
+
+State run_deterministic(Machine* m) {
+  while (machine_turn(m)) {
+  }
+  return m->threads[0].state;
+}
+
+bool machine_turn(Machine* m) {
+  /*Round robin, one instruction per live thread per turn, in spawn order.
+   * Threads spawned during a turn get their first instruction in that turn.
+   * Returns whether any thread is still running.*/
+  TokenizedProgram p = m->program;
+  History* h = m->history;
+  i64 steps_before = 0;
+  if (h != NULL) {
+    history_snapshot(m);
+    steps_before = h->steps_head;
+  }
+  bool running = false;
+  int i = 0;
+  for (; i < m->thread_count; i++) {
+    GuestThread* t = &m->threads[i];
+    if (t->done) {
+      continue;
+    }
+    if (h != NULL) {
+      history_begin_step(h, m, i);
+    }
+    State s = m->guard_mem ? step_guarded(t->state) : step(t->state);
+    if (s.pc > p.len || s.pc < 0) {
+      s.cont = false;
+    }
+    if (h != NULL) {
+      history_end_step(h, &s);
+    }
+    t->state = s;
+    t->done = !s.cont;
+    if (t->done) {
+      guest_io_flush(m);
+    }
+    running = running || s.cont;
+  }
+  if (h != NULL && h->steps_head != steps_before) {
+    h->turn++;
+  }
+  return running;
+}
+
+History* history_create(int entries, int snapshots) {
+  /*Room for entries undo entries and as many step records, and up to
+   * snapshots full snapshots.*/
+  History* h = calloc(1, sizeof(History));
+  h->cap = entries < 1 ? 1 : entries;
+  h->entries = malloc((size_t)h->cap * sizeof(UndoEntry));
+  h->steps = malloc((size_t)h->cap * sizeof(StepRecord));
+  /*thinning needs two to leave room for the next*/
+  h->snapshot_cap = snapshots < 2 ? 2 : snapshots;
+  h->snapshots = calloc((size_t)h->snapshot_cap, sizeof(Snapshot));
+  history_clear(h);
+  return h;
+}
+
+void history_destroy(History* h) {
+  int i = 0;
+  for (; i < h->snapshot_cap; i++) {
+    free(h->snapshots[i].threads);
+    free(h->snapshots[i].memory);
+  }
+  free(h->snapshots);
+  free(h->entries);
+  free(h->steps);
+  free(h);
+}
+
+void history_clear(History* h) {
+  /*Forget everything, the snapshots keep their buffers for reuse.*/
+  h->entries_head = 0;
+  h->steps_head = 0;
+  h->steps_tail = 0;
+  h->snapshot_count = 0;
+  h->snapshot_every = HISTORY_SNAPSHOT_EVERY;
+  h->turn = 0;
+  h->floor = 0;
+}
+
+void machine_record(Machine* m, History* h) {
+  /*Record m's turns into h from where it is now, which becomes turn 0. Only
+   * the deterministic interleaving can be replayed, so m switches to it.*/
+  history_clear(h);
+  m->history = h;
+  m->deterministic = true;
+  m->threads[0].state.memory->history = h;
+}
+
+void history_save(History* h, int where, int old) {
+  /*Once the entry about to be overwritten belongs to the oldest step, that
+   * step can't be undone any more.*/
+  while (h->steps_tail < h->steps_head &&
+         h->steps[h->steps_tail % h->cap].first_entry <=
+             h->entries_head - h->cap) {
+    history_drop_step(h);
+  }
+  UndoEntry* e = &h->entries[h->entries_head % h->cap];
+  e->where = where;
+  e->old = old;
+  h->entries_head++;
+}
+
+void history_drop_step(History* h) {
+  /*Without its oldest step a turn can't be undone either.*/
+  h->floor = h->steps[h->steps_tail % h->cap].turn + 1;
+  h->steps_tail++;
+}
+
+void history_begin_step(History* h, Machine* m, int tid) {
+  if (h->steps_head - h->steps_tail == h->cap) {
+    history_drop_step(h);
+  }
+  GuestThread* t = &m->threads[tid];
+  StepRecord* r = &h->steps[h->steps_head % h->cap];
+  r->turn = h->turn;
+  r->tid = tid;
+  r->pc = t->state.pc;
+  r->cmp = t->state.cmp;
+  r->cont = t->state.cont;
+  r->done = t->done;
+  r->thread_count = m->thread_count;
+  r->first_entry = h->entries_head;
+  h->steps_head++;
+  memcpy(h->registers, t->state.registers, sizeof(h->registers));
+}
+
+void history_end_step(History* h, const State* s) {
+  /*Memory and vector lanes were saved as they were written, registers are
+   * cheaper to compare afterwards.*/
+  int i = 0;
+  for (; i < NUM_REGISTERS; i++) {
+    if (s->registers[i] != h->registers[i]) {
+      history_save(h, UNDO_REG(i), h->registers[i]);
+    }
+  }
+}
+
+void history_snapshot(Machine* m) {
+  /*Keep the whole machine, if this turn is due a snapshot and has none.*/
+  History* h = m->history;
+  if (h->turn % h->snapshot_every != 0 ||
+      (h->snapshot_count > 0 &&
+       h->snapshots[h->snapshot_count - 1].turn == h->turn)) {
+    return;
+  }
+  if (h->snapshot_count == h->snapshot_cap) {
+    history_thin_snapshots(h);
+    if (h->turn % h->snapshot_every != 0) {
+      return;
+    }
+  }
+  Snapshot* snap = &h->snapshots[h->snapshot_count++];
+  Memory* mem = m->threads[0].state.memory;
+  snap->turn = h->turn;
+  snap->thread_count = m->thread_count;
+  snap->threads = realloc(snap->threads,
+                          (size_t)m->thread_count * sizeof(GuestThread));
+  memcpy(snap->threads, m->threads,
+         (size_t)m->thread_count * sizeof(GuestThread));
+  if (snap->memory == NULL) {
+    snap->memory = malloc((size_t)mem->size * sizeof(int));
+  }
+  mem_read(mem, 0, snap->memory, mem->size);
+}
+
+void history_thin_snapshots(History* h) {
+  /*Keep every other snapshot, turn 0's included, and take them half as
+   * often. Dropped ones are swapped to the end to reuse their buffers.*/
+  h->snapshot_every *= 2;
+  int kept = 0;
+  int i = 0;
+  for (; i < h->snapshot_count; i++) {
+    if (h->snapshots[i].turn % h->snapshot_every == 0) {
+      Snapshot keep = h->snapshots[i];
+      h->snapshots[i] = h->snapshots[kept];
+      h->snapshots[kept] = keep;
+      kept++;
+    }
+  }
+  h->snapshot_count = kept;
+}
+
+void history_restore(Machine* m, const Snapshot* snap) {
+  /*Put the machine back to snap. The logs start over from there, since what
+   * they hold is for turns after it.*/
+  History* h = m->history;
+  Memory* mem = m->threads[0].state.memory;
+  mem->history = NULL;
+  mem_write(mem, 0, snap->memory, mem->size);
+  mem->history = h;
+  memcpy(m->threads, snap->threads,
+         (size_t)snap->thread_count * sizeof(GuestThread));
+  m->thread_count = snap->thread_count;
+  h->turn = snap->turn;
+  h->floor = snap->turn;
+  h->steps_tail = h->steps_head;
+  while (h->snapshot_count > 0 &&
+         h->snapshots[h->snapshot_count - 1].turn > h->turn) {
+    h->snapshot_count--;
+  }
+}
+
+void history_undo_step(Machine* m, const StepRecord* r) {
+  /*Newest entry first, so a value written twice in a step ends up as it was
+   * before either write.*/
+  History* h = m->history;
+  GuestThread* t = &m->threads[r->tid];
+  Memory* mem = t->state.memory;
+  while (h->entries_head > r->first_entry) {
+    h->entries_head--;
+    UndoEntry e = h->entries[h->entries_head % h->cap];
+    if (e.where >= 0) {
+      *mem_store_ptr(mem, e.where) = e.old;
+      mem_mark_dirty(mem, e.where, 1);
+    } else if (e.where >= UNDO_REG(NUM_REGISTERS - 1)) {
+      t->state.registers[UNDO_REG(e.where)] = e.old;
+    } else {
+      int lane = UNDO_VREG(e.where);
+      t->vregisters[lane / VEC_LANES][lane % VEC_LANES] = e.old;
+    }
+  }
+  t->state.pc = r->pc;
+  t->state.cmp = r->cmp;
+  t->state.cont = r->cont;
+  t->done = r->done;
+  m->thread_count = r->thread_count;
+}
+
+bool history_undo_turn(Machine* m) {
+  /*Back to the start of the last turn, if the logs still hold all of it.*/
+  History* h = m->history;
+  if (h->turn <= h->floor) {
+    return false;
+  }
+  h->turn--;
+  while (h->steps_head > h->steps_tail &&
+         h->steps[(h->steps_head - 1) % h->cap].turn == h->turn) {
+    h->steps_head--;
+    history_undo_step(m, &h->steps[h->steps_head % h->cap]);
+  }
+  /*snapshots from later turns would restore the future just undone*/
+  while (h->snapshot_count > 0 &&
+         h->snapshots[h->snapshot_count - 1].turn > h->turn) {
+    h->snapshot_count--;
+  }
+  return true;
+}
+
+bool history_seek(Machine* m, i64 turn) {
+  /*Back to the start of an earlier turn. Undoes turns while the logs reach,
+   * past that restores the last snapshot before it and replays forward
+   * quietly.*/
+  History* h = m->history;
+  if (turn < 0 || turn > h->turn) {
+    return false;
+  }
+  if (turn < h->floor) {
+    int i = h->snapshot_count - 1;
+    while (i >= 0 && h->snapshots[i].turn > turn) {
+      i--;
+    }
+    if (i < 0) {
+      return false;
+    }
+    history_restore(m, &h->snapshots[i]);
+  }
+  while (h->turn > turn && history_undo_turn(m)) {
+  }
+  bool trace = m->trace;
+  m->trace = false;
+  while (h->turn < turn && machine_turn(m)) {
+  }
+  m->trace = trace;
+  return h->turn == turn;
+}
+
+bool history_reverse_continue(Machine* m, int line) {
+  /*Back a turn at a time until a thread is about to run line, or as far as
+   * the logs reach. Returns whether it stopped at line.*/
+  while (history_undo_turn(m)) {
+    int i = 0;
+    for (; i < m->thread_count; i++) {
+      GuestThread* t = &m->threads[i];
+      if (!t->done && t->state.pc == line) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+bool history_find_write(History* h, int addr, StepRecord* found) {
+  /*The last step the logs hold that wrote addr, whether or not it changed
+   * the value.*/
+  i64 end = h->entries_head;
+  i64 oldest = h->entries_head - h->cap;
+  i64 i = h->steps_head;
+  while (i > h->steps_tail) {
+    i--;
+    StepRecord* r = &h->steps[i % h->cap];
+    if (r->turn < h->floor) {
+      break;
+    }
+    i64 e = end;
+    while (e > r->first_entry && e > oldest) {
+      e--;
+      if (h->entries[e % h->cap].where == addr) {
+        *found = *r;
+        return true;
+      }
+    }
+    end = r->first_entry;
+  }
+  return false;
+}
+
+State machine_rewind(Machine* m, Rewind how, int value) {
+  /*Take a recorded run back the way --rewind* asked and show where it
+   * stopped, returns the state of the thread that is about to run.*/
+  History* h = m->history;
+  int tid = 0;
+  bool ok = false;
+  if (how == REWIND_TURNS) {
+    ok = value <= h->turn && history_seek(m, h->turn - value);
+    if (!ok) {
+      out_printf("rewind: can't go back %i turns, %li were recorded\n", value,
+                 h->turn);
+    }
+  } else if (how == REWIND_LINE) {
+    ok = history_reverse_continue(m, value);
+    if (!ok) {
+      out_printf("rewind: line %i didn't run in the recorded history\n",
+                 value);
+    }
+  } else if (how == REWIND_WRITE) {
+    /*being the last write, what it wrote is still there*/
+    Memory* mem = m->threads[0].state.memory;
+    int written = value >= 0 && value < mem->size ? mem_load(mem, value) : 0;
+    StepRecord r;
+    ok = history_find_write(h, value, &r) && history_seek(m, r.turn);
+    if (ok) {
+      tid = r.tid;
+      out_printf("line %i on thread %i last wrote address %i, %i to %i\n",
+                 r.pc, tid, value, mem_load(mem, value), written);
+    } else {
+      out_printf("rewind: no write of address %i in the recorded history\n",
+                 value);
+    }
+  }
+  if (how == REWIND_LINE && ok) {
+    while (m->threads[tid].done || m->threads[tid].state.pc != value) {
+      tid++;
+    }
+  }
+  State s = m->threads[tid].state;
+  if (ok) {
+    out_printf("rewound to turn %li, thread %i is about to run line %i:\n",
+               h->turn, tid, s.pc);
+    if (s.pc >= 0 && s.pc < m->program.len) {
+      log_line(m->program.lines[s.pc]);
+    }
+    log_registers(s);
+  }
+  return s;
+}
+
+void vreg_save_undo(State* s, int reg) {
+  /*Before a write to a whole vector register.*/
+  if (s->machine == NULL || s->machine->history == NULL) {
+    return;
+  }
+  int lane = 0;
+  for (; lane < VEC_LANES; lane++) {
+    history_save(s->machine->history, UNDO_VREG(reg * VEC_LANES + lane),
+                 s->vregisters[reg][lane]);
+  }
+}
+
+Machine* machine_start(Program p, bool deterministic, Engine engine) {
+  /*A machine with fresh memory and its main thread ready to run p.*/
+  State s;
+  memset(&s, 0, sizeof(State));
+  s.memory = mem_create(MEM_BYTES);
+  s.cont = true;
+  s.labels = p.labels;
+
+  Machine* m = machine_init(p.tokens, deterministic);
+  m->owns_memory = true;
+  machine_set_engine(m, engine);
+  s.machine = m;
+  s.tid = 0;
+  s.vregisters = m->threads[0].vregisters;
+  m->threads[0].state = s;
+  m->threads[0].parent = -1;
+  return m;
+}
+
+DiffResult diff_machines(Machine* a, Machine* b, int every, int max_steps) {
+  /*Run both machines a turn at a time, in the deterministic interleaving,
+   * and compare them every few turns and when they stop. Stops at the first
+   * difference, or after max_steps turns if max_steps > 0.*/
+  DiffResult r;
+  r.diverged = false;
+  r.steps = 0;
+  a->deterministic = true;
+  b->deterministic = true;
+  /*a fused loop is one turn, which would look like a difference*/
+  a->idioms = false;
+  b->idioms = false;
+  int last_pcs[MAX_GUEST_THREADS];
+  bool running = true;
+  while (running && (max_steps <= 0 || r.steps < max_steps)) {
+    int i = 0;
+    for (; i < a->thread_count; i++) {
+      last_pcs[i] = a->threads[i].state.pc;
+    }
+    bool a_running = machine_turn(a);
+    bool b_running = machine_turn(b);
+    r.steps++;
+    running = a_running || b_running;
+    if (!running || a_running != b_running || r.steps % every == 0) {
+      if (diff_report(a, b, r.steps, last_pcs)) {
+        r.diverged = true;
+        return r;
+      }
+    }
+  }
+  return r;
+}
+
+bool diff_report(Machine* a, Machine* b, int steps, const int* last_pcs) {
+  /*Print what differs between a and b, returns false if nothing does.*/
+  const char* an = engine_name(a->engine);
+  const char* bn = engine_name(b->engine);
+  bool same = a->thread_count == b->thread_count;
+  int diff_tid = -1;
+  int t = 0;
+  for (; same && t < a->thread_count; t++) {
+    State x = a->threads[t].state;
+    State y = b->threads[t].state;
+    same = x.pc == y.pc && x.cmp == y.cmp && x.cont == y.cont &&
+           memcmp(x.registers, y.registers, sizeof(x.registers)) == 0 &&
+           memcmp(x.vregisters, y.vregisters,
+                  sizeof(int) * NUM_VREGISTERS * VEC_LANES) == 0;
+    if (!same) {
+      diff_tid = t;
+    }
+  }
+  u64 ah = mem_hash(a->threads[0].state.memory);
+  u64 bh = mem_hash(b->threads[0].state.memory);
+  if (same && ah == bh) {
+    return false;
+  }
+
+  if (diff_tid < 0) {
+    diff_tid = 0;
+  }
+  int pc = last_pcs[diff_tid];
+  out_printf("engines diverged after %i steps, thread %i last ran line %i:\n",
+             steps, diff_tid, pc);
+  if (pc >= 0 && pc < a->program.len) {
+    log_line(a->program.lines[pc]);
+  }
+  if (a->thread_count != b->thread_count) {
+    out_printf("  threads: %s %i, %s %i\n", an, a->thread_count, bn,
+               b->thread_count);
+  }
+  if (diff_tid < a->thread_count && diff_tid < b->thread_count) {
+    State x = a->threads[diff_tid].state;
+    State y = b->threads[diff_tid].state;
+    if (x.pc != y.pc) {
+      out_printf("  pc: %s %i, %s %i\n", an, x.pc, bn, y.pc);
+    }
+    if (x.cmp != y.cmp) {
+      out_printf("  cmp: %s %i, %s %i\n", an, x.cmp, bn, y.cmp);
+    }
+    if (x.cont != y.cont) {
+      out_printf("  running: %s %i, %s %i\n", an, x.cont, bn, y.cont);
+    }
+    int i = 0;
+    for (; i < NUM_REGISTERS; i++) {
+      if (x.registers[i] != y.registers[i]) {
+        out_printf("  x%i: %s %i, %s %i\n", i, an, x.registers[i], bn,
+                   y.registers[i]);
+      }
+    }
+    for (i = 0; i < NUM_VREGISTERS * VEC_LANES; i++) {
+      int xv = x.vregisters[i / VEC_LANES][i % VEC_LANES];
+      int yv = y.vregisters[i / VEC_LANES][i % VEC_LANES];
+      if (xv != yv) {
+        out_printf("  v%i[%i]: %s %i, %s %i\n", i / VEC_LANES, i % VEC_LANES,
+                   an, xv, bn, yv);
+      }
+    }
+  }
+  if (ah != bh) {
+    Memory* am = a->threads[0].state.memory;
+    Memory* bm = b->threads[0].state.memory;
+    int addr = 0;
+    while (addr < am->size && mem_load(am, addr) == mem_load(bm, addr)) {
+      addr++;
+    }
+    if (addr < am->size) {
+      out_printf("  memory at %i: %s %i, %s %i\n", addr, an, mem_load(am, addr),
+                 bn, mem_load(bm, addr));
+    }
+  }
+  return true;
+}
+
+void join_all(Machine* m) {
+  pthread_mutex_lock(&m->lock);
+  int count = m->thread_count;
+  pthread_mutex_unlock(&m->lock);
+  int i = 1;
+  for (; i < count; i++) {
+    GuestThread* t = &m->threads[i];
+    if (t->started && !t->joined) {
+      pthread_join(t->handle, NULL);
+      t->joined = true;
+    }
+    /*joined threads may have spawned more*/
+    pthread_mutex_lock(&m->lock);
+    count = m->thread_count;
+    pthread_mutex_unlock(&m->lock);
+  }
+}
+
+State spawn(State s, Line line, Args args) {
+  int start = label_line(s.labels, args.args[0].label);
+  if (start < 0) {
+    s.cont = false;
+    out_printf("label declaration not found for label: %.*s",
+               line.tokens[1].len, line.tokens[1].str);
+    return s;
+  }
+  Machine* m = s.machine;
+  if (m == NULL) {
+    out_printf("spawn: threads need a machine to run on\n");
+    s.cont = false;
+    return s;
+  }
+
+  pthread_mutex_lock(&m->lock);
+  if (m->thread_count == MAX_GUEST_THREADS) {
+    pthread_mutex_unlock(&m->lock);
+    out_printf("spawn: can't start more than %i threads\n", MAX_GUEST_THREADS);
+    s.cont = false;
+    return s;
+  }
+  int tid = m->thread_count;
+  GuestThread* t = &m->threads[tid];
+  memset(t, 0, sizeof(GuestThread));
+  t->parent = s.tid;
+  t->state = s;
+  memcpy(t->vregisters, s.vregisters, sizeof(t->vregisters));
+  t->state.vregisters = t->vregisters;
+  t->state.tid = tid;
+  /*the label line itself does nothing, so the child starts on it*/
+  t->state.pc = start;
+  t->state.cont = true;
+  m->thread_count++;
+  if (!m->deterministic) {
+    t->started = true;
+    if (pthread_create(&t->handle, NULL, run_guest_thread, t) != 0) {
+      out_flush();
+      perror("pthread_create");
+      t->started = false;
+      t->done = true;
+      s.cont = false;
+    }
+  }
+  pthread_mutex_unlock(&m->lock);
+  return s;
+}
+
+State join(State s) {
+  Machine* m = s.machine;
+  if (m == NULL) {
+    return s;
+  }
+
+  /*Only this thread spawns its children, so none can appear while waiting.*/
+  pthread_mutex_lock(&m->lock);
+  int count = m->thread_count;
+  pthread_mutex_unlock(&m->lock);
+  int i = 0;
+  for (; i < count; i++) {
+    GuestThread* t = &m->threads[i];
+    if (t->parent != s.tid || i == s.tid) {
+      continue;
+    }
+    if (m->deterministic) {
+      if (!t->done) {
+        /*come back to this join on our next turn*/
+        s.pc--;
+        return s;
+      }
+    } else if (t->started && !t->joined) {
+      pthread_join(t->handle, NULL);
+      t->joined = true;
+    }
+  }
+  return s;
+}
+
+Memory* mem_create(int size) {
+  /*Zeroed memory of size ints, none of it shared.*/
+  Memory* m = malloc(sizeof(Memory));
+  m->size = size;
+  m->page_count = (size + MEM_PAGE_INTS - 1) >> MEM_PAGE_SHIFT;
+  m->pages = malloc((size_t)m->page_count * sizeof(MemPage*));
+  m->dirty = calloc((size_t)m->page_count, sizeof(u64));
+  int i = 0;
+  for (; i < m->page_count; i++) {
+    m->pages[i] = mem_page_new();
+  }
+  pthread_mutex_init(&m->lock, NULL);
+  m->history = NULL;
+  m->flat = NULL;
+  return m;
+}
+
+Memory* mem_create_guarded(int size) {
+  /*Zeroed memory in one block that ends where MEM_GUARD_BYTES of PROT_NONE
+   * pages start, so any int address past the end, or negative and read as
+   * unsigned, faults instead of needing a bounds check. NULL if the address
+   * space can't be had.*/
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  size_t bytes = (size_t)size * sizeof(int);
+  size_t used = (bytes + page - 1) / page * page;
+  size_t len = used + MEM_GUARD_BYTES;
+  char* addr = mmap(NULL, len, PROT_NONE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (addr == MAP_FAILED) {
+    out_printf("mem-guard: can't reserve guard pages\n");
+    return NULL;
+  }
+  if (mprotect(addr, used, PROT_READ | PROT_WRITE) != 0) {
+    out_printf("mem-guard: can't reserve guard pages\n");
+    munmap(addr, len);
+    return NULL;
+  }
+  Memory* m = mem_create(size);
+  MemMap* map = malloc(sizeof(MemMap));
+  map->addr = addr;
+  map->len = len;
+  m->flat = (int*)(addr + used - bytes);
+  mem_adopt(m, map, m->flat);
+  return m;
+}
+
+Memory* mem_fork(Memory* m) {
+  /*A copy of m that costs one pointer per page. Pages are copied the first
+   * time either side writes to them.*/
+  Memory* f = malloc(sizeof(Memory));
+  f->size = m->size;
+  f->page_count = m->page_count;
+  f->pages = malloc((size_t)m->page_count * sizeof(MemPage*));
+  f->dirty = malloc((size_t)m->page_count * sizeof(u64));
+  memcpy(f->dirty, m->dirty, (size_t)m->page_count * sizeof(u64));
+  int i = 0;
+  for (; i < m->page_count; i++) {
+    f->pages[i] = m->pages[i];
+    __atomic_add_fetch(&f->pages[i]->refs, 1, __ATOMIC_ACQ_REL);
+  }
+  pthread_mutex_init(&f->lock, NULL);
+  f->history = NULL;
+  /*a fork's pages get copied out of the block on write*/
+  f->flat = NULL;
+  return f;
+}
+
+void mem_destroy(Memory* m) {
+  int i = 0;
+  for (; i < m->page_count; i++) {
+    mem_page_release(m->pages[i]);
+  }
+  pthread_mutex_destroy(&m->lock);
+  free(m->pages);
+  free(m->dirty);
+  free(m);
+}
+
+void mem_clear(Memory* m) {
+  /*Zero every page, swapping shared ones for fresh pages rather than copying
+   * them first.*/
+  int i = 0;
+  memset(m->dirty, 0, (size_t)m->page_count * sizeof(u64));
+  for (; i < m->page_count; i++) {
+    MemPage* p = m->pages[i];
+    if (__atomic_load_n(&p->refs, __ATOMIC_ACQUIRE) == 1) {
+      memset(p->data, 0, MEM_PAGE_INTS * sizeof(int));
+    } else {
+      m->pages[i] = mem_page_new();
+      mem_page_release(p);
+    }
+  }
+}
+
+void mem_page_release(MemPage* p) {
+  if (__atomic_sub_fetch(&p->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    MemMap* map = p->map;
+    if (map != NULL &&
+        __atomic_sub_fetch(&map->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+      munmap(map->addr, map->len);
+      free(map);
+    }
+    free(p);
+  }
+}
+
+MemPage* mem_page_new(void) {
+  /*A zeroed page using its own storage.*/
+  MemPage* p = calloc(1, sizeof(MemPage));
+  p->refs = 1;
+  p->data = p->storage;
+  return p;
+}
+
+bool mem_map_file(Memory* m, const char* path, long offset, bool shared) {
+  /*Back m with the file at path, starting offset bytes in. Shared mappings
+   * write straight through to the file, private ones copy on write. Any part
+   * of m past the end of the file reads as zero and isn't saved.*/
+  int fd = open(path, shared ? O_RDWR : O_RDONLY);
+  if (fd < 0) {
+    out_printf("mem-file: can't open %s\n", path);
+    return false;
+  }
+  struct stat st;
+  fstat(fd, &st);
+  if (offset < 0 || offset % (long)sizeof(int) != 0 || offset > st.st_size) {
+    out_printf("mem-file: offset %li must be a multiple of %i inside %s\n",
+               offset, (int)sizeof(int), path);
+    close(fd);
+    return false;
+  }
+
+  /*mmap wants offsets on a page boundary, and faults on whole pages past the
+   * end of the file. So start at the page holding offset, map anonymous zero
+   * pages for the full size and lay the file over as much of it as exists.*/
+  long page = sysconf(_SC_PAGESIZE);
+  long start = offset - offset % page;
+  size_t lead = (size_t)(offset - start);
+  size_t bytes = (size_t)m->size * sizeof(int);
+  size_t len = (lead + bytes + (size_t)page - 1) / (size_t)page * (size_t)page;
+  size_t file_len = (size_t)(st.st_size - start);
+  if (file_len > len) {
+    file_len = len;
+  }
+  char* addr = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (addr == MAP_FAILED) {
+    out_printf("mem-file: can't map %s\n", path);
+    close(fd);
+    return false;
+  }
+  if (file_len > 0 &&
+      mmap(addr, file_len, PROT_READ | PROT_WRITE,
+           MAP_FIXED | (shared ? MAP_SHARED : MAP_PRIVATE), fd,
+           start) == MAP_FAILED) {
+    out_printf("mem-file: can't map %s\n", path);
+    munmap(addr, len);
+    close(fd);
+    return false;
+  }
+  close(fd);
+
+  MemMap* map = malloc(sizeof(MemMap));
+  map->addr = addr;
+  map->len = len;
+  mem_adopt(m, map, (int*)(addr + lead));
+  return true;
+}
+
+void mem_adopt(Memory* m, MemMap* map, int* ints) {
+  /*Point every page of m into map, starting at ints.*/
+  map->refs = m->page_count;
+  int i = 0;
+  for (; i < m->page_count; i++) {
+    MemPage* p = malloc(sizeof(MemPage));
+    p->refs = 1;
+    p->data = ints + i * MEM_PAGE_INTS;
+    p->map = map;
+    mem_page_release(m->pages[i]);
+    m->pages[i] = p;
+  }
+}
+
+bool parse_mem_file(s8 value, const char** path, long* offset) {
+  /*Split file[:offset], a trailing part that isn't a number belongs to the
+   * file name. The offset is a long, so it can be past 2GB, but not
+   * negative.*/
+  *offset = 0;
+  int colon = value.len - 1;
+  while (colon >= 0 && value.str[colon] != ':') {
+    colon--;
+  }
+  if (colon >= 0 && colon + 1 < value.len) {
+    const char* copy = s8_to_c(malloc, value);
+    char* end = NULL;
+    errno = 0;
+    long long n = strtoll(copy + colon + 1, &end, 10);
+    bool number = *end == '\0';
+    bool fits = errno == 0 && n >= 0 && n <= LONG_MAX;
+    free((char*)copy);
+    if (number && !fits) {
+      return false;
+    }
+    if (number) {
+      *offset = (long)n;
+      value.len = colon;
+    }
+  }
+  *path = s8_to_c(malloc, value);
+  return value.len > 0;
+}
+
+void mem_mark_dirty(Memory* m, int addr, int len) {
+  /*Note len ints from addr as written for the next compact mem dump. The bits
+   * are usually set already, so look before paying for the locked or.*/
+  while (len > 0) {
+    int n = mem_run_len(addr, len);
+    u64 bits = (n == MEM_PAGE_INTS ? ~0UL : (1UL << n) - 1)
+               << (addr & MEM_PAGE_MASK);
+    u64* word = &m->dirty[addr >> MEM_PAGE_SHIFT];
+    if ((__atomic_load_n(word, __ATOMIC_RELAXED) & bits) != bits) {
+      __atomic_fetch_or(word, bits, __ATOMIC_RELAXED);
+    }
+    addr += n;
+    len -= n;
+  }
+}
+
+void mem_save_undo(Memory* m, int addr, int len) {
+  /*Before writing len ints from addr, so a recording History can put them
+   * back.*/
+  if (m->history == NULL) {
+    return;
+  }
+  int i = 0;
+  for (; i < len; i++) {
+    history_save(m->history, addr + i, mem_load(m, addr + i));
+  }
+}
+
+int mem_load(Memory* m, int addr) {
+  return m->pages[addr >> MEM_PAGE_SHIFT]->data[addr & MEM_PAGE_MASK];
+}
+
+int* mem_store_ptr(Memory* m, int addr) {
+  /*Where a write to addr goes. Only valid until the next fork.*/
+  return mem_page_for_write(m, addr >> MEM_PAGE_SHIFT) + (addr & MEM_PAGE_MASK);
+}
+
+int* mem_page_for_write(Memory* m, int page) {
+  /*A page only this Memory points at can't become shared while the VM runs,
+   * so the common case needs no lock.*/
+  MemPage* p = m->pages[page];
+  if (__atomic_load_n(&p->refs, __ATOMIC_ACQUIRE) == 1) {
+    return p->data;
+  }
+  pthread_mutex_lock(&m->lock);
+  /*another guest thread may have copied it while we waited*/
+  p = m->pages[page];
+  if (__atomic_load_n(&p->refs, __ATOMIC_ACQUIRE) != 1) {
+    MemPage* copy = mem_page_new();
+    memcpy(copy->data, p->data, MEM_PAGE_INTS * sizeof(int));
+    __atomic_store_n(&m->pages[page], copy, __ATOMIC_RELEASE);
+    mem_page_release(p);
+    p = copy;
+  }
+  pthread_mutex_unlock(&m->lock);
+  return p->data;
+}
+
+int mem_run_len(int addr, int len) {
+  /*How much of len ints starting at addr fit before the next page.*/
+  int left_in_page = MEM_PAGE_INTS - (addr & MEM_PAGE_MASK);
+  return len < left_in_page ? len : left_in_page;
+}
+
+/*The range functions expect callers to have bounds checked the whole range,
+ * and work a page at a time.*/
+void mem_read(Memory* m, int addr, int* dest, int len) {
+  while (len > 0) {
+    int n = mem_run_len(addr, len);
+    const int* from =
+        m->pages[addr >> MEM_PAGE_SHIFT]->data + (addr & MEM_PAGE_MASK);
+    memcpy(dest, from, (size_t)n * sizeof(int));
+    dest += n;
+    addr += n;
+    len -= n;
+  }
+}
+
+void mem_write(Memory* m, int addr, const int* src, int len) {
+  mem_save_undo(m, addr, len);
+  mem_mark_dirty(m, addr, len);
+  while (len > 0) {
+    int n = mem_run_len(addr, len);
+    memcpy(mem_store_ptr(m, addr), src, (size_t)n * sizeof(int));
+    src += n;
+    addr += n;
+    len -= n;
+  }
+}
+
+void mem_fill(Memory* m, int addr, int val, int len) {
+  mem_save_undo(m, addr, len);
+  mem_mark_dirty(m, addr, len);
+  while (len > 0) {
+    int n = mem_run_len(addr, len);
+    int* p = mem_store_ptr(m, addr);
+    /*memset only writes bytes, which covers 0 and -1. Anything else is a plain
+     * loop the compiler turns into vector stores.*/
+    if (val == 0 || val == -1) {
+      memset(p, val, (size_t)n * sizeof(int));
+    } else {
+      int i = 0;
+      for (; i < n; i++) {
+        p[i] = val;
+      }
+    }
+    addr += n;
+    len -= n;
+  }
+}
+
+void mem_move(Memory* m, int dest, int src, int len) {
+  /*Pieces that stay inside one page on both sides, front to back when moving
+   * down and back to front when moving up, so overlapping runs end up like
+   * memmove.*/
+  mem_save_undo(m, dest, len);
+  mem_mark_dirty(m, dest, len);
+  if (dest <= src) {
+    while (len > 0) {
+      int n = mem_run_len(src, mem_run_len(dest, len));
+      int* to = mem_store_ptr(m, dest);
+      const int* from =
+          m->pages[src >> MEM_PAGE_SHIFT]->data + (src & MEM_PAGE_MASK);
+      memmove(to, from, (size_t)n * sizeof(int));
+      dest += n;
+      src += n;
+      len -= n;
+    }
+  } else {
+    while (len > 0) {
+      int dest_end = dest + len;
+      int src_end = src + len;
+      int n = len;
+      if (((dest_end - 1) & MEM_PAGE_MASK) + 1 < n) {
+        n = ((dest_end - 1) & MEM_PAGE_MASK) + 1;
+      }
+      if (((src_end - 1) & MEM_PAGE_MASK) + 1 < n) {
+        n = ((src_end - 1) & MEM_PAGE_MASK) + 1;
+      }
+      int* to = mem_store_ptr(m, dest_end - n);
+      const int* from = m->pages[(src_end - n) >> MEM_PAGE_SHIFT]->data +
+                        ((src_end - n) & MEM_PAGE_MASK);
+      memmove(to, from, (size_t)n * sizeof(int));
+      len -= n;
     }
-    args.args[args.count] = a;
-    args.count++;
   }
-
-  return args;
 }
 
-State mov(State s, Line line) {
-  Args args = parse_args(line);
-  if (!args.is_valid) {
-    s.cont = false;
-    return s;
+u64 mem_hash(Memory* m) {
+  /*FNV-1a over every int, to compare memories without keeping a copy.*/
+  u64 h = 14695981039346656037ull;
+  int i = 0;
+  for (; i < m->size; i++) {
+    h ^= (u32)mem_load(m, i);
+    h *= 1099511628211ull;
   }
+  return h;
+}
 
-  ArgValidations v;
-  v.cmd_pretty_str = "mov";
-  v.expected_arg_count = 2;
-  ArgValidation first_arg;
-  first_arg.expected_arg_type = REGISTER;
-  ArgValidation second_arg;
-  second_arg.expected_arg_type = REGISTER_OR_CONSTANT;
-  v.validations[0] = first_arg;
-  v.validations[1] = second_arg;
-  if (!validate_args(args, v)) {
-    s.cont = false;
-    return s;
+int mem_shared_pages(Memory* m) {
+  /*Pages still shared with another Memory.*/
+  int shared = 0;
+  int i = 0;
+  for (; i < m->page_count; i++) {
+    if (__atomic_load_n(&m->pages[i]->refs, __ATOMIC_ACQUIRE) > 1) {
+      shared++;
+    }
   }
+  return shared;
+}
 
-  Arg a1 = args.args[0];
-  Arg a2 = args.args[1];
-
-  int val = get_register_or_constant(s, a2);
-
-  s.registers[a1.reg] = val;
-  return s;
+int resolve_address(State* s, Arg a, const char* cmd_pretty_str) {
+  /*Memory index an address argument points at, or -1 (with the thread
+   * stopped) if it is out of bounds.*/
+  return resolve_address_range(s, a, 1, cmd_pretty_str);
 }
 
-State ldr(State s, Line line) {
-  Args args = parse_args(line);
+int resolve_address_range(State* s,
+                          Arg a,
+                          int len,
+                          const char* cmd_pretty_str) {
+  /*Like resolve_address, for len ints starting at the address.*/
+  int addr = a.addr.val;
+  if (a.addr.type == A_REGISTER) {
+    addr = s->registers[a.addr.val];
+  }
+  if (addr < 0 || addr > MEM_BYTES - len) {
+    out_printf("%s: out of bounds memory access at address %i\n",
+               cmd_pretty_str, addr);
+    s->cont = false;
+    return -1;
+  }
+  return addr;
+}
 
-  if (!args.is_valid) {
-    s.cont = false;
+State ldadd(State s, Args args) {
+  int addr = resolve_address(&s, args.args[2], "ldadd");
+  if (addr < 0) {
     return s;
   }
+  int add = s.registers[args.args[0].reg];
+  mem_save_undo(s.memory, addr, 1);
+  s.registers[args.args[1].reg] =
+      __atomic_fetch_add(mem_store_ptr(s.memory, addr), add, __ATOMIC_SEQ_CST);
+  mem_mark_dirty(s.memory, addr, 1);
+  return s;
+}
 
-  ArgValidations v;
-  v.cmd_pretty_str = "ldr";
-  v.expected_arg_count = 2;
-  ArgValidation first_arg;
-  first_arg.expected_arg_type = REGISTER;
-  ArgValidation second_arg;
-  second_arg.expected_arg_type = ADDRESS;
-  v.validations[0] = first_arg;
-  v.validations[1] = second_arg;
-  if (!validate_args(args, v)) {
-    s.cont = false;
+State cas(State s, Args args) {
+  int addr = resolve_address(&s, args.args[2], "cas");
+  if (addr < 0) {
     return s;
   }
-
-  Arg a1 = args.args[0];
-  Arg a2 = args.args[1];
-
-  if (a2.addr.type == A_REGISTER) {
-    int addr = s.registers[a2.addr.val];
-    if (addr < 0 || addr >= MEM_BYTES) {
-      printf("ldr: out of bounds memory access at address %i\n", addr);
-      s.cont = false;
-      return s;
-    }
-    s.registers[a1.reg] = s.memory[addr];
-  } else if (a2.addr.type == A_CONSTANT) {
-    s.registers[a1.reg] = s.memory[a2.addr.val];
+  /*on failure expected is overwritten with the value in memory, on success it
+   * already equals it, either way the first register gets the old value*/
+  int expected = s.registers[args.args[0].reg];
+  mem_save_undo(s.memory, addr, 1);
+  if (__atomic_compare_exchange_n(mem_store_ptr(s.memory, addr), &expected,
+                                  s.registers[args.args[1].reg], false,
+                                  __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+    mem_mark_dirty(s.memory, addr, 1);
   }
-
+  s.registers[args.args[0].reg] = expected;
   return s;
 }
 
-State str(State s, Line line) {
-  Args args = parse_args(line);
-  if (!args.is_valid) {
-    s.cont = false;
-    return s;
+int resolve_length(State* s, Arg a, const char* cmd_pretty_str) {
+  /*Element count for the bulk memory instructions, or -1 (with the thread
+   * stopped) if it is negative.*/
+  int len = get_register_or_constant(*s, a);
+  if (len < 0) {
+    out_printf("%s: negative length %i\n", cmd_pretty_str, len);
+    s->cont = false;
+    return -1;
   }
+  return len;
+}
 
-  ArgValidations v;
-  v.cmd_pretty_str = "str";
-  v.expected_arg_count = 2;
-  ArgValidation first_arg;
-  first_arg.expected_arg_type = REGISTER;
-  ArgValidation second_arg;
-  second_arg.expected_arg_type = ADDRESS;
-  v.validations[0] = first_arg;
-  v.validations[1] = second_arg;
-  if (!validate_args(args, v)) {
-    s.cont = false;
+State fill(State s, Args args) {
+  int val = get_register_or_constant(s, args.args[1]);
+  int len = resolve_length(&s, args.args[2], "fill");
+  if (len < 0) {
     return s;
   }
-
-  Arg a1 = args.args[0];
-  Arg a2 = args.args[1];
-
-  if (a2.addr.type == A_REGISTER) {
-    int addr = s.registers[a2.addr.val];
-    if (addr < 0 || addr >= MEM_BYTES) {
-      printf("str: out of bounds memory access at address %i\n", addr);
-      s.cont = false;
-      return s;
-    }
-    s.memory[addr] = s.registers[a1.reg];
-  } else if (a2.addr.type == A_CONSTANT) {
-    if (a2.addr.val < 0 || a2.addr.val >= MEM_BYTES) {
-      printf("str: out of bounds memory access at address %i\n", a2.addr.val);
-      s.cont = false;
-      return s;
-    }
-    s.memory[a2.addr.val] = s.registers[a1.reg];
+  int dest = resolve_address_range(&s, args.args[0], len, "fill");
+  if (dest < 0) {
+    return s;
   }
+
+  mem_fill(s.memory, dest, val, len);
   return s;
 }
 
-State add_or_sub(State s, Line line, bool is_add) {
-  Args args = parse_args(line);
-  if (!args.is_valid) {
-    s.cont = false;
+State cpy(State s, Args args) {
+  int len = resolve_length(&s, args.args[2], "cpy");
+  if (len < 0) {
     return s;
   }
-
-  ArgValidations v;
-  if (is_add) {
-    v.cmd_pretty_str = "add";
-  } else {
-    v.cmd_pretty_str = "sub";
-  }
-  v.expected_arg_count = 3;
-  ArgValidation first_arg;
-  first_arg.expected_arg_type = REGISTER;
-  ArgValidation second_arg;
-  second_arg.expected_arg_type = REGISTER_OR_CONSTANT;
-  ArgValidation third_arg;
-  third_arg.expected_arg_type = REGISTER_OR_CONSTANT;
-  v.validations[0] = first_arg;
-  v.validations[1] = second_arg;
-  v.validations[2] = third_arg;
-  if (!validate_args(args, v)) {
-    s.cont = false;
+  int dest = resolve_address_range(&s, args.args[0], len, "cpy");
+  if (dest < 0) {
     return s;
   }
-
-  Arg a1 = args.args[0];
-  Arg a2 = args.args[1];
-  Arg a3 = args.args[2];
-
-  int val1 = get_register_or_constant(s, a2);
-  int val2 = get_register_or_constant(s, a3);
-
-  if (!is_add) {
-    val2 = val2 * -1;
+  int src = resolve_address_range(&s, args.args[1], len, "cpy");
+  if (src < 0) {
+    return s;
   }
-  s.registers[a1.reg] = val1 + val2;
+  /*ranges may overlap, same as memmove*/
+  mem_move(s.memory, dest, src, len);
   return s;
 }
 
-State lsl_or_lsr(State s, Line line, bool is_left) {
-  Args args = parse_args(line);
-  if (!args.is_valid) {
-    s.cont = false;
-    return s;
-  }
-
-  ArgValidations v;
-  if (is_left) {
-    v.cmd_pretty_str = "lsl";
+State in(State s, Args args) {
+  /*One word from the guest input, the cmp byte says whether there was one.*/
+  int word;
+  if (fread(&word, sizeof(int), 1, s.machine->guest_in) == 1) {
+    s.registers[args.args[0].reg] = word;
+    s.cmp = 0;
   } else {
-    v.cmd_pretty_str = "lsr";
-  }
-  v.expected_arg_count = 3;
-  ArgValidation first_arg;
-  first_arg.expected_arg_type = REGISTER;
-  ArgValidation second_arg;
-  second_arg.expected_arg_type = REGISTER_OR_CONSTANT;
-  ArgValidation third_arg;
-  third_arg.expected_arg_type = REGISTER_OR_CONSTANT;
-  v.validations[0] = first_arg;
-  v.validations[1] = second_arg;
-  v.validations[2] = third_arg;
-  if (!validate_args(args, v)) {
-    s.cont = false;
-    return s;
+    s.cmp = 1;
   }
+  return s;
+}
 
-  Arg a1 = args.args[0];
-  Arg a2 = args.args[1];
-  Arg a3 = args.args[2];
-
-  int val1 = get_register_or_constant(s, a2);
-  int val2 = get_register_or_constant(s, a3);
-
-  if (is_left) {
-    s.registers[a1.reg] = val1 << val2;
+State out(State s, Args args) {
+  int word = get_register_or_constant(s, args.args[0]);
+  if (s.machine->guest_out == NULL) {
+    out_write((const char*)&word, sizeof(int));
   } else {
-    s.registers[a1.reg] = val1 >> val2;
+    fwrite(&word, sizeof(int), 1, s.machine->guest_out);
   }
   return s;
 }
 
-State cmp(State s, Line line) {
-  Args args = parse_args(line);
-  if (!args.is_valid) {
-    s.cont = false;
+State read_words(State s, Args args) {
+  /*Up to len words from the guest input straight into memory, the register
+   * gets how many arrived, 0 once the input is used up.*/
+  int len = resolve_length(&s, args.args[2], "read");
+  if (len < 0) {
     return s;
   }
-
-  ArgValidations v;
-  v.expected_arg_count = 2;
-  v.cmd_pretty_str = "cmp";
-  ArgValidation a1;
-  a1.expected_arg_type = REGISTER_OR_CONSTANT;
-  ArgValidation a2;
-  a2.expected_arg_type = REGISTER_OR_CONSTANT;
-  v.validations[0] = a1;
-  v.validations[1] = a2;
-
-  if (!validate_args(args, v)) {
-    s.cont = false;
+  int dest = resolve_address_range(&s, args.args[1], len, "read");
+  if (dest < 0) {
     return s;
   }
+  int words[MEM_BYTES];
+  int n = (int)fread(words, sizeof(int), (size_t)len, s.machine->guest_in);
+  mem_write(s.memory, dest, words, n);
+  s.registers[args.args[0].reg] = n;
+  return s;
+}
 
-  int val1 = get_register_or_constant(s, args.args[0]);
-  int val2 = get_register_or_constant(s, args.args[1]);
-  if (val1 < val2) {
-    s.cmp = -1;
-  } else if (val1 > val2) {
-    s.cmp = 1;
+State write_words(State s, Args args) {
+  int len = resolve_length(&s, args.args[1], "write");
+  if (len < 0) {
+    return s;
+  }
+  int src = resolve_address_range(&s, args.args[0], len, "write");
+  if (src < 0) {
+    return s;
+  }
+  int words[MEM_BYTES];
+  mem_read(s.memory, src, words, len);
+  if (s.machine->guest_out == NULL) {
+    out_write((const char*)words, len * (int)sizeof(int));
   } else {
-    s.cmp = 0;
+    fwrite(words, sizeof(int), (size_t)len, s.machine->guest_out);
   }
   return s;
 }
 
-State branch(State s, Line line, CMD command) {
-  Args args = parse_args(line);
-  if (!args.is_valid) {
-    s.cont = false;
-    return s;
+void diff_guest_io(Machine* a, Machine* b) {
+  /*Both engines need to see the same input, so when the program reads any,
+   * read all of it up front and give each engine its own copy. b's output is
+   * thrown away.*/
+  int i = 0;
+  for (; i < a->program.len; i++) {
+    Line line = a->program.lines[i];
+    if (line.len > 0 && (identify_cmd(line.tokens[0]) == IN ||
+                         identify_cmd(line.tokens[0]) == READ)) {
+      break;
+    }
+  }
+  if (i < a->program.len) {
+    int cap = GUEST_IO_BYTES;
+    char* input = malloc((size_t)cap);
+    size_t len = 0;
+    size_t n;
+    while ((n = fread(input + len, 1, (size_t)cap - len, a->guest_in)) > 0) {
+      len += n;
+      if (len == (size_t)cap) {
+        cap *= 2;
+        input = realloc(input, (size_t)cap);
+      }
+    }
+    a->guest_in = fmemopen(input, len, "rb");
+    b->guest_in = fmemopen(input, len, "rb");
   }
+  b->guest_out = fopen("/dev/null", "wb");
+}
 
-  ArgValidations v;
-  v.expected_arg_count = 1;
-  v.cmd_pretty_str = "branch";
+void guest_io_flush(Machine* m) {
+  /*Called whenever a guest thread stops, so output isn't lost to an error.*/
+  if (m->guest_out != NULL) {
+    fflush(m->guest_out);
+  }
+  out_flush();
+}
 
-  ArgValidation v1;
-  v1.expected_arg_type = LABEL_ARG;
-  v.validations[0] = v1;
-  if (!validate_args(args, v)) {
-    s.cont = false;
-    return s;
+bool is_vector_register(s8 t) {
+  /*v followed by only digits, so labels like vals or v2_done still work*/
+  int i = 1;
+  if (t.len < 2 || t.str[0] != 'v') {
+    return false;
+  }
+  for (; i < t.len; i++) {
+    if (t.str[i] < '0' || t.str[i] > '9') {
+      return false;
+    }
   }
+  return true;
+}
 
-  s8 label = args.args[0].label;
-  ResultInt jmp = map_get(s.labels, label);
-  if (!jmp.ok) {
-    s.cont = false;
-    printf("label declaration not found for label: %s", s8_to_c(malloc, label));
+State vld_or_vst(State s, Args args, bool is_load) {
+  int addr = resolve_address_range(&s, args.args[1], VEC_LANES,
+                                   is_load ? "vld" : "vst");
+  if (addr < 0) {
     return s;
   }
+  int* vreg = s.vregisters[args.args[0].reg];
+  if (is_load) {
+    vreg_save_undo(&s, args.args[0].reg);
+    mem_read(s.memory, addr, vreg, VEC_LANES);
+  } else {
+    mem_write(s.memory, addr, vreg, VEC_LANES);
+  }
+  return s;
+}
 
+State vector_op(State s, Args args, CMD command) {
+  VecOp op;
+  if (vec_kernels.cmp == 0) {
+    vec_kernels_init();
+  }
   switch (command) {
-    case BRANCH:
-      s.pc = jmp.val;
-      break;
-    case BLE:
-      if (s.cmp <= 0) {
-        s.pc = jmp.val;
-      }
-      break;
-    case BLT:
-      if (s.cmp < 0) {
-        s.pc = jmp.val;
-      }
+    case VADD:
+      op = vec_kernels.add;
       break;
-    case BGE:
-      if (s.cmp >= 0) {
-        s.pc = jmp.val;
-      }
-      break;
-    case BGT:
-      if (s.cmp > 0) {
-        s.pc = jmp.val;
-      }
+    case VSUB:
+      op = vec_kernels.sub;
       break;
-    case BNE:
-      if (s.cmp != 0) {
-        s.pc = jmp.val;
-      }
+    case VMIN:
+      op = vec_kernels.min;
       break;
-    case BEQ:
-      if (s.cmp == 0) {
-        s.pc = jmp.val;
-      }
+    case VMAX:
+      op = vec_kernels.max;
       break;
     default:
-      printf("this should never happen");
+      op = vec_kernels.cmp;
       break;
   }
+  vreg_save_undo(&s, args.args[0].reg);
+  op(s.vregisters[args.args[0].reg], s.vregisters[args.args[1].reg],
+     s.vregisters[args.args[2].reg]);
   return s;
 }
 
+VecKernels vec_kernels;
+
+void vec_kernels_init(void) {
+  /*cmp is set last since it is what the lazy check looks at.*/
+  VecKernels k = vec_kernels_scalar();
+#if OSTD_X86_SIMD
+  if (cpu_has_avx2()) {
+    k = vec_kernels_avx2();
+  } else if (cpu_has_sse2()) {
+    k = vec_kernels_sse2();
+  }
+#endif
+  vec_kernels.name = k.name;
+  vec_kernels.add = k.add;
+  vec_kernels.sub = k.sub;
+  vec_kernels.min = k.min;
+  vec_kernels.max = k.max;
+  vec_kernels.cmp = k.cmp;
+}
+
+VecKernels vec_kernels_scalar(void) {
+  VecKernels k;
+  k.name = "scalar";
+  k.add = vec_add_scalar;
+  k.sub = vec_sub_scalar;
+  k.min = vec_min_scalar;
+  k.max = vec_max_scalar;
+  k.cmp = vec_cmp_scalar;
+  return k;
+}
+
+/*add and sub wrap around like the SIMD versions, going through unsigned so
+ * the overflow is defined.*/
+void vec_add_scalar(int* dest, const int* a, const int* b) {
+  int i = 0;
+  for (; i < VEC_LANES; i++) {
+    dest[i] = (int)((u32)a[i] + (u32)b[i]);
+  }
+}
+
+void vec_sub_scalar(int* dest, const int* a, const int* b) {
+  int i = 0;
+  for (; i < VEC_LANES; i++) {
+    dest[i] = (int)((u32)a[i] - (u32)b[i]);
+  }
+}
+
+void vec_min_scalar(int* dest, const int* a, const int* b) {
+  int i = 0;
+  for (; i < VEC_LANES; i++) {
+    dest[i] = a[i] < b[i] ? a[i] : b[i];
+  }
+}
+
+void vec_max_scalar(int* dest, const int* a, const int* b) {
+  int i = 0;
+  for (; i < VEC_LANES; i++) {
+    dest[i] = a[i] > b[i] ? a[i] : b[i];
+  }
+}
+
+void vec_cmp_scalar(int* dest, const int* a, const int* b) {
+  /*-1, 0 or 1 per lane, like cmp*/
+  int i = 0;
+  for (; i < VEC_LANES; i++) {
+    dest[i] = (a[i] > b[i]) - (a[i] < b[i]);
+  }
+}
+
+#if OSTD_X86_SIMD
+/*SSE2 has no 32 bit min/max, so those select with a compare mask. Lanes are
+ * done in two halves of 4.*/
+VecKernels vec_kernels_sse2(void) {
+  VecKernels k;
+  k.name = "sse2";
+  k.add = vec_add_sse2;
+  k.sub = vec_sub_sse2;
+  k.min = vec_min_sse2;
+  k.max = vec_max_sse2;
+  k.cmp = vec_cmp_sse2;
+  return k;
+}
+
+__attribute__((target("sse2"))) void vec_add_sse2(int* dest,
+                                                  const int* a,
+                                                  const int* b) {
+  int i = 0;
+  for (; i < VEC_LANES; i += 4) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(a + i));
+    __m128i y = _mm_loadu_si128((const __m128i*)(b + i));
+    _mm_storeu_si128((__m128i*)(dest + i), _mm_add_epi32(x, y));
+  }
+}
+
+__attribute__((target("sse2"))) void vec_sub_sse2(int* dest,
+                                                  const int* a,
+                                                  const int* b) {
+  int i = 0;
+  for (; i < VEC_LANES; i += 4) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(a + i));
+    __m128i y = _mm_loadu_si128((const __m128i*)(b + i));
+    _mm_storeu_si128((__m128i*)(dest + i), _mm_sub_epi32(x, y));
+  }
+}
+
+__attribute__((target("sse2"))) void vec_min_sse2(int* dest,
+                                                  const int* a,
+                                                  const int* b) {
+  int i = 0;
+  for (; i < VEC_LANES; i += 4) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(a + i));
+    __m128i y = _mm_loadu_si128((const __m128i*)(b + i));
+    __m128i x_bigger = _mm_cmpgt_epi32(x, y);
+    _mm_storeu_si128(
+        (__m128i*)(dest + i),
+        _mm_or_si128(_mm_and_si128(x_bigger, y),
+                     _mm_andnot_si128(x_bigger, x)));
+  }
+}
+
+__attribute__((target("sse2"))) void vec_max_sse2(int* dest,
+                                                  const int* a,
+                                                  const int* b) {
+  int i = 0;
+  for (; i < VEC_LANES; i += 4) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(a + i));
+    __m128i y = _mm_loadu_si128((const __m128i*)(b + i));
+    __m128i x_bigger = _mm_cmpgt_epi32(x, y);
+    _mm_storeu_si128(
+        (__m128i*)(dest + i),
+        _mm_or_si128(_mm_and_si128(x_bigger, x),
+                     _mm_andnot_si128(x_bigger, y)));
+  }
+}
+
+__attribute__((target("sse2"))) void vec_cmp_sse2(int* dest,
+                                                  const int* a,
+                                                  const int* b) {
+  /*compare masks are -1 where true, so gt - lt is (-1 * lt) - (-1 * gt)*/
+  int i = 0;
+  for (; i < VEC_LANES; i += 4) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(a + i));
+    __m128i y = _mm_loadu_si128((const __m128i*)(b + i));
+    _mm_storeu_si128(
+        (__m128i*)(dest + i),
+        _mm_sub_epi32(_mm_cmpgt_epi32(y, x), _mm_cmpgt_epi32(x, y)));
+  }
+}
+
+VecKernels vec_kernels_avx2(void) {
+  VecKernels k;
+  k.name = "avx2";
+  k.add = vec_add_avx2;
+  k.sub = vec_sub_avx2;
+  k.min = vec_min_avx2;
+  k.max = vec_max_avx2;
+  k.cmp = vec_cmp_avx2;
+  return k;
+}
+
+__attribute__((target("avx2"))) void vec_add_avx2(int* dest,
+                                                  const int* a,
+                                                  const int* b) {
+  __m256i x = _mm256_loadu_si256((const __m256i*)a);
+  __m256i y = _mm256_loadu_si256((const __m256i*)b);
+  _mm256_storeu_si256((__m256i*)dest, _mm256_add_epi32(x, y));
+}
+
+__attribute__((target("avx2"))) void vec_sub_avx2(int* dest,
+                                                  const int* a,
+                                                  const int* b) {
+  __m256i x = _mm256_loadu_si256((const __m256i*)a);
+  __m256i y = _mm256_loadu_si256((const __m256i*)b);
+  _mm256_storeu_si256((__m256i*)dest, _mm256_sub_epi32(x, y));
+}
+
+__attribute__((target("avx2"))) void vec_min_avx2(int* dest,
+                                                  const int* a,
+                                                  const int* b) {
+  __m256i x = _mm256_loadu_si256((const __m256i*)a);
+  __m256i y = _mm256_loadu_si256((const __m256i*)b);
+  _mm256_storeu_si256((__m256i*)dest, _mm256_min_epi32(x, y));
+}
+
+__attribute__((target("avx2"))) void vec_max_avx2(int* dest,
+                                                  const int* a,
+                                                  const int* b) {
+  __m256i x = _mm256_loadu_si256((const __m256i*)a);
+  __m256i y = _mm256_loadu_si256((const __m256i*)b);
+  _mm256_storeu_si256((__m256i*)dest, _mm256_max_epi32(x, y));
+}
+
+__attribute__((target("avx2"))) void vec_cmp_avx2(int* dest,
+                                                  const int* a,
+                                                  const int* b) {
+  __m256i x = _mm256_loadu_si256((const __m256i*)a);
+  __m256i y = _mm256_loadu_si256((const __m256i*)b);
+  _mm256_storeu_si256(
+      (__m256i*)dest,
+      _mm256_sub_epi32(_mm256_cmpgt_epi32(y, x), _mm256_cmpgt_epi32(x, y)));
+}
+#endif
+
 void log_registers(State s) {
   int i = 0;
-  printf("registers: [");
+  out_printf("registers: [");
   for (; i < NUM_REGISTERS; i++) {
-    printf("%i, ", s.registers[i]);
+    out_printf("%i, ", s.registers[i]);
   }
-  printf("]\n");
+  out_printf("]\n");
 }
 
 void log_mem(State s) {
+  if (s.machine != NULL && s.machine->compact_mem) {
+    log_mem_changes(s);
+    return;
+  }
   int i = 0;
-  printf("mem: [");
+  out_printf("mem: [");
   for (; i < MEM_BYTES; i++) {
     if (i % 48 == 0) {
-      printf("\n");
+      out_printf("\n");
+    }
+    out_printf("%i, ", mem_load(s.memory, i));
+  }
+  out_printf("]\n");
+  /*everything was just printed, so nothing counts as changed any more*/
+  for (i = 0; i < s.memory->page_count; i++) {
+    __atomic_store_n(&s.memory->dirty[i], 0, __ATOMIC_RELAXED);
+  }
+}
+
+void log_mem_changes(State s) {
+  /*Print each run of ints written since the last dump as
+   * "  start-end: values", and forget them.*/
+  Memory* m = s.memory;
+  bool any = false;
+  int start = -1;
+  int addr = 0;
+  out_printf("mem changed:");
+  for (; addr <= m->size; addr++) {
+    bool changed = false;
+    if (addr < m->size) {
+      u64* word = &m->dirty[addr >> MEM_PAGE_SHIFT];
+      u64 bit = 1UL << (addr & MEM_PAGE_MASK);
+      changed = (__atomic_load_n(word, __ATOMIC_RELAXED) & bit) != 0;
+      if (changed) {
+        __atomic_fetch_and(word, ~bit, __ATOMIC_RELAXED);
+      }
+    }
+    if (changed && start < 0) {
+      start = addr;
+    } else if (!changed && start >= 0) {
+      if (addr - 1 == start) {
+        out_printf("\n  %i:", start);
+      } else {
+        out_printf("\n  %i-%i:", start, addr - 1);
+      }
+      for (; start < addr; start++) {
+        out_printf(" %i", mem_load(m, start));
+      }
+      start = -1;
+      any = true;
+    }
+  }
+  out_printf(any ? "\n" : " none\n");
+}
+
+Output output = {{0}, 0, PTHREAD_MUTEX_INITIALIZER};
+
+void out_printf(const char* fmt, ...) {
+  /*Format straight into the buffer, flushing first and trying again when it
+   * doesn't fit. Text bigger than the whole buffer skips it.*/
+  va_list args;
+  pthread_mutex_lock(&output.lock);
+  int room = OUT_BUFFER_BYTES - output.len;
+  va_start(args, fmt);
+  int n = vsnprintf(output.buf + output.len, (size_t)room, fmt, args);
+  va_end(args);
+  if (n >= room) {
+    out_flush_locked();
+    va_start(args, fmt);
+    if (n < OUT_BUFFER_BYTES) {
+      n = vsnprintf(output.buf, OUT_BUFFER_BYTES, fmt, args);
+    } else {
+      vfprintf(stdout, fmt, args);
+      fflush(stdout);
+      n = 0;
     }
-    printf("%i, ", s.memory[i]);
+    va_end(args);
   }
-  printf("]\n");
+  if (n > 0) {
+    output.len += n;
+  }
+  pthread_mutex_unlock(&output.lock);
+}
+
+void out_char(char c) {
+  out_write(&c, 1);
+}
+
+void out_write(const char* str, int len) {
+  pthread_mutex_lock(&output.lock);
+  if (len > OUT_BUFFER_BYTES - output.len) {
+    out_flush_locked();
+  }
+  if (len > OUT_BUFFER_BYTES) {
+    fwrite(str, 1, (size_t)len, stdout);
+    fflush(stdout);
+  } else {
+    memcpy(output.buf + output.len, str, (size_t)len);
+    output.len += len;
+  }
+  pthread_mutex_unlock(&output.lock);
+}
+
+void out_flush(void) {
+  pthread_mutex_lock(&output.lock);
+  out_flush_locked();
+  pthread_mutex_unlock(&output.lock);
+}
+
+void out_flush_locked(void) {
+  /*Hand the buffer to stdio in one piece, so anything else printed with
+   * printf stays in order with it.*/
+  if (output.len > 0) {
+    fwrite(output.buf, 1, (size_t)output.len, stdout);
+    output.len = 0;
+  }
+  fflush(stdout);
 }
 
 bool validate_args(Args args, ArgValidations validations) {
+  return validate_args_report(args, validations, true);
+}
+
+bool validate_args_report(Args args,
+                          ArgValidations validations,
+                          bool report) {
   if (args.count != validations.expected_arg_count) {
-    printf("%s: expected %i arguments, got %i\n", validations.cmd_pretty_str,
-           validations.expected_arg_count, args.count);
+    if (report) {
+      out_printf("%s: expected %i arguments, got %i\n",
+                 validations.cmd_pretty_str, validations.expected_arg_count,
+                 args.count);
+    }
     return false;
   }
   int i = 0;
@@ -899,8 +5492,10 @@ bool validate_args(Args args, ArgValidations validations) {
 
     if (expected == REGISTER_OR_CONSTANT && !(cmd_type == REGISTER) &&
         !(cmd_type == CONSTANT)) {
-      printf("%s: expected arg %i to be a register or a constant.\n",
-             validations.cmd_pretty_str, i + 1);
+      if (report) {
+        out_printf("%s: expected arg %i to be a register or a constant.\n",
+                   validations.cmd_pretty_str, i + 1);
+      }
       return false;
     }
     if (expected != REGISTER_OR_CONSTANT && expected != cmd_type) {
@@ -912,9 +5507,13 @@ bool validate_args(Args args, ArgValidations validations) {
       }
       if (expected == ADDRESS) {
         err_msg = "address";
+      } else if (expected == VREGISTER) {
+        err_msg = "vector register";
+      }
+      if (report) {
+        out_printf("%s: expected arg %i to be a %s.\n",
+                   validations.cmd_pretty_str, i + 1, err_msg);
       }
-      printf("%s: expected arg %i to be a %s.\n", validations.cmd_pretty_str,
-             i + 1, err_msg);
       return false;
     }
   }
@@ -933,47 +5532,51 @@ int get_register_or_constant(State s, Arg a) {
 
 void log_line(Line line) {
   int i = 0;
-  printf("> ");
+  out_printf("> ");
   for (; i < line.len; i++) {
-    s8 t = line.tokens[i];
-    int j = 0;
-    for (; j < t.len; j++) {
-      putchar(t.str[j]);
-    }
-    putchar(' ');
+    out_write(line.tokens[i].str, line.tokens[i].len);
+    out_char(' ');
+  }
+  out_char('\n');
+}
+
+void log_line_tokens(Line line) {
+  /*The line's tokens, each after a space, for the end of a report row.*/
+  int i = 0;
+  for (; i < line.len; i++) {
+    out_printf(" %.*s", line.tokens[i].len, line.tokens[i].str);
   }
-  putchar('\n');
+}
+
+void log_unknown_cmd(Line line) {
+  s8 t = line.tokens[0];
+  out_printf("Error could not parse statement identifier: %.*s\n",
+             t.len < 3 ? t.len : 3, t.str);
 }
 
 void log_tokenized_program(TokenizedProgram p) {
 #ifndef LOG_NONE
-  printf("\n\nTokenized Program:\n");
-  printf("Line count: %i\n", p.len);
+  out_printf("\n\nTokenized Program:\n");
+  out_printf("Line count: %i\n", p.len);
 #endif
   int i = 0;
   for (; i < p.len; i++) {
 #ifndef LOG_NONE
-    putchar('\n');
+    out_char('\n');
 #endif
     int j = 0;
     Line line = p.lines[i];
 #ifndef LOG_NONE
-    printf("%i. (Toks: %i):", i, line.len);
+    out_printf("%i. (Toks: %i):", i, line.len);
 #endif
     for (; j < line.len; j++) {
-      int t = 0;
-#ifndef LOG_NONE
-      putchar(' ');
-#endif
-      s8 token = line.tokens[j];
-      for (; t < token.len; t++) {
 #ifndef LOG_NONE
-        putchar(token.str[t]);
+      out_char(' ');
+      out_write(line.tokens[j].str, line.tokens[j].len);
 #endif
-      }
     }
   }
 #ifndef LOG_NONE
-  printf("\n\n");
+  out_printf("\n\n");
 #endif
 }
\ No newline at end of file
@@ -1,23 +1,111 @@
 #ifndef OARM_H
 #define OARM_H
 
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <malloc.h>
 #include <math.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
 #include "ostd.h"
 
 #define MAX_LINE_LEN 128
 #define MAX_IDENT_LEN 32
-#define MAX_TOKENS_PER_LINE 4
+#define MAX_TOKENS_PER_LINE 5
 #define CMD_LEN 3
 #define ARGS_LEN (MAX_LINE_LEN - CMD_LEN - 1)
 #define NUM_REGISTERS 10
+#define NUM_VREGISTERS 8
+/*ints per vector register, one AVX2 register wide*/
+#define VEC_LANES 8
 #define MEM_BYTES 256
 
+/*Sources at least this big are assembled on multiple threads by default.*/
+#define PARALLEL_ASSEMBLE_MIN_BYTES (1 << 20)
+#define MAX_ASSEMBLE_THREADS 64
+/*Guest threads a program can spawn over a whole run, including main.*/
+#define MAX_GUEST_THREADS 64
+
+/*Symbol id for tokens that are not identifiers, like '#4'.*/
+#define NO_SYMBOL -1
+
+/*Line number of each label by symbol id, open addressed in twice as many
+ * slots as the program declares labels. Symbol ids are shared by every
+ * program assembled in the process, so a table indexed by them would grow with
+ * all of those. Empty slots have the id NO_SYMBOL and line -1.*/
+typedef struct LabelTable {
+  /*len ids and then len lines, in one block*/
+  int* lines;
+  int* ids;
+  /*slots, a power of two*/
+  int len;
+} LabelTable;
+
+/*Guest memory is split into pages so a forked VM shares every page until one
+ * side writes to it.*/
+#define MEM_PAGE_SHIFT 6
+#define MEM_PAGE_INTS (1 << MEM_PAGE_SHIFT)
+#define MEM_PAGE_MASK (MEM_PAGE_INTS - 1)
+
+/*A file mapped in as guest memory, unmapped once no page points into it.*/
+typedef struct MemMap {
+  int refs;
+  void* addr;
+  size_t len;
+} MemMap;
+
+/*Guard pages after guarded memory, enough for any int address read as
+ * unsigned.*/
+#define MEM_GUARD_BYTES ((size_t)1 << 34)
+
+typedef struct MemPage {
+  /*how many Memories point at this page, only changed atomically*/
+  int refs;
+  /*storage, or this page's part of a mapped file*/
+  int* data;
+  MemMap* map;
+  int storage[MEM_PAGE_INTS];
+} MemPage;
+
+struct History;
+
+typedef struct Memory {
+  int size;
+  int page_count;
+  MemPage** pages;
+  /*one word per page, bit i is set once int i of the page has been written
+   * since the last mem dump. Only changed atomically.*/
+  u64* dirty;
+  /*taken to swap a shared page for a private copy*/
+  pthread_mutex_t lock;
+  /*where writes save what they overwrite while time travel is recording,
+   * otherwise NULL*/
+  struct History* history;
+  /*every page in one block followed by MEM_GUARD_BYTES of guard pages, or
+   * NULL for separately allocated pages*/
+  int* flat;
+} Memory;
+
+struct Machine;
+
 typedef struct State {
   int registers[NUM_REGISTERS];
-  int memory[MEM_BYTES];
+  /*points at this thread's GuestThread, so the State copied on every
+   * instruction stays small*/
+  int (*vregisters)[VEC_LANES];
+  /*shared by every guest thread of a run*/
+  Memory* memory;
 
   /* comparison byte, -1 if lt, 0 eq, 1 gt */
   int cmp;
@@ -26,50 +114,449 @@ typedef struct State {
   int pc;
   bool cont;
 
-  Map labels;
-  Map register_labels;
-} State;
+  LabelTable labels;
 
-typedef struct ResultState {
-  int return_val;
-  State state;
-} ResultState;
+  /*the run this state belongs to and its index in machine->threads, the
+   * main thread is 0*/
+  struct Machine* machine;
+  int tid;
+} State;
 
 typedef struct Line {
   s8 tokens[MAX_TOKENS_PER_LINE];
+  /*symbol id of each token with any ':' or [] stripped, or NO_SYMBOL*/
+  int ids[MAX_TOKENS_PER_LINE];
   int len;
 } Line;
 
 typedef struct TokenizedProgram {
   Line* lines;
   int len;
+  /*false if tokenizing stopped early because of a malformed line*/
+  bool ok;
+  /*the copy of the source the tokens point into, and the [xN] tokens made
+   * for register labels, both freed with the lines by
+   * tokenized_program_destroy*/
+  char* text;
+  char* register_text;
+  /*a program loaded from the cache lives in its mapped cache file, text and
+   * lines included, and is unmapped instead*/
+  void* mapping;
+  u64 mapping_len;
 } TokenizedProgram;
 
+/*A slice of the program assembled by one thread. Line numbers inside a chunk
+ * are relative to line_offset.*/
+typedef struct AssembleChunk {
+  s8 source;
+  TokenizedProgram program;
+  int line_offset;
+  LabelTable labels;
+
+  /*Token ids are local to the chunk until they are mapped to global ones.*/
+  Interner symbols;
+  int* global_ids;
+  Line* dest;
+  bool copy_end_line;
+
+  /*.reg declarations found in this chunk, in order, and the index of the
+   * first one in the RegisterLabels of the whole program*/
+  int* reg_decl_lines;
+  int reg_decl_count;
+  int first_reg_decl;
+  /*RegisterLabels index of the alias live for each symbol id, -1 for none*/
+  LabelTable register_labels;
+  struct RegisterLabels* decls;
+} AssembleChunk;
+
+/*An assembled program, ready to run any number of times.*/
+typedef struct Program {
+  TokenizedProgram tokens;
+  LabelTable labels;
+  bool ok;
+} Program;
+
+typedef struct ResultState {
+  int return_val;
+  State state;
+  /*what ran, freed with the rest by result_destroy*/
+  Program program;
+} ResultState;
+
+/*What each .reg declaration in the program points to.*/
+typedef struct RegisterLabels {
+  s8* reg;
+  s8* reg_addr;
+  int* reg_id;
+  int count;
+} RegisterLabels;
+
+/*One guest thread. Each has its own registers, cmp and pc and, unless the run
+ * is deterministic, its own host thread.*/
+typedef struct GuestThread {
+  State state;
+  int vregisters[NUM_VREGISTERS][VEC_LANES];
+  pthread_t handle;
+  int parent;
+  bool started;
+  bool done;
+  bool joined;
+} GuestThread;
+
+/*Ways of running a program. tick parses each line every time it runs it,
+ * decoded parses every line once before the run. They have to behave exactly
+ * the same, --diff-engines checks that.*/
+typedef enum { ENGINE_TICK, ENGINE_DECODED } Engine;
+
+struct Decoded;
+struct CostModel;
+struct CacheSim;
+struct BranchPredictor;
+
+/*Everything the guest threads of one run share.*/
+typedef struct Machine {
+  TokenizedProgram program;
+  Engine engine;
+  /*one per line, plus one past the end, when the engine is decoded*/
+  struct Decoded* decoded;
+  /*machine_destroy frees decoded, it wasn't handed in*/
+  bool owns_decoded;
+  /*machine_destroy frees the main thread's memory, machine_start made it*/
+  bool owns_memory;
+  GuestThread threads[MAX_GUEST_THREADS];
+  int thread_count;
+  /*run every guest thread on the calling host thread, one instruction each in
+   * turn, so runs are repeatable*/
+  bool deterministic;
+  /*print each line as it runs*/
+  bool trace;
+  /*mem prints only the ranges written since the last dump*/
+  bool compact_mem;
+  /*where in and read take words from, and out and write send them. NULL
+   * guest_out means the emulator's own output*/
+  FILE* guest_in;
+  FILE* guest_out;
+  /*the time travel log turns are recorded into, or NULL*/
+  struct History* history;
+  /*memory is guarded, ldr and str run without bounds checks*/
+  bool guard_mem;
+  /*the decoded engine runs the loops find_idioms recognised as one native
+   * operation each*/
+  bool idioms;
+  /*lines run by guest threads on host threads of their own, added as each
+   * finishes. Only changed atomically*/
+  u64 instructions;
+  pthread_mutex_t lock;
+  /*what --cost-model prices the run with, or NULL. While it is set each line
+   * run is counted in line_runs and each jump it makes in line_taken, one
+   * count per line of the program*/
+  const struct CostModel* costs;
+  u64* line_runs;
+  u64* line_taken;
+  /*the data cache --cache-sim feeds every ldr and str to, or NULL*/
+  struct CacheSim* cache_sim;
+  /*the predictor --bpred-sim feeds every conditional branch to, or NULL*/
+  struct BranchPredictor* bpred;
+} Machine;
+
+/*Where a host thread running guest code on guarded memory goes back to when
+ * a guest access faults. Thread local, like the signal that lands in it.*/
+typedef struct GuardFrame {
+  sigjmp_buf env;
+  /*the memory being run on, NULL outside guarded runs*/
+  int* base;
+  /*the thread as it was before the step that faulted*/
+  State state;
+  /*the guest address that faulted*/
+  int addr;
+} GuardFrame;
+
+extern __thread GuardFrame guard_frame;
+extern pthread_once_t guard_once;
+/*whoever handled SIGSEGV before us, for faults that aren't ours*/
+extern struct sigaction guard_previous;
+
+/*Time travel. While a History is attached the machine runs deterministically
+ * and each turn leaves behind what it takes to undo it: a StepRecord for every
+ * thread it stepped, with the pc, cmp and flags the thread had, and an
+ * UndoEntry for every register, vector lane and memory int the step changed,
+ * with the old value. Both logs are rings of a fixed size, the oldest turns are
+ * dropped once they fill.
+ *
+ * Every so often a full Snapshot is kept as well, to reach turns the logs no
+ * longer hold by replaying forward from one. When the snapshots fill up every
+ * other one is dropped and they're taken half as often, so they always reach
+ * back to turn 0.
+ *
+ * Guest input and output aren't recorded. Running forward again, replays
+ * included, reads new input and prints again.*/
+#define HISTORY_ENTRIES (1 << 20)
+#define HISTORY_SNAPSHOTS 16
+#define HISTORY_SNAPSHOT_EVERY 1024
+
+/*UndoEntry.where for a register and for a vector lane, reg * VEC_LANES +
+ * lane. Memory addresses are where they are. Each is its own inverse.*/
+#define UNDO_REG(i) (-1 - (i))
+#define UNDO_VREG(i) (-1 - NUM_REGISTERS - (i))
+
+typedef struct UndoEntry {
+  int where;
+  int old;
+} UndoEntry;
+
+typedef struct StepRecord {
+  i64 turn;
+  int tid;
+  /*the thread as it was before the step*/
+  int pc;
+  int cmp;
+  bool cont;
+  bool done;
+  int thread_count;
+  /*its UndoEntries run from here to the next step's first*/
+  i64 first_entry;
+} StepRecord;
+
+typedef struct Snapshot {
+  /*the machine before turn ran*/
+  i64 turn;
+  int thread_count;
+  GuestThread* threads;
+  int* memory;
+} Snapshot;
+
+typedef struct History {
+  /*capacity of both rings, heads and tails count up forever*/
+  i64 cap;
+  UndoEntry* entries;
+  i64 entries_head;
+  StepRecord* steps;
+  i64 steps_head;
+  i64 steps_tail;
+
+  Snapshot* snapshots;
+  int snapshot_count;
+  int snapshot_cap;
+  int snapshot_every;
+
+  /*turns run since recording started, and the earliest turn the logs can
+   * still undo back to*/
+  i64 turn;
+  i64 floor;
+  /*registers of the thread being stepped, from before the step*/
+  int registers[NUM_REGISTERS];
+} History;
+
+typedef enum {
+  REWIND_NONE,
+  REWIND_TURNS,
+  REWIND_LINE,
+  REWIND_WRITE
+} Rewind;
+
+/*The instruction set, one row per instruction:
+ *   X(cmd, name, mnemonic, kind, semantics, arg count, 4 arg types,
+ *     docs section, docs)
+ * The CMD enum, identify_cmd, cmd_validations, print_docs and the handlers
+ * that run each instruction are all generated from it.
+ *
+ * kind says what semantics is and how the handlers are made:
+ *   ALU: x = semantics(a, b), one handler per register/constant shape of a, b
+ *   MAC: x = semantics(a, b, c), likewise
+ *   MOVE: x = a, likewise
+ *   COMPARE: the cmp byte = semantics(a, b), likewise
+ *   OTHER: an expression run with s, args and line in scope, one handler
+ * An arg count of -1 means the instruction ignores its arguments. Only the
+ * first 3 characters of a mnemonic are matched. docs follow the mnemonic in
+ * --docs, and rows in DOC_NONE are left out.*/
+#define OARM_INSTRUCTIONS(X)                                                  \
+  X(REG, reg, "reg", OTHER, log_registers(s), -1, REGISTER, REGISTER,         \
+    REGISTER, REGISTER, DOC_DEBUGGING, " - print all registers")              \
+  X(MEM, mem, "mem", OTHER, log_mem(s), -1, REGISTER, REGISTER, REGISTER,     \
+    REGISTER, DOC_DEBUGGING,                                                  \
+    " - print all memory, or with --mem=changes only what was written "       \
+    "since the last mem")                                                     \
+  X(RPC, rpc, "rpc", OTHER, (out_printf("pc: %i\n", s.pc)), -1, REGISTER,     \
+    REGISTER, REGISTER, REGISTER, DOC_DEBUGGING,                              \
+    " - print the program counter")                                           \
+  X(RCB, rcb, "rcb", OTHER, (out_printf("cmp: %i\n", s.cmp)), -1, REGISTER,   \
+    REGISTER, REGISTER, REGISTER, DOC_DEBUGGING,                              \
+    " - print the comparison byte")                                           \
+  X(MOV, mov, "mov", MOVE, 0, 2, REGISTER, REGISTER_OR_CONSTANT, REGISTER,    \
+    REGISTER, DOC_MEMORY,                                                     \
+    " - move a constant or register value to a register ex: \'mov x0, "       \
+    "x0, #1\'")                                                               \
+  X(LDR, ldr, "ldr", OTHER, (s = ldr(s, *args)), 2, REGISTER, ADDRESS,        \
+    REGISTER, REGISTER, DOC_MEMORY,                                           \
+    " - load value at memory address into register ex: \'ldr x0, [#1]\'")     \
+  X(STR, str, "str", OTHER, (s = str(s, *args)), 2, REGISTER, ADDRESS,        \
+    REGISTER, REGISTER, DOC_MEMORY,                                           \
+    " - store the value from register into memory ex: \'str x0, [#1]\'")      \
+  X(ADD, add, "add", ALU, add_wrap, 3, REGISTER, REGISTER_OR_CONSTANT,        \
+    REGISTER_OR_CONSTANT, REGISTER, DOC_ARITHMETIC,                           \
+    " - add two register or constant values and store in register ex: "       \
+    "\'add x0, x0, #1\' increments x0 by 1")                                  \
+  X(SUB, sub, "sub", ALU, sub_wrap, 3, REGISTER, REGISTER_OR_CONSTANT,        \
+    REGISTER_OR_CONSTANT, REGISTER, DOC_ARITHMETIC, " - subtract")            \
+  X(LSL, lsl, "lsl", ALU, shift_left, 3, REGISTER, REGISTER_OR_CONSTANT,      \
+    REGISTER_OR_CONSTANT, REGISTER, DOC_ARITHMETIC,                           \
+    " - bitwise shift left ex: \'lsl x0, x0, #1\' shifts the value in x0 "    \
+    "left 1")                                                                 \
+  X(LSR, lsr, "lsr", ALU, shift_right, 3, REGISTER, REGISTER_OR_CONSTANT,     \
+    REGISTER_OR_CONSTANT, REGISTER, DOC_ARITHMETIC,                           \
+    " - bitwise shift right")                                                 \
+  X(MUL, mul, "mul", ALU, mul_wrap, 3, REGISTER, REGISTER_OR_CONSTANT,        \
+    REGISTER_OR_CONSTANT, REGISTER, DOC_ARITHMETIC,                           \
+    " - multiply, wrapping on overflow ex: \'mul x0, x1, #3\'")               \
+  X(SDIV, sdiv, "sdiv", ALU, sdiv_defined, 3, REGISTER, REGISTER_OR_CONSTANT, \
+    REGISTER_OR_CONSTANT, REGISTER, DOC_ARITHMETIC,                           \
+    " - signed divide, rounds toward zero, dividing by zero gives 0")         \
+  X(UDIV, udiv, "udiv", ALU, udiv_defined, 3, REGISTER, REGISTER_OR_CONSTANT, \
+    REGISTER_OR_CONSTANT, REGISTER, DOC_ARITHMETIC,                           \
+    " - unsigned divide, dividing by zero gives 0")                           \
+  X(MOD, mod, "mod", ALU, mod_defined, 3, REGISTER, REGISTER_OR_CONSTANT,     \
+    REGISTER_OR_CONSTANT, REGISTER, DOC_ARITHMETIC,                           \
+    " - signed remainder, has the sign of the first value, mod by zero "      \
+    "gives the first value")                                                  \
+  X(MADD, madd, "madd", MAC, madd_wrap, 4, REGISTER, REGISTER_OR_CONSTANT,    \
+    REGISTER_OR_CONSTANT, REGISTER_OR_CONSTANT, DOC_ARITHMETIC,               \
+    " - multiply then add ex: \'madd x0, x1, x2, x3\' sets x0 to x3 + "       \
+    "x1 * x2")                                                                \
+  X(MSUB, msub, "msub", MAC, msub_wrap, 4, REGISTER, REGISTER_OR_CONSTANT,    \
+    REGISTER_OR_CONSTANT, REGISTER_OR_CONSTANT, DOC_ARITHMETIC,               \
+    " - multiply then subtract ex: \'msub x0, x1, x2, x3\' sets x0 to x3 "    \
+    "- x1 * x2")                                                              \
+  X(CMP, cmp, "cmp", COMPARE, compare_ints, 2, REGISTER_OR_CONSTANT,          \
+    REGISTER_OR_CONSTANT, REGISTER, REGISTER, DOC_BRANCHES,                   \
+    " - compare two register or constant values, sets the sign byte to "      \
+    "-1, 0, or 1 ex: \'cmp x0, #1\'")                                         \
+  X(LABEL_DECL, label_decl, "", OTHER, (void)0, -1, REGISTER, REGISTER,       \
+    REGISTER, REGISTER, DOC_BRANCHES,                                         \
+    "<label name>: - labels are arbitrary strings with a colon ex: "          \
+    "\'exit:\' declares the exit label")                                      \
+  X(BRANCH, b, "b", OTHER, (s = branch(s, *line, *args, BRANCH)), 1,          \
+    LABEL_ARG, REGISTER, REGISTER, REGISTER, DOC_BRANCHES,                    \
+    " - branch (jump) to the label specified ex: \'b exit\' jumps the exit "  \
+    "label")                                                                  \
+  X(BEQ, beq, "beq", OTHER, (s = branch(s, *line, *args, BEQ)), 1,            \
+    LABEL_ARG, REGISTER, REGISTER, REGISTER, DOC_BRANCHES,                    \
+    " - branch if equal, jumps if the cmp byte is 0 ex: \'beq exit\'")        \
+  X(BNE, bne, "bne", OTHER, (s = branch(s, *line, *args, BNE)), 1,            \
+    LABEL_ARG, REGISTER, REGISTER, REGISTER, DOC_BRANCHES,                    \
+    " - branch if not equal")                                                 \
+  X(BLT, blt, "blt", OTHER, (s = branch(s, *line, *args, BLT)), 1,            \
+    LABEL_ARG, REGISTER, REGISTER, REGISTER, DOC_BRANCHES,                    \
+    " - branch if less than")                                                 \
+  X(BLE, ble, "ble", OTHER, (s = branch(s, *line, *args, BLE)), 1,            \
+    LABEL_ARG, REGISTER, REGISTER, REGISTER, DOC_BRANCHES,                    \
+    " - branch if less than or equal")                                        \
+  X(BGT, bgt, "bgt", OTHER, (s = branch(s, *line, *args, BGT)), 1,            \
+    LABEL_ARG, REGISTER, REGISTER, REGISTER, DOC_BRANCHES,                    \
+    " - branch if greater than")                                              \
+  X(BGE, bge, "bge", OTHER, (s = branch(s, *line, *args, BGE)), 1,            \
+    LABEL_ARG, REGISTER, REGISTER, REGISTER, DOC_BRANCHES,                    \
+    " - branch if greater than or equal")                                     \
+  X(RET, ret, "ret", OTHER, (s.cont = false), -1, REGISTER, REGISTER,         \
+    REGISTER, REGISTER, DOC_BRANCHES,                                         \
+    " - stop, ends the thread it runs on")                                    \
+  X(FILL, fill, "fill", OTHER, (s = fill(s, *args)), 3, ADDRESS,              \
+    REGISTER_OR_CONSTANT, REGISTER_OR_CONSTANT, REGISTER, DOC_BULK_MEMORY,    \
+    " - set a run of memory to one value ex: \'fill [x1], #0, x2\' sets x2 "  \
+    "ints starting at the address in x1 to 0")                                \
+  X(CPY, cpy, "cpy", OTHER, (s = cpy(s, *args)), 3, ADDRESS, ADDRESS,         \
+    REGISTER_OR_CONSTANT, REGISTER, DOC_BULK_MEMORY,                          \
+    " - copy a run of memory, the runs may overlap ex: \'cpy [x1], [x3], "    \
+    "#16\' copies 16 ints from the address in x3 to the address in x1")       \
+  X(VLD, vld, "vld", OTHER, (s = vld_or_vst(s, *args, true)), 2, VREGISTER,   \
+    ADDRESS, REGISTER, REGISTER, DOC_VECTORS,                                 \
+    " - load 8 ints starting at a memory address ex: \'vld v0, [x1]\'")       \
+  X(VST, vst, "vst", OTHER, (s = vld_or_vst(s, *args, false)), 2, VREGISTER,  \
+    ADDRESS, REGISTER, REGISTER, DOC_VECTORS,                                 \
+    " - store 8 ints starting at a memory address ex: \'vst v0, [#8]\'")      \
+  X(VADD, vadd, "vadd", OTHER, (s = vector_op(s, *args, VADD)), 3,            \
+    VREGISTER, VREGISTER, VREGISTER, REGISTER, DOC_VECTORS,                   \
+    " - add lane by lane ex: \'vadd v0, v1, v2\' sets each lane of v0 to "    \
+    "v1 + v2")                                                                \
+  X(VSUB, vsub, "vsub", OTHER, (s = vector_op(s, *args, VSUB)), 3,            \
+    VREGISTER, VREGISTER, VREGISTER, REGISTER, DOC_VECTORS,                   \
+    " - subtract lane by lane")                                               \
+  X(VMIN, vmin, "vmin", OTHER, (s = vector_op(s, *args, VMIN)), 3,            \
+    VREGISTER, VREGISTER, VREGISTER, REGISTER, DOC_VECTORS,                   \
+    " - minimum lane by lane")                                                \
+  X(VMAX, vmax, "vmax", OTHER, (s = vector_op(s, *args, VMAX)), 3,            \
+    VREGISTER, VREGISTER, VREGISTER, REGISTER, DOC_VECTORS,                   \
+    " - maximum lane by lane")                                                \
+  X(VCMP, vcmp, "vcmp", OTHER, (s = vector_op(s, *args, VCMP)), 3,            \
+    VREGISTER, VREGISTER, VREGISTER, REGISTER, DOC_VECTORS,                   \
+    " - compare lane by lane, each lane is set to -1, 0 or 1 like the cmp "   \
+    "byte")                                                                   \
+  X(IN, in, "in", OTHER, (s = in(s, *args)), 1, REGISTER, REGISTER,           \
+    REGISTER, REGISTER, DOC_IO,                                               \
+    " - read the next word into a register, the cmp byte is 0 if there was "  \
+    "one and 1 at the end of the input ex: \'in x0\' then \'bne done\'")      \
+  X(OUT, out, "out", OTHER, (s = out(s, *args)), 1, REGISTER_OR_CONSTANT,     \
+    REGISTER, REGISTER, REGISTER, DOC_IO,                                     \
+    " - write a register or constant ex: \'out x0\'")                         \
+  X(READ, read, "read", OTHER, (s = read_words(s, *args)), 3, REGISTER,       \
+    ADDRESS, REGISTER_OR_CONSTANT, REGISTER, DOC_IO,                          \
+    " - read up to a count of words into memory, the register gets how many " \
+    "arrived ex: \'read x0, [x1], #64\'")                                     \
+  X(WRITE, write, "write", OTHER, (s = write_words(s, *args)), 2, ADDRESS,    \
+    REGISTER_OR_CONSTANT, REGISTER, REGISTER, DOC_IO,                         \
+    " - write a count of words from memory ex: \'write [x1], x0\'")           \
+  X(SPAWN, spawn, "spawn", OTHER, (s = spawn(s, *line, *args)), 1,            \
+    LABEL_ARG, REGISTER, REGISTER, REGISTER, DOC_THREADS,                     \
+    " - start a guest thread at a label, it gets a copy of the registers "    \
+    "and stops at ret ex: \'spawn worker\'")                                  \
+  X(JOIN, join, "join", OTHER, (s = join(s)), 0, REGISTER, REGISTER,          \
+    REGISTER, REGISTER, DOC_THREADS,                                          \
+    " - wait for every thread this thread spawned to finish")                 \
+  X(LDADD, ldadd, "ldadd", OTHER, (s = ldadd(s, *args)), 3, REGISTER,         \
+    REGISTER, ADDRESS, REGISTER, DOC_THREADS,                                 \
+    " - atomically add a register to memory and load the old value ex: "      \
+    "\'ldadd x1, x2, [x3]\' adds x1 to [x3], x2 gets the old value")          \
+  X(CAS, cas, "cas", OTHER, (s = cas(s, *args)), 3, REGISTER, REGISTER,       \
+    ADDRESS, REGISTER, DOC_THREADS,                                           \
+    " - compare and swap ex: \'cas x1, x2, [x3]\' stores x2 at [x3] if it "   \
+    "holds x1, x1 always gets the old value")                                 \
+  X(REG_LABEL, reg_label, ".reg", OTHER, (void)0, -1, REGISTER, REGISTER,     \
+    REGISTER, REGISTER, DOC_REGISTER_LABELS,                                  \
+    " <label_name> <register> - give pretty name to register ex: \'.reg "     \
+    "counter x0\' lets you use the word \'counter\' in place of \'x0\'")      \
+  X(NL, nl, "", OTHER, (s.cont = false), -1, REGISTER, REGISTER, REGISTER,    \
+    REGISTER, DOC_NONE, "")                                                   \
+  X(UNKNOWN, unknown, "", OTHER, log_unknown_cmd(*line), -1, REGISTER,        \
+    REGISTER, REGISTER, REGISTER, DOC_NONE, "")
+
+/*--docs sections in the order they're printed, with an intro for each.*/
+#define OARM_DOC_SECTIONS(X)                                               \
+  X(DOC_NONE, "", "")                                                      \
+  X(DOC_DEBUGGING, "Debugging", "")                                        \
+  X(DOC_MEMORY, "Registers + Memory", "")                                  \
+  X(DOC_ARITHMETIC, "Arithmetic", "")                                      \
+  X(DOC_BRANCHES, "Branches", "")                                          \
+  X(DOC_BULK_MEMORY, "Bulk memory", "")                                    \
+  X(DOC_VECTORS, "Vectors",                                                \
+    "  v0 to v7 are vector registers of 8 ints each\n")                    \
+  X(DOC_IO, "Input and output",                                            \
+    "  words are raw 4 byte ints, read from stdin or --in and written to " \
+    "stdout or --out\n")                                                   \
+  X(DOC_THREADS, "Threads", "")                                            \
+  X(DOC_REGISTER_LABELS, "Register Labels", "")
+
 typedef enum {
-  ADD,
-  LDR,
-  LSL,
-  LSR,
-  MEM,
-  MOV,
-  REG,
-  RET,
-  STR,
-  SUB,
-  NL,
-  LABEL_DECL,
-  BRANCH,
-  BLE,
-  BGE,
-  BLT,
-  BGT,
-  BEQ,
-  BNE,
-  RPC,
-  CMP,
-  RCB,
-  REG_LABEL,
-  UNKNOWN
+#define DOC_SECTION_ENUM(section, title, intro) section,
+  OARM_DOC_SECTIONS(DOC_SECTION_ENUM)
+#undef DOC_SECTION_ENUM
+  DOC_SECTION_COUNT
+} DocSection;
+
+typedef enum {
+#define CMD_ENUM(cmd, name, mnemonic, kind, semantics, count, t1, t2, t3, \
+                 t4, section, docs)                                       \
+  cmd,
+  OARM_INSTRUCTIONS(CMD_ENUM)
+#undef CMD_ENUM
 } CMD;
 typedef int Register;
 
@@ -84,7 +571,8 @@ typedef enum {
   CONSTANT,
   REGISTER,
   REGISTER_OR_CONSTANT,
-  LABEL_ARG
+  LABEL_ARG,
+  VREGISTER
 } ArgType;
 
 typedef struct Arg {
@@ -93,16 +581,382 @@ typedef struct Arg {
     Register reg;
     Address addr;
     int constant;
-    s8 label;
+    int label;
   };
 } Arg;
 
 typedef struct Args {
   int count;
-  Arg args[3];
+  Arg args[MAX_TOKENS_PER_LINE - 1];
   bool is_valid;
 } Args;
 
+/*Lane wise kernels behind the vector instructions, picked from the CPU
+ * features like s8_kernels. Each works on VEC_LANES ints.*/
+typedef void (*VecOp)(int* dest, const int* a, const int* b);
+typedef struct VecKernels {
+  const char* name;
+  VecOp add;
+  VecOp sub;
+  VecOp min;
+  VecOp max;
+  VecOp cmp;
+} VecKernels;
+
+extern VecKernels vec_kernels;
+
+/*Everything the emulator prints is collected here and written out in large
+ * chunks: when the buffer fills, when a guest thread stops and when entry
+ * returns.*/
+#define OUT_BUFFER_BYTES (1 << 16)
+/*stdio buffer for the files guest programs read and write*/
+#define GUEST_IO_BYTES (1 << 16)
+
+typedef struct Output {
+  char buf[OUT_BUFFER_BYTES];
+  int len;
+  pthread_mutex_t lock;
+} Output;
+
+extern Output output;
+
+/*The sampling profiler. Every host thread running guest code publishes the
+ * line it is on in profile_pc, and a SIGPROF timer counts a hit for whatever
+ * line the interrupted thread was on. Counts per line keep memory fixed however
+ * long the run.*/
+#define PROFILE_HZ 997
+
+typedef struct Profile {
+  /*hits per line, only changed atomically*/
+  u64* hits;
+  int len;
+  /*samples that landed outside guest code, assembling or printing say*/
+  u64 missed;
+} Profile;
+
+extern Profile profile;
+extern __thread int profile_pc;
+/*Lines run by guest code on this host thread, counted by step. A fused idiom
+ * counts the lines it stands in for.*/
+extern __thread u64 guest_instructions;
+
+/*The phases --timings splits a run into, with their names in its output.*/
+#define OARM_PHASES(X)                                        \
+  X(PHASE_LOAD, "load")                                       \
+  X(PHASE_TOKENIZE, "tokenize")                               \
+  X(PHASE_RESOLVE_LABELS, "resolve_labels")                   \
+  X(PHASE_RESOLVE_REGISTER_LABELS, "resolve_register_labels") \
+  X(PHASE_CACHE, "cache")                                     \
+  X(PHASE_SETUP, "setup")                                     \
+  X(PHASE_RUN, "run")
+
+typedef enum {
+#define PHASE_ENUM(phase, name) phase,
+  OARM_PHASES(PHASE_ENUM)
+#undef PHASE_ENUM
+  PHASE_COUNT
+} Phase;
+
+typedef struct Timings {
+  /*monotonic clock time and growth in heap bytes in use, per phase*/
+  double seconds[PHASE_COUNT];
+  i64 bytes[PHASE_COUNT];
+  /*from alloc_stats, which only counts while enabled, per phase*/
+  i64 allocs[PHASE_COUNT];
+  i64 alloc_bytes[PHASE_COUNT];
+  i64 frees[PHASE_COUNT];
+  i64 peak[PHASE_COUNT];
+  /*lines the guest ran in the run phase*/
+  u64 instructions;
+  /*where the phase being timed started*/
+  double started;
+  i64 heap_started;
+  AllocStats allocs_started;
+} Timings;
+
+/*Where the front end allocates, for --alloc-report. Each site gets an AllocFn
+ * that counts what it hands out under that site.*/
+#define OARM_ALLOC_SITES(X)                                           \
+  X(ALLOC_SOURCE, alloc_source, "source")                             \
+  X(ALLOC_TEXT, alloc_text, "text")                                   \
+  X(ALLOC_LINES, alloc_lines, "lines")                                \
+  X(ALLOC_SYMBOLS, alloc_symbols, "symbols")                          \
+  X(ALLOC_LABELS, alloc_labels, "labels")                             \
+  X(ALLOC_REGISTER_LABELS, alloc_register_labels, "register_labels") \
+  X(ALLOC_SCRATCH, alloc_scratch, "scratch")                          \
+  X(ALLOC_DECODED, alloc_decoded, "decoded")
+
+typedef enum {
+#define ALLOC_SITE_ENUM(site, fn, name) site,
+  OARM_ALLOC_SITES(ALLOC_SITE_ENUM)
+#undef ALLOC_SITE_ENUM
+  ALLOC_SITE_COUNT
+} AllocSite;
+
+#define ALLOC_SITE_PROTO(site, fn, name) void* fn(u64 size);
+OARM_ALLOC_SITES(ALLOC_SITE_PROTO)
+#undef ALLOC_SITE_PROTO
+
+/*--cache keeps assembled programs on disk, decoded and with their labels
+ * resolved, in files named after a hash of the source and the emulator
+ * version. A file is the header then each section at an 8 byte boundary: the
+ * len + 1 lines, len + 1 decoded lines, the idioms, the symbol names, the
+ * label line of each symbol and the text. Pointers in the lines and decoded
+ * lines are stored as offsets, into the text or 1 + an index into the idioms,
+ * and symbol ids as indexes into the names. Loading maps the file privately
+ * and puts the pointers and global symbol ids back in place.*/
+#define PROGRAM_CACHE_MAGIC 0x6f616361
+#define OARM_VERSION "0.1"
+
+typedef struct CacheHeader {
+  u32 magic;
+  /*cache_version_key of the emulator that wrote it*/
+  u64 version;
+  /*cache_key of the source*/
+  u64 key;
+  u64 file_len;
+  int source_len;
+  int line_count;
+  int idiom_count;
+  int symbol_count;
+  u64 text_len;
+  /*where each section starts*/
+  u64 lines_at;
+  u64 decoded_at;
+  u64 idioms_at;
+  u64 symbols_at;
+  u64 labels_at;
+  u64 text_at;
+} CacheHeader;
+
+/*Runs one instruction whose args have passed cmd_validations.*/
+typedef State (*Handler)(State s, const Args* args, const Line* line);
+#define HANDLER(fn) State fn(State s, const Args* args, const Line* line)
+
+/*The handlers for each instruction, named after the shape of the operands
+ * they're made for, r for a register and i for a constant. Each
+ * name##_shapes lists them by the bits of operand_shape.*/
+#define DECLARE_ALU(name) \
+  HANDLER(name##_rr);     \
+  HANDLER(name##_ir);     \
+  HANDLER(name##_ri);     \
+  HANDLER(name##_ii);
+#define DECLARE_MAC(name) \
+  HANDLER(name##_rrr);    \
+  HANDLER(name##_irr);    \
+  HANDLER(name##_rir);    \
+  HANDLER(name##_iir);    \
+  HANDLER(name##_rri);    \
+  HANDLER(name##_iri);    \
+  HANDLER(name##_rii);    \
+  HANDLER(name##_iii);
+#define DECLARE_MOVE(name) \
+  HANDLER(name##_r);       \
+  HANDLER(name##_i);
+#define DECLARE_COMPARE(name) DECLARE_ALU(name)
+#define DECLARE_OTHER(name) HANDLER(exec_##name);
+#define DECLARE_HANDLERS(cmd, name, mnemonic, kind, semantics, count, t1, \
+                         t2, t3, t4, section, docs)                       \
+  DECLARE_##kind(name) extern const Handler name##_shapes[];
+OARM_INSTRUCTIONS(DECLARE_HANDLERS)
+#undef DECLARE_HANDLERS
+
+/*identify_cmd looks the first 3 characters of a mnemonic up in an open
+ * addressed table, filled from the instruction table on first use.*/
+#define CMD_KEY_SLOTS 128
+
+typedef struct CmdKey {
+  /*0 for an empty slot*/
+  int key;
+  CMD cmd;
+} CmdKey;
+
+extern CmdKey cmd_keys[CMD_KEY_SLOTS];
+extern pthread_once_t cmd_keys_once;
+
+/*Loops the decoded engine runs as one native operation rather than line by
+ * line. find_idioms looks for a label, one of these bodies with its loads and
+ * stores through registers the loop steps by a constant, the adds or subs
+ * that step them, and a cmp of one of them with a bound the loop doesn't
+ * change:
+ *
+ *   fill      str v, [a]
+ *   sum       ldr t, [a]; add acc, acc, t
+ *   copy      ldr t, [a]; str t, [b]
+ *   min scan  ldr t, [a]; cmp t, min; bge skip; mov min, t; mov at, a; skip:
+ *
+ * The test either closes the loop, a cmp and a branch back to the label after
+ * the body, or comes first, a cmp and a branch out before the body with a b
+ * back to the label after it. A min scan's skip branch can be any condition,
+ * so a max scan is one too.
+ *
+ * The loop is fused when its label line runs and the result is sure to be
+ * what the lines would have left in registers, memory and cmp: only one guest
+ * thread, no history being recorded and every address in bounds. Otherwise it
+ * runs line by line as always, and reports any error at the line it happens.*/
+typedef enum {
+  IDIOM_FILL,
+  IDIOM_SUM,
+  IDIOM_COPY,
+  IDIOM_MIN_SCAN
+} IdiomKind;
+
+typedef struct Idiom {
+  IdiomKind kind;
+  /*the label line and the loop's last line*/
+  int first;
+  int last;
+  /*the line the loop leaves from, pc is set to it once the loop is done*/
+  int exit;
+  /*the test comes before the body and its branch leaves the loop, rather
+   * than coming after it and closing the loop*/
+  bool test_first;
+  CMD test;
+  Register index;
+  Arg bound;
+  /*cmp bound, index rather than cmp index, bound*/
+  bool bound_first;
+  /*added to each register every trip, 0 for the ones the loop doesn't step*/
+  int steps[NUM_REGISTERS];
+  /*the address registers loaded from and stored to*/
+  Register load;
+  Register store;
+  /*what a fill stores, or where the others load to*/
+  Register value;
+  /*the sum, or the min scan's smallest value and its address*/
+  Register acc;
+  Register at;
+  /*the branch that skips over taking a new min*/
+  CMD keep;
+  /*lines that branch jumps over*/
+  int skipped;
+} Idiom;
+
+/*A line parsed and checked ahead of time for the decoded engine.*/
+typedef struct Decoded {
+  CMD cmd;
+  Args args;
+  /*the handler for this line's operand shape, when ok*/
+  Handler run;
+  /*false for lines with errors, they run through tick so the errors are
+   * reported the same way*/
+  bool ok;
+  /*the loop this label starts, when it is one of the idioms, otherwise NULL*/
+  Idiom* idiom;
+} Decoded;
+
+/*How a --diff-engines run ended.*/
+typedef struct DiffResult {
+  bool diverged;
+  /*turns run on each engine, a turn is one instruction per live thread*/
+  int steps;
+} DiffResult;
+
+/*How many lines, blocks and the like the reports after a run list, the ones
+ * costing the most.*/
+#define REPORT_ROWS 20
+
+/*The table --cost-model prices a run with, to estimate the cycles it would
+ * take on a real core. A line costs cycles[cmd] each time it runs, memory
+ * more if it reads or writes guest memory and branch_taken more each time it
+ * jumps.*/
+
+typedef struct CostModel {
+  int cycles[UNKNOWN + 1];
+  int branch_taken;
+  int memory;
+} CostModel;
+
+/*The data cache --cache-sim runs every ldr and str address through, a first
+ * level and optionally a second one the first level's misses go on to. Guest
+ * addresses are ints, CACHE_WORD_BYTES each, so a line of 64 bytes holds 16 of
+ * them. Stores allocate lines like loads, and lines are only ever evicted, so
+ * hits and misses are all that is counted.*/
+#define CACHE_WORD_BYTES 4
+#define CACHE_MAX_LEVELS 2
+/*the first level of a Cortex-A53*/
+#define CACHE_SIM_DEFAULT "32768,64,4,lru"
+
+#define OARM_CACHE_POLICIES(X) \
+  X(CACHE_LRU, "lru")           \
+  X(CACHE_FIFO, "fifo")         \
+  X(CACHE_RANDOM, "random")
+
+typedef enum {
+#define CACHE_POLICY_ENUM(policy, name) policy,
+  OARM_CACHE_POLICIES(CACHE_POLICY_ENUM)
+#undef CACHE_POLICY_ENUM
+  CACHE_POLICY_COUNT
+} CachePolicy;
+
+typedef struct CacheLevel {
+  /*bytes in all, bytes per line and lines per set*/
+  int size;
+  int line;
+  int ways;
+  CachePolicy policy;
+  int sets;
+  /*the line address in each way of each set, way by way, -1 when empty*/
+  i64* tags;
+  /*when each way was last used, or for fifo filled*/
+  u64* stamps;
+  u64 clock;
+  u32 random;
+  u64 hits;
+  u64 misses;
+} CacheLevel;
+
+typedef struct CacheSim {
+  CacheLevel levels[CACHE_MAX_LEVELS];
+  int level_count;
+  u64 loads;
+  u64 stores;
+  /*per line of the program, accesses and misses in each level*/
+  u64* line_accesses;
+  u64* line_misses[CACHE_MAX_LEVELS];
+  int len;
+  /*taken when guest threads run on host threads of their own*/
+  pthread_mutex_t lock;
+} CacheSim;
+
+/*The branch predictor --bpred-sim runs every conditional branch through.
+ * static guesses a branch back to an earlier line is taken and one forward
+ * isn't, like a core with no history. bimodal keeps a 2 bit counter per
+ * branch, picked by the line's low bits, and gshare picks the counter with
+ * the line xored with the last outcomes of every branch. Counters start
+ * weakly taken.*/
+#define BPRED_BITS 12
+#define BPRED_MAX_BITS 24
+
+#define OARM_PREDICTORS(X)          \
+  X(PREDICT_STATIC, "static")       \
+  X(PREDICT_BIMODAL, "bimodal")     \
+  X(PREDICT_GSHARE, "gshare")
+
+typedef enum {
+#define PREDICTOR_ENUM(predictor, name) predictor,
+  OARM_PREDICTORS(PREDICTOR_ENUM)
+#undef PREDICTOR_ENUM
+  PREDICTOR_COUNT
+} Predictor;
+
+typedef struct BranchPredictor {
+  Predictor kind;
+  /*1 << bits counters, and as many outcomes of history for gshare*/
+  int bits;
+  u8* counters;
+  u32 history;
+  u64 branches;
+  u64 mispredicts;
+  /*per line of the program, runs, jumps and wrong guesses*/
+  u64* line_branches;
+  u64* line_taken;
+  u64* line_mispredicts;
+  int len;
+  /*taken when guest threads run on host threads of their own*/
+  pthread_mutex_t lock;
+} BranchPredictor;
+
 typedef struct ArgValidation {
   ArgType expected_arg_type;
 } ArgValidation;
@@ -110,34 +964,290 @@ typedef struct ArgValidation {
 typedef struct ArgValidations {
   int expected_arg_count;
   const char* cmd_pretty_str;
-  ArgValidation validations[3];
+  ArgValidation validations[MAX_TOKENS_PER_LINE - 1];
 } ArgValidations;
 
 State tick(State s, Line line);
+State tick_decoded(State s, const Decoded* d, Line line);
+State step(State s);
+bool profile_start(int len, int hz);
+void profile_sample(int sig);
+void profile_stop(void);
+bool profile_write(TokenizedProgram p, const char* path);
+CostModel cost_model_default(void);
+bool cost_model_load(const char* path, CostModel* model);
+CMD cost_model_cmd(const char* text);
+bool cmd_accesses_memory(CMD cmd);
+bool cmd_ends_block(CMD cmd);
+CMD line_cmd(Line line);
+void machine_count_costs(Machine* m, const CostModel* model);
+void cost_count(Machine* m, int pc, int next);
+u64 line_cycles(const Machine* m, int ln);
+void top_rows(const u64* counts, int len, int* top, int rows);
+void cost_report(const Machine* m);
+bool parse_cache_level(s8 value, CacheLevel* c);
+const char* cache_policy_name(CachePolicy policy);
+CacheSim* cache_sim_create(const CacheLevel* levels, int count, int len);
+void cache_sim_destroy(CacheSim* sim);
+bool cache_level_access(CacheLevel* c, int addr);
+void cache_sim_access(Machine* m, int pc, int addr, bool store);
+void cache_sim_report(const CacheSim* sim, TokenizedProgram p);
+bool parse_predictor(s8 name, Predictor* kind);
+const char* predictor_name(Predictor kind);
+BranchPredictor* bpred_create(Predictor kind, int bits, int len);
+void bpred_destroy(BranchPredictor* bp);
+bool bpred_predict(BranchPredictor* bp, int pc, int target, bool taken);
+void bpred_branch(Machine* m, int pc, int target, bool taken);
+void bpred_report(const BranchPredictor* bp, TokenizedProgram p);
+double monotonic_seconds(void);
+i64 heap_in_use(void);
+void timings_begin(Timings* t);
+void timings_end(Timings* t, Phase phase);
+void timings_print(const Timings* t, bool json);
+void alloc_report_print(const Timings* t);
+Decoded decode_line(Line line);
+Decoded* decode_program(TokenizedProgram p);
+void decoded_destroy(Decoded* decoded, TokenizedProgram p);
+void find_idioms(TokenizedProgram p, Decoded* decoded);
+bool match_idiom(TokenizedProgram p,
+                 const Decoded* d,
+                 LabelTable labels,
+                 int first,
+                 Idiom* idiom);
+int match_idiom_body(TokenizedProgram p,
+                     const Decoded* d,
+                     LabelTable labels,
+                     int ln,
+                     Idiom* idiom);
+bool idiom_registers_ok(const Idiom* idiom);
+bool is_line(TokenizedProgram p, const Decoded* d, int ln, CMD cmd);
+bool is_conditional_branch(TokenizedProgram p, const Decoded* d, int ln);
+int next_instruction(TokenizedProgram p, const Decoded* d, int ln);
+bool idiom_trips(const Idiom* idiom, const State* s, int* trips, int* cmp);
+bool idiom_in_bounds(const Idiom* idiom,
+                     const State* s,
+                     Register r,
+                     int trips);
+State run_idiom(State s, const Idiom* idiom, int trips);
+HANDLER(exec_idiom);
+const char* idiom_name(IdiomKind kind);
+void explain_idioms(TokenizedProgram p, const Decoded* decoded);
+void machine_set_engine(Machine* m, Engine engine);
+const char* engine_name(Engine engine);
+bool parse_engine(s8 name, Engine* engine);
+Machine* machine_start(Program p, bool deterministic, Engine engine);
+DiffResult diff_machines(Machine* a, Machine* b, int every, int max_steps);
+bool diff_report(Machine* a, Machine* b, int steps, const int* last_pcs);
+u64 mem_hash(Memory* m);
+bool flag_value(s8 arg, const char* flag, s8* value);
+State execute(State s, const Line* line, CMD cmd, const Args* args);
+Handler select_handler(CMD cmd, const Args* args);
+int operand_shape(const Args* args, int first, int count);
+ArgValidations cmd_validations(CMD cmd);
+ArgValidations arg_validations(const char* cmd_pretty_str,
+                               int expected_arg_count,
+                               ArgType a1,
+                               ArgType a2,
+                               ArgType a3,
+                               ArgType a4);
 CMD identify_cmd(s8 t);
+void cmd_keys_init(void);
+int mnemonic_key(const char* mnemonic);
+u32 cmd_key_slot(int key);
 
 Args parse_args(Line line);
+Args parse_args_report(Line line, bool report);
 ResultInt parse_int(s8 s);
+ResultInt parse_int_report(s8 s, bool report);
+ResultInt parse_int_scalar(s8 s);
+bool is_8_digits(const char* digits);
+u64 parse_8_digits(const char* digits);
 TokenizedProgram tokenize(s8 s);
-Map resolve_labels(TokenizedProgram p);
+TokenizedProgram tokenize_chunk(s8 s, Interner* local);
+s8 symbol_key(s8 token);
+int label_line(LabelTable labels, int id);
+LabelTable label_table_create(AllocFn alloc, int count);
+LabelTable label_table_clone(AllocFn alloc, LabelTable labels);
+void label_table_set(LabelTable* labels, int id, int line);
+u32 label_slot(LabelTable labels, int id);
+/*Taken around every use of the global symbols, so host threads can assemble
+ * at the same time.*/
+extern pthread_mutex_t symbols_lock;
+int register_label_keyword(void);
+s8 symbol_name(int id);
+LabelTable resolve_labels(TokenizedProgram p);
 TokenizedProgram resolve_register_labels(TokenizedProgram p);
 
-State mov(State s, Line line);
-State ldr(State s, Line line);
-State str(State s, Line line);
-State add_or_sub(State s, Line line, bool is_add);
-State branch(State s, Line line, CMD command);
-State lsl_or_lsr(State s, Line line, bool is_left);
-State cmp(State s, Line line);
+Program assemble(s8 source, int jobs);
+Program assemble_timed(s8 source, int jobs, Timings* t);
+void program_destroy(Program p);
+void tokenized_program_destroy(TokenizedProgram p);
+Program assemble_cached(const char* dir,
+                        s8 source,
+                        int jobs,
+                        Timings* t,
+                        Decoded** decoded);
+const char* cache_default_dir(void);
+u64 cache_version_key(void);
+u64 cache_key(s8 source);
+char* cache_path(const char* dir, u64 key, const char* suffix);
+void cache_layout(CacheHeader* h);
+bool cache_load(const char* dir, s8 source, Program* p, Decoded** decoded);
+bool cache_store(const char* dir, s8 source, Program p, const Decoded* d);
+bool make_dirs(const char* dir);
+TokenizedProgram tokenize_parallel(s8 s, int num_threads);
+LabelTable resolve_labels_parallel(TokenizedProgram p, int num_threads);
+TokenizedProgram resolve_register_labels_parallel(TokenizedProgram p,
+                                                  int num_threads);
+int default_assemble_threads(s8 source);
+int split_source(s8 s, int num_chunks, AssembleChunk* chunks);
+int split_lines(TokenizedProgram p, int num_chunks, AssembleChunk* chunks);
+void run_chunks(void* (*worker)(void*), AssembleChunk* chunks, int n);
+void* tokenize_chunk_worker(void* arg);
+void* resolve_labels_chunk_worker(void* arg);
+void* intern_chunk_worker(void* arg);
+void* find_register_label_decls_worker(void* arg);
+void* resolve_register_labels_chunk_worker(void* arg);
+
+State ldr(State s, Args args);
+State str(State s, Args args);
+State branch(State s, Line line, Args args, CMD command);
+bool branch_taken(CMD command, int cmp);
+State spawn(State s, Line line, Args args);
+State join(State s);
+State ldadd(State s, Args args);
+State cas(State s, Args args);
+
+Machine* machine_init(TokenizedProgram program, bool deterministic);
+void machine_destroy(Machine* m);
+State run_thread(State s);
+State run_thread_guarded(State s);
+State step_guarded(State s);
+State guard_stop(GuardFrame* f);
+void guard_install(void);
+void guard_fault(int sig, siginfo_t* info, void* context);
+bool machine_guard_memory(Machine* m);
+Handler guarded_handler(CMD cmd, Handler run);
+HANDLER(exec_ldr_guarded);
+HANDLER(exec_str_guarded);
+void* run_guest_thread(void* arg);
+State run_deterministic(Machine* m);
+bool machine_turn(Machine* m);
+History* history_create(int entries, int snapshots);
+void history_destroy(History* h);
+void history_clear(History* h);
+void machine_record(Machine* m, History* h);
+void history_save(History* h, int where, int old);
+void history_drop_step(History* h);
+void history_begin_step(History* h, Machine* m, int tid);
+void history_end_step(History* h, const State* s);
+void history_snapshot(Machine* m);
+void history_thin_snapshots(History* h);
+void history_restore(Machine* m, const Snapshot* snap);
+void history_undo_step(Machine* m, const StepRecord* r);
+bool history_undo_turn(Machine* m);
+bool history_seek(Machine* m, i64 turn);
+bool history_reverse_continue(Machine* m, int line);
+bool history_find_write(History* h, int addr, StepRecord* found);
+State machine_rewind(Machine* m, Rewind how, int value);
+void vreg_save_undo(State* s, int reg);
+void join_all(Machine* m);
+Memory* mem_create(int size);
+Memory* mem_create_guarded(int size);
+void mem_adopt(Memory* m, MemMap* map, int* ints);
+Memory* mem_fork(Memory* m);
+void mem_destroy(Memory* m);
+void mem_clear(Memory* m);
+void mem_page_release(MemPage* p);
+MemPage* mem_page_new(void);
+bool mem_map_file(Memory* m, const char* path, long offset, bool shared);
+bool parse_mem_file(s8 value, const char** path, long* offset);
+void mem_mark_dirty(Memory* m, int addr, int len);
+void mem_save_undo(Memory* m, int addr, int len);
+int mem_load(Memory* m, int addr);
+int* mem_store_ptr(Memory* m, int addr);
+int* mem_page_for_write(Memory* m, int page);
+int mem_run_len(int addr, int len);
+void mem_read(Memory* m, int addr, int* dest, int len);
+void mem_write(Memory* m, int addr, const int* src, int len);
+void mem_fill(Memory* m, int addr, int val, int len);
+void mem_move(Memory* m, int dest, int src, int len);
+int mem_shared_pages(Memory* m);
+int resolve_address(State* s, Arg a, const char* cmd_pretty_str);
+int resolve_address_range(State* s,
+                          Arg a,
+                          int len,
+                          const char* cmd_pretty_str);
+
+int add_wrap(int a, int b);
+int sub_wrap(int a, int b);
+int shift_left(int a, int b);
+int shift_right(int a, int b);
+int mul_wrap(int a, int b);
+int madd_wrap(int a, int b, int c);
+int msub_wrap(int a, int b, int c);
+int compare_ints(int a, int b);
+int sdiv_defined(int a, int b);
+int udiv_defined(int a, int b);
+int mod_defined(int a, int b);
+State fill(State s, Args args);
+State cpy(State s, Args args);
+State in(State s, Args args);
+State out(State s, Args args);
+State read_words(State s, Args args);
+State write_words(State s, Args args);
+void diff_guest_io(Machine* a, Machine* b);
+void guest_io_flush(Machine* m);
+int resolve_length(State* s, Arg a, const char* cmd_pretty_str);
+bool is_vector_register(s8 t);
+State vld_or_vst(State s, Args args, bool is_load);
+State vector_op(State s, Args args, CMD command);
+void vec_kernels_init(void);
+VecKernels vec_kernels_scalar(void);
+void vec_add_scalar(int* dest, const int* a, const int* b);
+void vec_sub_scalar(int* dest, const int* a, const int* b);
+void vec_min_scalar(int* dest, const int* a, const int* b);
+void vec_max_scalar(int* dest, const int* a, const int* b);
+void vec_cmp_scalar(int* dest, const int* a, const int* b);
+#if OSTD_X86_SIMD
+VecKernels vec_kernels_sse2(void);
+VecKernels vec_kernels_avx2(void);
+void vec_add_sse2(int* dest, const int* a, const int* b);
+void vec_sub_sse2(int* dest, const int* a, const int* b);
+void vec_min_sse2(int* dest, const int* a, const int* b);
+void vec_max_sse2(int* dest, const int* a, const int* b);
+void vec_cmp_sse2(int* dest, const int* a, const int* b);
+void vec_add_avx2(int* dest, const int* a, const int* b);
+void vec_sub_avx2(int* dest, const int* a, const int* b);
+void vec_min_avx2(int* dest, const int* a, const int* b);
+void vec_max_avx2(int* dest, const int* a, const int* b);
+void vec_cmp_avx2(int* dest, const int* a, const int* b);
+#endif
 
 bool validate_args(Args args, ArgValidations validations);
+bool validate_args_report(Args args,
+                          ArgValidations validations,
+                          bool report);
 void log_registers(State s);
 void log_mem(State s);
+void log_mem_changes(State s);
+void out_printf(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+void out_char(char c);
+void out_write(const char* str, int len);
+void out_flush(void);
+void out_flush_locked(void);
 int get_register_or_constant(State s, Arg a);
 void print_help(void);
 void print_docs(void);
+void print_doc_section(DocSection section,
+                       const char* title,
+                       const char* intro);
 void log_tokenized_program(TokenizedProgram p);
 void log_line(Line line);
+void log_line_tokens(Line line);
+void log_unknown_cmd(Line line);
 ResultState entry(int argc, char** argv);
+void result_destroy(ResultState r);
+ResultState run_args(int argc, char** argv);
 
 #endif
\ No newline at end of file
@@ -1,6 +1,106 @@
 #include "ostd.h"
 
+Interner symbols;
+
+AllocStats alloc_stats;
+
+S8Kernels s8_kernels;
+
 u64 s8_hash(s8 key) {
+  if (s8_kernels.hash == 0) {
+    s8_kernels_init();
+  }
+  return s8_kernels.hash(key);
+}
+
+bool s8_eq(s8 s1, s8 s2) {
+  if (s1.len != s2.len) {
+    return false;
+  }
+  if (s8_kernels.eq == 0) {
+    s8_kernels_init();
+  }
+  return s8_kernels.eq(s1, s2);
+}
+
+int s8_index_of(s8 s, char c, int from) {
+  /*Index of the first c at or after from, or s.len if there is none.*/
+  if (s8_kernels.index_of == 0) {
+    s8_kernels_init();
+  }
+  return s8_kernels.index_of(s, c, from);
+}
+
+int s8_index_of_any(s8 s, s8 set, int from) {
+  /*Index of the first char at or after from that is in set, or s.len.*/
+  if (s8_kernels.index_of_any == 0) {
+    s8_kernels_init();
+  }
+  return s8_kernels.index_of_any(s, set, from);
+}
+
+int s8_find(s8 s, s8 target, int from) {
+  /*Index of the first occurence of target at or after from, or -1.*/
+  if (s8_kernels.find == 0) {
+    s8_kernels_init();
+  }
+  return s8_kernels.find(s, target, from);
+}
+
+bool cpu_has_sse2(void) {
+#if OSTD_X86_SIMD
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("sse2") != 0;
+#else
+  return false;
+#endif
+}
+
+bool cpu_has_avx2(void) {
+#if OSTD_X86_SIMD
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2") != 0 &&
+         __builtin_cpu_supports("sse4.2") != 0;
+#else
+  return false;
+#endif
+}
+
+void s8_kernels_init(void) {
+  /*Pick the widest kernels this CPU runs. Racing threads all pick the same
+   * ones. hash is set last since it is what the lazy checks look at first.*/
+  S8Kernels k;
+  k.name = "scalar";
+  k.eq = s8_eq_scalar;
+  k.hash = s8_hash_scalar;
+  k.index_of = s8_index_of_scalar;
+  k.index_of_any = s8_index_of_any_scalar;
+  k.find = s8_find_scalar;
+#if OSTD_X86_SIMD
+  if (cpu_has_avx2()) {
+    k.name = "avx2";
+    k.eq = s8_eq_avx2;
+    k.hash = s8_hash_crc32;
+    k.index_of = s8_index_of_avx2;
+    k.index_of_any = s8_index_of_any_avx2;
+    k.find = s8_find_avx2;
+  } else if (cpu_has_sse2()) {
+    k.name = "sse2";
+    k.eq = s8_eq_sse2;
+    k.index_of = s8_index_of_sse2;
+    k.index_of_any = s8_index_of_any_sse2;
+    k.find = s8_find_sse2;
+  }
+#endif
+  s8_kernels.name = k.name;
+  s8_kernels.eq = k.eq;
+  s8_kernels.index_of = k.index_of;
+  s8_kernels.index_of_any = k.index_of_any;
+  s8_kernels.find = k.find;
+  s8_kernels.hash = k.hash;
+}
+
+u64 s8_hash_scalar(s8 key) {
   const u64 fnv_offset_basis = 1469598103934665603ull;
   const u64 fnv_prime = 1099511628211ull;
 
@@ -14,7 +114,7 @@ u64 s8_hash(s8 key) {
   return h;
 }
 
-bool s8_eq(s8 s1, s8 s2) {
+bool s8_eq_scalar(s8 s1, s8 s2) {
   if (s1.len != s2.len) {
     return false;
   }
@@ -28,6 +128,221 @@ bool s8_eq(s8 s1, s8 s2) {
   return true;
 }
 
+int s8_index_of_scalar(s8 s, char c, int from) {
+  int i = from;
+  for (; i < s.len; i++) {
+    if (s.str[i] == c) {
+      return i;
+    }
+  }
+  return s.len;
+}
+
+int s8_index_of_any_scalar(s8 s, s8 set, int from) {
+  int i = from;
+  for (; i < s.len; i++) {
+    int j = 0;
+    for (; j < set.len; j++) {
+      if (s.str[i] == set.str[j]) {
+        return i;
+      }
+    }
+  }
+  return s.len;
+}
+
+int s8_find_scalar(s8 s, s8 target, int from) {
+  int i = from;
+  for (; i <= s.len - target.len; i++) {
+    if (memcmp(s.str + i, target.str, (u64)target.len) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+#if OSTD_X86_SIMD
+/*The SIMD kernels work on whole 16 or 32 byte blocks and never read past the
+ * end of a string, the leftover bytes go through the scalar versions.*/
+
+__attribute__((target("sse2"))) bool s8_eq_sse2(s8 s1, s8 s2) {
+  if (s1.len != s2.len) {
+    return false;
+  }
+  int i = 0;
+  for (; i + 16 <= s1.len; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i*)(s1.str + i));
+    __m128i b = _mm_loadu_si128((const __m128i*)(s2.str + i));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) != 0xFFFF) {
+      return false;
+    }
+  }
+  return memcmp(s1.str + i, s2.str + i, (u64)(s1.len - i)) == 0;
+}
+
+__attribute__((target("avx2"))) bool s8_eq_avx2(s8 s1, s8 s2) {
+  if (s1.len != s2.len) {
+    return false;
+  }
+  int i = 0;
+  for (; i + 32 <= s1.len; i += 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i*)(s1.str + i));
+    __m256i b = _mm256_loadu_si256((const __m256i*)(s2.str + i));
+    if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b)) != -1) {
+      return false;
+    }
+  }
+  return memcmp(s1.str + i, s2.str + i, (u64)(s1.len - i)) == 0;
+}
+
+__attribute__((target("sse4.2"))) u64 s8_hash_crc32(s8 key) {
+  /*crc32c of 8 bytes at a time, then a multiply so the low bits used for map
+   * buckets depend on every input bit.*/
+  u64 h = 0xffffffffu;
+  int i = 0;
+  for (; i + 8 <= key.len; i += 8) {
+    u64 w;
+    memcpy(&w, key.str + i, sizeof(w));
+    h = _mm_crc32_u64(h, w);
+  }
+  for (; i < key.len; i++) {
+    h = _mm_crc32_u8((u32)h, (u8)key.str[i]);
+  }
+  h = (h << 32) ^ h ^ (u64)key.len;
+  h *= 0x9e3779b97f4a7c15ull;
+  return h ^ (h >> 29);
+}
+
+__attribute__((target("sse2"))) int s8_index_of_sse2(s8 s, char c, int from) {
+  __m128i needle = _mm_set1_epi8(c);
+  int i = from;
+  for (; i + 16 <= s.len; i += 16) {
+    __m128i block = _mm_loadu_si128((const __m128i*)(s.str + i));
+    int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, needle));
+    if (mask != 0) {
+      return i + __builtin_ctz((u32)mask);
+    }
+  }
+  return s8_index_of_scalar(s, c, i);
+}
+
+__attribute__((target("avx2"))) int s8_index_of_avx2(s8 s,
+                                                      char c,
+                                                      int from) {
+  __m256i needle = _mm256_set1_epi8(c);
+  int i = from;
+  for (; i + 32 <= s.len; i += 32) {
+    __m256i block = _mm256_loadu_si256((const __m256i*)(s.str + i));
+    int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, needle));
+    if (mask != 0) {
+      return i + __builtin_ctz((u32)mask);
+    }
+  }
+  return s8_index_of_sse2(s, c, i);
+}
+
+__attribute__((target("sse2"))) int s8_index_of_any_sse2(s8 s,
+                                                          s8 set,
+                                                          int from) {
+  if (set.len > 8) {
+    return s8_index_of_any_scalar(s, set, from);
+  }
+  __m128i needles[8];
+  int j = 0;
+  for (; j < set.len; j++) {
+    needles[j] = _mm_set1_epi8(set.str[j]);
+  }
+  int i = from;
+  for (; i + 16 <= s.len; i += 16) {
+    __m128i block = _mm_loadu_si128((const __m128i*)(s.str + i));
+    __m128i hits = _mm_setzero_si128();
+    for (j = 0; j < set.len; j++) {
+      hits = _mm_or_si128(hits, _mm_cmpeq_epi8(block, needles[j]));
+    }
+    int mask = _mm_movemask_epi8(hits);
+    if (mask != 0) {
+      return i + __builtin_ctz((u32)mask);
+    }
+  }
+  return s8_index_of_any_scalar(s, set, i);
+}
+
+__attribute__((target("avx2"))) int s8_index_of_any_avx2(s8 s,
+                                                          s8 set,
+                                                          int from) {
+  if (set.len > 8) {
+    return s8_index_of_any_scalar(s, set, from);
+  }
+  __m256i needles[8];
+  int j = 0;
+  for (; j < set.len; j++) {
+    needles[j] = _mm256_set1_epi8(set.str[j]);
+  }
+  int i = from;
+  for (; i + 32 <= s.len; i += 32) {
+    __m256i block = _mm256_loadu_si256((const __m256i*)(s.str + i));
+    __m256i hits = _mm256_setzero_si256();
+    for (j = 0; j < set.len; j++) {
+      hits = _mm256_or_si256(hits, _mm256_cmpeq_epi8(block, needles[j]));
+    }
+    int mask = _mm256_movemask_epi8(hits);
+    if (mask != 0) {
+      return i + __builtin_ctz((u32)mask);
+    }
+  }
+  return s8_index_of_any_sse2(s, set, i);
+}
+
+__attribute__((target("sse2"))) int s8_find_sse2(s8 s, s8 target, int from) {
+  /*Only look closer where both the first and last byte of target match.*/
+  if (target.len == 0) {
+    return from <= s.len ? from : -1;
+  }
+  __m128i first = _mm_set1_epi8(target.str[0]);
+  __m128i last = _mm_set1_epi8(target.str[target.len - 1]);
+  int i = from;
+  for (; i + target.len - 1 + 16 <= s.len; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i*)(s.str + i));
+    __m128i b =
+        _mm_loadu_si128((const __m128i*)(s.str + i + target.len - 1));
+    u32 mask = (u32)_mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+    while (mask != 0) {
+      int at = i + __builtin_ctz(mask);
+      if (memcmp(s.str + at, target.str, (u64)target.len) == 0) {
+        return at;
+      }
+      mask &= mask - 1;
+    }
+  }
+  return s8_find_scalar(s, target, i);
+}
+
+__attribute__((target("avx2"))) int s8_find_avx2(s8 s, s8 target, int from) {
+  if (target.len == 0) {
+    return from <= s.len ? from : -1;
+  }
+  __m256i first = _mm256_set1_epi8(target.str[0]);
+  __m256i last = _mm256_set1_epi8(target.str[target.len - 1]);
+  int i = from;
+  for (; i + target.len - 1 + 32 <= s.len; i += 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i*)(s.str + i));
+    __m256i b =
+        _mm256_loadu_si256((const __m256i*)(s.str + i + target.len - 1));
+    u32 mask = (u32)_mm256_movemask_epi8(_mm256_and_si256(
+        _mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+    while (mask != 0) {
+      int at = i + __builtin_ctz(mask);
+      if (memcmp(s.str + at, target.str, (u64)target.len) == 0) {
+        return at;
+      }
+      mask &= mask - 1;
+    }
+  }
+  return s8_find_sse2(s, target, i);
+}
+#endif
+
 s8 s8_from(AllocFn alloc, const char* s) {
   s8 r;
   int i = 0;
@@ -40,6 +355,14 @@ s8 s8_from(AllocFn alloc, const char* s) {
   return r;
 }
 
+s8 s8_view(const char* s) {
+  /*s itself as an s8, for comparing against without a copy to free.*/
+  s8 r;
+  r.str = (char*)s;
+  r.len = (int)strlen(s);
+  return r;
+}
+
 const char* s8_to_c(AllocFn alloc, s8 s) {
   char* n = alloc((u64)(1 + s.len));
   memcpy(n, s.str, (u64)s.len);
@@ -82,13 +405,11 @@ s8 s8_replace_all(AllocFn alloc,
   /*find occurences, store where they are*/
   int* match_list = alloc(((u64)(dest.len / target.len) + 1) * sizeof(int));
   int match_count = 0;
-  int i = 0;
-  for (; i < (dest.len - target.len) + 1; i++) {
-    if (memcmp(dest.str + i, target.str, (u64)target.len) == 0) {
-      match_list[match_count] = i;
-      match_count++;
-      i = i + target.len - 1;
-    }
+  int i = s8_find(dest, target, 0);
+  while (i >= 0) {
+    match_list[match_count] = i;
+    match_count++;
+    i = s8_find(dest, target, i + target.len);
   }
 
   /*calculate size needed, allocate it*/
@@ -133,6 +454,67 @@ void s8_destroy(FreeFn free, s8 s) {
   free(s.str);
 }
 
+void* counted_alloc(int site, u64 size) {
+  /*malloc, counted under site. Wrap it in an AllocFn per site to pass it to
+   * the functions here.*/
+  void* p = malloc(size);
+  if (p != NULL) {
+    alloc_stats_note(site, (i64)malloc_usable_size(p), 0);
+  }
+  return p;
+}
+
+void* counted_realloc(int site, void* p, u64 size) {
+  /*Counted as a free of the old block and an allocation of the new one.*/
+  i64 old = p != NULL ? (i64)malloc_usable_size(p) : 0;
+  void* n = realloc(p, size);
+  if (n != NULL) {
+    alloc_stats_note(site, (i64)malloc_usable_size(n), old);
+  }
+  return n;
+}
+
+void counted_free(void* p) {
+  if (p != NULL) {
+    alloc_stats_note(0, 0, (i64)malloc_usable_size(p));
+  }
+  free(p);
+}
+
+void alloc_stats_note(int site, i64 allocated, i64 freed) {
+  /*Safe from any thread. A block allocated before counting was enabled and
+   * freed after still counts as freed, so enable it before the work to
+   * measure starts.*/
+  if (!alloc_stats.enabled) {
+    return;
+  }
+  if (allocated > 0) {
+    __atomic_add_fetch(&alloc_stats.count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&alloc_stats.bytes, allocated, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&alloc_stats.site_count[site], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&alloc_stats.site_bytes[site], allocated,
+                       __ATOMIC_RELAXED);
+  }
+  if (freed > 0) {
+    __atomic_add_fetch(&alloc_stats.frees, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&alloc_stats.freed_bytes, freed, __ATOMIC_RELAXED);
+  }
+  i64 live = __atomic_add_fetch(&alloc_stats.live, allocated - freed,
+                                __ATOMIC_RELAXED);
+  i64 peak = __atomic_load_n(&alloc_stats.peak, __ATOMIC_RELAXED);
+  while (live > peak &&
+         !__atomic_compare_exchange_n(&alloc_stats.peak, &peak, live, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+void alloc_stats_mark(void) {
+  /*Start measuring the peak again from what is live now.*/
+  __atomic_store_n(&alloc_stats.peak,
+                   __atomic_load_n(&alloc_stats.live, __ATOMIC_RELAXED),
+                   __ATOMIC_RELAXED);
+}
+
 Map map_init(AllocFn alloc, u64 size_log_2) {
   int size = 1;
   u64 i = 0;
@@ -140,7 +522,7 @@ Map map_init(AllocFn alloc, u64 size_log_2) {
     size = size * 2;
   }
   Map m;
-  u64 byte_size = (u64)size * sizeof(MapNode);
+  u64 byte_size = (u64)size * sizeof(MapNode*);
   m.buckets = alloc(byte_size);
   m.count = 0;
   m.size = size;
@@ -166,9 +548,9 @@ MapNode* map_node_init(AllocFn alloc,
   return n;
 }
 
-Map map_set(AllocFn alloc, Map m, s8 key, int val) {
+Map map_set(AllocFn alloc, FreeFn free, Map m, s8 key, int val) {
   if (m.count >> 1 > m.size) {
-    /* TODO: rebalance if m count is greater than half the size */
+    m = map_grow(alloc, free, m);
   }
   u64 hash = s8_hash(key);
   int index = (int)(hash & (u64)(m.size - 1));
@@ -216,8 +598,126 @@ ResultInt map_get(Map m, s8 key) {
   return r;
 }
 
+Map map_clone(AllocFn alloc, Map m) {
+  /*copies every node, the clone can be modified without affecting m.*/
+  Map c;
+  u64 byte_size = (u64)m.size * sizeof(MapNode*);
+  c.buckets = alloc(byte_size);
+  c.count = m.count;
+  c.size = m.size;
+  memset(c.buckets, 0, byte_size);
+  int i = 0;
+  for (; i < m.size; i++) {
+    MapNode* curr = m.buckets[i];
+    MapNode** tail = &c.buckets[i];
+    while (curr != 0) {
+      *tail = map_node_init(alloc, curr->key, curr->val, curr->hash, 0);
+      tail = &(*tail)->next;
+      curr = curr->next;
+    }
+  }
+  return c;
+}
+
+Map map_grow(AllocFn alloc, FreeFn free, Map m) {
+  /*Relink every node into a bucket array 4 times bigger and free the old one.
+   * The nodes keep their hash so nothing is rehashed.*/
+  Map g;
+  g.size = m.size * 4;
+  g.count = m.count;
+  u64 byte_size = (u64)g.size * sizeof(MapNode*);
+  g.buckets = alloc(byte_size);
+  memset(g.buckets, 0, byte_size);
+  int i = 0;
+  for (; i < m.size; i++) {
+    MapNode* curr = m.buckets[i];
+    while (curr != 0) {
+      MapNode* next = curr->next;
+      int index = (int)(curr->hash & (u64)(g.size - 1));
+      curr->next = g.buckets[index];
+      g.buckets[index] = curr;
+      curr = next;
+    }
+  }
+  free(m.buckets);
+  return g;
+}
+
 void map_destroy(FreeFn free, Map map) {
   /*iterate through all the buckets and free all the strings too before freeing
    * the buckets buffer.*/
+  int i = 0;
+  for (; i < map.size; i++) {
+    MapNode* curr = map.buckets[i];
+    while (curr != 0) {
+      MapNode* next = curr->next;
+      free(curr->key.str);
+      free(curr);
+      curr = next;
+    }
+  }
   free(map.buckets);
 }
+
+Interner interner_init(AllocFn alloc, u64 size_log_2) {
+  Interner in;
+  in.ids = map_init(alloc, size_log_2);
+  in.count = 0;
+  in.cap = 16;
+  in.names = alloc((u64)in.cap * sizeof(s8));
+  return in;
+}
+
+int intern(AllocFn alloc, FreeFn free, Interner* in, s8 name) {
+  /*Return the id of name, giving it the next free id if it is new.*/
+  if (in->names == 0) {
+    *in = interner_init(alloc, 10);
+  }
+  ResultInt r = map_get(in->ids, name);
+  if (r.ok) {
+    return r.val;
+  }
+  if (in->count == in->cap) {
+    s8* names = alloc((u64)in->cap * 2 * sizeof(s8));
+    memcpy(names, in->names, (u64)in->cap * sizeof(s8));
+    free(in->names);
+    in->names = names;
+    in->cap = in->cap * 2;
+  }
+  s8 copy;
+  copy.len = name.len;
+  copy.str = alloc((u64)name.len);
+  memcpy(copy.str, name.str, (u64)name.len);
+  int id = in->count;
+  in->ids = map_set(alloc, free, in->ids, copy, id);
+  in->names[id] = copy;
+  in->count++;
+  return id;
+}
+
+ResultInt interner_find(Interner in, s8 name) {
+  ResultInt r;
+  if (in.names == 0) {
+    r.ok = false;
+    r.val = 0;
+    return r;
+  }
+  return map_get(in.ids, name);
+}
+
+s8 interner_name(Interner in, int id) {
+  return in.names[id];
+}
+
+void interner_destroy(FreeFn free, Interner in) {
+  /*The map keeps its own copy of each name.*/
+  if (in.names == 0) {
+    return;
+  }
+  int id = 0;
+  for (; id < in.count; id++) {
+    free(in.names[id].str);
+  }
+  free(in.names);
+  map_destroy(free, in.ids);
+}
@@ -1,9 +1,19 @@
 #ifndef OSTD_H
 #define OSTD_H
 
+#include <malloc.h>
+#include <stdlib.h>
 #include <string.h>
 #include "ostd.h"
 
+/*x86 builds get SSE2/AVX2 versions of the s8 kernels, picked at runtime.*/
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define OSTD_X86_SIMD 1
+#include <immintrin.h>
+#else
+#define OSTD_X86_SIMD 0
+#endif
+
 #define bool int
 #define true 1
 #define false 0
@@ -21,6 +31,26 @@ typedef char i8;
 typedef void* (*AllocFn)(u64);
 typedef void (*FreeFn)(void*);
 
+#define ALLOC_MAX_SITES 16
+
+/*Totals for memory that went through the counted_ functions while enabled.
+ * Sizes are what malloc_usable_size reports, so a free can be counted without
+ * a header on every block. Callers number their allocation sites from 0.*/
+typedef struct AllocStats {
+  bool enabled;
+  i64 count;
+  i64 bytes;
+  i64 frees;
+  i64 freed_bytes;
+  i64 live;
+  /*most live at once since the last alloc_stats_mark*/
+  i64 peak;
+  i64 site_count[ALLOC_MAX_SITES];
+  i64 site_bytes[ALLOC_MAX_SITES];
+} AllocStats;
+
+extern AllocStats alloc_stats;
+
 typedef struct s8 {
   char* str;
   int len;
@@ -44,8 +74,39 @@ typedef struct Map {
   int count;
 } Map;
 
+/*The s8 kernels in use, chosen from the CPU features on first use. Every
+ * member has the same behaviour as the _scalar version, except hash which only
+ * has to be consistent within a process.*/
+typedef struct S8Kernels {
+  const char* name;
+  bool (*eq)(s8 s1, s8 s2);
+  u64 (*hash)(s8 key);
+  int (*index_of)(s8 s, char c, int from);
+  int (*index_of_any)(s8 s, s8 set, int from);
+  int (*find)(s8 s, s8 target, int from);
+} S8Kernels;
+
+extern S8Kernels s8_kernels;
+
+/*Hands out a dense integer id for each distinct string, starting at 0.*/
+typedef struct Interner {
+  Map ids;
+  s8* names;
+  int count;
+  int cap;
+} Interner;
+
+/*Process wide symbol table, ids are shared by every program assembled in this
+ * process. Not safe to use from more than one thread at a time, oarm takes
+ * symbols_lock around it.*/
+extern Interner symbols;
+
 u64 s8_hash(s8 key);
+int s8_index_of(s8 s, char c, int from);
+int s8_index_of_any(s8 s, s8 set, int from);
+int s8_find(s8 s, s8 target, int from);
 s8 s8_from(AllocFn alloc, const char* s);
+s8 s8_view(const char* s);
 const char* s8_to_c(AllocFn alloc, s8 s);
 bool s8_eq(s8 s1, s8 s2);
 void s8_destroy(FreeFn free, s8 s);
@@ -57,10 +118,44 @@ s8 s8_replace_all(AllocFn alloc,
                   s8 replacement);
 s8 s8_concat(AllocFn alloc, s8 s1, s8 s2);
 
+void s8_kernels_init(void);
+bool cpu_has_sse2(void);
+bool cpu_has_avx2(void);
+bool s8_eq_scalar(s8 s1, s8 s2);
+u64 s8_hash_scalar(s8 key);
+int s8_index_of_scalar(s8 s, char c, int from);
+int s8_index_of_any_scalar(s8 s, s8 set, int from);
+int s8_find_scalar(s8 s, s8 target, int from);
+#if OSTD_X86_SIMD
+bool s8_eq_sse2(s8 s1, s8 s2);
+bool s8_eq_avx2(s8 s1, s8 s2);
+u64 s8_hash_crc32(s8 key);
+int s8_index_of_sse2(s8 s, char c, int from);
+int s8_index_of_avx2(s8 s, char c, int from);
+int s8_index_of_any_sse2(s8 s, s8 set, int from);
+int s8_index_of_any_avx2(s8 s, s8 set, int from);
+int s8_find_sse2(s8 s, s8 target, int from);
+int s8_find_avx2(s8 s, s8 target, int from);
+#endif
+
+void* counted_alloc(int site, u64 size);
+void* counted_realloc(int site, void* p, u64 size);
+void counted_free(void* p);
+void alloc_stats_note(int site, i64 allocated, i64 freed);
+void alloc_stats_mark(void);
+
 Map map_init(AllocFn alloc, u64 size_log_2);
-Map map_set(AllocFn alloc, Map m, s8 key, int val);
+Map map_set(AllocFn alloc, FreeFn free, Map m, s8 key, int val);
 ResultInt map_get(Map m, s8 key);
+Map map_clone(AllocFn alloc, Map m);
 void map_destroy(FreeFn free, Map map);
+Map map_grow(AllocFn alloc, FreeFn free, Map m);
+
+Interner interner_init(AllocFn alloc, u64 size_log_2);
+int intern(AllocFn alloc, FreeFn free, Interner* in, s8 name);
+ResultInt interner_find(Interner in, s8 name);
+s8 interner_name(Interner in, int id);
+void interner_destroy(FreeFn free, Interner in);
 
 MapNode* map_node_init(AllocFn alloc, s8 key, int val, u64 hash, MapNode* next);
 #endif
\ No newline at end of file
@@ -0,0 +1,530 @@
+#include "serve.h"
+#include "ostd.h"
+
+Server* server_start(const char* path, int workers) {
+  /*Listen on path, replacing any stale socket there, and start the workers.
+   * NULL if the socket can't be set up.*/
+  struct sockaddr_un addr;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    out_printf("serve: socket path too long: %s\n", path);
+    return NULL;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(path);
+  if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+      listen(fd, SOMAXCONN) != 0) {
+    out_flush();
+    perror("serve");
+    if (fd >= 0) {
+      close(fd);
+    }
+    return NULL;
+  }
+  /*a client hanging up mid reply is its problem, not a reason to exit*/
+  signal(SIGPIPE, SIG_IGN);
+
+  Server* srv = calloc(1, sizeof(Server));
+  srv->listen_fd = fd;
+  srv->path = path;
+  srv->worker_count = workers;
+  if (workers < 1) {
+    srv->worker_count = 1;
+  } else if (workers > SERVE_MAX_WORKERS) {
+    srv->worker_count = SERVE_MAX_WORKERS;
+  }
+  /*nothing here may block the poller: a connection it saw can be gone by the
+   * time it accepts, and a full wake pipe already wakes it*/
+  pipe(srv->wake);
+  fcntl(fd, F_SETFL, O_NONBLOCK);
+  fcntl(srv->wake[0], F_SETFL, O_NONBLOCK);
+  fcntl(srv->wake[1], F_SETFL, O_NONBLOCK);
+  pthread_mutex_init(&srv->cache_lock, NULL);
+  pthread_mutex_init(&srv->lock, NULL);
+  pthread_cond_init(&srv->ready, NULL);
+  int i = 0;
+  for (; i < srv->worker_count; i++) {
+    pthread_create(&srv->workers[i], NULL, server_worker, srv);
+  }
+  pthread_create(&srv->poller, NULL, server_poll, srv);
+  return srv;
+}
+
+void server_wait(Server* srv) {
+  pthread_join(srv->poller, NULL);
+}
+
+void server_stop(Server* srv) {
+  /*Stop accepting and close the connections between jobs, let the workers
+   * finish the jobs already arriving and wait for them, then drop the cache.*/
+  pthread_mutex_lock(&srv->lock);
+  srv->stopping = true;
+  pthread_cond_broadcast(&srv->ready);
+  pthread_mutex_unlock(&srv->lock);
+  write(srv->wake[1], "", 1);
+  pthread_join(srv->poller, NULL);
+  int i = 0;
+  for (; i < srv->worker_count; i++) {
+    pthread_join(srv->workers[i], NULL);
+  }
+  for (i = 0; i < PROGRAM_CACHE_BUCKETS; i++) {
+    while (srv->cache[i] != NULL) {
+      server_evict(srv, &srv->cache[i]);
+    }
+  }
+  close(srv->listen_fd);
+  close(srv->wake[0]);
+  close(srv->wake[1]);
+  unlink(srv->path);
+  pthread_mutex_destroy(&srv->cache_lock);
+  pthread_mutex_destroy(&srv->lock);
+  pthread_cond_destroy(&srv->ready);
+  free(srv);
+}
+
+void* server_poll(void* arg) {
+  /*Accept connections and wait on the ones between jobs, queueing each for
+   * the next free worker as soon as its next job starts to arrive.*/
+  Server* srv = (Server*)arg;
+  struct pollfd fds[SERVE_MAX_CONNECTIONS + 2];
+  char drain[64];
+  for (;;) {
+    pthread_mutex_lock(&srv->lock);
+    if (srv->stopping) {
+      pthread_mutex_unlock(&srv->lock);
+      break;
+    }
+    fds[0].fd = srv->listen_fd;
+    fds[1].fd = srv->wake[0];
+    int n = 2;
+    int i = 0;
+    for (; i < srv->idle_len; i++) {
+      fds[n++].fd = srv->idle[i];
+    }
+    pthread_mutex_unlock(&srv->lock);
+    for (i = 0; i < n; i++) {
+      fds[i].events = POLLIN;
+      fds[i].revents = 0;
+    }
+    if (poll(fds, (nfds_t)n, -1) < 0) {
+      continue;
+    }
+    while (read(srv->wake[0], drain, sizeof(drain)) > 0) {
+    }
+
+    pthread_mutex_lock(&srv->lock);
+    /*hung up counts too, the worker finds out and closes it*/
+    for (i = 2; i < n; i++) {
+      if (fds[i].revents == 0) {
+        continue;
+      }
+      int k = 0;
+      while (srv->idle[k] != fds[i].fd) {
+        k++;
+      }
+      srv->idle[k] = srv->idle[--srv->idle_len];
+      srv->queue[(srv->queue_head + srv->queue_len) % SERVE_MAX_CONNECTIONS] =
+          fds[i].fd;
+      srv->queue_len++;
+      pthread_cond_signal(&srv->ready);
+    }
+    pthread_mutex_unlock(&srv->lock);
+
+    int fd = fds[0].revents != 0 ? accept(srv->listen_fd, NULL, NULL) : -1;
+    if (fd < 0) {
+      continue;
+    }
+    pthread_mutex_lock(&srv->lock);
+    if (srv->connections == SERVE_MAX_CONNECTIONS) {
+      close(fd);
+    } else {
+      srv->idle[srv->idle_len++] = fd;
+      srv->connections++;
+    }
+    pthread_mutex_unlock(&srv->lock);
+  }
+
+  pthread_mutex_lock(&srv->lock);
+  while (srv->idle_len > 0) {
+    close(srv->idle[--srv->idle_len]);
+    srv->connections--;
+  }
+  pthread_mutex_unlock(&srv->lock);
+  return NULL;
+}
+
+void* server_worker(void* arg) {
+  /*Serve one job at a time from any connection, every job in the same Vm,
+   * created with the first program this worker sees.*/
+  Server* srv = (Server*)arg;
+  Vm* vm = NULL;
+  char* source = NULL;
+  int source_cap = 0;
+  for (;;) {
+    pthread_mutex_lock(&srv->lock);
+    while (srv->queue_len == 0 && !srv->stopping) {
+      pthread_cond_wait(&srv->ready, &srv->lock);
+    }
+    if (srv->queue_len == 0) {
+      pthread_mutex_unlock(&srv->lock);
+      break;
+    }
+    int fd = srv->queue[srv->queue_head];
+    srv->queue_head = (srv->queue_head + 1) % SERVE_MAX_CONNECTIONS;
+    srv->queue_len--;
+    pthread_mutex_unlock(&srv->lock);
+
+    bool keep = server_job(srv, &vm, fd, &source, &source_cap);
+    pthread_mutex_lock(&srv->lock);
+    keep = keep && !srv->stopping;
+    if (keep) {
+      srv->idle[srv->idle_len++] = fd;
+    } else {
+      close(fd);
+      srv->connections--;
+    }
+    pthread_mutex_unlock(&srv->lock);
+    if (keep) {
+      write(srv->wake[1], "", 1);
+    }
+  }
+  free(source);
+  if (vm != NULL) {
+    fclose(vm->machine->guest_in);
+    fclose(vm->machine->guest_out);
+    vm_destroy(vm);
+  }
+  return NULL;
+}
+
+bool server_job(Server* srv, Vm** vm, int fd, char** source, int* source_cap) {
+  /*One job from fd, false once the client hung up or sent something that
+   * isn't one. source is the worker's buffer for it, grown as needed.*/
+  int mem[MEM_BYTES];
+  JobRequest req;
+  JobReply reply;
+  if (!read_full(fd, &req, sizeof(req))) {
+    return false;
+  }
+  memset(&reply, 0, sizeof(reply));
+  bool ok = req.magic == JOB_MAGIC && req.source_len >= 0 &&
+            req.source_len <= SERVE_MAX_SOURCE && req.mem_len >= 0 &&
+            req.mem_len <= MEM_BYTES;
+  if (ok && req.source_len > *source_cap) {
+    *source_cap = req.source_len;
+    *source = realloc(*source, (size_t)*source_cap);
+  }
+  if (ok) {
+    ok = read_full(fd, *source, (size_t)req.source_len) &&
+         read_full(fd, mem, (size_t)req.mem_len * sizeof(int));
+  }
+  if (!ok) {
+    reply.status = JOB_BAD_REQUEST;
+    write_full(fd, &reply, sizeof(reply));
+    return false;
+  }
+  server_run(srv, vm, &req, *source, mem, &reply);
+  if (!write_full(fd, &reply, sizeof(reply))) {
+    return false;
+  }
+  /*a job that didn't run gets zeroes, not the last one's memory*/
+  if (reply.status <= JOB_BUDGET) {
+    vm_read_memory(*vm, 0, mem, MEM_BYTES);
+  } else {
+    memset(mem, 0, sizeof(mem));
+  }
+  return write_full(fd, mem, sizeof(mem));
+}
+
+CachedProgram* server_program(Server* srv,
+                              u64 hash,
+                              char* source,
+                              int source_len) {
+  /*The program cached for this source, assembling it on first sight. With no
+   * source the hash alone picks it, or NULL if it was never sent. Hand it back
+   * with server_release once the job is done with it.*/
+  if (source_len > 0) {
+    hash = source_hash(source, source_len);
+  }
+  int bucket = (int)(hash % PROGRAM_CACHE_BUCKETS);
+  pthread_mutex_lock(&srv->cache_lock);
+  CachedProgram* c = srv->cache[bucket];
+  int len = 0;
+  /*same hash isn't enough when the source is there to compare*/
+  while (c != NULL &&
+         (c->hash != hash ||
+          (source_len > 0 && (c->source.len != source_len ||
+                              memcmp(c->source.str, source,
+                                     (size_t)source_len) != 0)))) {
+    c = c->next;
+    len++;
+  }
+  if (c == NULL && source_len > 0) {
+    pthread_mutex_lock(&symbols_lock);
+    if (symbols.count > SERVE_MAX_SYMBOLS) {
+      /*ids only mean something within one program and nothing that runs
+       * looks them up, so programs still running keep working*/
+      int i = 0;
+      for (; i < PROGRAM_CACHE_BUCKETS; i++) {
+        while (srv->cache[i] != NULL) {
+          server_evict(srv, &srv->cache[i]);
+        }
+      }
+      interner_destroy(counted_free, symbols);
+      memset(&symbols, 0, sizeof(symbols));
+      len = 0;
+    }
+    pthread_mutex_unlock(&symbols_lock);
+    for (; len >= SERVE_CACHE_BUCKET_LEN; len--) {
+      server_evict(srv, server_oldest(srv, bucket, bucket + 1));
+    }
+    while (srv->cached > 0 &&
+           (srv->cached == SERVE_CACHE_PROGRAMS ||
+            srv->cached_bytes + source_len > SERVE_CACHE_BYTES)) {
+      server_evict(srv, server_oldest(srv, 0, PROGRAM_CACHE_BUCKETS));
+    }
+    c = calloc(1, sizeof(CachedProgram));
+    c->hash = hash;
+    c->source.str = malloc((size_t)source_len);
+    c->source.len = source_len;
+    memcpy(c->source.str, source, (size_t)source_len);
+    c->program = assemble_buffer(c->source.str, source_len, 1);
+    c->decoded = c->program.ok ? decode_program(c->program.tokens) : NULL;
+    c->next = srv->cache[bucket];
+    srv->cache[bucket] = c;
+    srv->cached++;
+    srv->cached_bytes += source_len;
+  }
+  if (c != NULL) {
+    c->used = ++srv->cache_clock;
+    c->users++;
+  }
+  pthread_mutex_unlock(&srv->cache_lock);
+  return c;
+}
+
+void server_release(Server* srv, CachedProgram* c) {
+  pthread_mutex_lock(&srv->cache_lock);
+  c->users--;
+  if (c->evicted && c->users == 0) {
+    cached_program_destroy(c);
+  }
+  pthread_mutex_unlock(&srv->cache_lock);
+}
+
+CachedProgram** server_oldest(Server* srv, int from, int to) {
+  /*The link to the least recently used program in buckets from to to.*/
+  CachedProgram** oldest = NULL;
+  int i = from;
+  for (; i < to; i++) {
+    CachedProgram** at = &srv->cache[i];
+    for (; *at != NULL; at = &(*at)->next) {
+      if (oldest == NULL || (*at)->used < (*oldest)->used) {
+        oldest = at;
+      }
+    }
+  }
+  return oldest;
+}
+
+void server_evict(Server* srv, CachedProgram** at) {
+  /*Unlink *at from the cache, freeing it unless a job still runs it. Called
+   * with cache_lock held.*/
+  CachedProgram* c = *at;
+  *at = c->next;
+  srv->cached--;
+  srv->cached_bytes -= c->source.len;
+  c->evicted = true;
+  if (c->users == 0) {
+    cached_program_destroy(c);
+  }
+}
+
+void cached_program_destroy(CachedProgram* c) {
+  if (c->decoded != NULL) {
+    decoded_destroy(c->decoded, c->program.tokens);
+  }
+  program_destroy(c->program);
+  free(c->source.str);
+  free(c);
+}
+
+void server_run(Server* srv,
+                Vm** vm,
+                const JobRequest* req,
+                char* source,
+                const int* mem,
+                JobReply* reply) {
+  CachedProgram* c = server_program(srv, req->hash, source, req->source_len);
+  if (c == NULL) {
+    reply->status = JOB_UNKNOWN_PROGRAM;
+    reply->hash = req->hash;
+    return;
+  }
+  reply->hash = c->hash;
+  if (!c->program.ok) {
+    reply->status = JOB_BAD_PROGRAM;
+    server_release(srv, c);
+    return;
+  }
+
+  if (*vm == NULL) {
+    /*stepped a turn at a time to count the budget, so deterministic*/
+    *vm = vm_create(c->program, true);
+    vm_set_io(*vm, fopen("/dev/null", "rb"), fopen("/dev/null", "wb"));
+  }
+  Vm* v = *vm;
+  vm_set_program(v, c->program, c->decoded);
+  vm_set_engine(v, ENGINE_DECODED);
+  int i = 0;
+  for (; i < NUM_REGISTERS; i++) {
+    vm_set_register(v, i, req->registers[i]);
+  }
+  vm_write_memory(v, 0, mem, req->mem_len);
+
+  bool running = true;
+  while (running && (req->budget <= 0 || reply->turns < req->budget)) {
+    running = vm_step(v);
+    reply->turns++;
+  }
+  State* s = vm_state(v);
+  reply->status = running ? JOB_BUDGET : JOB_DONE;
+  reply->pc = s->pc;
+  reply->cmp = s->cmp;
+  memcpy(reply->registers, s->registers, sizeof(reply->registers));
+  server_release(srv, c);
+}
+
+int serve_main(const char* path, int workers) {
+  /*--serve, runs until killed.*/
+  Server* srv = server_start(path, workers);
+  if (srv == NULL) {
+    return 1;
+  }
+  out_printf("serving on %s with %i workers\n", path, srv->worker_count);
+  out_flush();
+  server_wait(srv);
+  return 0;
+}
+
+u64 source_hash(const char* source, int len) {
+  /*FNV-1a, the same for a source on every run and every machine.*/
+  u64 h = 14695981039346656037ull;
+  int i = 0;
+  for (; i < len; i++) {
+    h ^= (u8)source[i];
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+
+bool read_full(int fd, void* buf, size_t len) {
+  /*false on EOF or an error before len bytes arrived*/
+  char* at = (char*)buf;
+  while (len > 0) {
+    ssize_t n = read(fd, at, len);
+    if (n <= 0) {
+      return false;
+    }
+    at += n;
+    len -= (size_t)n;
+  }
+  return true;
+}
+
+bool write_full(int fd, const void* buf, size_t len) {
+  const char* at = (const char*)buf;
+  while (len > 0) {
+    ssize_t n = write(fd, at, len);
+    if (n <= 0) {
+      return false;
+    }
+    at += n;
+    len -= (size_t)n;
+  }
+  return true;
+}
+
+int client_connect(const char* path) {
+  /*A connection to the server at path, or -1.*/
+  struct sockaddr_un addr;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd >= 0 && connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+bool client_job(int fd,
+                const JobRequest* req,
+                const char* source,
+                const int* mem,
+                JobReply* reply,
+                int* mem_out) {
+  /*Send one job and wait for its reply, mem_out gets all MEM_BYTES ints of
+   * memory. false if the connection failed.*/
+  if (!write_full(fd, req, sizeof(JobRequest)) ||
+      !write_full(fd, source, (size_t)req->source_len) ||
+      !write_full(fd, mem, (size_t)req->mem_len * sizeof(int)) ||
+      !read_full(fd, reply, sizeof(JobReply))) {
+    return false;
+  }
+  if (reply->status == JOB_BAD_REQUEST) {
+    return true;
+  }
+  return read_full(fd, mem_out, MEM_BYTES * sizeof(int));
+}
+
+int client_main(const char* path, s8 source, int budget) {
+  /*--client, runs source on the server with zeroed registers and memory and
+   * prints how it ended.*/
+  const char* statuses[] = {"done", "out of budget", "didn't assemble",
+                            "unknown program", "bad request"};
+  int fd = client_connect(path);
+  if (fd < 0) {
+    out_printf("client: can't connect to %s\n", path);
+    return 1;
+  }
+  JobRequest req;
+  memset(&req, 0, sizeof(req));
+  req.magic = JOB_MAGIC;
+  req.source_len = source.len;
+  req.budget = budget;
+  JobReply reply;
+  int mem[MEM_BYTES];
+  bool ok = client_job(fd, &req, source.str, NULL, &reply, mem);
+  close(fd);
+  if (!ok) {
+    out_printf("client: connection to %s failed\n", path);
+    return 1;
+  }
+  if (reply.status < JOB_DONE || reply.status > JOB_BAD_REQUEST) {
+    out_printf("client: job ended with unknown status %i\n", reply.status);
+    return 1;
+  }
+  out_printf("job %s after %i turns, pc %i, cmp %i, program %016lx\n",
+             statuses[reply.status], reply.turns, reply.pc, reply.cmp,
+             reply.hash);
+  out_printf("registers: [");
+  int i = 0;
+  for (; i < NUM_REGISTERS; i++) {
+    out_printf("%i, ", reply.registers[i]);
+  }
+  out_printf("]\nmem:");
+  for (i = 0; reply.status <= JOB_BUDGET && i < MEM_BYTES; i++) {
+    if (mem[i] != 0) {
+      out_printf(" [%i] %i", i, mem[i]);
+    }
+  }
+  out_printf("\n");
+  return reply.status <= JOB_BUDGET ? 0 : 1;
+}
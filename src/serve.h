@@ -0,0 +1,148 @@
+#ifndef SERVE_H
+#define SERVE_H
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "liboarm.h"
+
+/*A local job server, so a host can run programs without a process start and
+ * an assemble per run.
+ *
+ * oarm --serve=SOCK listens on a Unix domain socket and watches every open
+ * connection, handing each job as it arrives to the next free worker of a fixed
+ * pool. A worker runs one job at a time in its own reused Vm and goes back to
+ * the queue, so a client between jobs holds no worker. Programs are
+ * assembled and decoded once and cached by a hash of their source, so after
+ * sending a program once a client can send just the hash.
+ *
+ * A connection carries any number of jobs, one at a time. A job is a
+ * JobRequest followed by source_len bytes of source and mem_len ints of memory
+ * from address 0. The answer is a JobReply followed by all MEM_BYTES ints of
+ * memory. Everything is in host byte order, client and server share a
+ * machine.*/
+
+#define JOB_MAGIC 0x6f61726d
+#define SERVE_MAX_WORKERS 64
+/*open connections, any more are closed as soon as they're accepted*/
+#define SERVE_MAX_CONNECTIONS 256
+#define SERVE_MAX_SOURCE (1 << 24)
+#define PROGRAM_CACHE_BUCKETS 256
+/*past any of these the least recently used programs are dropped: cached in
+ * all, in one bucket and bytes of source in all*/
+#define SERVE_CACHE_PROGRAMS 256
+#define SERVE_CACHE_BUCKET_LEN 4
+#define SERVE_CACHE_BYTES (1 << 26)
+/*interned symbols before the server starts over with an empty cache*/
+#define SERVE_MAX_SYMBOLS (1 << 20)
+
+typedef enum {
+  JOB_DONE,
+  /*the budget ran out first, the reply has the state at that point*/
+  JOB_BUDGET,
+  JOB_BAD_PROGRAM,
+  /*no source and nothing cached under the hash*/
+  JOB_UNKNOWN_PROGRAM,
+  /*the connection is closed after this one*/
+  JOB_BAD_REQUEST
+} JobStatus;
+
+typedef struct JobRequest {
+  int magic;
+  /*0 runs the program cached under hash*/
+  int source_len;
+  u64 hash;
+  int registers[NUM_REGISTERS];
+  int mem_len;
+  /*turns to run before stopping, one instruction per running thread each, 0
+   * for no limit*/
+  int budget;
+} JobRequest;
+
+typedef struct JobReply {
+  int status;
+  /*what to send instead of the source next time*/
+  u64 hash;
+  int turns;
+  int pc;
+  int cmp;
+  int registers[NUM_REGISTERS];
+} JobReply;
+
+typedef struct CachedProgram {
+  u64 hash;
+  s8 source;
+  Program program;
+  Decoded* decoded;
+  /*cache clock at the last job, to find the least recently used*/
+  u64 used;
+  /*jobs running it, an evicted program is freed when the last one ends*/
+  int users;
+  bool evicted;
+  struct CachedProgram* next;
+} CachedProgram;
+
+typedef struct Server {
+  int listen_fd;
+  const char* path;
+  pthread_t poller;
+  /*written to wake the poller when a connection comes back or on stop*/
+  int wake[2];
+  pthread_t workers[SERVE_MAX_WORKERS];
+  int worker_count;
+
+  /*also held while assembling, so one source is assembled once*/
+  pthread_mutex_t cache_lock;
+  CachedProgram* cache[PROGRAM_CACHE_BUCKETS];
+  u64 cache_clock;
+  int cached;
+  long cached_bytes;
+
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  int connections;
+  /*connections between jobs, watched by the poller*/
+  int idle[SERVE_MAX_CONNECTIONS];
+  int idle_len;
+  /*connections with a job arriving, for the next free worker*/
+  int queue[SERVE_MAX_CONNECTIONS];
+  int queue_head;
+  int queue_len;
+  bool stopping;
+} Server;
+
+Server* server_start(const char* path, int workers);
+void server_wait(Server* srv);
+void server_stop(Server* srv);
+void* server_poll(void* arg);
+void* server_worker(void* arg);
+bool server_job(Server* srv, Vm** vm, int fd, char** source, int* source_cap);
+CachedProgram* server_program(Server* srv,
+                              u64 hash,
+                              char* source,
+                              int source_len);
+void server_release(Server* srv, CachedProgram* c);
+CachedProgram** server_oldest(Server* srv, int from, int to);
+void server_evict(Server* srv, CachedProgram** at);
+void cached_program_destroy(CachedProgram* c);
+void server_run(Server* srv,
+                Vm** vm,
+                const JobRequest* req,
+                char* source,
+                const int* mem,
+                JobReply* reply);
+int serve_main(const char* path, int workers);
+
+u64 source_hash(const char* source, int len);
+bool read_full(int fd, void* buf, size_t len);
+bool write_full(int fd, const void* buf, size_t len);
+int client_connect(const char* path);
+bool client_job(int fd,
+                const JobRequest* req,
+                const char* source,
+                const int* mem,
+                JobReply* reply,
+                int* mem_out);
+int client_main(const char* path, s8 source, int budget);
+
+#endif
@@ -1,5 +1,7 @@
+#include "liboarm.h"
 #include "oarm.h"
 #include "ostd.h"
+#include "serve.h"
 
 bool assert(bool cond);
 void test_parse_int(void);
@@ -13,11 +15,42 @@ void test_all_branches(void);
 void test_s8_replace_all(void);
 void test_s8_concat(void);
 void test_register_labels(void);
+void test_parallel_assemble(void);
+void test_ostd_interner(void);
+void test_register_label_ids(void);
+void test_s8_kernels(void);
+void test_threads(void);
+void test_vectors(void);
+void test_bulk_memory(void);
+void test_mul_div(void);
+void test_library(void);
+void test_fork(void);
+void test_paged_memory(void);
+void test_diff_engines(void);
+void test_output(void);
+void test_mem_file(void);
+void test_guest_io(void);
+void test_instruction_table(void);
+void test_time_travel(void);
+void test_mem_guard(void);
+void test_profile(void);
+void test_serve(void);
+void test_idioms(void);
+void test_timings(void);
+void test_alloc_report(void);
+void test_program_cache(void);
+void test_cost_model(void);
+void test_cache_sim(void);
+void test_bpred_sim(void);
+s8 random_program(u32 seed, int num_lines);
+u32 next_random(u32* state);
+void* assemble_worker(void* arg);
 
 int main(void) {
   printf("oarm test run\n");
   test_parse_int();
   test_tokenize();
+  test_resolve_labels();
   test_ostd_map();
   test_e2e_add_sub();
   test_e2e_ldr_str();
@@ -26,47 +59,130 @@ int main(void) {
   test_s8_replace_all();
   test_s8_concat();
   test_register_labels();
+  test_parallel_assemble();
+  test_ostd_interner();
+  test_register_label_ids();
+  test_s8_kernels();
+  test_threads();
+  test_vectors();
+  test_bulk_memory();
+  test_mul_div();
+  test_library();
+  test_fork();
+  test_paged_memory();
+  test_diff_engines();
+  test_output();
+  test_mem_file();
+  test_guest_io();
+  test_instruction_table();
+  test_time_travel();
+  test_mem_guard();
+  test_profile();
+  test_serve();
+  test_idioms();
+  test_timings();
+  test_alloc_report();
+  test_program_cache();
+  test_cost_model();
+  test_cache_sim();
+  test_bpred_sim();
   printf("\nend tests.\n");
+  return 0;
 }
 
 void test_parse_int(void) {
   printf("\ntest_parse_int\n");
-  int n = parse_int(s8_from(malloc, "123")).val;
+  int n = parse_int(s8_view("123")).val;
   if (!assert(123 == n)) {
     printf("test_part_int: expected 123 got %i", n);
   }
 
-  n = parse_int(s8_from(malloc, "0")).val;
+  n = parse_int(s8_view("0")).val;
   if (!assert(0 == n)) {
     printf("test_part_int: expected 0 got %i", n);
   }
 
-  n = parse_int(s8_from(malloc, "2")).val;
+  n = parse_int(s8_view("2")).val;
   if (!assert(2 == n)) {
     printf("test_part_int: expected 2 got %i", n);
   }
 
-  n = parse_int(s8_from(malloc, "1234")).val;
+  n = parse_int(s8_view("1234")).val;
   if (!assert(1234 == n)) {
     printf("test_part_int: expected 1234 got %i", n);
   }
 
-  n = parse_int(s8_from(malloc, "-3")).val;
+  n = parse_int(s8_view("-3")).val;
   if (!assert(-3 == n)) {
     printf("test_part_int: expected -3 got %i", n);
   }
 
-  n = parse_int(s8_from(malloc, "-765")).val;
+  n = parse_int(s8_view("-765")).val;
   if (!assert(-765 == n)) {
     printf("test_part_int: expected -765 got %i", n);
   }
+
+  n = parse_int(s8_view("2147483647")).val;
+  if (!assert(2147483647 == n)) {
+    printf("test_part_int: expected 2147483647 got %i", n);
+  }
+
+  n = parse_int(s8_view("-2147483648")).val;
+  if (!assert(-2147483647 - 1 == n)) {
+    printf("test_part_int: expected -2147483648 got %i", n);
+  }
+
+  n = parse_int(s8_view("000000000000123456789")).val;
+  if (!assert(123456789 == n)) {
+    printf("test_part_int: expected 123456789 got %i", n);
+  }
+
+  ResultInt r = parse_int(s8_view("2147483648"));
+  if (!assert(!r.ok)) {
+    printf("test_part_int: expected 2147483648 to overflow got %i", r.val);
+  }
+
+  r = parse_int(s8_view("12345678901"));
+  if (!assert(!r.ok)) {
+    printf("test_part_int: expected 12345678901 to overflow got %i", r.val);
+  }
+
+  r = parse_int(s8_view("1234567a9"));
+  if (!assert(!r.ok)) {
+    printf("test_part_int: expected 1234567a9 to fail got %i", r.val);
+  }
+
+  /*every length and sign against the one digit at a time version*/
+  const char* digits = "9876543210";
+  bool same = true;
+  int len = 1;
+  for (; len <= 10; len++) {
+    char buf[16];
+    buf[0] = '-';
+    memcpy(buf + 1, digits + 10 - len, (u64)len);
+    s8 neg;
+    neg.str = buf;
+    neg.len = len + 1;
+    s8 pos;
+    pos.str = buf + 1;
+    pos.len = len;
+    ResultInt a = parse_int(pos);
+    ResultInt b = parse_int_scalar(pos);
+    same = same && a.ok == b.ok && a.val == b.val;
+    a = parse_int(neg);
+    b = parse_int_scalar(neg);
+    same = same && a.ok == b.ok && a.val == b.val;
+  }
+  if (!assert(same)) {
+    printf("test_part_int: expected parse_int to match parse_int_scalar");
+  }
 }
 
 void test_tokenize(void) {
   printf("\ntest_tokenize\n");
 
   TokenizedProgram p = tokenize(
-      s8_from(malloc, " mov  x0, #1 \n rpc\n add  x1 , x0, #2\nreg\n"));
+      s8_view(" mov  x0, #1 \n rpc\n add  x1 , x0, #2\nreg\n"));
 
   if (!assert(4 == p.len)) {
     printf("expected program len of 4 got %i", p.len);
@@ -79,13 +195,32 @@ void test_tokenize(void) {
   if (!assert(1 == line2.len)) {
     printf("expected 1 tokens on line 2 got %i", line2.len);
   }
+  tokenized_program_destroy(p);
 }
 
 void test_resolve_labels(void) {
   printf("\ntest_resolve_labels\n");
+  /*symbols other programs interned don't make this one's table any bigger*/
+  char name[32];
+  int i = 0;
+  for (; i < 10000; i++) {
+    sprintf(name, "other_label_%i", i);
+    intern(malloc, free, &symbols, s8_view(name));
+  }
   TokenizedProgram p = tokenize(
-      s8_from(malloc, "loop:\nmov x0, #0\nadd x0, x0, #1\nb loop\nexit:"));
-  resolve_labels(p);
+      s8_view("loop:\nmov x0, #0\nadd x0, x0, #1\nb loop\nexit:\n"));
+  LabelTable labels = resolve_labels(p);
+  int loop = interner_find(symbols, s8_view("loop")).val;
+  int exit_id = interner_find(symbols, s8_view("exit")).val;
+  int other = interner_find(symbols, s8_view("other_label_7")).val;
+  if (!assert(labels.len == 4 && label_line(labels, loop) == 0 &&
+              label_line(labels, exit_id) == 4 &&
+              label_line(labels, other) == -1)) {
+    printf("expected 4 slots with loop at 0 and exit at 4, got %i slots\n",
+           labels.len);
+  }
+  counted_free(labels.lines);
+  tokenized_program_destroy(p);
 }
 
 void test_ostd_map(void) {
@@ -95,16 +230,16 @@ void test_ostd_map(void) {
     printf("expected map size 2 got %i", m.size);
   }
 
-  m = map_set(malloc, m, s8_from(malloc, "hello"), 1);
-  m = map_set(malloc, m, s8_from(malloc, "goodbye"), 2);
-  m = map_set(malloc, m, s8_from(malloc, "orion"), 3);
-  m = map_set(malloc, m, s8_from(malloc, "orion2"), 3);
-  m = map_set(malloc, m, s8_from(malloc, "orion3"), 3);
-  m = map_set(malloc, m, s8_from(malloc, "orion4"), 3);
-  m = map_set(malloc, m, s8_from(malloc, "orion5"), 3);
-  m = map_set(malloc, m, s8_from(malloc, "orion"), -1);
+  m = map_set(malloc, free, m, s8_view("hello"), 1);
+  m = map_set(malloc, free, m, s8_view("goodbye"), 2);
+  m = map_set(malloc, free, m, s8_view("orion"), 3);
+  m = map_set(malloc, free, m, s8_view("orion2"), 3);
+  m = map_set(malloc, free, m, s8_view("orion3"), 3);
+  m = map_set(malloc, free, m, s8_view("orion4"), 3);
+  m = map_set(malloc, free, m, s8_view("orion5"), 3);
+  m = map_set(malloc, free, m, s8_view("orion"), -1);
 
-  ResultInt r1 = map_get(m, s8_from(malloc, "hello"));
+  ResultInt r1 = map_get(m, s8_view("hello"));
   if (!assert(r1.ok)) {
     printf("expected to find str hello in map");
   }
@@ -112,11 +247,11 @@ void test_ostd_map(void) {
     printf("expected to val for hello to be 1 got %i", r1.val);
   }
 
-  ResultInt r2 = map_get(m, s8_from(malloc, "notok"));
+  ResultInt r2 = map_get(m, s8_view("notok"));
   if (!assert(!r2.ok)) {
     printf("Expected not to find string notok");
   }
-  ResultInt r3 = map_get(m, s8_from(malloc, "orion"));
+  ResultInt r3 = map_get(m, s8_view("orion"));
   if (!assert(r3.ok)) {
     printf("expected to find str orion in map");
   }
@@ -127,6 +262,7 @@ void test_ostd_map(void) {
   if (!assert(m.count == 7)) {
     printf("expected m count to be 7 got %i", m.count);
   }
+  map_destroy(free, m);
 }
 
 void test_e2e_add_sub(void) {
@@ -143,6 +279,7 @@ void test_e2e_add_sub(void) {
     printf("expected add_sub.s to have 3 in its first register, got %i\n",
            rs.state.registers[0]);
   }
+  result_destroy(rs);
 }
 
 void test_e2e_ldr_str(void) {
@@ -159,6 +296,7 @@ void test_e2e_ldr_str(void) {
     printf("expected ldr_str.s to have 99 in its first register, got %i\n",
            rs.state.registers[0]);
   }
+  result_destroy(rs);
 }
 
 void test_e2e_lsl_lsr(void) {
@@ -175,6 +313,7 @@ void test_e2e_lsl_lsr(void) {
     printf("expected lsl_lsr.s to have 2 in its first register, got %i\n",
            rs.state.registers[0]);
   }
+  result_destroy(rs);
 }
 void test_all_branches(void) {
   printf("\ntest_all_branches\n");
@@ -203,35 +342,38 @@ void test_all_branches(void) {
       printf("expected %s to have 1 in its first register, got %i\n", fn,
              rs.state.registers[0]);
     }
+    result_destroy(rs);
   }
 }
 
 void test_s8_replace_all(void) {
   printf("\ntest_s8_replace_all\n");
 
-  s8 r1 = s8_replace_all(malloc, free, s8_from(malloc, "batcatcat"),
-                         s8_from(malloc, "cat"), s8_from(malloc, "hello"));
-  if (!assert(s8_eq(r1, s8_from(malloc, "bathellohello")))) {
+  s8 r1 = s8_replace_all(malloc, free, s8_view("batcatcat"),
+                         s8_view("cat"), s8_view("hello"));
+  if (!assert(s8_eq(r1, s8_view("bathellohello")))) {
     printf("expected bathellohello from replace all but got %s\n",
            s8_to_c(malloc, r1));
   }
 
-  s8 r2 = s8_replace_all(malloc, free, s8_from(malloc, "batcatcat"),
-                         s8_from(malloc, "cat"), s8_from(malloc, "b"));
-  if (!assert(s8_eq(r2, s8_from(malloc, "batbb")))) {
+  s8 r2 = s8_replace_all(malloc, free, s8_view("batcatcat"),
+                         s8_view("cat"), s8_view("b"));
+  if (!assert(s8_eq(r2, s8_view("batbb")))) {
     printf("expected batbb from replace all but got %s", s8_to_c(malloc, r2));
   }
+  s8_destroy(free, r1);
+  s8_destroy(free, r2);
 }
 
 void test_s8_concat(void) {
   printf("\ntest_s8_concat\n");
-  s8 r = s8_concat(
-      malloc,
-      s8_concat(malloc, s8_from(malloc, "["), s8_from(malloc, "inside")),
-      s8_from(malloc, "]"));
-  if (!assert(s8_eq(r, s8_from(malloc, "[inside]")))) {
+  s8 inner = s8_concat(malloc, s8_view("["), s8_view("inside"));
+  s8 r = s8_concat(malloc, inner, s8_view("]"));
+  if (!assert(s8_eq(r, s8_view("[inside]")))) {
     printf("expected [inside] from str concat got %s\n", s8_to_c(malloc, r));
   }
+  s8_destroy(free, inner);
+  s8_destroy(free, r);
 }
 
 void test_register_labels(void) {
@@ -244,10 +386,11 @@ void test_register_labels(void) {
   if (!assert(rs.return_val == 0)) {
     printf("expected %s to return successful, got %i\n", fn, rs.return_val);
   }
-  if (!assert(rs.state.memory[99] == 99)) {
+  if (!assert(mem_load(rs.state.memory, 99) == 99)) {
     printf("expected %s to have 99 in its 100th mem address, got %i\n", fn,
-           rs.state.memory[99]);
+           mem_load(rs.state.memory, 99));
   }
+  result_destroy(rs);
 }
 
 bool assert(bool cond) {
@@ -257,4 +400,1841 @@ bool assert(bool cond) {
     putchar('!');
   }
   return cond;
-}
\ No newline at end of file
+}
+void test_parallel_assemble(void) {
+  printf("\ntest_parallel_assemble\n");
+  const char* src =
+      ".reg i, x0\n"
+      "mov i, #0\n"
+      "loop:\n"
+      "add i, i, #1\n"
+      "\n"
+      ".reg max, x1\n"
+      "mov max, #4\n"
+      "cmp i, max\n"
+      "blt loop\n"
+      "loop:\n"
+      ".reg i, x2\n"
+      "str i, [i]\n"
+      "exit:\n"
+      "ret\n";
+
+  TokenizedProgram serial = tokenize(s8_view(src));
+  LabelTable serial_labels = resolve_labels(serial);
+  serial = resolve_register_labels(serial);
+
+  int threads = 1;
+  for (; threads <= 16; threads *= 4) {
+    TokenizedProgram p = tokenize_parallel(s8_view(src), threads);
+    LabelTable labels = resolve_labels_parallel(p, threads);
+    p = resolve_register_labels_parallel(p, threads);
+
+    if (!assert(p.len == serial.len)) {
+      printf("expected %i lines with %i threads got %i\n", serial.len, threads,
+             p.len);
+      counted_free(labels.lines);
+      tokenized_program_destroy(p);
+      continue;
+    }
+    bool same = true;
+    int ln = 0;
+    for (; ln < p.len; ln++) {
+      int j = 0;
+      same = same && p.lines[ln].len == serial.lines[ln].len;
+      for (; same && j < p.lines[ln].len; j++) {
+        same = s8_eq(p.lines[ln].tokens[j], serial.lines[ln].tokens[j]) &&
+               p.lines[ln].ids[j] == serial.lines[ln].ids[j];
+      }
+    }
+    if (!assert(same)) {
+      printf("expected the same tokens as the serial path with %i threads\n",
+             threads);
+    }
+
+    int loop = interner_find(symbols, s8_view("loop")).val;
+    int exit_id = interner_find(symbols, s8_view("exit")).val;
+    int l1 = label_line(labels, loop);
+    int l2 = label_line(serial_labels, loop);
+    if (!assert(l1 == 8 && l1 == l2)) {
+      printf("expected label loop at line 8 with %i threads got %i\n",
+             threads, l1);
+    }
+    l1 = label_line(labels, exit_id);
+    if (!assert(l1 == 11)) {
+      printf("expected label exit at line 11 with %i threads got %i\n",
+             threads, l1);
+    }
+    counted_free(labels.lines);
+    tokenized_program_destroy(p);
+  }
+  counted_free(serial_labels.lines);
+  tokenized_program_destroy(serial);
+}
+
+void test_ostd_interner(void) {
+  printf("\ntest_ostd_interner\n");
+  Interner in = interner_init(malloc, 1);
+  int a = intern(malloc, free, &in, s8_view("loop"));
+  int b = intern(malloc, free, &in, s8_view("exit"));
+  int c = intern(malloc, free, &in, s8_view("loop"));
+  if (!assert(a == 0 && b == 1 && c == 0)) {
+    printf("expected ids 0, 1, 0 got %i, %i, %i\n", a, b, c);
+  }
+  if (!assert(s8_eq(interner_name(in, b), s8_view("exit")))) {
+    printf("expected id 1 to be named exit\n");
+  }
+  if (!assert(!interner_find(in, s8_view("nope")).ok)) {
+    printf("expected nope to not be interned\n");
+  }
+
+  /*enough names to make the map grow a few times*/
+  char buf[16];
+  int i = 0;
+  bool ok = true;
+  for (; i < 1000; i++) {
+    sprintf(buf, "sym%i", i);
+    ok = ok && intern(malloc, free, &in, s8_view(buf)) == i + 2;
+  }
+  for (i = 0; i < 1000; i++) {
+    sprintf(buf, "sym%i", i);
+    ResultInt r = interner_find(in, s8_view(buf));
+    ok = ok && r.ok && r.val == i + 2;
+  }
+  if (!assert(ok && in.count == 1002)) {
+    printf("expected 1002 dense ids got %i\n", in.count);
+  }
+  interner_destroy(free, in);
+}
+
+void test_register_label_ids(void) {
+  printf("\ntest_register_label_ids\n");
+  TokenizedProgram p = tokenize(
+      s8_view(".reg big, x12\nmov big, #1\nstr big, [big]\nbig:\nb big\n"));
+  p = resolve_register_labels(p);
+
+  s8 x12 = s8_view("x12");
+  int x12_id = interner_find(symbols, x12).val;
+  Line mov = p.lines[1];
+  if (!assert(s8_eq(mov.tokens[1], x12) && mov.ids[1] == x12_id)) {
+    printf("expected big to become x12 got %s\n",
+           s8_to_c(malloc, mov.tokens[1]));
+  }
+  Line st = p.lines[2];
+  if (!assert(s8_eq(st.tokens[2], s8_view("[x12]")) &&
+              st.ids[2] == x12_id)) {
+    printf("expected [big] to become [x12] got %s\n",
+           s8_to_c(malloc, st.tokens[2]));
+  }
+  Line decl = p.lines[3];
+  if (!assert(s8_eq(decl.tokens[0], s8_view("big:")))) {
+    printf("expected label declaration big: to be left alone\n");
+  }
+  tokenized_program_destroy(p);
+}
+
+void test_s8_kernels(void) {
+  printf("\ntest_s8_kernels (%s)\n", s8_kernels.name != 0
+                                          ? s8_kernels.name
+                                          : "not picked yet");
+  /*Check the kernels in use against the scalar ones at every offset and length
+   * around the 16 and 32 byte block sizes.*/
+  char text[100];
+  int i = 0;
+  for (; i < 100; i++) {
+    text[i] = (char)('a' + (i * 7) % 13);
+  }
+  text[70] = '\n';
+  text[95] = ':';
+  s8 set = s8_view(":\n,");
+
+  bool eq_ok = true;
+  bool index_ok = true;
+  bool find_ok = true;
+  int from = 0;
+  for (; from < 40; from++) {
+    int len = 0;
+    for (; len + from <= 100; len++) {
+      s8 a;
+      a.str = text + from;
+      a.len = len;
+      s8 b;
+      b.str = malloc((u64)len + 1);
+      b.len = len;
+      memcpy(b.str, a.str, (u64)len);
+      eq_ok = eq_ok && s8_eq(a, b) == s8_eq_scalar(a, b);
+      if (len > 0) {
+        b.str[len / 2] = 'z';
+        eq_ok = eq_ok && s8_eq(a, b) == s8_eq_scalar(a, b);
+      }
+      eq_ok = eq_ok && (!s8_eq(a, b) || s8_hash(a) == s8_hash(b));
+
+      s8 whole;
+      whole.str = text;
+      whole.len = from + len;
+      index_ok = index_ok && s8_index_of(whole, '\n', from) ==
+                                 s8_index_of_scalar(whole, '\n', from);
+      index_ok = index_ok && s8_index_of_any(whole, set, from) ==
+                                 s8_index_of_any_scalar(whole, set, from);
+
+      s8 target;
+      target.str = text + 50;
+      target.len = len % 9 + 1;
+      find_ok = find_ok && s8_find(whole, target, from) ==
+                               s8_find_scalar(whole, target, from);
+#if OSTD_X86_SIMD
+      /*the sse2 kernels are only picked on machines without avx2*/
+      if (cpu_has_sse2()) {
+        eq_ok = eq_ok && s8_eq_sse2(a, b) == s8_eq_scalar(a, b);
+        index_ok = index_ok && s8_index_of_sse2(whole, '\n', from) ==
+                                   s8_index_of_scalar(whole, '\n', from);
+        index_ok = index_ok && s8_index_of_any_sse2(whole, set, from) ==
+                                   s8_index_of_any_scalar(whole, set, from);
+        find_ok = find_ok && s8_find_sse2(whole, target, from) ==
+                                 s8_find_scalar(whole, target, from);
+      }
+#endif
+      free(b.str);
+    }
+  }
+  if (!assert(eq_ok)) {
+    printf("expected s8_eq and s8_hash to agree with s8_eq_scalar\n");
+  }
+  if (!assert(index_ok)) {
+    printf("expected s8_index_of(_any) to agree with the scalar versions\n");
+  }
+  if (!assert(find_ok)) {
+    printf("expected s8_find to agree with s8_find_scalar\n");
+  }
+}
+
+void test_threads(void) {
+  printf("\ntest_threads\n");
+
+  /*the same answer with real threads and in the deterministic interleaving*/
+  char* argv[3];
+  argv[1] = "asm/e2e/threads.s";
+  ResultState rs = entry(2, (char**)&argv);
+  if (!assert(rs.return_val == 0 && rs.state.registers[0] == 300)) {
+    printf("expected threads.s to count to 300 got %i\n",
+           rs.state.registers[0]);
+  }
+  result_destroy(rs);
+
+  argv[1] = "--deterministic";
+  argv[2] = "asm/e2e/threads.s";
+  rs = entry(3, (char**)&argv);
+  if (!assert(rs.return_val == 0 && rs.state.registers[0] == 300)) {
+    printf("expected deterministic threads.s to count to 300 got %i\n",
+           rs.state.registers[0]);
+  }
+  /*main spins on join while the workers take turns, so the number of
+   * instructions it ran is always the same*/
+  Machine* m = rs.state.machine;
+  if (!assert(m->thread_count == 4 && m->threads[1].done &&
+              m->threads[3].state.registers[4] == 100)) {
+    printf("expected 3 finished workers that looped 100 times\n");
+  }
+  result_destroy(rs);
+
+  argv[1] = "asm/e2e/cas.s";
+  rs = entry(2, (char**)&argv);
+  if (!assert(rs.state.registers[0] == 23)) {
+    printf("expected cas.s to have 23 in its first register, got %i\n",
+           rs.state.registers[0]);
+  }
+  result_destroy(rs);
+}
+
+void test_vectors(void) {
+  printf("\ntest_vectors\n");
+
+  char* argv[2];
+  argv[1] = "asm/e2e/vec.s";
+  ResultState rs = entry(2, (char**)&argv);
+  /*lane 0 of v0 + v1, lane 7 of v0 + v1, lane 0 of vcmp, lane 7 of vsub*/
+  if (!assert(rs.return_val == 0 && rs.state.registers[0] == 8 + 22 - 1 + 8)) {
+    printf("expected vec.s to have 37 in its first register, got %i\n",
+           rs.state.registers[0]);
+  }
+  result_destroy(rs);
+
+  /*every kernel set agrees with the scalar one, including on overflow*/
+  int a[VEC_LANES] = {0, 1, -1, 2147483647, -2147483647 - 1, 5, -7, 100};
+  int b[VEC_LANES] = {0, -1, -1, 1, 1, 9, -7, -100};
+  VecKernels scalar = vec_kernels_scalar();
+  VecKernels sets[2];
+  int set_count = 0;
+#if OSTD_X86_SIMD
+  if (cpu_has_sse2()) {
+    sets[set_count++] = vec_kernels_sse2();
+  }
+  if (cpu_has_avx2()) {
+    sets[set_count++] = vec_kernels_avx2();
+  }
+#endif
+  int i = 0;
+  for (; i < set_count; i++) {
+    VecOp want[5];
+    VecOp got[5];
+    want[0] = scalar.add;
+    want[1] = scalar.sub;
+    want[2] = scalar.min;
+    want[3] = scalar.max;
+    want[4] = scalar.cmp;
+    got[0] = sets[i].add;
+    got[1] = sets[i].sub;
+    got[2] = sets[i].min;
+    got[3] = sets[i].max;
+    got[4] = sets[i].cmp;
+    int op = 0;
+    for (; op < 5; op++) {
+      int w[VEC_LANES];
+      int g[VEC_LANES];
+      want[op](w, a, b);
+      got[op](g, a, b);
+      if (!assert(memcmp(w, g, sizeof(w)) == 0)) {
+        printf("%s vector kernel %i does not match scalar\n", sets[i].name,
+               op);
+      }
+    }
+  }
+
+  int lanes[VEC_LANES];
+  scalar.cmp(lanes, a, b);
+  if (!assert(lanes[0] == 0 && lanes[1] == 1 && lanes[4] == -1)) {
+    printf("expected vcmp lanes 0, 1, -1 got %i %i %i\n", lanes[0], lanes[1],
+           lanes[4]);
+  }
+}
+
+void test_bulk_memory(void) {
+  printf("\ntest_bulk_memory\n");
+
+  char* argv[2];
+  argv[1] = "asm/e2e/fill_cpy.s";
+  ResultState rs = entry(2, (char**)&argv);
+  /*the out of bounds fill at the end stops the program before x0 is reset*/
+  if (!assert(rs.state.registers[0] == 9 + 5 - 1)) {
+    printf("expected fill_cpy.s to have 13 in its first register, got %i\n",
+           rs.state.registers[0]);
+  }
+  Memory* m = rs.state.memory;
+  if (!assert(mem_load(m, 5) == 5 && mem_load(m, 10) == 0 &&
+              mem_load(m, 250) == 0)) {
+    printf("expected fill_cpy.s to leave memory 5, 10, 250 as 5 0 0, got %i %i "
+           "%i\n",
+           mem_load(m, 5), mem_load(m, 10), mem_load(m, 250));
+  }
+  result_destroy(rs);
+}
+
+void test_mul_div(void) {
+  printf("\ntest_mul_div\n");
+
+  char* argv[2];
+  argv[1] = "asm/e2e/mul_div.s";
+  ResultState rs = entry(2, (char**)&argv);
+  if (!assert(rs.return_val == 0 && rs.state.registers[0] == 122)) {
+    printf("expected mul_div.s to have 122 in its first register, got %i\n",
+           rs.state.registers[0]);
+  }
+  result_destroy(rs);
+
+  /*the edges C leaves undefined*/
+  int int_min = -2147483647 - 1;
+  if (!assert(sdiv_defined(int_min, -1) == int_min &&
+              mod_defined(int_min, -1) == 0 && sdiv_defined(5, 0) == 0 &&
+              mod_defined(5, 0) == 5 && udiv_defined(-1, 0) == 0)) {
+    printf("expected defined results for INT_MIN / -1 and division by 0\n");
+  }
+  if (!assert(udiv_defined(-2, 2) == 2147483647 &&
+              mul_wrap(65536, 65536) == 0 && mod_defined(-7, 2) == -1)) {
+    printf("expected udiv to be unsigned and mul to wrap\n");
+  }
+}
+
+void test_library(void) {
+  printf("\ntest_library\n");
+
+  const char* src =
+      "mov x0, #0\n"
+      "loop:\n"
+      "ldr x3, [x2]\n"
+      "add x0, x0, x3\n"
+      "add x2, x2, #1\n"
+      "cmp x2, x1\n"
+      "blt loop\n"
+      "str x0, [#100]\n"
+      "ret\n";
+  Program p = assemble_buffer(src, (int)strlen(src), 1);
+  assert(p.ok);
+  Vm* vm = vm_create(p, false);
+  int data[4] = {5, 6, 7, 8};
+  vm_write_memory(vm, 0, data, 4);
+  vm_set_register(vm, 1, 4);
+  vm_run(vm);
+  int out = 0;
+  vm_read_memory(vm, 100, &out, 1);
+  if (!assert(vm_get_register(vm, 0) == 26 && out == 26 && !vm_running(vm))) {
+    printf("expected the library run to sum to 26, got %i and %i\n",
+           vm_get_register(vm, 0), out);
+  }
+
+  /*a reset vm starts from zero, same memory buffer*/
+  Memory* memory = vm->memory;
+  vm_reset(vm);
+  vm_write_memory(vm, 0, data, 4);
+  vm_set_register(vm, 1, 2);
+  int steps = 0;
+  while (vm_step(vm)) {
+    steps++;
+  }
+  if (!assert(vm_get_register(vm, 0) == 11 && vm->memory == memory &&
+              steps == 13)) {
+    printf("expected 11 after 13 steps in the reused vm, got %i after %i\n",
+           vm_get_register(vm, 0), steps);
+  }
+
+  if (!assert(!vm_write_memory(vm, MEM_BYTES - 2, data, 4) &&
+              !vm_read_memory(vm, -1, &out, 1))) {
+    printf("expected out of bounds host memory access to be refused\n");
+  }
+  vm_destroy(vm);
+
+  /*vms that decode, record and fork free it all, parents first*/
+  int i = 0;
+  bool same = true;
+  for (; i < 50; i++) {
+    vm = vm_create(p, true);
+    vm_set_engine(vm, ENGINE_DECODED);
+    vm_record(vm, 16);
+    vm_write_memory(vm, 0, data, 4);
+    vm_set_register(vm, 1, 4);
+    vm_step(vm);
+    Vm* child = vm_fork(vm);
+    vm_destroy(vm);
+    vm_run(child);
+    same = same && vm_get_register(child, 0) == 26;
+    vm_destroy(child);
+  }
+  if (!assert(same)) {
+    printf("expected every fork to finish the sum\n");
+  }
+  program_destroy(p);
+
+  /*host threads assembling at once each get their own labels back*/
+  pthread_t threads[4];
+  int found[4];
+  for (i = 0; i < 4; i++) {
+    found[i] = i;
+    pthread_create(&threads[i], NULL, assemble_worker, &found[i]);
+  }
+  for (i = 0; i < 4; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  if (!assert(found[0] == 200 && found[1] == 200 && found[2] == 200 &&
+              found[3] == 200)) {
+    printf("expected every label found, got %i %i %i %i\n", found[0],
+           found[1], found[2], found[3]);
+  }
+}
+
+void test_fork(void) {
+  printf("\ntest_fork\n");
+
+  const char* src =
+      "ldr x1, [#0]\n"
+      "add x1, x1, x2\n"
+      "str x1, [#200]\n"
+      "ret\n";
+  Program p = assemble_buffer(src, (int)strlen(src), 1);
+  Vm* parent = vm_create(p, false);
+  int seven = 7;
+  vm_write_memory(parent, 0, &seven, 1);
+  vm_step(parent);
+
+  /*children pick up from the parent's pc and registers*/
+  Vm* a = vm_fork(parent);
+  Vm* b = vm_fork(parent);
+  vm_set_register(a, 2, 1);
+  vm_set_register(b, 2, 2);
+  vm_run(a);
+  vm_run(b);
+  int out_a = 0;
+  int out_b = 0;
+  int out_parent = 0;
+  vm_read_memory(a, 200, &out_a, 1);
+  vm_read_memory(b, 200, &out_b, 1);
+  vm_read_memory(parent, 200, &out_parent, 1);
+  if (!assert(out_a == 8 && out_b == 9 && out_parent == 0)) {
+    printf("expected forks to write 8 and 9 and the parent 0, got %i %i %i\n",
+           out_a, out_b, out_parent);
+  }
+
+  /*each child copied only the page it wrote*/
+  int pages = a->memory->page_count;
+  if (!assert(mem_shared_pages(a->memory) == pages - 1 &&
+              mem_shared_pages(parent->memory) == pages - 1)) {
+    printf("expected %i shared pages, got %i\n", pages - 1,
+           mem_shared_pages(a->memory));
+  }
+
+  vm_destroy(a);
+  vm_destroy(b);
+  if (!assert(mem_shared_pages(parent->memory) == 0)) {
+    printf("expected the parent to own its pages again\n");
+  }
+  vm_destroy(parent);
+  program_destroy(p);
+}
+
+void test_paged_memory(void) {
+  printf("\ntest_paged_memory\n");
+
+  /*moves across page boundaries, both directions, against plain memmove*/
+  int flat[MEM_BYTES];
+  Memory* m = mem_create(MEM_BYTES);
+  int i = 0;
+  for (; i < MEM_BYTES; i++) {
+    flat[i] = i;
+  }
+  mem_write(m, 0, flat, MEM_BYTES);
+  Memory* before = mem_fork(m);
+
+  int moves[4][3] = {{10, 50, 100}, {120, 60, 70}, {0, 1, 255}, {65, 64, 130}};
+  for (i = 0; i < 4; i++) {
+    memmove(flat + moves[i][0], flat + moves[i][1],
+            (size_t)moves[i][2] * sizeof(int));
+    mem_move(m, moves[i][0], moves[i][1], moves[i][2]);
+  }
+  int got[MEM_BYTES];
+  mem_read(m, 0, got, MEM_BYTES);
+  if (!assert(memcmp(got, flat, sizeof(flat)) == 0)) {
+    printf("expected mem_move to match memmove\n");
+  }
+
+  mem_fill(m, 30, 3, 40);
+  if (!assert(mem_load(m, 29) == flat[29] && mem_load(m, 30) == 3 &&
+              mem_load(m, 69) == 3 && mem_load(m, 70) == flat[70])) {
+    printf("expected fill to cover 30 to 69\n");
+  }
+
+  /*the fork taken first never saw any of it*/
+  mem_read(before, 0, got, MEM_BYTES);
+  for (i = 0; i < MEM_BYTES && got[i] == i; i++) {
+  }
+  if (!assert(i == MEM_BYTES)) {
+    printf("expected the forked memory to be unchanged at %i\n", i);
+  }
+  mem_destroy(before);
+  mem_destroy(m);
+}
+
+void* assemble_worker(void* arg) {
+  /*Assemble programs with labels of their own on this host thread, and count
+   * the ones whose label is found on its line.*/
+  int* seed = arg;
+  char src[64];
+  int found = 0;
+  int i = 0;
+  for (; i < 200; i++) {
+    int len = sprintf(src, "b t%i_%i\nmov x0, #1\nt%i_%i:\nret\n", *seed, i,
+                      *seed, i);
+    Program p = assemble_buffer(src, len, 1);
+    s8 name;
+    name.str = src + 2;
+    name.len = s8_index_of(s8_view(src), '\n', 0) - 2;
+    pthread_mutex_lock(&symbols_lock);
+    ResultInt id = interner_find(symbols, name);
+    pthread_mutex_unlock(&symbols_lock);
+    found += p.ok && id.ok && label_line(p.labels, id.val) == 2;
+    program_destroy(p);
+  }
+  *seed = found;
+  return NULL;
+}
+
+u32 next_random(u32* state) {
+  /*xorshift, so programs are the same on every machine*/
+  u32 x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  *state = x;
+  return x;
+}
+
+s8 random_program(u32 seed, int num_lines) {
+  /*Random but assemblable programs using every kind of argument, with labels
+   * to branch back and forth between and the odd broken line. Register
+   * addresses are often out of bounds, which stops the program, so most
+   * addresses are constants.*/
+  const char* three_ops[9] = {"add",  "sub", "mul", "sdiv", "udiv",
+                              "mod",  "lsl", "lsr", "vadd"};
+  const char* branches[7] = {"b", "beq", "bne", "blt", "ble", "bgt", "bge"};
+  u32 r = seed * 2654435761u + 1;
+  s8 p;
+  p.str = malloc((u64)num_lines * 48 + 1);
+  p.len = 0;
+  int i = 0;
+  for (; i < num_lines; i++) {
+    char* out = p.str + p.len;
+    int a = (int)(next_random(&r) % NUM_REGISTERS);
+    int b = (int)(next_random(&r) % NUM_REGISTERS);
+    int c = (int)(next_random(&r) % 200) - 100;
+    int addr = (int)(next_random(&r) % (MEM_BYTES - 16));
+    int label = (int)(next_random(&r) % (u32)(num_lines / 8));
+    if (i % 8 == 0) {
+      p.len += sprintf(out, "l%i:\n", i / 8);
+      continue;
+    }
+    switch (next_random(&r) % 16) {
+      case 0:
+        p.len += sprintf(out, "mov x%i, #%i\n", a, addr);
+        break;
+      case 1:
+        p.len += sprintf(out, "mov x%i, #%i\n", a, c);
+        break;
+      case 2: {
+        const char* op = three_ops[next_random(&r) % 8];
+        p.len += sprintf(out, "%s x%i, x%i, #%i\n", op, a, b, c);
+        break;
+      }
+      case 3: {
+        const char* op = three_ops[next_random(&r) % 8];
+        p.len += sprintf(out, "%s x%i, x%i, x%i\n", op, a, b, a);
+        break;
+      }
+      case 4:
+        p.len += sprintf(out, "madd x%i, x%i, #%i, x%i\n", a, b, c, a);
+        break;
+      case 5:
+        p.len += sprintf(out, "str x%i, [#%i]\n", a, addr);
+        break;
+      case 6:
+        p.len += sprintf(out, "ldr x%i, [x%i]\n", a, b);
+        break;
+      case 7:
+        p.len += sprintf(out, "cmp x%i, #%i\n", a, c);
+        break;
+      case 8:
+        p.len += sprintf(out, "%s l%i\n", branches[next_random(&r) % 7],
+                         label);
+        break;
+      case 9:
+        p.len += sprintf(out, "vld v%i, [#%i]\n", a % NUM_VREGISTERS, addr);
+        break;
+      case 10:
+        if (next_random(&r) % 2) {
+          p.len += sprintf(out, "fill [#%i], x%i, #%i\n", addr, a, c & 15);
+        } else {
+          p.len += sprintf(out, "cpy [x%i], [#%i], #8\n", a, addr);
+        }
+        break;
+      case 11:
+        p.len += sprintf(out, "vst v%i, [#%i]\n", a % NUM_VREGISTERS, addr);
+        break;
+      case 12:
+        p.len += sprintf(out, "vcmp v%i, v%i, v%i\n", a % NUM_VREGISTERS,
+                         b % NUM_VREGISTERS, c & 7);
+        break;
+      case 13:
+        p.len += sprintf(out, "msub x%i, x%i, x%i, #%i\n", a, b, a, c);
+        break;
+      case 14:
+        p.len += sprintf(out, "%s l%i\n", branches[next_random(&r) % 7],
+                         label);
+        break;
+      default:
+        /*now and then wrong argument types, so both engines report the same
+         * error*/
+        if (next_random(&r) % 8 == 0) {
+          p.len += sprintf(out, "add #%i, x%i\n", c, a);
+        } else {
+          p.len += sprintf(out, "sub x%i, x%i, #%i\n", a, a, c);
+        }
+        break;
+    }
+  }
+  p.str[p.len] = EOF;
+  p.len++;
+  return p;
+}
+
+void test_diff_engines(void) {
+  printf("\ntest_diff_engines\n");
+
+  /*random programs run the same on both engines*/
+  int diverged = 0;
+  int total_steps = 0;
+  int seed = 1;
+  for (; seed <= 100; seed++) {
+    s8 source = random_program((u32)seed, 64);
+    Program p = assemble(source, 1);
+    Machine* a = machine_start(p, true, ENGINE_TICK);
+    Machine* b = machine_start(p, true, ENGINE_DECODED);
+    a->trace = false;
+    b->trace = false;
+    DiffResult d = diff_machines(a, b, 1, 2000);
+    if (d.diverged) {
+      diverged++;
+    }
+    total_steps += d.steps;
+    machine_destroy(a);
+    machine_destroy(b);
+    program_destroy(p);
+    s8_destroy(free, source);
+  }
+  if (!assert(diverged == 0 && total_steps > 10000)) {
+    printf("expected tick and decoded to agree over %i steps, %i programs "
+           "diverged\n",
+           total_steps, diverged);
+  }
+
+  /*and a decoded engine with a wrong constant is caught at that line*/
+  const char* src =
+      "mov x1, #1\n"
+      "add x1, x1, #2\n"
+      "add x1, x1, #3\n"
+      "ret\n";
+  Program p = assemble_buffer(src, (int)strlen(src), 1);
+  Machine* a = machine_start(p, true, ENGINE_TICK);
+  Machine* b = machine_start(p, true, ENGINE_DECODED);
+  a->trace = false;
+  b->trace = false;
+  b->decoded[2].args.args[2].constant = 4;
+  DiffResult d = diff_machines(a, b, 1, 0);
+  if (!assert(d.diverged && d.steps == 3)) {
+    printf("expected a divergence on the third step, got %i after %i\n",
+           d.diverged, d.steps);
+  }
+  machine_destroy(a);
+  machine_destroy(b);
+
+  /*comparing less often still catches it, at the next comparison*/
+  a = machine_start(p, true, ENGINE_TICK);
+  b = machine_start(p, true, ENGINE_DECODED);
+  a->trace = false;
+  b->trace = false;
+  b->decoded[1].args.args[2].constant = 4;
+  d = diff_machines(a, b, 3, 0);
+  if (!assert(d.diverged && d.steps == 3)) {
+    printf("expected a divergence at step 3 comparing every 3, got %i\n",
+           d.steps);
+  }
+  machine_destroy(a);
+  machine_destroy(b);
+  program_destroy(p);
+}
+
+void test_output(void) {
+  printf("\ntest_output\n");
+
+  /*text waits in the buffer until something flushes it*/
+  out_flush();
+  out_printf("%i", 12345);
+  if (!assert(output.len == 5)) {
+    printf("expected 5 buffered bytes, got %i\n", output.len);
+  }
+  out_flush();
+  if (!assert(output.len == 0)) {
+    printf("expected the flush to empty the buffer, got %i\n", output.len);
+  }
+
+  /*writes mark their ints, across page boundaries too*/
+  Memory* m = mem_create(MEM_BYTES);
+  mem_mark_dirty(m, 60, 10);
+  if (!assert(m->dirty[0] == 0xf000000000000000UL && m->dirty[1] == 0x3f)) {
+    printf("expected 60 to 69 dirty, got %lx %lx\n", m->dirty[0], m->dirty[1]);
+  }
+  mem_fill(m, 128, 1, 64);
+  if (!assert(m->dirty[2] == ~0UL && m->dirty[3] == 0)) {
+    printf("expected all of page 2 dirty, got %lx\n", m->dirty[2]);
+  }
+  mem_destroy(m);
+
+  /*a compact dump forgets what it printed, so only the last store is left*/
+  const char* src =
+      "str x1, [#5]\n"
+      "str x1, [#6]\n"
+      "mem\n"
+      "str x1, [#200]\n"
+      "ret\n";
+  Program p = assemble_buffer(src, (int)strlen(src), 1);
+  Vm* vm = vm_create(p, false);
+  vm_set_compact_mem(vm, true);
+  vm_run(vm);
+  if (!assert(vm->memory->dirty[0] == 0 &&
+              vm->memory->dirty[3] == 1UL << (200 - 192))) {
+    printf("expected only 200 dirty after the dump, got %lx %lx\n",
+           vm->memory->dirty[0], vm->memory->dirty[3]);
+  }
+  vm_destroy(vm);
+  program_destroy(p);
+}
+
+void test_mem_file(void) {
+  printf("\ntest_mem_file\n");
+
+  /*100 ints, so the file ends part way through a guest page*/
+  char path[] = "/tmp/oarm_mem_XXXXXX";
+  int fd = mkstemp(path);
+  int data[100];
+  int i = 0;
+  for (; i < 100; i++) {
+    data[i] = i;
+  }
+  write(fd, data, sizeof(data));
+  close(fd);
+
+  const char* src =
+      "ldr x1, [#0]\n"
+      "ldr x2, [#99]\n"
+      "str x2, [#0]\n"
+      "str x1, [#99]\n"
+      "ldr x0, [#150]\n"
+      "mov x3, #7\n"
+      "str x3, [#200]\n"
+      "ret\n";
+  Program p = assemble_buffer(src, (int)strlen(src), 1);
+
+  /*private, the guest sees the file but the file never changes*/
+  Vm* vm = vm_create(p, false);
+  assert(vm_map_file(vm, path, 0, false));
+  vm_run(vm);
+  if (!assert(vm_get_register(vm, 1) == 0 && vm_get_register(vm, 2) == 99 &&
+              vm_get_register(vm, 0) == 0)) {
+    printf("expected the file in memory and zeros past its end\n");
+  }
+  vm_destroy(vm);
+  FILE* f = fopen(path, "rb");
+  int got[101];
+  int n = (int)fread(got, sizeof(int), 101, f);
+  fclose(f);
+  assert(n == 100 && got[0] == 0 && got[99] == 99);
+
+  /*shared, the swap lands in the file and the file keeps its size*/
+  vm = vm_create(p, false);
+  assert(vm_map_file(vm, path, 0, true));
+  vm_run(vm);
+  vm_destroy(vm);
+  f = fopen(path, "rb");
+  n = (int)fread(got, sizeof(int), 101, f);
+  fclose(f);
+  if (!assert(n == 100 && got[0] == 99 && got[99] == 0 && got[50] == 50)) {
+    printf("expected the swap in a 100 int file, got %i ints\n", n);
+  }
+
+  /*an offset starts guest memory further into the file*/
+  vm = vm_create(p, false);
+  assert(vm_map_file(vm, path, 2 * sizeof(int), false));
+  vm_run(vm);
+  assert(vm_get_register(vm, 1) == 2);
+  assert(!vm_map_file(vm, path, 3, false));
+  vm_destroy(vm);
+  remove(path);
+
+  /*--mem-file offsets are longs, past what an int holds*/
+  const char* file = NULL;
+  long offset = 0;
+  bool parsed = parse_mem_file(s8_view("data.bin:8589934592"), &file,
+                               &offset);
+  if (!assert(parsed && strcmp(file, "data.bin") == 0 &&
+              offset == 8589934592L)) {
+    printf("expected data.bin at 8589934592, got %s at %li\n", file, offset);
+  }
+  free((char*)file);
+  parsed = parse_mem_file(s8_view("a:b:12"), &file, &offset);
+  assert(parsed && strcmp(file, "a:b") == 0 && offset == 12);
+  free((char*)file);
+  parsed = parse_mem_file(s8_view("data.bin:x"), &file, &offset);
+  assert(parsed && strcmp(file, "data.bin:x") == 0 && offset == 0);
+  free((char*)file);
+  assert(!parse_mem_file(s8_view("data.bin:-4"), &file, &offset));
+  assert(!parse_mem_file(s8_view("data.bin:99999999999999999999"),
+                         &file, &offset));
+  program_destroy(p);
+}
+
+void test_guest_io(void) {
+  printf("\ntest_guest_io\n");
+
+  /*double every word until the input runs out, then echo a block back*/
+  const char* src =
+      "loop:\n"
+      "in x1\n"
+      "bne block\n"
+      "add x1, x1, x1\n"
+      "out x1\n"
+      "b loop\n"
+      "block:\n"
+      "out #-1\n"
+      "fill [#0], #9, #3\n"
+      "write [#0], #3\n"
+      "read x0, [#10], #8\n"
+      "ret\n";
+  Program p = assemble_buffer(src, (int)strlen(src), 1);
+
+  int words[4] = {1, 2, 3, 4};
+  FILE* in = tmpfile();
+  fwrite(words, sizeof(int), 4, in);
+  rewind(in);
+  FILE* out = tmpfile();
+  Vm* vm = vm_create(p, false);
+  vm_set_io(vm, in, out);
+  vm_run(vm);
+
+  int got[16];
+  rewind(out);
+  int n = (int)fread(got, sizeof(int), 16, out);
+  if (!assert(n == 8 && got[0] == 2 && got[3] == 8 && got[4] == -1 &&
+              got[5] == 9 && got[7] == 9)) {
+    printf("expected 2 4 6 8 -1 9 9 9, got %i words\n", n);
+  }
+  /*the input was used up, so read found nothing*/
+  assert(vm_get_register(vm, 0) == 0);
+  vm_destroy(vm);
+  fclose(in);
+  fclose(out);
+  program_destroy(p);
+}
+
+void test_instruction_table(void) {
+  printf("\ntest_instruction_table\n");
+
+  /*every mnemonic finds its own row, 1 and 2 letter ones included*/
+  bool found = true;
+  char token[8];
+#define CHECK_KEY(cmd, name, mnemonic, kind, semantics, count, t1, t2, t3, \
+                  t4, section, docs)                                       \
+  if (mnemonic[0] != '\0') {                                               \
+    memset(token, 0, sizeof(token));                                       \
+    strcpy(token, mnemonic);                                               \
+    s8 t;                                                                  \
+    t.str = token;                                                         \
+    t.len = (int)strlen(token);                                            \
+    if (identify_cmd(t) != cmd) {                                          \
+      printf("%s didn't identify as itself\n", mnemonic);                  \
+      found = false;                                                       \
+    }                                                                      \
+  }
+  OARM_INSTRUCTIONS(CHECK_KEY)
+#undef CHECK_KEY
+  assert(found);
+
+  /*the decoder picks the handler made for each operand shape*/
+  const char* src =
+      "mov x1, #5\n"
+      "add x0, #2, #3\n"
+      "sub x2, #10, x1\n"
+      "madd x3, x1, #2, x0\n"
+      "cmp #1, x1\n"
+      "ret\n";
+  Program p = assemble_buffer(src, (int)strlen(src), 1);
+  Vm* vm = vm_create(p, false);
+  vm_set_engine(vm, ENGINE_DECODED);
+  Decoded* d = vm->machine->decoded;
+  if (!assert(d[0].run == mov_i && d[1].run == add_ii &&
+              d[2].run == sub_ir && d[3].run == madd_rir &&
+              d[4].run == cmp_ir)) {
+    printf("expected mov_i, add_ii, sub_ir, madd_rir and cmp_ir\n");
+  }
+  vm_run(vm);
+  State* s = vm_state(vm);
+  if (!assert(s->registers[0] == 5 && s->registers[2] == 5 &&
+              s->registers[3] == 15 && s->cmp == -1)) {
+    printf("expected 5 5 15 and cmp -1, got %i %i %i and %i\n",
+           s->registers[0], s->registers[2], s->registers[3], s->cmp);
+  }
+  vm_destroy(vm);
+  program_destroy(p);
+}
+
+void test_time_travel(void) {
+  printf("\ntest_time_travel\n");
+  const char* src =
+      "mov x0, #0\n"
+      "loop:\n"
+      "str x0, [x0]\n"
+      "add x0, x0, #1\n"
+      "cmp x0, #20\n"
+      "blt loop\n"
+      "fill [#32], #7, #16\n"
+      "cpy [#64], [#0], #20\n"
+      "vld v1, [#0]\n"
+      "vadd v2, v1, v1\n"
+      "vst v2, [#100]\n"
+      "spawn worker\n"
+      "join\n"
+      "ret\n"
+      "worker:\n"
+      "mov x1, #5\n"
+      "ldadd x1, x2, [#200]\n"
+      "ret\n";
+  Program p = assemble_buffer(src, (int)strlen(src), 1);
+  Vm* vm = vm_create(p, false);
+  vm_record(vm, 1 << 12);
+  vm_run(vm);
+  int end[MEM_BYTES];
+  int zero[MEM_BYTES];
+  int mem[MEM_BYTES];
+  memset(zero, 0, sizeof(zero));
+  vm_read_memory(vm, 0, end, MEM_BYTES);
+  i64 turns = vm->history->turn;
+
+  /*back to the start one turn at a time, then forward to the same end*/
+  i64 back = 0;
+  while (vm_reverse_step(vm)) {
+    back++;
+  }
+  vm_read_memory(vm, 0, mem, MEM_BYTES);
+  State* s = vm_state(vm);
+  if (!assert(back == turns && memcmp(mem, zero, sizeof(mem)) == 0 &&
+              s->pc == 0 && s->registers[0] == 0 &&
+              vm->machine->thread_count == 1 &&
+              vm->machine->threads[0].vregisters[1][3] == 0)) {
+    printf("expected %li turns back to a zeroed start, went %li to pc %i\n",
+           turns, back, s->pc);
+  }
+  vm_run(vm);
+  vm_read_memory(vm, 0, mem, MEM_BYTES);
+  if (!assert(memcmp(mem, end, sizeof(mem)) == 0 &&
+              vm->history->turn == turns)) {
+    printf("expected running again to end the same way\n");
+  }
+
+  /*str x0, [x0] on line 2 wrote 19 last*/
+  vm_rewind_to_write(vm, 19);
+  vm_read_memory(vm, 0, mem, MEM_BYTES);
+  if (!assert(s->pc == 2 && s->registers[0] == 19 && mem[19] == 0 &&
+              mem[18] == 18)) {
+    printf("expected to be about to store 19, at pc %i with x0 %i\n", s->pc,
+           s->registers[0]);
+  }
+  vm_run(vm);
+  if (!assert(vm_reverse_continue(vm, 3) && s->pc == 3 &&
+              s->registers[0] == 19 && !vm_reverse_continue(vm, 9))) {
+    printf("expected to stop at the last add, at pc %i\n", s->pc);
+  }
+  vm_destroy(vm);
+
+  /*logs too small for one turn still reach back through snapshots*/
+  Vm* a = vm_create(p, false);
+  Vm* b = vm_create(p, false);
+  vm_record(a, 1 << 12);
+  vm_record(b, 4);
+  vm_run(a);
+  vm_run(b);
+  bool same = true;
+  i64 turn = turns;
+  for (; turn >= 0; turn -= 7) {
+    history_seek(a->machine, turn);
+    history_seek(b->machine, turn);
+    int am[MEM_BYTES];
+    vm_read_memory(a, 0, am, MEM_BYTES);
+    vm_read_memory(b, 0, mem, MEM_BYTES);
+    same = same && memcmp(am, mem, sizeof(mem)) == 0 &&
+           memcmp(vm_state(a)->registers, vm_state(b)->registers,
+                  sizeof(int) * NUM_REGISTERS) == 0 &&
+           vm_state(a)->pc == vm_state(b)->pc;
+  }
+  if (!assert(same)) {
+    printf("expected replaying from snapshots to match the undo log\n");
+  }
+  vm_destroy(a);
+  vm_destroy(b);
+  program_destroy(p);
+}
+
+void test_mem_guard(void) {
+  printf("\ntest_mem_guard\n");
+  const char* src =
+      "mov x1, #255\n"
+      "mov x3, #9\n"
+      "str x3, [x1]\n"
+      "ldr x4, [x1]\n"
+      "spawn low\n"
+      "join\n"
+      "mov x1, #256\n"
+      "str x3, [x1]\n"
+      "mov x5, #1\n"
+      "ret\n"
+      "low:\n"
+      "mov x1, #-7\n"
+      "ldr x3, [x1]\n"
+      "mov x5, #2\n"
+      "ret\n";
+  Program p = assemble_buffer(src, (int)strlen(src), 1);
+
+  /*every engine and interleaving stops each thread on its bad access*/
+  bool stopped = true;
+  int run = 0;
+  for (; run < 4; run++) {
+    Machine* m = machine_start(p, run >= 2, run % 2 == 0 ? ENGINE_TICK
+                                                         : ENGINE_DECODED);
+    m->trace = false;
+    if (!assert(machine_guard_memory(m))) {
+      printf("expected guard pages to be reserved\n");
+      machine_destroy(m);
+      program_destroy(p);
+      return;
+    }
+    State s;
+    if (m->deterministic) {
+      s = run_deterministic(m);
+    } else {
+      s = run_thread(m->threads[0].state);
+      join_all(m);
+    }
+    State child = m->threads[1].state;
+    Memory* mem = s.memory;
+    stopped = stopped && !s.cont && s.pc == 8 && s.registers[4] == 9 &&
+              s.registers[5] == 0 && mem_load(mem, 255) == 9 &&
+              child.pc == 13 && child.registers[3] == 9 &&
+              child.registers[5] == 0;
+    machine_destroy(m);
+  }
+  if (!assert(stopped)) {
+    printf("expected both threads to stop after their bad access\n");
+  }
+  program_destroy(p);
+}
+
+void test_profile(void) {
+  printf("\ntest_profile\n");
+  const char* src =
+      "mov x0, #0\n"
+      "loop:\n"
+      "add x0, x0, #1\n"
+      "b loop\n";
+  Program p = assemble_buffer(src, (int)strlen(src), 1);
+
+  /*samples taken by hand, as the timer would*/
+  profile.hits = calloc((size_t)p.tokens.len, sizeof(u64));
+  profile.len = p.tokens.len;
+  profile.missed = 0;
+  int samples[] = {2, 2, 3, 0, -1, 2};
+  int i = 0;
+  for (; i < 6; i++) {
+    profile_pc = samples[i];
+    profile_sample(SIGPROF);
+  }
+  profile_pc = -1;
+
+  char path[] = "/tmp/oarm_profile_XXXXXX";
+  close(mkstemp(path));
+  profile_write(p.tokens, path);
+  char folded[256];
+  FILE* f = fopen(path, "r");
+  size_t n = fread(folded, 1, sizeof(folded) - 1, f);
+  fclose(f);
+  unlink(path);
+  folded[n] = '\0';
+  const char* want =
+      "(start);0: mov x0 #0 1\n"
+      "loop;2: add x0 x0 #1 3\n"
+      "loop;3: b loop 1\n";
+  if (!assert(strcmp(folded, want) == 0 && profile.missed == 1)) {
+    printf("expected folded stacks:\n%s\ngot:\n%s\n", want, folded);
+  }
+  free(profile.hits);
+  program_destroy(p);
+}
+
+void test_serve(void) {
+  printf("\ntest_serve\n");
+  char path[64];
+  sprintf(path, "/tmp/oarm_test_%i.sock", (int)getpid());
+  Server* srv = server_start(path, 2);
+  if (!assert(srv != NULL)) {
+    printf("expected the server to start on %s\n", path);
+    return;
+  }
+  const char* src =
+      "mov x0, #0\n"
+      "loop:\n"
+      "ldr x3, [x0]\n"
+      "add x2, x2, x3\n"
+      "add x0, x0, #1\n"
+      "cmp x0, x1\n"
+      "blt loop\n"
+      "str x2, [#100]\n"
+      "ret\n";
+  int data[4] = {5, 6, 7, 8};
+  int mem[MEM_BYTES];
+  JobRequest req;
+  JobReply reply;
+  memset(&req, 0, sizeof(req));
+  req.magic = JOB_MAGIC;
+  req.source_len = (int)strlen(src);
+  req.registers[1] = 4;
+  req.mem_len = 4;
+  /*as many clients sitting between jobs as there are workers, which mustn't
+   * keep the jobs below waiting*/
+  int idle[2];
+  idle[0] = client_connect(path);
+  idle[1] = client_connect(path);
+  int fd = client_connect(path);
+  bool ok = client_job(fd, &req, src, data, &reply, mem);
+  if (!assert(ok && reply.status == JOB_DONE && reply.registers[2] == 26 &&
+              mem[100] == 26 && mem[3] == 8 &&
+              reply.hash == source_hash(src, req.source_len))) {
+    printf("expected the sum 26, got status %i and %i\n", reply.status,
+           reply.registers[2]);
+  }
+
+  /*the second time by hash alone, with a budget too short to finish. The
+   * loop is a sum idiom, so it is one turn*/
+  req.source_len = 0;
+  req.hash = reply.hash;
+  req.registers[1] = 3;
+  req.budget = 2;
+  ok = client_job(fd, &req, NULL, data, &reply, mem);
+  if (!assert(ok && reply.status == JOB_BUDGET && reply.turns == 2 &&
+              reply.pc == 7 && reply.registers[2] == 18 && mem[100] == 0)) {
+    printf("expected to stop at pc 7 after 2 turns, got status %i pc %i\n",
+           reply.status, reply.pc);
+  }
+
+  req.hash = reply.hash + 1;
+  ok = client_job(fd, &req, NULL, data, &reply, mem);
+  if (!assert(ok && reply.status == JOB_UNKNOWN_PROGRAM)) {
+    printf("expected an unknown program, got status %i\n", reply.status);
+  }
+
+  /*enough programs after the sum to push it out of the cache*/
+  u64 sum_hash = source_hash(src, (int)strlen(src));
+  char other[64];
+  int i = 0;
+  for (; i < SERVE_CACHE_PROGRAMS && ok; i++) {
+    sprintf(other, "mov x0, #%i\nret\n", i);
+    req.source_len = (int)strlen(other);
+    ok = client_job(fd, &req, other, data, &reply, mem);
+  }
+  req.source_len = 0;
+  req.hash = sum_hash;
+  ok = ok && client_job(fd, &req, NULL, data, &reply, mem);
+  if (!assert(ok && reply.status == JOB_UNKNOWN_PROGRAM)) {
+    printf("expected the sum evicted, got status %i\n", reply.status);
+  }
+  req.hash = source_hash(other, (int)strlen(other));
+  ok = client_job(fd, &req, NULL, data, &reply, mem);
+  if (!assert(ok && reply.status == JOB_DONE &&
+              reply.registers[0] == SERVE_CACHE_PROGRAMS - 1)) {
+    printf("expected the last program still cached, got status %i\n",
+           reply.status);
+  }
+
+  req.magic = 0;
+  ok = client_job(fd, &req, NULL, data, &reply, mem);
+  if (!assert(ok && reply.status == JOB_BAD_REQUEST)) {
+    printf("expected a bad request, got status %i\n", reply.status);
+  }
+  close(fd);
+  close(idle[0]);
+  close(idle[1]);
+  server_stop(srv);
+}
+
+void test_idioms(void) {
+  printf("\ntest_idioms\n");
+  const char* srcs[3] = {
+      /*one of each, the copy stepping by 2 with a sub and a count down*/
+      "mov x0, #7\n"
+      "mov x1, #10\n"
+      "fill:\n"
+      "str x0, [x1]\n"
+      "add x1, x1, #1\n"
+      "cmp x1, #50\n"
+      "blt fill\n"
+      "mov x5, #10\n"
+      "sum:\n"
+      "ldr x6, [x5]\n"
+      "add x4, x6, x4\n"
+      "add x5, x5, #1\n"
+      "cmp #60, x5\n"
+      "bne sum\n"
+      "mov x5, #0\n"
+      "mov x7, #100\n"
+      "mov x2, #20\n"
+      "copy:\n"
+      "ldr x6, [x5]\n"
+      "str x6, [x7]\n"
+      "sub x5, x5, #-2\n"
+      "add x7, x7, #2\n"
+      "sub x2, x2, #1\n"
+      "cmp x2, #0\n"
+      "bgt copy\n"
+      "mov x5, #100\n"
+      "mov x8, #999\n"
+      "scan:\n"
+      "cmp x5, #140\n"
+      "bgt done\n"
+      "ldr x6, [x5]\n"
+      "cmp x6, x8\n"
+      "bgt skip\n"
+      "mov x9, x5\n"
+      "mov x8, x6\n"
+      "skip:\n"
+      "add x5, x5, #1\n"
+      "b scan\n"
+      "done:\n"
+      "ret\n",
+      /*the selection sort in asm/sort.s, one int apart*/
+      "mov x2, #15\n"
+      "outer:\n"
+      "cmp x2, x5\n"
+      "blt exit\n"
+      "ldr x7, [x5]\n"
+      "mov x3, x5\n"
+      "mov x4, x7\n"
+      "add x6, x5, #1\n"
+      "inner:\n"
+      "cmp x6, x2\n"
+      "bgt inner_exit\n"
+      "ldr x8, [x6]\n"
+      "cmp x8, x4\n"
+      "bge not_min\n"
+      "mov x4, x8\n"
+      "mov x3, x6\n"
+      "not_min:\n"
+      "add x6, x6, #1\n"
+      "b inner\n"
+      "inner_exit:\n"
+      "str x4, [x5]\n"
+      "str x7, [x3]\n"
+      "add x5, x5, #1\n"
+      "b outer\n"
+      "exit:\n"
+      "ret\n",
+      /*a fill that runs off the end, which has to stop where tick does*/
+      "mov x1, #250\n"
+      "mov x0, #3\n"
+      "fill:\n"
+      "str x0, [x1]\n"
+      "add x1, x1, #1\n"
+      "cmp x1, #300\n"
+      "blt fill\n"
+      "ret\n"};
+  int expected_idioms[3] = {4, 1, 1};
+  int data[16] = {9, -3, 14, 0, 7, 7, 22, -8, 5, 1, 30, 2, -1, 11, 6, 4};
+  int i = 0;
+  for (; i < 3; i++) {
+    Program p = assemble_buffer(srcs[i], (int)strlen(srcs[i]), 1);
+    Vm* tick = vm_create(p, true);
+    Vm* decoded = vm_create(p, true);
+    vm_set_engine(decoded, ENGINE_DECODED);
+    vm_write_memory(tick, 0, data, 16);
+    vm_write_memory(decoded, 0, data, 16);
+    vm_run(tick);
+    vm_run(decoded);
+
+    int found = 0;
+    int ln = 0;
+    for (; ln < p.tokens.len; ln++) {
+      found += decoded->machine->decoded[ln].idiom != NULL;
+    }
+    if (!assert(found == expected_idioms[i])) {
+      printf("expected %i idioms in program %i, found %i\n",
+             expected_idioms[i], i, found);
+    }
+    State* a = vm_state(tick);
+    State* b = vm_state(decoded);
+    int mem_a[MEM_BYTES];
+    int mem_b[MEM_BYTES];
+    vm_read_memory(tick, 0, mem_a, MEM_BYTES);
+    vm_read_memory(decoded, 0, mem_b, MEM_BYTES);
+    if (!assert(memcmp(a->registers, b->registers, sizeof(a->registers)) ==
+                    0 &&
+                a->cmp == b->cmp && a->pc == b->pc &&
+                memcmp(mem_a, mem_b, sizeof(mem_a)) == 0)) {
+      printf("expected program %i to end the same on both engines, pc %i and "
+             "%i\n",
+             i, a->pc, b->pc);
+    }
+    if (i == 1 && !assert(mem_b[0] == -8 && mem_b[7] == 5 && mem_b[15] == 30)) {
+      printf("expected the sort to sort, got %i %i %i\n", mem_b[0], mem_b[7],
+             mem_b[15]);
+    }
+    vm_destroy(tick);
+    vm_destroy(decoded);
+    program_destroy(p);
+  }
+
+  /*a body with anything else in it is left alone*/
+  const char* other =
+      "loop:\n"
+      "ldr x3, [x0]\n"
+      "add x2, x2, x3\n"
+      "add x2, x2, #1\n"
+      "add x0, x0, #1\n"
+      "cmp x0, #8\n"
+      "blt loop\n"
+      "ret\n";
+  Program p = assemble_buffer(other, (int)strlen(other), 1);
+  Decoded* d = decode_program(p.tokens);
+  if (!assert(d[0].idiom == NULL && d[0].run == exec_label_decl)) {
+    printf("expected no idiom in a loop that also counts\n");
+  }
+  decoded_destroy(d, p.tokens);
+  program_destroy(p);
+}
+
+void test_timings(void) {
+  printf("\ntest_timings\n");
+  const char* src =
+      "mov x1, #40\n"
+      "fill:\n"
+      "str x1, [x0]\n"
+      "add x0, x0, #1\n"
+      "cmp x0, x1\n"
+      "blt fill\n"
+      "mov x5, #0\n"
+      "mov x8, #99\n"
+      "scan:\n"
+      "cmp x5, #20\n"
+      "bge done\n"
+      "ldr x6, [x5]\n"
+      "cmp x6, x8\n"
+      "bge skip\n"
+      "mov x8, x6\n"
+      "mov x9, x5\n"
+      "skip:\n"
+      "add x5, x5, #1\n"
+      "b scan\n"
+      "done:\n"
+      "ret\n";
+  s8 source = s8_from(malloc, src);
+  source.str[source.len - 1] = EOF;
+  Timings t;
+  memset(&t, 0, sizeof(t));
+  Program p = assemble_timed(source, 1, &t);
+  if (!assert(p.ok && t.seconds[PHASE_TOKENIZE] > 0 &&
+              t.seconds[PHASE_RESOLVE_LABELS] >= 0 &&
+              t.seconds[PHASE_RUN] <= 0)) {
+    printf("expected the assemble phases timed, tokenize took %f\n",
+           t.seconds[PHASE_TOKENIZE]);
+  }
+
+  /*the fused loops count the lines they stand in for, skipped ones not*/
+  u64 ran[2];
+  int e = 0;
+  for (; e < 2; e++) {
+    Vm* vm = vm_create(p, true);
+    vm_set_engine(vm, e == 0 ? ENGINE_TICK : ENGINE_DECODED);
+    u64 before = guest_instructions;
+    vm_run(vm);
+    ran[e] = guest_instructions - before;
+    vm_destroy(vm);
+  }
+  if (!assert(ran[0] == ran[1] && ran[0] > 200)) {
+    printf("expected both engines to count the same lines, got %lu and %lu\n",
+           ran[0], ran[1]);
+  }
+  program_destroy(p);
+  free(source.str);
+}
+
+void test_alloc_report(void) {
+  printf("\ntest_alloc_report\n");
+  const char* src =
+      ".reg i, x2\n"
+      "mov i, #0\n"
+      "loop:\n"
+      "str i, [i]\n"
+      "add i, i, #1\n"
+      "cmp i, #8\n"
+      "blt loop\n"
+      "ret\n";
+  s8 source = s8_from(malloc, src);
+  source.str[source.len - 1] = EOF;
+  /*once first, so every symbol is already interned*/
+  program_destroy(assemble(source, 1));
+
+  alloc_stats.enabled = true;
+  int jobs = 1;
+  for (; jobs <= 4; jobs *= 4) {
+    AllocStats before = alloc_stats;
+    Timings t;
+    memset(&t, 0, sizeof(t));
+    Program p = assemble_timed(source, jobs, &t);
+    Decoded* decoded = decode_program(p.tokens);
+    if (!assert(t.allocs[PHASE_TOKENIZE] > 0 &&
+                t.frees[PHASE_TOKENIZE] > 0 &&
+                t.allocs[PHASE_RESOLVE_LABELS] > 0 &&
+                t.peak[PHASE_TOKENIZE] > before.live)) {
+      printf("expected allocations counted per phase with %i jobs\n", jobs);
+    }
+    i64* sites = alloc_stats.site_count;
+    if (!assert(sites[ALLOC_TEXT] > before.site_count[ALLOC_TEXT] &&
+                sites[ALLOC_REGISTER_LABELS] >
+                    before.site_count[ALLOC_REGISTER_LABELS] &&
+                sites[ALLOC_DECODED] > before.site_count[ALLOC_DECODED])) {
+      printf("expected allocations counted per site with %i jobs\n", jobs);
+    }
+    /*the [x2] token was made for the register label*/
+    Line str = p.tokens.lines[3];
+    if (!assert(s8_eq(str.tokens[2], s8_view("[x2]")))) {
+      printf("expected [x2] got %.*s\n", str.tokens[2].len,
+             str.tokens[2].str);
+    }
+    decoded_destroy(decoded, p.tokens);
+    program_destroy(p);
+    if (!assert(alloc_stats.live == before.live)) {
+      printf("expected everything freed with %i jobs, %li bytes left\n", jobs,
+             alloc_stats.live - before.live);
+    }
+  }
+  alloc_stats.enabled = false;
+
+  /*tokens point into the source, so only the first len chars count*/
+  s8 b;
+  b.str = "blt";
+  b.len = 1;
+  if (!assert(identify_cmd(b) == BRANCH)) {
+    printf("expected b from the first char of blt\n");
+  }
+  free(source.str);
+}
+
+void test_program_cache(void) {
+  printf("\ntest_program_cache\n");
+  const char* src =
+      ".reg i, x2\n"
+      "mov x1, #30\n"
+      "fill:\n"
+      "str x1, [x0]\n"
+      "add x0, x0, #1\n"
+      "cmp x0, x1\n"
+      "blt fill\n"
+      "mov i, #0\n"
+      "count:\n"
+      "add i, i, #3\n"
+      "cmp i, #40\n"
+      "blt count\n"
+      "str i, [i]\n"
+      "ret\n";
+  s8 source = s8_from(malloc, src);
+  source.str[source.len - 1] = EOF;
+  char dir[] = "/tmp/oarm_cache_XXXXXX";
+  if (!assert(mkdtemp(dir) != NULL)) {
+    printf("expected a temporary directory\n");
+    return;
+  }
+
+  /*a miss assembles and writes the file, a hit maps it instead*/
+  Timings t[2];
+  Program p[2];
+  Decoded* decoded[2];
+  int k = 0;
+  for (; k < 2; k++) {
+    memset(&t[k], 0, sizeof(Timings));
+    p[k] = assemble_cached(dir, source, 1, &t[k], &decoded[k]);
+  }
+  char* path = cache_path(dir, cache_key(source), ".oac");
+  if (!assert(access(path, R_OK) == 0 && t[0].seconds[PHASE_TOKENIZE] > 0 &&
+              t[1].seconds[PHASE_TOKENIZE] <= 0 &&
+              p[0].tokens.mapping == NULL && p[1].tokens.mapping != NULL)) {
+    printf("expected a miss then a hit, tokenizing took %f then %f\n",
+           t[0].seconds[PHASE_TOKENIZE], t[1].seconds[PHASE_TOKENIZE]);
+  }
+
+  bool same = p[1].ok && p[0].tokens.len == p[1].tokens.len;
+  int ln = 0;
+  for (; same && ln < p[0].tokens.len; ln++) {
+    Line a = p[0].tokens.lines[ln];
+    Line b = p[1].tokens.lines[ln];
+    int j = 0;
+    same = a.len == b.len && decoded[0][ln].ok == decoded[1][ln].ok &&
+           (decoded[0][ln].idiom == NULL) == (decoded[1][ln].idiom == NULL);
+    for (; same && j < a.len; j++) {
+      same = s8_eq(a.tokens[j], b.tokens[j]) && a.ids[j] == b.ids[j];
+    }
+  }
+  int fill = interner_find(symbols, s8_view("fill")).val;
+  if (!assert(same && label_line(p[1].labels, fill) == 2)) {
+    printf("expected the cached program to match the assembled one\n");
+  }
+
+  int regs[2];
+  int mem[2][MEM_BYTES];
+  for (k = 0; k < 2; k++) {
+    Vm* vm = vm_create(p[k], true);
+    vm_set_program(vm, p[k], decoded[k]);
+    vm_set_engine(vm, ENGINE_DECODED);
+    vm_run(vm);
+    regs[k] = vm_get_register(vm, 2);
+    vm_read_memory(vm, 0, mem[k], MEM_BYTES);
+    vm_destroy(vm);
+  }
+  if (!assert(regs[0] == 42 && regs[1] == regs[0] &&
+              memcmp(mem[0], mem[1], sizeof(mem[0])) == 0)) {
+    printf("expected the cached program to run the same, x2 %i and %i\n",
+           regs[0], regs[1]);
+  }
+  for (k = 0; k < 2; k++) {
+    decoded_destroy(decoded[k], p[k].tokens);
+    program_destroy(p[k]);
+  }
+
+  /*a file cut short is a miss, and is written again*/
+  if (!assert(truncate(path, 100) == 0)) {
+    printf("expected to truncate %s\n", path);
+  }
+  Timings again;
+  memset(&again, 0, sizeof(again));
+  Decoded* d;
+  Program q = assemble_cached(dir, source, 1, &again, &d);
+  struct stat st;
+  stat(path, &st);
+  if (!assert(again.seconds[PHASE_TOKENIZE] > 0 && st.st_size > 100)) {
+    printf("expected a short file to be a miss\n");
+  }
+  decoded_destroy(d, q.tokens);
+  program_destroy(q);
+
+  /*other source, other file*/
+  u64 key = cache_key(source);
+  source.str[0] = '#';
+  if (!assert(cache_key(source) != key)) {
+    printf("expected the key to change with the source\n");
+  }
+  unlink(path);
+  rmdir(dir);
+  free(path);
+  free(source.str);
+}
+
+void test_cost_model(void) {
+  printf("\ntest_cost_model\n");
+  const char* src =
+      "mov x0, #0\n"
+      "loop:\n"
+      "ldr x1, [x0]\n"
+      "add x0, x0, #1\n"
+      "cmp x0, #3\n"
+      "blt loop\n"
+      "mul x2, x0, x0\n"
+      "ret\n";
+  Program p = assemble_buffer(src, (int)strlen(src), 1);
+  CostModel model = cost_model_default();
+  model.memory = 10;
+  int e = 0;
+  for (; e < 2; e++) {
+    Machine* m = machine_start(p, true, e == 0 ? ENGINE_TICK : ENGINE_DECODED);
+    m->trace = false;
+    machine_count_costs(m, &model);
+    run_deterministic(m);
+    /*the label only runs falling into the loop, the branch back skips it*/
+    u64 total = 0;
+    int ln = 0;
+    for (; ln < p.tokens.len; ln++) {
+      total += line_cycles(m, ln);
+    }
+    if (!assert(m->line_runs[1] == 1 && m->line_runs[2] == 3 &&
+                m->line_taken[5] == 2 && line_cycles(m, 2) == 33 &&
+                line_cycles(m, 5) == 7 && total == 51)) {
+      printf("expected 51 cycles with the loads at 33, got %lu and %lu\n",
+             total, line_cycles(m, 2));
+    }
+    machine_destroy(m);
+  }
+
+  /*a branch right after its own label comes back to itself, and still runs*/
+  const char* spin =
+      "cmp x0, #0\n"
+      "again:\n"
+      "beq again\n";
+  Program q = assemble_buffer(spin, (int)strlen(spin), 1);
+  Machine* m = machine_start(q, true, ENGINE_TICK);
+  m->trace = false;
+  machine_count_costs(m, &model);
+  for (e = 0; e < 10; e++) {
+    machine_turn(m);
+  }
+  if (!assert(m->line_runs[2] == 8 && m->line_taken[2] == 8 &&
+              line_cycles(m, 2) == 8 * 3)) {
+    printf("expected 8 taken runs of the beq, got %lu\n", m->line_runs[2]);
+  }
+  machine_destroy(m);
+
+  /*no ret, so the thread steps off the end*/
+  const char* off_end =
+      "mov x0, #1\n"
+      "add x0, x0, #2\n";
+  Program r = assemble_buffer(off_end, (int)strlen(off_end), 1);
+  m = machine_start(r, true, ENGINE_TICK);
+  m->trace = false;
+  machine_count_costs(m, &model);
+  run_deterministic(m);
+  if (!assert(m->line_runs[0] == 1 && m->line_runs[1] == 1 &&
+              m->line_taken[0] == 0 && m->line_taken[1] == 0)) {
+    printf("expected each line once, got %lu and %lu\n", m->line_runs[0],
+           m->line_runs[1]);
+  }
+  machine_destroy(m);
+  program_destroy(p);
+  program_destroy(q);
+  program_destroy(r);
+
+  char path[] = "/tmp/oarm_costs_XXXXXX";
+  int fd = mkstemp(path);
+  const char* table =
+      "# a slower core\n"
+      "\n"
+      "add 2\n"
+      "b 3 # and a comment\n"
+      "label 1\n"
+      "branch_taken 5\n"
+      "memory 9\n";
+  write(fd, table, strlen(table));
+  close(fd);
+  bool loaded = cost_model_load(path, &model);
+  if (!assert(loaded && model.cycles[ADD] == 2 && model.cycles[BRANCH] == 3 &&
+              model.cycles[LABEL_DECL] == 1 && model.cycles[SUB] == 1 &&
+              model.cycles[MUL] == 3 && model.branch_taken == 5 &&
+              model.memory == 9)) {
+    printf("expected the file's costs over the default ones\n");
+  }
+  const char* bad[] = {"add\n", "add x\n", "add 1 2\n", "add -1\n",
+                       "bl 2\n"};
+  int i = 0;
+  for (; i < 5; i++) {
+    FILE* f = fopen(path, "w");
+    fputs(bad[i], f);
+    fclose(f);
+    if (!assert(!cost_model_load(path, &model))) {
+      printf("expected \"%s\" to be refused\n", bad[i]);
+    }
+  }
+  unlink(path);
+}
+
+void test_cache_sim(void) {
+  printf("\ntest_cache_sim\n");
+  CacheLevel levels[2];
+  const char* bad[] = {"32768,48,4", "100,64,4", "32768,64", "32768,64,4,mru",
+                       "32768,64,4,", "32768,2,4", ",64,4"};
+  int i = 0;
+  for (; i < 7; i++) {
+    if (!assert(!parse_cache_level(s8_view(bad[i]), &levels[0]))) {
+      printf("expected %s to be refused\n", bad[i]);
+    }
+  }
+  bool parsed = parse_cache_level(s8_view("32768,64,4"), &levels[0]);
+  if (!assert(parsed && levels[0].sets == 128 &&
+              levels[0].policy == CACHE_LRU)) {
+    printf("expected 128 sets of 4 lru ways, got %i\n", levels[0].sets);
+  }
+
+  /*one set of two ways, A B A C A: lru evicts B for C, fifo evicts A*/
+  const char* policies[] = {"8,4,2,lru", "8,4,2,fifo"};
+  u64 hits[2];
+  int p = 0;
+  for (; p < 2; p++) {
+    parse_cache_level(s8_view(policies[p]), &levels[0]);
+    CacheSim* sim = cache_sim_create(levels, 1, 1);
+    int seq[] = {0, 1, 0, 2, 0};
+    for (i = 0; i < 5; i++) {
+      cache_level_access(&sim->levels[0], seq[i]);
+    }
+    hits[p] = sim->levels[0].hits;
+    cache_sim_destroy(sim);
+  }
+  if (!assert(hits[0] == 2 && hits[1] == 1)) {
+    printf("expected lru to hit twice and fifo once, got %lu and %lu\n",
+           hits[0], hits[1]);
+  }
+
+  /*8 byte strides over 1024 bytes: 8 loads a 64 byte line, 4 a 32 byte
+   * one, and every load misses 4 byte lines*/
+  const char* src =
+      "mov x0, #0\n"
+      "loop:\n"
+      "ldr x1, [x0]\n"
+      "add x0, x0, #2\n"
+      "cmp x0, #256\n"
+      "blt loop\n"
+      "str x1, [#0]\n"
+      "ret\n";
+  Program prog = assemble_buffer(src, (int)strlen(src), 1);
+  const char* shapes[] = {"2048,64,2", "2048,32,2", "2048,4,2"};
+  u64 want[] = {16, 32, 128};
+  for (i = 0; i < 3; i++) {
+    parse_cache_level(s8_view(shapes[i]), &levels[0]);
+    parse_cache_level(s8_view("4096,128,4"), &levels[1]);
+    Machine* m = machine_start(prog, true, ENGINE_DECODED);
+    m->trace = false;
+    m->cache_sim = cache_sim_create(levels, 2, prog.tokens.len);
+    run_deterministic(m);
+    CacheSim* sim = m->cache_sim;
+    if (!assert(sim->loads == 128 && sim->stores == 1 &&
+                sim->line_misses[0][2] == want[i] &&
+                sim->line_accesses[2] == 128 &&
+                sim->levels[0].hits + sim->levels[0].misses == 129 &&
+                sim->levels[1].hits + sim->levels[1].misses ==
+                    sim->levels[0].misses &&
+                sim->levels[1].misses == 8)) {
+      printf("expected %lu L1 misses with %s, got %lu\n", want[i], shapes[i],
+             sim->line_misses[0][2]);
+    }
+    machine_destroy(m);
+  }
+  program_destroy(prog);
+}
+
+void test_bpred_sim(void) {
+  printf("\ntest_bpred_sim\n");
+  Predictor kind = PREDICT_STATIC;
+  if (!assert(parse_predictor(s8_view("bimodal"), &kind) &&
+              kind == PREDICT_BIMODAL &&
+              !parse_predictor(s8_view("tage"), &kind))) {
+    printf("expected bimodal and not tage\n");
+  }
+
+  /*a branch back that alternates: only gshare sees the pattern*/
+  u64 missed[PREDICTOR_COUNT];
+  int k = 0;
+  for (; k < PREDICTOR_COUNT; k++) {
+    BranchPredictor* bp = bpred_create((Predictor)k, 8, 8);
+    int i = 0;
+    missed[k] = 0;
+    for (; i < 200; i++) {
+      missed[k] += !bpred_predict(bp, 5, 1, i % 2 == 0);
+    }
+    bpred_destroy(bp);
+  }
+  if (!assert(missed[PREDICT_STATIC] == 100 &&
+              missed[PREDICT_BIMODAL] == 100 && missed[PREDICT_GSHARE] < 10)) {
+    printf("expected gshare to learn the pattern, missed %lu, %lu and %lu\n",
+           missed[PREDICT_STATIC], missed[PREDICT_BIMODAL],
+           missed[PREDICT_GSHARE]);
+  }
+
+  /*a loop of 10 trips misses once leaving, the b isn't conditional*/
+  const char* src =
+      "mov x0, #0\n"
+      "loop:\n"
+      "add x0, x0, #1\n"
+      "cmp x0, #10\n"
+      "blt loop\n"
+      "b end\n"
+      "end:\n"
+      "ret\n";
+  Program p = assemble_buffer(src, (int)strlen(src), 1);
+  for (k = 0; k < PREDICTOR_COUNT; k++) {
+    Machine* m = machine_start(p, true, k == 0 ? ENGINE_TICK : ENGINE_DECODED);
+    m->trace = false;
+    m->bpred = bpred_create((Predictor)k, BPRED_BITS, p.tokens.len);
+    run_deterministic(m);
+    BranchPredictor* bp = m->bpred;
+    if (!assert(bp->branches == 10 && bp->line_branches[4] == 10 &&
+                bp->line_taken[4] == 9 && bp->mispredicts == 1 &&
+                bp->line_mispredicts[4] == 1)) {
+      printf("expected %s to miss the loop exit only, missed %lu\n",
+             predictor_name((Predictor)k), bp->mispredicts);
+    }
+    machine_destroy(m);
+  }
+  program_destroy(p);
+}